@@ -0,0 +1,241 @@
+/*
+ * The list of accounts to synchronize.
+ *
+ * If ad_account_list is set, only the principals listed in that file are
+ * synchronized with Active Directory, instead of choosing them by instance.
+ * The list may be very large, so rather than reading it into memory, the
+ * file is mapped and searched in place.  It must contain one principal per
+ * line, without the realm, sorted in byte order (as with LC_ALL=C sort), so
+ * that a lookup is a binary search over the lines of the file and only
+ * touches the few pages that it reads.  The order is checked when the file
+ * is mapped, since a lookup in an unsorted file would silently miss accounts.
+ *
+ * The file is checked on every lookup and mapped again if it has changed.
+ * To update it, write the new list to a temporary file in the same directory
+ * and rename it over the old one, so that a lookup never sees a partial list.
+ * Like the other lookup state, this is only used from kadmind's thread and
+ * so isn't locked.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+
+/* The mapped account list and the identity of the file it came from. */
+struct sync_accounts {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    const char *map;
+};
+
+
+/*
+ * Compare a string with the line of length length at line, in the same
+ * order as sort with LC_ALL=C, returning a value less than, equal to, or
+ * greater than zero like strcmp.
+ */
+static int
+accounts_compare(const char *string, size_t slength, const char *line,
+                 size_t length)
+{
+    int result;
+
+    result = memcmp(string, line, (slength < length) ? slength : length);
+    if (result != 0)
+        return result;
+    if (slength == length)
+        return 0;
+    return (slength < length) ? -1 : 1;
+}
+
+
+/*
+ * Return the length of the line starting at offset start in the mapped list,
+ * not counting the newline.
+ */
+static size_t
+accounts_line(const struct sync_accounts *accounts, size_t start)
+{
+    const char *end;
+
+    end = memchr(accounts->map + start, '\n', accounts->size - start);
+    if (end == NULL)
+        return accounts->size - start;
+    return end - (accounts->map + start);
+}
+
+
+/*
+ * Check that the lines of the mapped list are sorted, returning false if
+ * they aren't.
+ */
+static bool
+accounts_sorted(const struct sync_accounts *accounts)
+{
+    size_t start, length, last, last_length;
+
+    if (accounts->size == 0)
+        return true;
+    last = 0;
+    last_length = accounts_line(accounts, 0);
+    start = last_length + 1;
+    while (start < (size_t) accounts->size) {
+        length = accounts_line(accounts, start);
+        if (accounts_compare(accounts->map + last, last_length,
+                             accounts->map + start, length) > 0)
+            return false;
+        last = start;
+        last_length = length;
+        start += length + 1;
+    }
+    return true;
+}
+
+
+/*
+ * Free a mapped account list.
+ */
+static void
+accounts_free(struct sync_accounts *accounts)
+{
+    if (accounts == NULL)
+        return;
+    if (accounts->map != NULL)
+        munmap((void *) accounts->map, accounts->size);
+    free(accounts);
+}
+
+
+/*
+ * Make sure the mapped account list is that of the current ad_account_list
+ * file, mapping the file again if it has been replaced or modified since it
+ * was last mapped.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+accounts_load(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_accounts *accounts = config->accounts;
+    const char *path = config->ad_account_list;
+    struct stat st;
+    void *map;
+    int fd;
+    krb5_error_code code;
+
+    /* Open the file and see if it's the one we already have mapped. */
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return sync_error_system(ctx, "cannot open account list %s", path);
+    if (fstat(fd, &st) < 0) {
+        code = sync_error_system(ctx, "cannot stat account list %s", path);
+        close(fd);
+        return code;
+    }
+    if (accounts != NULL && accounts->dev == st.st_dev
+        && accounts->ino == st.st_ino && accounts->size == st.st_size
+        && accounts->mtime == st.st_mtime) {
+        close(fd);
+        return 0;
+    }
+
+    /* Map the new file.  An empty file can't be mapped and lists nothing. */
+    accounts = calloc(1, sizeof(*accounts));
+    if (accounts == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        close(fd);
+        return code;
+    }
+    accounts->dev = st.st_dev;
+    accounts->ino = st.st_ino;
+    accounts->size = st.st_size;
+    accounts->mtime = st.st_mtime;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            code = sync_error_system(ctx, "cannot map account list %s", path);
+            free(accounts);
+            close(fd);
+            return code;
+        }
+        accounts->map = map;
+    }
+    close(fd);
+    if (!accounts_sorted(accounts)) {
+        accounts_free(accounts);
+        return sync_error_config(ctx, "account list %s is not sorted", path);
+    }
+
+    /* Replace the old mapping. */
+    accounts_free(config->accounts);
+    config->accounts = accounts;
+    return 0;
+}
+
+
+/*
+ * Check whether a principal, given without its realm, is in the list of
+ * accounts in ad_account_list, setting found accordingly.  Returns a Kerberos
+ * status code if the list can't be read.
+ */
+krb5_error_code
+sync_accounts_check(kadm5_hook_modinfo *config, krb5_context ctx,
+                    const char *name, bool *found)
+{
+    const struct sync_accounts *accounts;
+    size_t low, high, start, length, nlength;
+    krb5_error_code code;
+    int result;
+
+    *found = false;
+    code = accounts_load(config, ctx);
+    if (code != 0)
+        return code;
+    accounts = config->accounts;
+
+    /*
+     * Binary search over byte offsets.  Each probe backs up to the start of
+     * the line containing the midpoint, and the range is then narrowed to
+     * the lines before or after that one.
+     */
+    nlength = strlen(name);
+    low = 0;
+    high = accounts->size;
+    while (low < high) {
+        start = low + (high - low) / 2;
+        while (start > low && accounts->map[start - 1] != '\n')
+            start--;
+        length = accounts_line(accounts, start);
+        result = accounts_compare(name, nlength, accounts->map + start,
+                                  length);
+        if (result == 0) {
+            *found = true;
+            return 0;
+        } else if (result < 0) {
+            high = start;
+        } else {
+            low = start + length + 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Unmap the account list.
+ */
+void
+sync_accounts_close(kadm5_hook_modinfo *config)
+{
+    accounts_free(config->accounts);
+    config->accounts = NULL;
+}
@@ -2,7 +2,10 @@
  * Active Directory synchronization functions.
  *
  * Implements the interface that talks to Active Directory for both password
- * changes and for account status updates.
+ * changes and for account status updates, and the listing of every account
+ * and its status used by krb5-sync to reconcile the two.  Passwords are set
+ * with kpasswd or, if ad_password_method is set to ldap, by replacing
+ * unicodePwd over a pooled LDAP connection.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Based on code developed by Derrick Brashear and Ken Hornstein of Sine
@@ -20,16 +23,81 @@
 #include <errno.h>
 #include <lber.h>
 #include <ldap.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include <plugin/internal.h>
 #include <util/macros.h>
 
-/* The memory cache name used to store credentials for AD. */
-#define CACHE_NAME "MEMORY:krb5_sync"
-
 /* The flag value used in Active Directory to indicate a disabled account. */
 #define UF_ACCOUNTDISABLE 0x02
 
+/* The number of entries to request per page when listing all accounts. */
+#define AD_PAGE_SIZE 1000
+
+/* The file in queue_dir holding the uSNChanged high-water marks. */
+#define AD_USN_FILE ".usn"
+
+/*
+ * A change in flight in a batch of status changes: its index, its AD
+ * principal, and the message ID and start time of the search or modify
+ * (depending on modify) waiting for a result, also recorded in limit for
+ * ad_adaptive_concurrency.  cached is true if the search reads a known DN,
+ * mapped is true if that DN came from ad_mapping_rules, and retried is true
+ * once the change has been started again because the account changed
+ * between the search and the modify.
+ */
+struct ad_batch_slot {
+    bool used;
+    size_t index;
+    const char *target;
+    int msgid;
+    bool modify;
+    bool cached;
+    bool mapped;
+    bool retried;
+    struct timeval start;
+    struct sync_limit_op limit;
+};
+
+/*
+ * The state of a change in a batch of password changes.  A change waiting for
+ * a retry with new credentials still blocks later changes for its account.
+ */
+enum ad_kpasswd_state {
+    AD_KPASSWD_PENDING,
+    AD_KPASSWD_RUNNING,
+    AD_KPASSWD_RETRY,
+    AD_KPASSWD_DONE,
+    AD_KPASSWD_REPORTED
+};
+
+/*
+ * A batch of password changes shared by the threads making them, with the AD
+ * principal and name of each change resolved before the threads start.  The
+ * mutex protects the state, result code, and error message of each change,
+ * and wakeup is signaled whenever a change finishes or is retried.
+ */
+struct ad_kpasswd_batch {
+    kadm5_hook_modinfo *config;
+    struct sync_ad_password *changes;
+    size_t count;
+    krb5_principal *principals;
+    const char **targets;
+    enum ad_kpasswd_state *state;
+    krb5_error_code *codes;
+    char **messages;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+};
+
+/* A thread making password changes from a batch, with its own context. */
+struct ad_kpasswd_thread {
+    struct ad_kpasswd_batch *batch;
+    krb5_context ctx;
+    pthread_t thread;
+};
+
 
 /*
  * Check a specific configuratino attribute to ensure that it's set and, if
@@ -47,318 +115,581 @@
 
 
 /*
- * Given the plugin options, a Kerberos context, and a pointer to krb5_ccache
- * storage, initialize a memory cache using the configured keytab to obtain
- * initial credentials.  Returns a Kerberos status code.
+ * Start the deadline for a password or status change, which is ad_timeout
+ * seconds from now, or clear it if ad_timeout isn't set.
  */
-static krb5_error_code
-get_creds(kadm5_hook_modinfo *config, krb5_context ctx, krb5_ccache *cc)
+static void
+ad_deadline_start(kadm5_hook_modinfo *config)
 {
-    krb5_error_code code;
-    krb5_keytab kt = NULL;
-    krb5_principal princ = NULL;
-    krb5_get_init_creds_opt *opts = NULL;
-    krb5_creds creds;
-    bool creds_valid = false;
-    const char *realm UNUSED;
+    config->ad_deadline.tv_sec = 0;
+    if (config->ad_timeout <= 0)
+        return;
+    if (gettimeofday(&config->ad_deadline, NULL) < 0)
+        config->ad_deadline.tv_sec = 0;
+    else
+        config->ad_deadline.tv_sec += config->ad_timeout;
+}
 
-    /* Initialize the credential cache pointer to NULL. */
-    *cc = NULL;
 
-    /* Ensure the configuration is sane. */
-    CHECK_CONFIG(ad_keytab);
-    CHECK_CONFIG(ad_principal);
+/*
+ * Check the deadline of the change in progress before a call that talks to
+ * Active Directory, and store in left, if it isn't NULL, the time allowed
+ * for that call.  This is the time left before the deadline, capped at limit
+ * seconds if limit is positive.  If there is neither a deadline nor a limit,
+ * left is set to -1 seconds.  Returns an error if the deadline has passed.
+ */
+krb5_error_code
+sync_ad_deadline(kadm5_hook_modinfo *config, krb5_context ctx, long limit,
+                 struct timeval *left)
+{
+    struct timeval now, remaining;
 
-    /* Resolve the keytab and principal used to get credentials. */
-    code = krb5_kt_resolve(ctx, config->ad_keytab, &kt);
-    if (code != 0)
-        goto fail;
-    code = krb5_parse_name(ctx, config->ad_principal, &princ);
-    if (code != 0)
-        goto fail;
+    if (left != NULL) {
+        left->tv_sec = (limit > 0) ? limit : -1;
+        left->tv_usec = 0;
+    }
+    if (config->ad_deadline.tv_sec == 0)
+        return 0;
+    if (gettimeofday(&now, NULL) < 0)
+        return 0;
+    remaining.tv_sec = config->ad_deadline.tv_sec - now.tv_sec;
+    remaining.tv_usec = config->ad_deadline.tv_usec - now.tv_usec;
+    if (remaining.tv_usec < 0) {
+        remaining.tv_sec--;
+        remaining.tv_usec += 1000000;
+    }
+    if (remaining.tv_sec < 0 || (remaining.tv_sec == 0
+                                 && remaining.tv_usec == 0))
+        return sync_error_generic(ctx, "Active Directory did not finish"
+                                  " within ad_timeout (%ld seconds)",
+                                  config->ad_timeout);
+    if (left != NULL && (left->tv_sec < 0 || remaining.tv_sec < left->tv_sec))
+        *left = remaining;
+    return 0;
+}
 
-    /* Set our credential acquisition options. */
-    code = krb5_get_init_creds_opt_alloc(ctx, &opts);
-    if (code != 0)
-        goto fail;
-    realm = krb5_principal_get_realm(ctx, princ);
-    krb5_get_init_creds_opt_set_default_flags(ctx, "krb5-sync", realm, opts);
 
-    /* Obtain credentials. */
-    memset(&creds, 0, sizeof(creds));
-    code = krb5_get_init_creds_keytab(ctx, &creds, princ, kt, 0, NULL, opts);
-    if (code != 0)
-        goto fail;
-    krb5_get_init_creds_opt_free(ctx, opts);
-    opts = NULL;
-    krb5_kt_close(ctx, kt);
-    kt = NULL;
-    creds_valid = true;
-
-    /* Open and initialize the credential cache. */
-    code = krb5_cc_resolve(ctx, CACHE_NAME, cc);
+/*
+ * Do the kpasswd exchange for a password change in Active Directory with the
+ * credentials in ccache.  Takes the module configuration, a Kerberos context,
+ * the AD principal, its unparsed form for error messages, and the new
+ * password.  Sets retry to true if the change failed in a way that may be
+ * fixed by getting new credentials.  Returns a Kerberos error code.  A soft
+ * error from kpasswd or an unreachable server counts as back-pressure for
+ * ad_adaptive_concurrency.
+ *
+ * This only uses the context it is given and the thread-safe statistics and
+ * concurrency limits, so it can be called from the threads of
+ * sync_ad_chpass_batch.
+ */
+static krb5_error_code
+ad_kpasswd(kadm5_hook_modinfo *config, krb5_context ctx, krb5_ccache ccache,
+           krb5_principal ad_principal, const char *target,
+           const char *password, bool *retry)
+{
+    krb5_error_code code;
+    int result_code;
+    krb5_data result_code_string, result_string;
+    struct timeval start;
+    struct sync_limit_op limit;
+    bool busy;
+
+    *retry = false;
+    memset(&result_code_string, 0, sizeof(result_code_string));
+    memset(&result_string, 0, sizeof(result_string));
+    sync_stats_start(config, &start);
+    sync_limit_start(config, SYNC_LIMIT_KPASSWD, &limit);
+    code = krb5_set_password_using_ccache(ctx, ccache, (char *) password,
+                                          ad_principal, &result_code,
+                                          &result_code_string, &result_string);
+    sync_stats_record(config, SYNC_STATS_KPASSWD, &start,
+                      (code != 0) ? code : result_code);
     if (code != 0)
-        goto fail;
-    code = krb5_cc_initialize(ctx, *cc, princ);
-    if (code == 0)
-        code = krb5_cc_store_cred(ctx, *cc, &creds);
+        busy = (code == KRB5_KDC_UNREACH || code == ETIMEDOUT);
+    else
+        busy = (result_code == KRB5_KPASSWD_SOFTERROR);
+    sync_limit_finish(config, SYNC_LIMIT_KPASSWD, &limit, busy);
     if (code != 0) {
-        krb5_cc_close(ctx, *cc);
-        *cc = NULL;
-        goto fail;
+        *retry = sync_ad_creds_error(code);
+        return code;
+    }
+    if (result_code != 0) {
+        *retry = (result_code == KRB5_KPASSWD_AUTHERROR);
+        code = sync_error_generic(ctx, "password change failed for %s: (%d)"
+                                  " %.*s%s%.*s", target, result_code,
+                                  (int) result_code_string.length,
+                                  (char *) result_code_string.data,
+                                  result_string.length ? ": " : "",
+                                  (int) result_string.length,
+                                  (char *) result_string.data);
     }
+    free(result_string.data);
+    free(result_code_string.data);
+    return code;
+}
 
-    /* Clean up and return success. */
-    krb5_free_cred_contents(ctx, &creds);
-    krb5_free_principal(ctx, princ);
-    return 0;
 
-fail:
-    if (kt != NULL)
-        krb5_kt_close(ctx, kt);
-    if (princ != NULL)
-        krb5_free_principal(ctx, princ);
-    if (opts != NULL)
-        krb5_get_init_creds_opt_free(ctx, opts);
-    if (creds_valid)
-        krb5_free_cred_contents(ctx, &creds);
-    return code;
+/*
+ * Fail a change for target at once if a search recently found no account
+ * for it, as remembered in the DN cache with ad_dn_cache_missing, rather
+ * than contacting Active Directory again.  The error is the one the search
+ * gave.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_check_missing(kadm5_hook_modinfo *config, krb5_context ctx,
+                 const char *target)
+{
+    if (!sync_dncache_missing(config, target))
+        return 0;
+    return sync_error_generic(ctx, "user \"%s\" not found via LDAP (cached)",
+                              target);
 }
 
 
 /*
- * Given the krb5_principal from kadmind, convert it to the corresponding
- * principal in Active Directory.  This may involve removing ad_base_instance
- * and always involves changing the realm.  Returns a Kerberos error code.
+ * Do the actual password change in Active Directory using our cached
+ * credentials.  Takes the same arguments as ad_kpasswd except for the
+ * credential cache.  Returns a Kerberos error code.
  */
 static krb5_error_code
-get_ad_principal(kadm5_hook_modinfo *config, krb5_context ctx,
-                 krb5_const_principal principal, krb5_principal *ad_principal)
+ad_set_password(kadm5_hook_modinfo *config, krb5_context ctx,
+                krb5_principal ad_principal, const char *target,
+                const char *password, bool *retry)
 {
     krb5_error_code code;
-    int ncomp;
+    krb5_ccache ccache;
 
-    /*
-     * Set ad_principal to NULL to start.  We fall back on copy and realm
-     * setting if we don't have to build it, and use whether it's NULL as a
-     * flag.
-     */
-    *ad_principal = NULL;
-
-    /* Get the number of components. */
-    ncomp = krb5_principal_get_num_comp(ctx, principal);
-
-    /* See if this is an ad_base_instance principal that needs a rewrite. */
-    if (config->ad_base_instance != NULL && ncomp == 2) {
-        const char *base, *instance;
-
-        instance = krb5_principal_get_comp_string(ctx, principal, 1);
-        if (strcmp(instance, config->ad_base_instance) == 0) {
-            base = krb5_principal_get_comp_string(ctx, principal, 0);
-            code = krb5_build_principal(ctx, ad_principal,
-                                        strlen(config->ad_realm),
-                                        config->ad_realm, base, (char *) 0);
-            if (code != 0)
-                return code;
-        }
-    }
+    /* Get the credentials we'll use to make the change in AD. */
+    *retry = false;
+    code = sync_ad_creds(config, ctx, &ccache);
+    if (code != 0)
+        return code;
 
-    /* Otherwise, copy the principal and set the realm. */
-    if (*ad_principal == NULL) {
-        code = krb5_copy_principal(ctx, principal, ad_principal);
-        if (code != 0)
-            return code;
-        krb5_principal_set_realm(ctx, *ad_principal, config->ad_realm);
-    }
-    return 0;
+    /* Do the actual password change. */
+    code = sync_ad_deadline(config, ctx, 0, NULL);
+    if (code == 0)
+        code = ad_kpasswd(config, ctx, ccache, ad_principal, target,
+                          password, retry);
+    krb5_cc_close(ctx, ccache);
+    return code;
 }
 
 
 /*
  * Push a password change to Active Directory.  Takes the module
- * configuration, a Kerberos context, the principal whose password is being
- * changed (we will have to change the realm), and the new password and its
- * length.  Returns a Kerberos error code.
+ * configuration, a Kerberos context, the request for the principal whose
+ * password is being changed (we will have to change the realm), and the new
+ * password.  Returns a Kerberos error code.
+ *
+ * If AD rejects our cached credentials, discard them and try once more with
+ * freshly obtained credentials.  If Active Directory couldn't be reached for
+ * a recent password change, fail immediately rather than waiting for the same
+ * timeouts again.  The whole change, including obtaining credentials, has to
+ * finish within ad_timeout if that is set.  If ad_password_method is set to
+ * ldap, the change is made by sync_ad_chpass_ldap instead.  Changes for
+ * accounts recently found to be missing fail without contacting AD.
  */
 krb5_error_code
 sync_ad_chpass(kadm5_hook_modinfo *config, krb5_context ctx,
-               krb5_principal principal, const char *password)
+               struct sync_request *request, const char *password)
 {
     krb5_error_code code;
-    char *target = NULL;
-    krb5_ccache ccache;
-    krb5_principal ad_principal = NULL;
-    int result_code;
-    krb5_data result_code_string, result_string;
+    const char *target;
+    krb5_principal ad_principal;
+    bool retry;
+
+    /* Set the password over LDAP instead if configured to. */
+    if (sync_ad_password_ldap(config))
+        return sync_ad_chpass_ldap(config, ctx, request, password);
 
     /* Ensure the configuration is sane. */
     CHECK_CONFIG(ad_realm);
+    ad_deadline_start(config);
 
-    /* Get the credentials we'll use to make the change in AD. */
-    code = get_creds(config, ctx, &ccache);
-    if (code != 0)
-        return code;
-
-    /* Get the corresponding AD principal. */
-    code = get_ad_principal(config, ctx, principal, &ad_principal);
+    /* Get the corresponding AD principal and its name for logging. */
+    code = sync_request_ad_principal(config, ctx, request, &ad_principal,
+                                     &target);
     if (code != 0)
         goto done;
-
-    /* This is just for logging purposes. */
-    code = krb5_unparse_name(ctx, ad_principal, &target);
+    code = ad_check_missing(config, ctx, target);
     if (code != 0)
         goto done;
 
-    /* Do the actual password change and record any error. */
-    code = krb5_set_password_using_ccache(ctx, ccache, (char *) password,
-                                          ad_principal, &result_code,
-                                          &result_code_string, &result_string);
+    /* Do the password change, retrying once with new credentials. */
+    code = sync_kpasswd_check(config, ctx);
     if (code != 0)
         goto done;
-    if (result_code != 0) {
-        code = sync_error_generic(ctx, "password change failed for %s: (%d)"
-                                  " %.*s%s%.*s", target, result_code,
-                                  (int) result_code_string.length,
-                                  (char *) result_code_string.data,
-                                  result_string.length ? ": " : "",
-                                  (int) result_string.length,
-                                  (char *) result_string.data);
-        goto done;
+    code = ad_set_password(config, ctx, ad_principal, target, password,
+                           &retry);
+    if (code != 0 && retry) {
+        sync_ad_creds_reset(config, ctx);
+        code = ad_set_password(config, ctx, ad_principal, target, password,
+                               &retry);
     }
-    free(result_string.data);
-    free(result_code_string.data);
+    sync_kpasswd_report(config, code);
+    if (code != 0)
+        goto done;
+    sync_dncache_set_missing(config, target, false);
     sync_syslog_info(config, "krb5-sync: %s password changed", target);
 
 done:
-    krb5_cc_destroy(ctx, ccache);
-    if (target != NULL)
-        krb5_free_unparsed_name(ctx, target);
-    if (ad_principal != NULL)
-        krb5_free_principal(ctx, ad_principal);
+    config->ad_deadline.tv_sec = 0;
     return code;
 }
 
 
 /*
- * Empty SASL callback function to satisfy the requirements of the LDAP SASL
- * bind interface.  Hopefully it won't need anything.
+ * Find the next change in a batch of password changes that can be started,
+ * which is the first pending change whose account has no change running or
+ * waiting for a retry.  Since that is the first pending change, changes for
+ * the same account are started in order.  No change is started while the
+ * window of ad_adaptive_concurrency is full.  Sets more to false if no change
+ * is pending or waiting for a retry, in which case no more changes will
+ * become startable.  Must be called with the mutex held.  Returns count if
+ * no change can be started now.
  */
-static int
-ad_interact_sasl(LDAP *ld UNUSED, unsigned flags UNUSED,
-                 void *defaults UNUSED, void *interact UNUSED)
+static size_t
+ad_kpasswd_next(struct ad_kpasswd_batch *batch, bool *more)
 {
-    return 0;
+    size_t i, j, running = 0, window;
+    bool busy;
+
+    *more = false;
+    window = sync_limit_window(batch->config, SYNC_LIMIT_KPASSWD,
+                               (size_t) batch->config->ad_kpasswd_concurrency);
+    for (i = 0; i < batch->count; i++)
+        if (batch->state[i] == AD_KPASSWD_RUNNING)
+            running++;
+    for (i = 0; i < batch->count; i++) {
+        if (batch->state[i] == AD_KPASSWD_RETRY)
+            *more = true;
+        if (batch->state[i] != AD_KPASSWD_PENDING)
+            continue;
+        *more = true;
+        if (running >= window)
+            continue;
+        busy = false;
+        for (j = 0; j < batch->count && !busy; j++)
+            if (batch->state[j] == AD_KPASSWD_RUNNING
+                || batch->state[j] == AD_KPASSWD_RETRY)
+                busy = (strcmp(batch->targets[i], batch->targets[j]) == 0);
+        if (!busy)
+            return i;
+    }
+    return batch->count;
 }
 
 
 /*
- * Change the status of an account in Active Directory.  Takes the plugin
- * configuration, a Kerberos context, the principal whose status changed (only
- * the principal name is used, ignoring the realm), a flag saying whether the
- * account is enabled, and a buffer into which to put error messages and its
- * length.
+ * The body of a thread making password changes from a batch.  Each change is
+ * made with the thread's own Kerberos context and its own handle to the
+ * shared credential cache, and its result and error message are stored for
+ * the calling thread to report.
  */
-krb5_error_code
-sync_ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
-               krb5_principal principal, bool enabled)
+static void *
+ad_kpasswd_thread(void *data)
 {
+    struct ad_kpasswd_thread *thread = data;
+    struct ad_kpasswd_batch *batch = thread->batch;
+    krb5_context ctx = thread->ctx;
     krb5_ccache ccache;
-    krb5_principal ad_principal = NULL;
-    LDAP *ld = NULL;
-    LDAPMessage *res = NULL;
-    LDAPMod mod, *mod_array[2];
-    char *dn;
-    char *ldapuri = NULL, *ldapdn = NULL, *control = NULL, *target = NULL;
-    struct berval **vals = NULL;
-    char *value;
-    const char *attrs[] = { "userAccountControl", NULL };
-    char *strvals[2];
-    int option;
-    unsigned int acctcontrol;
+    const char *message;
+    char *copy;
+    size_t i;
+    bool more, retry;
     krb5_error_code code;
 
+    pthread_mutex_lock(&batch->mutex);
+    for (;;) {
+        i = ad_kpasswd_next(batch, &more);
+        if (i == batch->count) {
+            if (!more)
+                break;
+            pthread_cond_wait(&batch->wakeup, &batch->mutex);
+            continue;
+        }
+        batch->state[i] = AD_KPASSWD_RUNNING;
+        pthread_mutex_unlock(&batch->mutex);
+
+        /* Make the change without holding the mutex. */
+        retry = false;
+        code = krb5_cc_resolve(ctx, batch->config->ad_ccache_name, &ccache);
+        if (code == 0) {
+            code = ad_kpasswd(batch->config, ctx, ccache,
+                              batch->principals[i], batch->targets[i],
+                              batch->changes[i].password, &retry);
+            krb5_cc_close(ctx, ccache);
+        }
+        copy = NULL;
+        if (code != 0) {
+            message = krb5_get_error_message(ctx, code);
+            copy = strdup(message);
+            krb5_free_error_message(ctx, message);
+        }
+
+        /* Store the result and wake the other threads. */
+        pthread_mutex_lock(&batch->mutex);
+        batch->codes[i] = code;
+        free(batch->messages[i]);
+        batch->messages[i] = copy;
+        batch->state[i] = retry ? AD_KPASSWD_RETRY : AD_KPASSWD_DONE;
+        pthread_cond_broadcast(&batch->wakeup);
+    }
+    pthread_mutex_unlock(&batch->mutex);
+    return NULL;
+}
+
+
+/*
+ * Report the result of a finished change in a batch of password changes,
+ * restoring its error message in the context of the calling thread first.
+ * Called without the mutex held.
+ */
+static void
+ad_kpasswd_report(struct ad_kpasswd_batch *batch, krb5_context ctx, size_t i,
+                  sync_ad_report_func report, void *data)
+{
+    krb5_error_code code = batch->codes[i];
+
+    sync_kpasswd_report(batch->config, code);
+    if (code == 0) {
+        sync_dncache_set_missing(batch->config, batch->targets[i], false);
+        sync_syslog_info(batch->config, "krb5-sync: %s password changed",
+                         batch->targets[i]);
+    } else if (batch->messages[i] != NULL)
+        krb5_set_error_message(ctx, code, "%s", batch->messages[i]);
+    report(data, i, code);
+}
+
+
+/*
+ * Change the passwords of many accounts in Active Directory with up to
+ * ad_kpasswd_concurrency kpasswd exchanges in flight at once.  Each exchange
+ * is made by a worker thread with its own Kerberos context, all sharing the
+ * cached AD credentials, which are obtained before the threads start.  A
+ * change isn't started while another for the same account is in progress,
+ * so changes for the same account are made in order.  report is called with
+ * data, the index of each change, and its result from the calling thread as
+ * soon as the change finishes, while the error message is still set in the
+ * context.
+ *
+ * If AD rejects the cached credentials, new ones are obtained once for the
+ * batch and each rejected change is retried once.  The new credentials are
+ * written to a temporary cache that replaces the cached one with
+ * krb5_cc_move, so the other threads reading the cache never find it empty.
+ * ad_timeout isn't applied to the batch.  If ad_kpasswd_concurrency is 1,
+ * passwords are set over LDAP, or no threads can be started, the changes are
+ * made one at a time with sync_ad_chpass.
+ * Returns a Kerberos error code for problems with the configuration or
+ * allocation failures; failures of individual changes are only reported.
+ */
+krb5_error_code
+sync_ad_chpass_batch(kadm5_hook_modinfo *config, krb5_context ctx,
+                     struct sync_ad_password *changes, size_t count,
+                     sync_ad_report_func report, void *data)
+{
+    struct ad_kpasswd_batch batch;
+    struct ad_kpasswd_thread *threads = NULL;
+    krb5_ccache ccache;
+    size_t nthreads, started = 0, left = 0, i;
+    bool refreshed = false, found;
+    bool *retried = NULL;
+    krb5_error_code code = 0;
+
     /* Ensure the configuration is sane. */
-    CHECK_CONFIG(ad_admin_server);
-    CHECK_CONFIG(ad_ldap_base);
+    CHECK_CONFIG(ad_realm);
+    nthreads = (size_t) config->ad_kpasswd_concurrency;
+    if (nthreads > count)
+        nthreads = count;
+    if (nthreads <= 1 || sync_ad_password_ldap(config)) {
+        for (i = 0; i < count; i++) {
+            code = sync_ad_chpass(config, ctx, changes[i].request,
+                                  changes[i].password);
+            report(data, i, code);
+        }
+        return 0;
+    }
 
-    /* Get the credentials we'll use to make the change in AD. */
-    code = get_creds(config, ctx, &ccache);
-    if (code != 0)
-        return code;
+    /* Allocate the shared state of the batch. */
+    memset(&batch, 0, sizeof(batch));
+    batch.config = config;
+    batch.changes = changes;
+    batch.count = count;
+    batch.principals = calloc(count, sizeof(*batch.principals));
+    batch.targets = calloc(count, sizeof(*batch.targets));
+    batch.state = calloc(count, sizeof(*batch.state));
+    batch.codes = calloc(count, sizeof(*batch.codes));
+    batch.messages = calloc(count, sizeof(*batch.messages));
+    retried = calloc(count, sizeof(*retried));
+    threads = calloc(nthreads, sizeof(*threads));
+    if (batch.principals == NULL || batch.targets == NULL
+        || batch.state == NULL || batch.codes == NULL
+        || batch.messages == NULL || retried == NULL || threads == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
 
     /*
-     * Point SASL at the memory cache we're about to create.  This is changing
-     * the global environment for kadmind and is therefore quite ugly, but
-     * should hopefully be harmless.  Ideally OpenLDAP should provide some way
-     * of calling through to Cyrus SASL to set the ticket cache, but that's
-     * hard.
+     * Fail every change at once if kpasswd was recently unreachable, and
+     * otherwise get the credentials now so that the threads find them in the
+     * cache.
      */
-    if (putenv((char *) "KRB5CCNAME=" CACHE_NAME) != 0) {
-        code = sync_error_system(ctx, "putenv of KRB5CCNAME failed");
+    code = sync_kpasswd_check(config, ctx);
+    if (code == 0) {
+        code = sync_ad_creds(config, ctx, &ccache);
+        if (code == 0)
+            krb5_cc_close(ctx, ccache);
+    }
+    if (code != 0) {
+        for (i = 0; i < count; i++)
+            report(data, i, code);
+        code = 0;
         goto done;
     }
 
-    /* Now, bind to the directory server using GSSAPI. */
-    if (asprintf(&ldapuri, "ldap://%s", config->ad_admin_server) < 0) {
-        code = sync_error_system(ctx, "cannot allocate memory");
-        goto done;
+    /* Resolve the AD principals, reporting changes that fail at once. */
+    for (i = 0; i < count; i++) {
+        code = sync_request_ad_principal(config, ctx, changes[i].request,
+                                         &batch.principals[i],
+                                         &batch.targets[i]);
+        if (code == 0)
+            code = ad_check_missing(config, ctx, batch.targets[i]);
+        if (code != 0) {
+            batch.state[i] = AD_KPASSWD_REPORTED;
+            report(data, i, code);
+        } else
+            left++;
     }
-    code = ldap_initialize(&ld, ldapuri);
-    if (code != LDAP_SUCCESS) {
-        code = sync_error_ldap(ctx, code, "LDAP initialization failed");
+    code = 0;
+
+    /* Start the threads, each with its own Kerberos context. */
+    if (pthread_mutex_init(&batch.mutex, NULL) != 0) {
+        code = sync_error_system(ctx, "cannot create mutex");
         goto done;
     }
-    option = LDAP_VERSION3;
-    code = ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &option);
-    if (code != LDAP_SUCCESS) {
-        code = sync_error_ldap(ctx, code, "LDAP protocol selection failed");
+    if (pthread_cond_init(&batch.wakeup, NULL) != 0) {
+        pthread_mutex_destroy(&batch.mutex);
+        code = sync_error_system(ctx, "cannot create condition variable");
         goto done;
     }
-    code = ldap_sasl_interactive_bind_s(ld, NULL, "GSSAPI", NULL, NULL,
-                                       LDAP_SASL_QUIET, ad_interact_sasl,
-                                       NULL);
-    if (code != LDAP_SUCCESS) {
-        code = sync_error_ldap(ctx, code, "LDAP bind failed");
-        goto done;
+    for (started = 0; started < nthreads; started++) {
+        threads[started].batch = &batch;
+        if (krb5_init_context(&threads[started].ctx) != 0)
+            break;
+        if (pthread_create(&threads[started].thread, NULL, ad_kpasswd_thread,
+                           &threads[started]) != 0) {
+            krb5_free_context(threads[started].ctx);
+            break;
+        }
     }
 
-    /*
-     * Since all we know is the local principal, we have to convert that to
-     * the AD principal and then query Active Directory via LDAP to get back
-     * the CN for the user to construct the full DN.
-     */
-    code = get_ad_principal(config, ctx, principal, &ad_principal);
-    if (code != 0)
-        goto done;
-    code = krb5_unparse_name(ctx, ad_principal, &target);
-    if (code != 0)
-        goto done;
-    if (asprintf(&ldapdn, "(userPrincipalName=%s)", target) < 0) {
-        code = sync_error_system(ctx, "cannot allocate memory");
-        goto done;
+    /* If no thread could be started, make the changes one at a time. */
+    if (started == 0)
+        for (i = 0; i < count; i++)
+            if (batch.state[i] == AD_KPASSWD_PENDING) {
+                code = sync_ad_chpass(config, ctx, changes[i].request,
+                                      changes[i].password);
+                report(data, i, code);
+                batch.state[i] = AD_KPASSWD_REPORTED;
+                left--;
+            }
+    code = 0;
+
+    /* Report the changes as they finish and retry rejected ones. */
+    pthread_mutex_lock(&batch.mutex);
+    while (left > 0) {
+        found = false;
+        for (i = 0; i < count; i++) {
+            if (batch.state[i] == AD_KPASSWD_RETRY && !retried[i]) {
+                found = true;
+                retried[i] = true;
+                if (!refreshed) {
+                    refreshed = true;
+                    pthread_mutex_unlock(&batch.mutex);
+                    __atomic_store_n(sync_shared_creds_expires(config), 0,
+                                     __ATOMIC_RELAXED);
+                    if (sync_ad_creds(config, ctx, &ccache) == 0)
+                        krb5_cc_close(ctx, ccache);
+                    pthread_mutex_lock(&batch.mutex);
+                }
+                batch.state[i] = AD_KPASSWD_PENDING;
+                pthread_cond_broadcast(&batch.wakeup);
+            } else if (batch.state[i] == AD_KPASSWD_RETRY
+                       || batch.state[i] == AD_KPASSWD_DONE) {
+                found = true;
+                batch.state[i] = AD_KPASSWD_REPORTED;
+                left--;
+                pthread_mutex_unlock(&batch.mutex);
+                ad_kpasswd_report(&batch, ctx, i, report, data);
+                pthread_mutex_lock(&batch.mutex);
+            }
+        }
+        if (!found)
+            pthread_cond_wait(&batch.wakeup, &batch.mutex);
     }
-    code = ldap_search_ext_s(ld, config->ad_ldap_base, LDAP_SCOPE_SUBTREE,
-                             ldapdn, (char **) attrs, 0, NULL, NULL, NULL, 0,
-                             &res);
-    if (code != LDAP_SUCCESS) {
-        code = sync_error_ldap(ctx, code, "LDAP search for \"%s\" failed",
-                               ldapdn);
-        goto done;
+    pthread_mutex_unlock(&batch.mutex);
+
+    /* Wait for the threads to exit and clean up. */
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+        krb5_free_context(threads[i].ctx);
     }
+    pthread_cond_destroy(&batch.wakeup);
+    pthread_mutex_destroy(&batch.mutex);
+
+done:
+    if (batch.messages != NULL)
+        for (i = 0; i < count; i++)
+            free(batch.messages[i]);
+    free(batch.principals);
+    free(batch.targets);
+    free(batch.state);
+    free(batch.codes);
+    free(batch.messages);
+    free(retried);
+    free(threads);
+    return code;
+}
+
+
+/*
+ * Given the result of a successful search for the AD account for target,
+ * retrieve its DN and current userAccountControl value.  The DN is returned
+ * in dn and should be freed with ldap_memfree.  If the search found nothing,
+ * remember that the account is missing for ad_dn_cache_missing.  Returns a
+ * Kerberos error code.
+ */
+static krb5_error_code
+ad_account_entry(kadm5_hook_modinfo *config, krb5_context ctx, LDAP *ld,
+                 LDAPMessage *res, const char *target, char **dn,
+                 unsigned int *acctcontrol)
+{
+    LDAPMessage *entry;
+    struct berval **vals = NULL;
+    char *value;
+    krb5_error_code code;
+
+    *dn = NULL;
     if (ldap_count_entries(ld, res) == 0) {
+        sync_dncache_set_missing(config, target, true);
         code = sync_error_generic(ctx, "user \"%s\" not found via LDAP",
                                   target);
         goto done;
     }
-    res = ldap_first_entry(ld, res);
-    dn = ldap_get_dn(ld, res);
-    if (ldap_msgtype(res) != LDAP_RES_SEARCH_ENTRY) {
+    entry = ldap_first_entry(ld, res);
+    if (ldap_msgtype(entry) != LDAP_RES_SEARCH_ENTRY) {
         code = sync_error_generic(ctx, "expected LDAP msgtype of"
                                   " RES_SEARCH_ENTRY (0x61), but got type %x"
-                                  " instead", ldap_msgtype(res));
+                                  " instead", ldap_msgtype(entry));
+        goto done;
+    }
+    *dn = ldap_get_dn(ld, entry);
+    if (*dn == NULL) {
+        code = sync_error_generic(ctx, "cannot get DN for user \"%s\"",
+                                  target);
         goto done;
     }
-    vals = ldap_get_values_len(ld, res, "userAccountControl");
+    vals = ldap_get_values_len(ld, entry, "userAccountControl");
     if (ldap_count_values_len(vals) != 1) {
         code = sync_error_generic(ctx, "expected one value for"
                                   " userAccountControl for user \"%s\" and"
@@ -367,11 +698,7 @@ sync_ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
         goto done;
     }
 
-    /*
-     * Okay, we've found the user and everything looks normal.  Parse the
-     * current flag value and modify it according to the enable, flag, and
-     * then push back the modified value.
-     */
+    /* Parse the current flag value. */
     value = malloc(vals[0]->bv_len + 1);
     if (value == NULL) {
         code = sync_error_system(ctx, "cannot allocate memory");
@@ -379,53 +706,1359 @@ sync_ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
     }
     memcpy(value, vals[0]->bv_val, vals[0]->bv_len);
     value[vals[0]->bv_len] = '\0';
-    if (sscanf(value, "%u", &acctcontrol) != 1) {
+    if (sscanf(value, "%u", acctcontrol) != 1) {
         code = sync_error_generic(ctx, "unable to parse userAccountControl"
                                   " for user \"%s\" (%s)", target, value);
         free(value);
         goto done;
     }
     free(value);
-    if (enabled)
-        acctcontrol &= ~UF_ACCOUNTDISABLE;
-    else
-        acctcontrol |= UF_ACCOUNTDISABLE;
-    memset(&mod, 0, sizeof(mod));
-    mod.mod_op = LDAP_MOD_REPLACE;
-    mod.mod_type = (char *) "userAccountControl";
-    if (asprintf(&control, "%u", acctcontrol) < 0) {
-        code = sync_error_system(ctx, "cannot allocate memory");
-        goto done;
-    }
-    strvals[0] = control;
-    strvals[1] = NULL;
-    mod.mod_vals.modv_strvals = strvals;
-    mod_array[0] = &mod;
-    mod_array[1] = NULL;
-    code = ldap_modify_ext_s(ld, dn, mod_array, NULL, NULL);
-    if (code != LDAP_SUCCESS) {
-        code = sync_error_ldap(ctx, code, "LDAP modification for user \"%s\""
-                               " failed", target);
-        goto done;
-    }
-
-    /* Success. */
     code = 0;
-    sync_syslog_info(config, "successfully %s account %s",
-                     enabled ? "enabled" : "disabled", target);
 
 done:
-    free(ldapuri);
-    free(ldapdn);
-    free(control);
-    krb5_cc_destroy(ctx, ccache);
-    if (target != NULL)
-        krb5_free_unparsed_name(ctx, target);
-    if (res != NULL)
-        ldap_msgfree(res);
+    if (code != 0 && *dn != NULL) {
+        ldap_memfree(*dn);
+        *dn = NULL;
+    }
     if (vals != NULL)
         ldap_value_free_len(vals);
-    if (ld == NULL)
-        ldap_unbind_ext_s(ld, NULL, NULL);
+    return code;
+}
+
+
+/*
+ * Return the base of the subtree search for the account of a request: the
+ * base given by its rule in ad_mapping_rules or in ad_ldap_instance_bases
+ * for the instance of its local principal, if any, and otherwise
+ * ad_ldap_base.
+ */
+static const char *
+ad_search_base(kadm5_hook_modinfo *config, krb5_context ctx,
+               struct sync_request *request)
+{
+    const char *instance, *entry;
+    size_t i, length;
+
+    entry = sync_mapping_base(config, ctx, request);
+    if (entry != NULL)
+        return entry;
+    if (config->ad_ldap_instance_bases == NULL
+        || krb5_principal_get_num_comp(ctx, request->principal) != 2)
+        return config->ad_ldap_base;
+    instance = krb5_principal_get_comp_string(ctx, request->principal, 1);
+    length = strlen(instance);
+    for (i = 0; i < config->ad_ldap_instance_bases->count; i++) {
+        entry = config->ad_ldap_instance_bases->strings[i];
+        if (strncmp(entry, instance, length) == 0 && entry[length] == ':')
+            return entry + length + 1;
+    }
+    return config->ad_ldap_base;
+}
+
+
+/*
+ * Store in filter the filter of the subtree search for the account of a
+ * request, whose AD principal is target.  The account is matched on
+ * userPrincipalName, or, if ad_ldap_filter_attribute is sAMAccountName, on
+ * that attribute with the first component of the AD principal, which is
+ * indexed in every domain.  The value is escaped as required by RFC 4515.
+ * The filter lasts until the request is freed.  Returns a Kerberos error
+ * code.
+ */
+static krb5_error_code
+ad_search_filter(kadm5_hook_modinfo *config, krb5_context ctx,
+                 struct sync_request *request, const char *target,
+                 const char **filter)
+{
+    krb5_principal ad_principal;
+    const char *attribute = "userPrincipalName";
+    const char *value = target;
+    char *escaped, *p;
+    krb5_error_code code;
+
+    if (config->ad_ldap_filter_attribute != NULL
+        && strcmp(config->ad_ldap_filter_attribute, "sAMAccountName") == 0) {
+        code = sync_request_ad_principal(config, ctx, request, &ad_principal,
+                                         NULL);
+        if (code != 0)
+            return code;
+        attribute = "sAMAccountName";
+        value = krb5_principal_get_comp_string(ctx, ad_principal, 0);
+    }
+    escaped = malloc(strlen(value) * 3 + 1);
+    if (escaped == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    for (p = escaped; *value != '\0'; value++)
+        if (strchr("*()\\", *value) != NULL) {
+            snprintf(p, 4, "\\%02x", (unsigned char) *value);
+            p += 3;
+        } else
+            *p++ = *value;
+    *p = '\0';
+    *filter = sync_request_printf(request, "(%s=%s)", attribute, escaped);
+    free(escaped);
+    if (*filter == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    return 0;
+}
+
+
+/*
+ * Store in dn the DN already known for the account of a request whose AD
+ * principal is target, or NULL if none is known.  That is the DN given by
+ * the rule for it in ad_mapping_rules, in which case mapped is set to true
+ * and the DN is never searched for, or else the DN in the DN cache.
+ * Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_known_dn(kadm5_hook_modinfo *config, krb5_context ctx,
+            struct sync_request *request, const char *target,
+            const char **dn, bool *mapped)
+{
+    krb5_error_code code;
+
+    code = sync_mapping_dn(config, ctx, request, dn);
+    if (code != 0)
+        return code;
+    *mapped = (*dn != NULL);
+    if (*dn == NULL)
+        *dn = sync_dncache_lookup(config, request, target);
+    return 0;
+}
+
+
+/*
+ * Search for the AD account for target and retrieve its DN and current
+ * userAccountControl value.  Takes the plugin configuration, the base and
+ * scope of the search and the filter to use, so that this can be used either
+ * for a subtree search from ad_search_base with ad_search_filter or to read
+ * an entry whose DN is already known.  The search has a size limit of one,
+ * so a filter that matches more than one account fails with
+ * LDAP_SIZELIMIT_EXCEEDED rather than picking one of them.  The DN is
+ * returned in dn and should be freed with ldap_memfree.  The LDAP result code
+ * of the search is stored in result so that the caller can check for lost
+ * connections or missing entries.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_find_account(kadm5_hook_modinfo *config, krb5_context ctx, LDAP *ld,
+                const char *base, int scope, const char *filter,
+                const char *target, char **dn, unsigned int *acctcontrol,
+                int *result)
+{
+    LDAPMessage *res = NULL;
+    const char *attrs[] = { "userAccountControl", NULL };
+    struct timeval start;
+    krb5_error_code code;
+
+    *dn = NULL;
+    sync_stats_start(config, &start);
+    *result = ldap_search_ext_s(ld, base, scope, filter, (char **) attrs, 0,
+                                NULL, NULL, NULL, 1, &res);
+    sync_stats_record(config, SYNC_STATS_LDAP_SEARCH, &start, *result);
+    if (*result != LDAP_SUCCESS)
+        code = sync_error_ldap(ctx, *result, "LDAP search for \"%s\" failed",
+                               filter);
+    else
+        code = ad_account_entry(config, ctx, ld, res, target, dn,
+                                acctcontrol);
+    if (res != NULL)
+        ldap_msgfree(res);
+    return code;
+}
+
+
+/*
+ * Returns true if ad_password_method says to set passwords over LDAP rather
+ * than with kpasswd.
+ */
+bool
+sync_ad_password_ldap(kadm5_hook_modinfo *config)
+{
+    return (config->ad_password_method != NULL
+            && strcmp(config->ad_password_method, "ldap") == 0);
+}
+
+
+/*
+ * Append a UTF-16 code unit in little-endian byte order to out at offset
+ * *length, updating *length.
+ */
+static void
+ad_utf16_put(char *out, size_t *length, unsigned long unit)
+{
+    out[(*length)++] = (char) (unit & 0xff);
+    out[(*length)++] = (char) ((unit >> 8) & 0xff);
+}
+
+
+/*
+ * Encode a password as a value of unicodePwd, which is the password
+ * surrounded by double quotes in UTF-16LE.  Takes the password in UTF-8 and
+ * the AD principal for error messages.  The value should be wiped with
+ * sync_wipe and freed by the caller.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_password_value(krb5_context ctx, const char *password, const char *target,
+                  struct berval *value)
+{
+    static const unsigned long minimum[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    const unsigned char *p;
+    unsigned long c;
+    size_t length = 0, size, i;
+    char *out;
+
+    /* Each UTF-8 byte becomes at most one UTF-16 code unit. */
+    value->bv_val = NULL;
+    value->bv_len = 0;
+    out = malloc((strlen(password) + 2) * 2);
+    if (out == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    ad_utf16_put(out, &length, '"');
+    for (p = (const unsigned char *) password; *p != '\0'; p += size) {
+        if (*p < 0x80) {
+            c = *p;
+            size = 1;
+        } else if ((*p & 0xe0) == 0xc0) {
+            c = *p & 0x1f;
+            size = 2;
+        } else if ((*p & 0xf0) == 0xe0) {
+            c = *p & 0x0f;
+            size = 3;
+        } else if ((*p & 0xf8) == 0xf0) {
+            c = *p & 0x07;
+            size = 4;
+        } else {
+            goto invalid;
+        }
+        for (i = 1; i < size; i++) {
+            if ((p[i] & 0xc0) != 0x80)
+                goto invalid;
+            c = (c << 6) | (p[i] & 0x3f);
+        }
+        if (c < minimum[size] || c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+            goto invalid;
+        if (c < 0x10000)
+            ad_utf16_put(out, &length, c);
+        else {
+            c -= 0x10000;
+            ad_utf16_put(out, &length, 0xd800 + (c >> 10));
+            ad_utf16_put(out, &length, 0xdc00 + (c & 0x3ff));
+        }
+    }
+    ad_utf16_put(out, &length, '"');
+    value->bv_val = out;
+    value->bv_len = length;
+    return 0;
+
+invalid:
+    sync_wipe(out, length);
+    free(out);
+    return sync_error_generic(ctx, "new password for %s is not valid UTF-8",
+                              target);
+}
+
+
+/*
+ * Replace the unicodePwd attribute of the account with the given DN, which
+ * sets its password.  The LDAP result code is stored in result so that the
+ * caller can check for lost connections or missing entries.  Returns a
+ * Kerberos error code.
+ */
+static krb5_error_code
+ad_password_modify(kadm5_hook_modinfo *config, krb5_context ctx, LDAP *ld,
+                   const char *dn, const char *target, struct berval *value,
+                   int *result)
+{
+    LDAPMod mod, *mod_array[2];
+    struct berval *bvals[2];
+    struct timeval start;
+    krb5_error_code code;
+
+    bvals[0] = value;
+    bvals[1] = NULL;
+    mod.mod_op = LDAP_MOD_REPLACE | LDAP_MOD_BVALUES;
+    mod.mod_type = (char *) "unicodePwd";
+    mod.mod_vals.modv_bvals = bvals;
+    mod_array[0] = &mod;
+    mod_array[1] = NULL;
+    *result = LDAP_SUCCESS;
+    code = sync_ldap_limit(config, ctx, ld);
+    if (code != 0)
+        return code;
+    sync_stats_start(config, &start);
+    *result = ldap_modify_ext_s(ld, dn, mod_array, NULL, NULL);
+    sync_stats_record(config, SYNC_STATS_LDAP_MODIFY, &start, *result);
+    if (*result != LDAP_SUCCESS)
+        return sync_error_ldap(ctx, *result, "LDAP password change for user"
+                               " \"%s\" failed", target);
+    return 0;
+}
+
+
+/*
+ * Set the password of an account in Active Directory over LDAP.  Takes the
+ * plugin configuration, a Kerberos context, the request, a bound LDAP
+ * connection, the AD principal, and the encoded unicodePwd value.  A known
+ * DN is used without reading the entry first, since the modify fails if the
+ * DN is stale, in which case the account is searched for unless the DN came
+ * from ad_mapping_rules.  Sets down to true if the connection was lost.
+ * Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_set_password_ldap(kadm5_hook_modinfo *config, krb5_context ctx,
+                     struct sync_request *request, LDAP *ld,
+                     const char *target, struct berval *value, bool *down)
+{
+    char *dn = NULL;
+    const char *cached, *filter;
+    unsigned int acctcontrol;
+    int result = LDAP_SUCCESS;
+    bool mapped;
+    krb5_error_code code;
+
+    /* Try the known DN first, if we have one. */
+    *down = false;
+    code = ad_known_dn(config, ctx, request, target, &cached, &mapped);
+    if (code != 0)
+        return code;
+    if (cached != NULL) {
+        code = ad_password_modify(config, ctx, ld, cached, target, value,
+                                  &result);
+        if (code == 0 || result != LDAP_NO_SUCH_OBJECT || mapped) {
+            *down = sync_ldap_down(result);
+            return code;
+        }
+        sync_dncache_remove(config, target);
+    }
+
+    /* Otherwise, search for the account to find its DN. */
+    code = ad_search_filter(config, ctx, request, target, &filter);
+    if (code != 0)
+        return code;
+    code = sync_ldap_limit(config, ctx, ld);
+    if (code != 0)
+        return code;
+    code = ad_find_account(config, ctx, ld,
+                           ad_search_base(config, ctx, request),
+                           LDAP_SCOPE_SUBTREE, filter, target, &dn,
+                           &acctcontrol, &result);
+    if (code != 0) {
+        *down = sync_ldap_down(result);
+        return code;
+    }
+    sync_dncache_store(config, target, dn);
+    code = ad_password_modify(config, ctx, ld, dn, target, value, &result);
+    *down = sync_ldap_down(result);
+    ldap_memfree(dn);
+    return code;
+}
+
+
+/*
+ * Push a password change to Active Directory over LDAP rather than kpasswd,
+ * using a pooled connection that is encrypted by LDAPS or GSSAPI.  Takes the
+ * same arguments as sync_ad_chpass, which calls this if ad_password_method
+ * is set to ldap.  If the pooled connection turns out to have been lost,
+ * discard it and retry once on a new connection.  The whole change has to
+ * finish within ad_timeout if that is set, and each LDAP call within
+ * ad_ldap_timeout.  Returns a Kerberos error code.
+ */
+krb5_error_code
+sync_ad_chpass_ldap(kadm5_hook_modinfo *config, krb5_context ctx,
+                    struct sync_request *request, const char *password)
+{
+    krb5_principal ad_principal;
+    struct berval value;
+    LDAP *ld = NULL;
+    const char *target;
+    bool down = false;
+    krb5_error_code code;
+
+    /* Ensure the configuration is sane. */
+    if (config->ad_ldap_servers == NULL)
+        CHECK_CONFIG(ad_admin_server);
+    CHECK_CONFIG(ad_ldap_base);
+    CHECK_CONFIG(ad_realm);
+    ad_deadline_start(config);
+    value.bv_val = NULL;
+
+    /* Get the AD principal and encode the password for unicodePwd. */
+    code = sync_request_ad_principal(config, ctx, request, &ad_principal,
+                                     &target);
+    if (code != 0)
+        goto done;
+    code = ad_check_missing(config, ctx, target);
+    if (code != 0)
+        goto done;
+    code = ad_password_value(ctx, password, target, &value);
+    if (code != 0)
+        goto done;
+
+    /* Make the change, retrying once if the pooled connection was lost. */
+    code = sync_ldap_get(config, ctx, &ld);
+    if (code != 0)
+        goto done;
+    code = ad_set_password_ldap(config, ctx, request, ld, target, &value,
+                                &down);
+    if (code != 0 && down) {
+        sync_ldap_release(config, ld, true);
+        code = sync_ldap_get(config, ctx, &ld);
+        if (code != 0)
+            goto done;
+        code = ad_set_password_ldap(config, ctx, request, ld, target,
+                                    &value, &down);
+    }
+    sync_ldap_release(config, ld, down);
+    if (code != 0)
+        goto done;
+    sync_syslog_info(config, "krb5-sync: %s password changed", target);
+
+done:
+    if (value.bv_val != NULL) {
+        sync_wipe(value.bv_val, value.bv_len);
+        free(value.bv_val);
+    }
+    config->ad_deadline.tv_sec = 0;
+    return code;
+}
+
+
+/*
+ * Returns true if the disabled flag in the userAccountControl value
+ * acctcontrol already says whether the account is enabled, in which case
+ * there is nothing to write.
+ */
+static bool
+ad_status_current(unsigned int acctcontrol, bool enabled)
+{
+    return ((acctcontrol & UF_ACCOUNTDISABLE) == 0) == enabled;
+}
+
+
+/*
+ * Create an LDAP assertion control (RFC 4528) for the modify of
+ * userAccountControl whose value was read as acctcontrol, so that the modify
+ * fails with LDAP_ASSERTION_FAILED rather than overwriting a change made by
+ * someone else since the read.  The control isn't critical, so a server that
+ * doesn't support it makes the modify as before.  The filter is made in the
+ * request.  Returns an LDAP status.
+ */
+static int
+ad_status_assert(LDAP *ld, struct sync_request *request,
+                 unsigned int acctcontrol, LDAPControl **control)
+{
+    char *filter;
+
+    *control = NULL;
+    filter = sync_request_printf(request, "(userAccountControl=%u)",
+                                 acctcontrol);
+    if (filter == NULL)
+        return LDAP_NO_MEMORY;
+    return ldap_create_assertion_control(ld, filter, 0, control);
+}
+
+
+/*
+ * Build the modification of userAccountControl that sets or clears the
+ * disabled flag in its current value acctcontrol, using mod, strvals, and
+ * mod_array for storage and making the new value in the request.  Returns
+ * false on failure to allocate memory.
+ */
+static bool
+ad_status_mod(struct sync_request *request, unsigned int acctcontrol,
+              bool enabled, LDAPMod *mod, char *strvals[2],
+              LDAPMod *mod_array[2])
+{
+    if (enabled)
+        acctcontrol &= ~UF_ACCOUNTDISABLE;
+    else
+        acctcontrol |= UF_ACCOUNTDISABLE;
+    memset(mod, 0, sizeof(*mod));
+    mod->mod_op = LDAP_MOD_REPLACE;
+    mod->mod_type = (char *) "userAccountControl";
+    strvals[0] = sync_request_printf(request, "%u", acctcontrol);
+    if (strvals[0] == NULL)
+        return false;
+    strvals[1] = NULL;
+    mod->mod_vals.modv_strvals = strvals;
+    mod_array[0] = mod;
+    mod_array[1] = NULL;
+    return true;
+}
+
+
+/*
+ * Given a bound LDAP connection, find the AD account for target and set or
+ * clear the disabled flag in its userAccountControl attribute.  Takes the
+ * plugin configuration, a Kerberos context, the request, the LDAP connection,
+ * the AD principal as a string, and whether the account should be enabled.
+ * Temporary strings are made in the request.  Sets
+ * down to true if the operation failed because the connection was lost.
+ * Returns a Kerberos error code.
+ *
+ * If the DN of the account is given by ad_mapping_rules or is in the DN
+ * cache, read the entry directly by DN rather than doing a subtree search
+ * from ad_ldap_base, which is slow in a large tree.  We still have to read
+ * the entry, since the modify replaces the whole userAccountControl value.
+ * If a cached DN no longer exists, discard it and fall back on the search,
+ * but a DN from ad_mapping_rules is never searched for.
+ *
+ * If the disabled flag is already right, nothing is written.  Otherwise, the
+ * modify asserts the value that was read, and if the account changed in
+ * between, it is read and modified once more.
+ */
+static krb5_error_code
+ad_set_status(kadm5_hook_modinfo *config, krb5_context ctx,
+              struct sync_request *request, LDAP *ld, const char *target,
+              bool enabled, bool *down)
+{
+    LDAPMod mod, *mod_array[2];
+    LDAPControl *assertion, *controls[2];
+    char *dn = NULL;
+    const char *cached, *filter;
+    char *strvals[2];
+    unsigned int acctcontrol = 0;
+    int result = LDAP_SUCCESS;
+    struct timeval start;
+    bool mapped, retried = false;
+    krb5_error_code code;
+
+    /* Try the known DN first, if we have one. */
+    *down = false;
+again:
+    code = ad_known_dn(config, ctx, request, target, &cached, &mapped);
+    if (code != 0)
+        goto done;
+    if (cached != NULL) {
+        code = sync_ldap_limit(config, ctx, ld);
+        if (code != 0)
+            goto done;
+        code = ad_find_account(config, ctx, ld, cached, LDAP_SCOPE_BASE,
+                               "(objectClass=*)", target, &dn, &acctcontrol,
+                               &result);
+        if (code != 0 && (mapped || sync_ldap_down(result))) {
+            *down = sync_ldap_down(result);
+            goto done;
+        }
+        if (code != 0)
+            sync_dncache_remove(config, target);
+    }
+
+    /*
+     * Otherwise, since all we know is the local principal, we have to query
+     * Active Directory via LDAP to get back the CN for the user to construct
+     * the full DN.
+     */
+    if (dn == NULL) {
+        code = ad_search_filter(config, ctx, request, target, &filter);
+        if (code != 0)
+            goto done;
+        code = sync_ldap_limit(config, ctx, ld);
+        if (code != 0)
+            goto done;
+        code = ad_find_account(config, ctx, ld,
+                               ad_search_base(config, ctx, request),
+                               LDAP_SCOPE_SUBTREE, filter, target, &dn,
+                               &acctcontrol, &result);
+        if (code != 0) {
+            *down = sync_ldap_down(result);
+            goto done;
+        }
+        sync_dncache_store(config, target, dn);
+    }
+
+    /* Skip the modify if the account already has the right status. */
+    if (ad_status_current(acctcontrol, enabled)) {
+        sync_syslog_debug(config, "krb5-sync: account %s already %s", target,
+                          enabled ? "enabled" : "disabled");
+        sync_dncache_set_status(config, target, true, enabled);
+        code = 0;
+        goto done;
+    }
+
+    /*
+     * Okay, we've found the user and everything looks normal.  Modify the
+     * flag value according to the enable flag and then push back the
+     * modified value, as long as the value is still the one we read.
+     */
+    if (!ad_status_mod(request, acctcontrol, enabled, &mod, strvals,
+                       mod_array)) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    result = ad_status_assert(ld, request, acctcontrol, &assertion);
+    if (result != LDAP_SUCCESS) {
+        code = sync_error_ldap(ctx, result, "cannot create LDAP assertion"
+                               " control");
+        goto done;
+    }
+    controls[0] = assertion;
+    controls[1] = NULL;
+    code = sync_ldap_limit(config, ctx, ld);
+    if (code != 0) {
+        ldap_control_free(assertion);
+        goto done;
+    }
+    sync_stats_start(config, &start);
+    code = ldap_modify_ext_s(ld, dn, mod_array, controls, NULL);
+    sync_stats_record(config, SYNC_STATS_LDAP_MODIFY, &start, code);
+    ldap_control_free(assertion);
+    if (code == LDAP_ASSERTION_FAILED && !retried) {
+        retried = true;
+        ldap_memfree(dn);
+        dn = NULL;
+        goto again;
+    }
+    if (code != LDAP_SUCCESS) {
+        *down = sync_ldap_down(code);
+        if (code == LDAP_NO_SUCH_OBJECT)
+            sync_dncache_remove(config, target);
+        else
+            sync_dncache_set_status(config, target, false, enabled);
+        code = sync_error_ldap(ctx, code, "LDAP modification for user \"%s\""
+                               " failed", target);
+        goto done;
+    }
+    sync_dncache_set_status(config, target, true, enabled);
+    code = 0;
+
+done:
+    if (dn != NULL)
+        ldap_memfree(dn);
+    return code;
+}
+
+
+/*
+ * Change the status of an account in Active Directory.  Takes the plugin
+ * configuration, a Kerberos context, the request for the principal whose
+ * status changed (only the principal name is used, ignoring the realm), and a
+ * flag saying whether the account is enabled.  Returns a Kerberos error code.
+ *
+ * The change is made over a pooled LDAP connection.  If that connection turns
+ * out to have been lost, discard it and retry once on a new connection.  The
+ * whole change has to finish within ad_timeout if that is set, and each LDAP
+ * call within ad_ldap_timeout.  If ad_dn_cache_status is set and the account
+ * is known to already have the new status, or if ad_dn_cache_missing is set
+ * and the account was recently found to be missing, no LDAP call is made at
+ * all.
+ */
+krb5_error_code
+sync_ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
+               struct sync_request *request, bool enabled)
+{
+    krb5_principal ad_principal;
+    LDAP *ld = NULL;
+    const char *target;
+    bool down = false;
+    krb5_error_code code;
+
+    /* Ensure the configuration is sane. */
+    if (config->ad_ldap_servers == NULL)
+        CHECK_CONFIG(ad_admin_server);
+    CHECK_CONFIG(ad_ldap_base);
+    ad_deadline_start(config);
+
+    /* Convert the local principal to the AD principal. */
+    code = sync_request_ad_principal(config, ctx, request, &ad_principal,
+                                     &target);
+    if (code != 0)
+        goto done;
+    code = ad_check_missing(config, ctx, target);
+    if (code != 0)
+        goto done;
+
+    /* Skip the change if the account is known to have that status. */
+    if (sync_dncache_status(config, target, enabled)) {
+        sync_syslog_debug(config, "krb5-sync: account %s already %s", target,
+                          enabled ? "enabled" : "disabled");
+        goto done;
+    }
+
+    /* Make the change, retrying once if the pooled connection was lost. */
+    code = sync_ldap_get(config, ctx, &ld);
+    if (code != 0)
+        goto done;
+    code = ad_set_status(config, ctx, request, ld, target, enabled, &down);
+    if (code != 0 && down) {
+        sync_ldap_release(config, ld, true);
+        code = sync_ldap_get(config, ctx, &ld);
+        if (code != 0)
+            goto done;
+        code = ad_set_status(config, ctx, request, ld, target, enabled,
+                             &down);
+    }
+    sync_ldap_release(config, ld, down);
+    if (code != 0)
+        goto done;
+
+    /* Success. */
+    sync_syslog_info(config, "successfully %s account %s",
+                     enabled ? "enabled" : "disabled", target);
+
+done:
+    config->ad_deadline.tv_sec = 0;
+    return code;
+}
+
+
+/*
+ * Returns true if an LDAP result code means that the server is overloaded or
+ * not responding, which counts as back-pressure for ad_adaptive_concurrency.
+ */
+static bool
+ad_ldap_busy(int result)
+{
+    return result == LDAP_BUSY || result == LDAP_UNAVAILABLE
+        || result == LDAP_ADMINLIMIT_EXCEEDED
+        || result == LDAP_TIMELIMIT_EXCEEDED || sync_ldap_down(result);
+}
+
+
+/*
+ * Start the search for the account of a change in a batch of status changes,
+ * reading the entry by DN if the DN is known, unless cached was cleared
+ * because a cached DN turned out to be stale.  On success, the slot is
+ * waiting for the search result.  Sets down to true if the connection was
+ * lost.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+ad_batch_search(kadm5_hook_modinfo *config, krb5_context ctx, LDAP *ld,
+                struct sync_ad_change *change, struct ad_batch_slot *slot,
+                bool *down)
+{
+    const char *attrs[] = { "userAccountControl", NULL };
+    const char *base, *cached, *filter;
+    int scope, status;
+    krb5_error_code code;
+
+    cached = NULL;
+    slot->mapped = false;
+    if (slot->cached) {
+        code = ad_known_dn(config, ctx, change->request, slot->target,
+                           &cached, &slot->mapped);
+        if (code != 0)
+            return code;
+    }
+    slot->cached = (cached != NULL);
+    if (cached != NULL) {
+        base = cached;
+        scope = LDAP_SCOPE_BASE;
+        filter = "(objectClass=*)";
+    } else {
+        base = ad_search_base(config, ctx, change->request);
+        scope = LDAP_SCOPE_SUBTREE;
+        code = ad_search_filter(config, ctx, change->request, slot->target,
+                                &filter);
+        if (code != 0)
+            return code;
+    }
+    slot->modify = false;
+    sync_stats_start(config, &slot->start);
+    sync_limit_start(config, SYNC_LIMIT_LDAP, &slot->limit);
+    status = ldap_search_ext(ld, base, scope, filter, (char **) attrs, 0,
+                             NULL, NULL, NULL, 1, &slot->msgid);
+    if (status != LDAP_SUCCESS) {
+        sync_stats_record(config, SYNC_STATS_LDAP_SEARCH, &slot->start,
+                          status);
+        *down = sync_ldap_down(status);
+        return sync_error_ldap(ctx, status, "LDAP search for \"%s\" failed",
+                               filter);
+    }
+    return 0;
+}
+
+
+/*
+ * Handle the result of an operation of a change in a batch of status
+ * changes.  After a search, start the modify unless the account already has
+ * the right status, or, if a cached DN is gone, search for the account
+ * again.  If the modify fails because the account changed since the search,
+ * start over once.  Sets finished to false if the change is
+ * still in progress and down to true if the connection was lost.  Returns a
+ * Kerberos error code.
+ */
+static krb5_error_code
+ad_batch_result(kadm5_hook_modinfo *config, krb5_context ctx, LDAP *ld,
+                struct sync_ad_change *change, struct ad_batch_slot *slot,
+                LDAPMessage *res, bool *finished, bool *down)
+{
+    LDAPMod mod, *mod_array[2];
+    LDAPControl *assertion, *controls[2];
+    char *strvals[2];
+    char *dn = NULL;
+    unsigned int acctcontrol = 0;
+    int result, status;
+    krb5_error_code code;
+
+    *finished = true;
+    status = ldap_parse_result(ld, res, &result, NULL, NULL, NULL, NULL, 0);
+    if (status != LDAP_SUCCESS)
+        result = status;
+    sync_limit_finish(config, SYNC_LIMIT_LDAP, &slot->limit,
+                      ad_ldap_busy(result));
+
+    /*
+     * The modify is the last step, unless the account changed since the
+     * search, in which case search for it again once.
+     */
+    if (slot->modify) {
+        sync_stats_record(config, SYNC_STATS_LDAP_MODIFY, &slot->start,
+                          result);
+        if (result == LDAP_ASSERTION_FAILED && !slot->retried) {
+            slot->retried = true;
+            slot->cached = true;
+            code = ad_batch_search(config, ctx, ld, change, slot, down);
+            if (code == 0)
+                *finished = false;
+            return code;
+        }
+        if (result != LDAP_SUCCESS) {
+            *down = sync_ldap_down(result);
+            if (result == LDAP_NO_SUCH_OBJECT)
+                sync_dncache_remove(config, slot->target);
+            else
+                sync_dncache_set_status(config, slot->target, false,
+                                        change->enabled);
+            return sync_error_ldap(ctx, result, "LDAP modification for user"
+                                   " \"%s\" failed", slot->target);
+        }
+        sync_dncache_set_status(config, slot->target, true, change->enabled);
+        sync_syslog_info(config, "successfully %s account %s",
+                         change->enabled ? "enabled" : "disabled",
+                         slot->target);
+        return 0;
+    }
+
+    /* Otherwise, this is the search.  Fall back on a search for a bad DN. */
+    sync_stats_record(config, SYNC_STATS_LDAP_SEARCH, &slot->start, result);
+    if (result != LDAP_SUCCESS) {
+        *down = sync_ldap_down(result);
+        code = sync_error_ldap(ctx, result, "LDAP search for \"%s\" failed",
+                               slot->target);
+    } else
+        code = ad_account_entry(config, ctx, ld, res, slot->target, &dn,
+                                &acctcontrol);
+    if (code != 0 && slot->cached && !slot->mapped && !*down) {
+        sync_dncache_remove(config, slot->target);
+        slot->cached = false;
+        code = ad_batch_search(config, ctx, ld, change, slot, down);
+        if (code == 0)
+            *finished = false;
+        return code;
+    }
+    if (code != 0)
+        return code;
+    if (!slot->cached)
+        sync_dncache_store(config, slot->target, dn);
+
+    /* Skip the modify if the account already has the right status. */
+    if (ad_status_current(acctcontrol, change->enabled)) {
+        ldap_memfree(dn);
+        sync_syslog_debug(config, "krb5-sync: account %s already %s",
+                          slot->target,
+                          change->enabled ? "enabled" : "disabled");
+        sync_dncache_set_status(config, slot->target, true, change->enabled);
+        return 0;
+    }
+
+    /* Start the modify, asserting the value that was read. */
+    if (!ad_status_mod(change->request, acctcontrol, change->enabled, &mod,
+                       strvals, mod_array)) {
+        ldap_memfree(dn);
+        return sync_error_system(ctx, "cannot allocate memory");
+    }
+    status = ad_status_assert(ld, change->request, acctcontrol, &assertion);
+    if (status != LDAP_SUCCESS) {
+        ldap_memfree(dn);
+        return sync_error_ldap(ctx, status, "cannot create LDAP assertion"
+                               " control");
+    }
+    controls[0] = assertion;
+    controls[1] = NULL;
+    slot->modify = true;
+    sync_stats_start(config, &slot->start);
+    sync_limit_start(config, SYNC_LIMIT_LDAP, &slot->limit);
+    status = ldap_modify_ext(ld, dn, mod_array, controls, NULL, &slot->msgid);
+    ldap_control_free(assertion);
+    ldap_memfree(dn);
+    if (status != LDAP_SUCCESS) {
+        sync_stats_record(config, SYNC_STATS_LDAP_MODIFY, &slot->start,
+                          status);
+        *down = sync_ldap_down(status);
+        return sync_error_ldap(ctx, status, "LDAP modification for user"
+                               " \"%s\" failed", slot->target);
+    }
+    *finished = false;
+    return 0;
+}
+
+
+/*
+ * Change the status of many accounts in Active Directory, keeping up to
+ * ad_status_depth LDAP operations in flight on one pooled connection rather
+ * than waiting for the result of each search and modify before sending the
+ * next, or fewer if ad_adaptive_concurrency has reduced the window.  Results
+ * are matched back to changes by message ID, and report is called with data,
+ * the index of each change, and its result as soon as the change finishes,
+ * while the error message is still set in the context.  Changes for the same
+ * account are made in order, since a change isn't started while another for
+ * the same account is in flight.
+ * Accounts that already have the new status aren't modified, and with
+ * ad_dn_cache_status, aren't read either if that status is remembered.
+ * Changes for accounts recently found to be missing fail at once.
+ *
+ * If the connection is lost or an LDAP result doesn't arrive within
+ * ad_ldap_timeout, the unfinished changes are made one at a time with
+ * sync_ad_status, which gets a new connection and retries lost ones.
+ * ad_timeout isn't applied to the batch as a whole.  Returns a Kerberos error
+ * code for problems with the configuration; failures of individual changes
+ * are only reported.
+ */
+krb5_error_code
+sync_ad_status_batch(kadm5_hook_modinfo *config, krb5_context ctx,
+                     struct sync_ad_change *changes, size_t count,
+                     sync_ad_report_func report, void *data)
+{
+    struct ad_batch_slot *slots, *slot;
+    krb5_principal ad_principal;
+    LDAPMessage *res;
+    LDAP *ld = NULL;
+    struct timeval timeout;
+    const char *target;
+    size_t next = 0, inflight = 0, depth, i, j;
+    bool down = false, finished, blocked;
+    int msgid;
+    krb5_error_code code;
+
+    /* Ensure the configuration is sane. */
+    if (config->ad_ldap_servers == NULL)
+        CHECK_CONFIG(ad_admin_server);
+    CHECK_CONFIG(ad_ldap_base);
+    depth = (config->ad_status_depth > 0) ? (size_t) config->ad_status_depth
+                                          : 1;
+    slots = calloc(depth, sizeof(*slots));
+    if (slots == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    if (sync_ldap_get(config, ctx, &ld) != 0) {
+        ld = NULL;
+        down = true;
+    }
+    while (!down && (next < count || inflight > 0)) {
+        /* Start changes until the pipeline is full. */
+        blocked = false;
+        while (!down && !blocked && next < count
+               && inflight < sync_limit_window(config, SYNC_LIMIT_LDAP,
+                                               depth)) {
+            code = sync_request_ad_principal(config, ctx,
+                                             changes[next].request,
+                                             &ad_principal, &target);
+            if (code == 0)
+                code = ad_check_missing(config, ctx, target);
+            if (code != 0) {
+                report(data, next++, code);
+                continue;
+            }
+            slot = NULL;
+            for (j = 0; j < depth; j++)
+                if (slots[j].used && strcmp(slots[j].target, target) == 0)
+                    blocked = true;
+                else if (!slots[j].used && slot == NULL)
+                    slot = &slots[j];
+            if (blocked)
+                break;
+            if (sync_dncache_status(config, target, changes[next].enabled)) {
+                sync_syslog_debug(config, "krb5-sync: account %s already %s",
+                                  target, changes[next].enabled ? "enabled"
+                                  : "disabled");
+                report(data, next++, 0);
+                continue;
+            }
+            slot->used = true;
+            slot->index = next++;
+            slot->target = target;
+            slot->cached = true;
+            slot->retried = false;
+            code = ad_batch_search(config, ctx, ld, &changes[slot->index],
+                                   slot, &down);
+            if (code == 0 || down)
+                inflight++;
+            else {
+                report(data, slot->index, code);
+                slot->used = false;
+            }
+        }
+        if (down || inflight == 0)
+            continue;
+
+        /* Wait for the next result and handle it. */
+        timeout.tv_sec = config->ad_ldap_timeout;
+        timeout.tv_usec = 0;
+        if (ldap_result(ld, LDAP_RES_ANY, LDAP_MSG_ALL,
+                        config->ad_ldap_timeout > 0 ? &timeout : NULL,
+                        &res) <= 0) {
+            for (j = 0; j < depth; j++)
+                if (slots[j].used)
+                    sync_limit_finish(config, SYNC_LIMIT_LDAP,
+                                      &slots[j].limit, true);
+            down = true;
+            continue;
+        }
+        msgid = ldap_msgid(res);
+        slot = NULL;
+        for (j = 0; j < depth; j++)
+            if (slots[j].used && slots[j].msgid == msgid)
+                slot = &slots[j];
+        if (slot == NULL) {
+            ldap_msgfree(res);
+            continue;
+        }
+        code = ad_batch_result(config, ctx, ld, &changes[slot->index], slot,
+                               res, &finished, &down);
+        ldap_msgfree(res);
+        if (finished && !down) {
+            report(data, slot->index, code);
+            slot->used = false;
+            inflight--;
+        }
+    }
+    if (ld != NULL)
+        sync_ldap_release(config, ld, down);
+
+    /*
+     * If the connection was lost, make the unfinished changes one at a time,
+     * first those in flight, which are all for different accounts, and then
+     * the rest in order.
+     */
+    if (down) {
+        for (i = 0; i < count; i++)
+            for (j = 0; j < depth; j++)
+                if (slots[j].used && slots[j].index == i) {
+                    code = sync_ad_status(config, ctx, changes[i].request,
+                                          changes[i].enabled);
+                    report(data, i, code);
+                }
+        for (i = next; i < count; i++) {
+            code = sync_ad_status(config, ctx, changes[i].request,
+                                  changes[i].enabled);
+            report(data, i, code);
+        }
+    }
+    free(slots);
+    return 0;
+}
+
+
+/*
+ * Copy the single value of an attribute of an LDAP entry into a newly
+ * allocated string.  Returns NULL if the attribute doesn't have exactly one
+ * value or on allocation failure.
+ */
+static char *
+ad_entry_value(LDAP *ld, LDAPMessage *entry, const char *attr)
+{
+    struct berval **vals;
+    char *value = NULL;
+
+    vals = ldap_get_values_len(ld, entry, attr);
+    if (ldap_count_values_len(vals) == 1) {
+        value = malloc(vals[0]->bv_len + 1);
+        if (value != NULL) {
+            memcpy(value, vals[0]->bv_val, vals[0]->bv_len);
+            value[vals[0]->bv_len] = '\0';
+        }
+    }
+    if (vals != NULL)
+        ldap_value_free_len(vals);
+    return value;
+}
+
+
+/*
+ * Call func for each entry of one page of the account listing, and store the
+ * cookie for the next page, which is empty after the last page.  Entries
+ * without a userPrincipalName or with an unparsable userAccountControl are
+ * skipped.  Accounts that were remembered as missing no longer are.  Returns
+ * a Kerberos status code.
+ */
+static krb5_error_code
+ad_accounts_page(kadm5_hook_modinfo *config, krb5_context ctx, LDAP *ld,
+                 LDAPMessage *res, sync_ad_account_func func, void *data,
+                 struct berval *cookie)
+{
+    LDAPMessage *entry;
+    LDAPControl **controls = NULL, *control;
+    char *upn, *value;
+    unsigned int acctcontrol;
+    ber_int_t count;
+    int status, result = LDAP_SUCCESS;
+
+    for (entry = ldap_first_entry(ld, res); entry != NULL;
+         entry = ldap_next_entry(ld, entry)) {
+        upn = ad_entry_value(ld, entry, "userPrincipalName");
+        value = ad_entry_value(ld, entry, "userAccountControl");
+        if (upn != NULL)
+            sync_dncache_set_missing(config, upn, false);
+        if (upn != NULL && value != NULL
+            && sscanf(value, "%u", &acctcontrol) == 1)
+            func(data, upn, (acctcontrol & UF_ACCOUNTDISABLE) == 0);
+        free(upn);
+        free(value);
+    }
+
+    /* Get the cookie for the next page. */
+    status = ldap_parse_result(ld, res, &result, NULL, NULL, NULL, &controls,
+                               0);
+    if (status == LDAP_SUCCESS)
+        status = result;
+    if (status != LDAP_SUCCESS)
+        return sync_error_ldap(ctx, status, "LDAP search of %s failed",
+                               config->ad_ldap_base);
+    control = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, controls, NULL);
+    if (control == NULL)
+        status = LDAP_SUCCESS;
+    else
+        status = ldap_parse_pageresponse_control(ld, control, &count, cookie);
+    if (controls != NULL)
+        ldap_controls_free(controls);
+    if (status != LDAP_SUCCESS)
+        return sync_error_ldap(ctx, status, "cannot parse LDAP paged results"
+                               " control");
+    return 0;
+}
+
+
+/*
+ * Read the name of the domain controller on the other end of an LDAP
+ * connection and its highestCommittedUSN from its root DSE, storing the name
+ * in a newly allocated string.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+ad_root_usn(kadm5_hook_modinfo *config, krb5_context ctx, LDAP *ld,
+            char **server, unsigned long long *usn, bool *down)
+{
+    LDAPMessage *res = NULL, *entry;
+    const char *attrs[] = { "dnsHostName", "highestCommittedUSN", NULL };
+    char *value = NULL;
+    int status;
+    krb5_error_code code;
+
+    *server = NULL;
+    code = sync_ldap_limit(config, ctx, ld);
+    if (code != 0)
+        return code;
+    status = ldap_search_ext_s(ld, "", LDAP_SCOPE_BASE, "(objectClass=*)",
+                               (char **) attrs, 0, NULL, NULL, NULL, 0, &res);
+    if (status != LDAP_SUCCESS) {
+        *down = sync_ldap_down(status);
+        code = sync_error_ldap(ctx, status, "cannot read LDAP root DSE");
+        goto done;
+    }
+    entry = ldap_first_entry(ld, res);
+    if (entry != NULL) {
+        *server = ad_entry_value(ld, entry, "dnsHostName");
+        value = ad_entry_value(ld, entry, "highestCommittedUSN");
+    }
+    if (*server == NULL || value == NULL || sscanf(value, "%llu", usn) != 1) {
+        free(*server);
+        *server = NULL;
+        code = sync_error_generic(ctx, "cannot get highestCommittedUSN from"
+                                  " LDAP root DSE");
+    }
+
+done:
+    free(value);
+    if (res != NULL)
+        ldap_msgfree(res);
+    return code;
+}
+
+
+/*
+ * Return the uSNChanged high-water mark stored for the given domain
+ * controller in queue_dir/AD_USN_FILE, or 0 if there is none.  The file has
+ * one line per domain controller, with its name and the highestCommittedUSN
+ * it reported before the last complete listing of accounts.
+ */
+static unsigned long long
+ad_usn_read(kadm5_hook_modinfo *config, const char *server)
+{
+    FILE *file;
+    char *path, name[256];
+    unsigned long long usn, found = 0;
+
+    if (asprintf(&path, "%s/%s", config->queue_dir, AD_USN_FILE) < 0)
+        return 0;
+    file = fopen(path, "r");
+    free(path);
+    if (file == NULL)
+        return 0;
+    while (fscanf(file, "%255s %llu", name, &usn) == 2)
+        if (strcmp(name, server) == 0)
+            found = usn;
+    fclose(file);
+    return found;
+}
+
+
+/*
+ * Store the uSNChanged high-water mark for the given domain controller,
+ * keeping those of other domain controllers.  The file is replaced with a
+ * rename, so readers never see a partial file.  Returns a Kerberos status
+ * code.
+ */
+static krb5_error_code
+ad_usn_write(kadm5_hook_modinfo *config, krb5_context ctx,
+             const char *server, unsigned long long usn)
+{
+    FILE *old, *new;
+    char *path = NULL, *tmp = NULL, name[256];
+    unsigned long long value;
+    krb5_error_code code = 0;
+
+    if (asprintf(&path, "%s/%s", config->queue_dir, AD_USN_FILE) < 0
+        || asprintf(&tmp, "%s.%lu", path, (unsigned long) getpid()) < 0) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    new = fopen(tmp, "w");
+    if (new == NULL) {
+        code = sync_error_system(ctx, "cannot create %s", tmp);
+        goto done;
+    }
+    old = fopen(path, "r");
+    if (old != NULL) {
+        while (fscanf(old, "%255s %llu", name, &value) == 2)
+            if (strcmp(name, server) != 0)
+                fprintf(new, "%s %llu\n", name, value);
+        fclose(old);
+    }
+    fprintf(new, "%s %llu\n", server, usn);
+    if (ferror(new) || fclose(new) != 0) {
+        code = sync_error_system(ctx, "cannot write %s", tmp);
+        unlink(tmp);
+        goto done;
+    }
+    if (rename(tmp, path) < 0) {
+        code = sync_error_system(ctx, "cannot rename %s to %s", tmp, path);
+        unlink(tmp);
+    }
+
+done:
+    free(path);
+    free(tmp);
+    return code;
+}
+
+
+/*
+ * List accounts under ad_ldap_base with a userPrincipalName, calling func
+ * with data, the userPrincipalName, and whether the account is enabled.  The
+ * listing uses one subtree search, retrieved in pages of AD_PAGE_SIZE
+ * entries over a pooled LDAP connection, instead of a search per account.
+ *
+ * If queue_dir is set, the highestCommittedUSN of the domain controller is
+ * read before the search and stored afterwards as its high-water mark.  If
+ * incremental is true and a mark is stored for the domain controller, only
+ * the accounts changed since then, according to their uSNChanged, are
+ * listed, and incremental is left true; otherwise it is set to false.  Since
+ * USNs are local to each domain controller, marks are kept separately for
+ * each one.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_ad_accounts(kadm5_hook_modinfo *config, krb5_context ctx,
+                 bool *incremental, sync_ad_account_func func, void *data)
+{
+    LDAP *ld = NULL;
+    LDAPMessage *res = NULL;
+    LDAPControl *page = NULL, *controls[2];
+    struct berval cookie = { 0, NULL };
+    const char *attrs[] = { "userPrincipalName", "userAccountControl", NULL };
+    char *filter = NULL, *server = NULL;
+    unsigned long long usn = 0, since = 0;
+    struct timeval start;
+    bool down = false;
+    int status;
+    krb5_error_code code;
+
+    /* Ensure the configuration is sane. */
+    if (config->ad_ldap_servers == NULL)
+        CHECK_CONFIG(ad_admin_server);
+    CHECK_CONFIG(ad_ldap_base);
+    code = sync_ldap_get(config, ctx, &ld);
+    if (code != 0)
+        return code;
+
+    /* Find the high-water mark and build the filter. */
+    if (config->queue_dir != NULL) {
+        code = ad_root_usn(config, ctx, ld, &server, &usn, &down);
+        if (code != 0)
+            goto done;
+        if (*incremental)
+            since = ad_usn_read(config, server);
+    }
+    *incremental = (since > 0);
+    if (since > 0)
+        status = asprintf(&filter, "(&(userPrincipalName=*)"
+                          "(uSNChanged>=%llu))", since + 1);
+    else
+        status = asprintf(&filter, "(userPrincipalName=*)");
+    if (status < 0) {
+        filter = NULL;
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+
+    /* Retrieve each page, passing back the cookie from the last. */
+    do {
+        status = ldap_create_page_control(ld, AD_PAGE_SIZE,
+                                          cookie.bv_val != NULL ? &cookie
+                                                                : NULL,
+                                          1, &page);
+        if (status != LDAP_SUCCESS) {
+            code = sync_error_ldap(ctx, status, "cannot create LDAP paged"
+                                   " results control");
+            break;
+        }
+        controls[0] = page;
+        controls[1] = NULL;
+        code = sync_ldap_limit(config, ctx, ld);
+        if (code != 0)
+            break;
+        sync_stats_start(config, &start);
+        status = ldap_search_ext_s(ld, config->ad_ldap_base,
+                                   LDAP_SCOPE_SUBTREE, filter,
+                                   (char **) attrs, 0, controls, NULL, NULL,
+                                   0, &res);
+        sync_stats_record(config, SYNC_STATS_LDAP_SEARCH, &start, status);
+        ldap_control_free(page);
+        page = NULL;
+        if (status != LDAP_SUCCESS) {
+            down = sync_ldap_down(status);
+            code = sync_error_ldap(ctx, status, "LDAP search of %s failed",
+                                   config->ad_ldap_base);
+            break;
+        }
+        if (cookie.bv_val != NULL)
+            ber_memfree(cookie.bv_val);
+        cookie.bv_val = NULL;
+        cookie.bv_len = 0;
+        code = ad_accounts_page(config, ctx, ld, res, func, data, &cookie);
+        ldap_msgfree(res);
+        res = NULL;
+    } while (code == 0 && cookie.bv_val != NULL && cookie.bv_len > 0);
+
+    /* Store the new high-water mark once the listing is complete. */
+    if (code == 0 && server != NULL)
+        code = ad_usn_write(config, ctx, server, usn);
+
+done:
+    if (res != NULL)
+        ldap_msgfree(res);
+    if (cookie.bv_val != NULL)
+        ber_memfree(cookie.bv_val);
+    free(filter);
+    free(server);
+    sync_ldap_release(config, ld, down);
     return code;
 }
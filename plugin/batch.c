@@ -0,0 +1,472 @@
+/*
+ * Micro-batching of account status changes from the kadmind hooks.
+ *
+ * Scripts that disable or enable many accounts through kadmin call the
+ * modify hook once per principal, and each status change would otherwise
+ * wait for its own LDAP search and modify.  If ad_status_window is set, a
+ * status change that would be tried in Active Directory is instead added to
+ * a pending batch and the hook returns at once, which is safe since status
+ * changes are only pushed after they are committed to the local KDB.  A
+ * background thread waits ad_status_window milliseconds after the first
+ * change of a batch for more to arrive and then makes all of them with
+ * sync_ad_status_batch, pipelined on one pooled connection per target.  Each
+ * change is then finished on its own: its result goes to the circuit breaker
+ * of its target, and it is queued if it failed.
+ *
+ * The batch mutex is held by the hooks for the whole of each change and by
+ * the thread while it makes a batch.  The thread therefore never uses the
+ * configuration, credentials, or connections at the same time as a hook, and
+ * a hook never checks the queue for a conflict while an earlier failed change
+ * may still be waiting to be queued.  A later status change for an account
+ * already in the pending batch replaces it, and one that is queued instead
+ * removes it, since only the last status matters.
+ *
+ * Pending changes are lost if kadmind exits abnormally before the window
+ * ends.  On shutdown, the pending batch is made before the thread exits.  As
+ * with the worker thread, a forked child doesn't inherit the thread, so it
+ * abandons the batch state of its parent, which makes the changes that were
+ * pending at the fork.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/* A pending status change, with the target name, or NULL for "ad". */
+struct batch_entry {
+    char *domain;
+    krb5_principal principal;
+    bool enabled;
+};
+
+/*
+ * State of the batching thread.  ctx is the Kerberos context of the thread,
+ * which is also used by the hooks for the pending principals, and first is
+ * when the first pending change was added.  Everything but the thread and
+ * the mutex itself is protected by the mutex.
+ */
+struct sync_batch {
+    kadm5_hook_modinfo *config;
+    krb5_context ctx;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    pid_t pid;
+    struct batch_entry *entries;
+    size_t count;
+    size_t allocated;
+    struct timeval first;
+    bool stop;
+};
+
+/* The changes for one target being made by batch_flush. */
+struct batch_run {
+    kadm5_hook_modinfo *config;
+    kadm5_hook_modinfo *target;
+    krb5_context ctx;
+    struct sync_ad_change *changes;
+    bool *reported;
+    struct timeval start;
+};
+
+
+/*
+ * Returns true if a pending change is for the given target, which is NULL for
+ * "ad".
+ */
+static bool
+batch_domain(struct batch_entry *entry, const char *domain)
+{
+    if (entry->domain == NULL || domain == NULL)
+        return (entry->domain == domain);
+    return (strcmp(entry->domain, domain) == 0);
+}
+
+
+/*
+ * Called by sync_ad_status_batch with the result of each change.  Report it
+ * to the circuit breaker of the target and queue the change if it failed,
+ * logging any failure to queue it, since the kadmind hook that asked for the
+ * change has already returned.
+ */
+static void
+batch_report(void *data, size_t index, krb5_error_code code)
+{
+    struct batch_run *run = data;
+    kadm5_hook_modinfo *target = run->target;
+    struct sync_request *request = run->changes[index].request;
+    const char *operation, *message;
+
+    run->reported[index] = true;
+    sync_breaker_report(target, code, &run->start);
+    if (code == 0)
+        return;
+    message = krb5_get_error_message(run->ctx, code);
+    sync_syslog_notice(target, "krb5-sync: AD status change%s%s failed,"
+                       " queuing: %s", target->target == NULL ? "" : " in ",
+                       target->target == NULL ? "" : target->target,
+                       message);
+    krb5_free_error_message(run->ctx, message);
+    operation = run->changes[index].enabled ? "enable" : "disable";
+    code = sync_queue_write(run->config, run->ctx, request, operation, NULL);
+    if (code != 0) {
+        message = krb5_get_error_message(run->ctx, code);
+        sync_syslog_warning(target, "krb5-sync: cannot queue status"
+                            " change: %s", message);
+        krb5_free_error_message(run->ctx, message);
+    }
+}
+
+
+/*
+ * Make up to room of the pending changes for one target, which are the
+ * entries from start on with the same domain, using requests, changes, and
+ * reported, which have room for that many.  The principals of the entries
+ * are taken over and freed, which marks them as done.  Changes for a target
+ * that is no longer configured are dropped, as a new change for it would be.
+ */
+static void
+batch_target(struct sync_batch *batch, size_t start, size_t room,
+             struct sync_request *requests, struct sync_ad_change *changes,
+             bool *reported)
+{
+    struct batch_entry *entry;
+    struct batch_run run;
+    const char *domain = batch->entries[start].domain;
+    krb5_principal principal;
+    size_t i, n = 0;
+    krb5_error_code code;
+
+    /* Collect the changes for this target. */
+    for (i = start; i < batch->count && n < room; i++) {
+        entry = &batch->entries[i];
+        if (entry->principal == NULL)
+            continue;
+        if (!batch_domain(entry, domain))
+            continue;
+        sync_request_init(&requests[n], entry->principal);
+        entry->principal = NULL;
+        requests[n].domain = domain;
+        changes[n].request = &requests[n];
+        changes[n].enabled = entry->enabled;
+        reported[n++] = false;
+    }
+
+    /* Make them and finish each one that sync_ad_status_batch didn't. */
+    run.config = batch->config;
+    run.target = sync_target_find(batch->config,
+                                  domain == NULL ? "ad" : domain);
+    run.ctx = batch->ctx;
+    run.changes = changes;
+    run.reported = reported;
+    if (run.target == NULL)
+        sync_syslog_notice(batch->config, "krb5-sync: dropping %lu status"
+                           " changes for target %s, which is no longer"
+                           " configured", (unsigned long) n, domain);
+    else {
+        if (gettimeofday(&run.start, NULL) < 0)
+            run.start.tv_sec = run.start.tv_usec = 0;
+        code = sync_ad_status_batch(run.target, batch->ctx, changes, n,
+                                    batch_report, &run);
+        for (i = 0; code != 0 && i < n; i++)
+            if (!reported[i])
+                batch_report(&run, i, code);
+    }
+
+    for (i = 0; i < n; i++) {
+        principal = requests[i].principal;
+        sync_request_free(batch->ctx, &requests[i]);
+        krb5_free_principal(batch->ctx, principal);
+    }
+}
+
+
+/*
+ * Make all of the pending changes, grouped by target, and empty the batch.
+ * Must be called with the mutex held.  If memory for the whole batch can't be
+ * allocated, the changes are made one at a time instead.
+ */
+static void
+batch_flush(struct sync_batch *batch)
+{
+    struct sync_request one, *requests;
+    struct sync_ad_change one_change, *changes;
+    bool one_reported, *reported;
+    size_t i, room = batch->count;
+
+    requests = calloc(room, sizeof(*requests));
+    changes = calloc(room, sizeof(*changes));
+    reported = calloc(room, sizeof(*reported));
+    if (requests == NULL || changes == NULL || reported == NULL) {
+        free(requests);
+        free(changes);
+        free(reported);
+        requests = &one;
+        changes = &one_change;
+        reported = &one_reported;
+        room = 1;
+    }
+    for (i = 0; i < batch->count; i++)
+        while (batch->entries[i].principal != NULL)
+            batch_target(batch, i, room, requests, changes, reported);
+    for (i = 0; i < batch->count; i++)
+        free(batch->entries[i].domain);
+    batch->count = 0;
+    if (requests != &one) {
+        free(requests);
+        free(changes);
+        free(reported);
+    }
+}
+
+
+/*
+ * The main loop of the batching thread.  Wait for a pending change, wait
+ * until ad_status_window milliseconds after it for more, and then make the
+ * whole batch, until asked to stop, which makes any changes still pending.
+ */
+static void *
+batch_main(void *data)
+{
+    struct sync_batch *batch = data;
+    struct timeval now, end;
+    struct timespec deadline;
+    long window;
+
+    pthread_mutex_lock(&batch->mutex);
+    while (!batch->stop || batch->count > 0) {
+        if (batch->count == 0) {
+            pthread_cond_wait(&batch->wakeup, &batch->mutex);
+            continue;
+        }
+        window = batch->config->ad_status_window;
+        end.tv_sec = batch->first.tv_sec + window / 1000;
+        end.tv_usec = batch->first.tv_usec + (window % 1000) * 1000;
+        if (end.tv_usec >= 1000000) {
+            end.tv_sec++;
+            end.tv_usec -= 1000000;
+        }
+        if (!batch->stop && gettimeofday(&now, NULL) == 0
+            && timercmp(&now, &end, <)) {
+            deadline.tv_sec = end.tv_sec;
+            deadline.tv_nsec = end.tv_usec * 1000;
+            pthread_cond_timedwait(&batch->wakeup, &batch->mutex, &deadline);
+            continue;
+        }
+        batch_flush(batch);
+    }
+    pthread_mutex_unlock(&batch->mutex);
+    return NULL;
+}
+
+
+/*
+ * Start the batching thread, with all signals blocked so that signals are
+ * still delivered to the kadmind main thread, and return with its mutex
+ * held by the caller.  Returns false on failure.
+ */
+static bool
+batch_start(kadm5_hook_modinfo *config)
+{
+    struct sync_batch *batch;
+    sigset_t all, old;
+    int status;
+
+    batch = calloc(1, sizeof(*batch));
+    if (batch == NULL)
+        return false;
+    batch->config = config;
+    batch->pid = getpid();
+    if (krb5_init_context(&batch->ctx) != 0) {
+        free(batch);
+        errno = ENOMEM;
+        return false;
+    }
+    if (pthread_mutex_init(&batch->mutex, NULL) != 0) {
+        krb5_free_context(batch->ctx);
+        free(batch);
+        return false;
+    }
+    if (pthread_cond_init(&batch->wakeup, NULL) != 0) {
+        pthread_mutex_destroy(&batch->mutex);
+        krb5_free_context(batch->ctx);
+        free(batch);
+        return false;
+    }
+    pthread_mutex_lock(&batch->mutex);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    status = pthread_create(&batch->thread, NULL, batch_main, batch);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (status != 0) {
+        pthread_mutex_unlock(&batch->mutex);
+        pthread_cond_destroy(&batch->wakeup);
+        pthread_mutex_destroy(&batch->mutex);
+        krb5_free_context(batch->ctx);
+        free(batch);
+        errno = status;
+        return false;
+    }
+    config->batch = batch;
+    return true;
+}
+
+
+/*
+ * Take the batch mutex, if there is a batching thread in this process, so
+ * that the caller can use the configuration and Active Directory without the
+ * thread doing the same.  Called by each hook before doing anything else.
+ * If we've forked since the thread was started, it doesn't exist in this
+ * process and the mutex may be in any state, so just abandon the parent's
+ * batch state.
+ */
+void
+sync_batch_lock(kadm5_hook_modinfo *config)
+{
+    struct sync_batch *batch = config->batch;
+
+    if (batch != NULL && batch->pid != getpid()) {
+        config->batch = NULL;
+        batch = NULL;
+    }
+    if (batch != NULL)
+        pthread_mutex_lock(&batch->mutex);
+}
+
+
+/*
+ * Release the batch mutex taken by sync_batch_lock, or by sync_batch_add if
+ * that started the thread.
+ */
+void
+sync_batch_unlock(kadm5_hook_modinfo *config)
+{
+    if (config->batch != NULL)
+        pthread_mutex_unlock(&config->batch->mutex);
+}
+
+
+/*
+ * Add a status change for the principal in the given target, or in the only
+ * Active Directory if domain is NULL, to the pending batch, starting the
+ * batching thread if needed.  Must be called between sync_batch_lock and
+ * sync_batch_unlock.  Returns false if the change couldn't be added, in
+ * which case the caller should make it directly.
+ */
+bool
+sync_batch_add(kadm5_hook_modinfo *config, const char *domain,
+               krb5_principal principal, bool enabled)
+{
+    struct sync_batch *batch;
+    struct batch_entry *entry, *entries;
+    size_t i, size;
+
+    if (config->batch == NULL && !batch_start(config)) {
+        sync_syslog_warning(config, "krb5-sync: cannot start status batch"
+                            " thread: %s", strerror(errno));
+        return false;
+    }
+    batch = config->batch;
+
+    /* A later change for the same account replaces the pending one. */
+    for (i = 0; i < batch->count; i++) {
+        entry = &batch->entries[i];
+        if (batch_domain(entry, domain)
+            && krb5_principal_compare(batch->ctx, entry->principal,
+                                      principal)) {
+            entry->enabled = enabled;
+            return true;
+        }
+    }
+
+    /* Otherwise, add it to the end. */
+    if (batch->count == batch->allocated) {
+        size = (batch->allocated == 0) ? 16 : batch->allocated * 2;
+        entries = reallocarray(batch->entries, size, sizeof(*entries));
+        if (entries == NULL)
+            return false;
+        batch->entries = entries;
+        batch->allocated = size;
+    }
+    entry = &batch->entries[batch->count];
+    entry->domain = NULL;
+    if (domain != NULL) {
+        entry->domain = strdup(domain);
+        if (entry->domain == NULL)
+            return false;
+    }
+    if (krb5_copy_principal(batch->ctx, principal, &entry->principal) != 0) {
+        free(entry->domain);
+        return false;
+    }
+    entry->enabled = enabled;
+    if (batch->count++ == 0) {
+        if (gettimeofday(&batch->first, NULL) < 0)
+            batch->first.tv_sec = batch->first.tv_usec = 0;
+        pthread_cond_signal(&batch->wakeup);
+    }
+    return true;
+}
+
+
+/*
+ * Remove any pending status change for the principal in the given target,
+ * since a newer one is being queued instead.  Must be called between
+ * sync_batch_lock and sync_batch_unlock.
+ */
+void
+sync_batch_cancel(kadm5_hook_modinfo *config, const char *domain,
+                  krb5_principal principal)
+{
+    struct sync_batch *batch = config->batch;
+    struct batch_entry *entry;
+    size_t i;
+
+    if (batch == NULL)
+        return;
+    for (i = 0; i < batch->count; i++) {
+        entry = &batch->entries[i];
+        if (entry->principal != NULL && batch_domain(entry, domain)
+            && krb5_principal_compare(batch->ctx, entry->principal,
+                                      principal)) {
+            krb5_free_principal(batch->ctx, entry->principal);
+            entry->principal = NULL;
+        }
+    }
+}
+
+
+/*
+ * Stop the batching thread, if any, after it makes any pending changes, and
+ * wait for it to exit.
+ */
+void
+sync_batch_stop(kadm5_hook_modinfo *config)
+{
+    struct sync_batch *batch = config->batch;
+
+    if (batch == NULL)
+        return;
+    config->batch = NULL;
+    if (batch->pid != getpid())
+        return;
+    pthread_mutex_lock(&batch->mutex);
+    batch->stop = true;
+    pthread_cond_signal(&batch->wakeup);
+    pthread_mutex_unlock(&batch->mutex);
+    pthread_join(batch->thread, NULL);
+    pthread_cond_destroy(&batch->wakeup);
+    pthread_mutex_destroy(&batch->mutex);
+    free(batch->entries);
+    krb5_free_context(batch->ctx);
+    free(batch);
+}
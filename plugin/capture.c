@@ -0,0 +1,171 @@
+/*
+ * Capture of hook events for replay.
+ *
+ * If capture_file is set, each call of the password and status change hooks
+ * appends one line to it describing the change, which krb5-sync -R can feed
+ * back through the hooks against another Active Directory to reproduce the
+ * load.  The line identifies neither the user nor the password:
+ *
+ *     <seconds>.<microseconds> <operation> <id> <instance> <duration>
+ *
+ * The time is when the hook was called, operation is password, enable, or
+ * disable, and duration is how long the hook took in microseconds.  id is
+ * eight hex digits of a hash of the first component of the principal keyed
+ * with a random value chosen when the file is opened and never written out,
+ * so changes for the same user share an id but the user can't be recovered
+ * from it.  instance is the instance of the principal, which decides how it is
+ * propagated, or - if there is none.
+ *
+ * The file is opened for appending on first use and each line is written with
+ * a single write, so the lines of several processes don't interleave.  Since
+ * the key is chosen on first use, ids are only comparable between the events
+ * of one process.  Failure to capture an event never affects the change.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+
+/*
+ * The open capture file, or -1 if it couldn't be opened, in which case
+ * capturing stops until the configuration changes, and the hash key.
+ */
+struct sync_capture {
+    int fd;
+    char key[17];
+};
+
+
+/*
+ * Open capture_file and choose the hash key.  Returns NULL on failure to
+ * allocate memory.  Failure to open the file is logged and recorded in the
+ * returned state.
+ */
+static struct sync_capture *
+capture_open(kadm5_hook_modinfo *config)
+{
+    struct sync_capture *capture;
+    unsigned char random[8];
+    struct timeval now;
+    ssize_t status = -1;
+    size_t i;
+    int fd;
+
+    capture = calloc(1, sizeof(*capture));
+    if (capture == NULL)
+        return NULL;
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        status = read(fd, random, sizeof(random));
+        close(fd);
+    }
+    if (status != (ssize_t) sizeof(random)) {
+        gettimeofday(&now, NULL);
+        for (i = 0; i < sizeof(random); i++)
+            random[i] = (unsigned char) ((now.tv_usec >> (i * 3))
+                                         ^ (getpid() >> i) ^ now.tv_sec);
+    }
+    for (i = 0; i < sizeof(random); i++)
+        snprintf(capture->key + i * 2, 3, "%02x", random[i]);
+    capture->fd = open(config->capture_file, O_WRONLY | O_APPEND | O_CREAT,
+                       0600);
+    if (capture->fd < 0)
+        sync_syslog_warning(config, "krb5-sync: cannot open %s: %s",
+                            config->capture_file, strerror(errno));
+    return capture;
+}
+
+
+/*
+ * Record a change in capture_file, given its request, which was traced when
+ * the hook was called, and its operation.  Does nothing if capture_file isn't
+ * set.  Errors are logged, since there is nobody to return them to.
+ */
+void
+sync_capture_event(kadm5_hook_modinfo *config, krb5_context ctx,
+                   struct sync_request *request, const char *operation)
+{
+    struct sync_capture *capture;
+    struct timeval now;
+    const char *name, *key;
+    char *instance, *line, *p;
+    long duration;
+    ssize_t status;
+
+    if (config->capture_file == NULL || !timerisset(&request->entered))
+        return;
+    if (config->capture == NULL) {
+        config->capture = capture_open(config);
+        if (config->capture == NULL)
+            goto fail;
+    }
+    capture = config->capture;
+    if (capture->fd < 0)
+        return;
+
+    /* Work out the fields of the line. */
+    gettimeofday(&now, NULL);
+    duration = (now.tv_sec - request->entered.tv_sec) * 1000000
+        + (now.tv_usec - request->entered.tv_usec);
+    name = krb5_principal_get_comp_string(ctx, request->principal, 0);
+    key = sync_request_printf(request, "%s:%s", capture->key,
+                              name == NULL ? "" : name);
+    if (key == NULL)
+        goto fail;
+    instance = NULL;
+    if (krb5_principal_get_num_comp(ctx, request->principal) > 1) {
+        name = krb5_principal_get_comp_string(ctx, request->principal, 1);
+        if (name != NULL && *name != '\0') {
+            instance = sync_request_printf(request, "%s", name);
+            if (instance == NULL)
+                goto fail;
+        }
+    }
+    for (p = instance; p != NULL && *p != '\0'; p++)
+        if (isspace((unsigned char) *p))
+            *p = '_';
+
+    /* Write it out at once. */
+    line = sync_request_printf(request, "%ld.%06ld %s %08lx %s %ld\n",
+                               (long) request->entered.tv_sec,
+                               (long) request->entered.tv_usec, operation,
+                               (unsigned long) sync_hash_string(key),
+                               instance == NULL ? "-" : instance,
+                               duration < 0 ? 0 : duration);
+    if (line == NULL)
+        goto fail;
+    status = write(capture->fd, line, strlen(line));
+    if (status < 0 || (size_t) status != strlen(line))
+        sync_syslog_warning(config, "krb5-sync: cannot write to %s: %s",
+                            config->capture_file,
+                            status < 0 ? strerror(errno) : "short write");
+    return;
+
+fail:
+    sync_syslog_warning(config, "krb5-sync: cannot allocate memory");
+}
+
+
+/*
+ * Close capture_file and free the capture state, so that the file is opened
+ * again with a new key if capturing continues.
+ */
+void
+sync_capture_close(kadm5_hook_modinfo *config)
+{
+    if (config->capture == NULL)
+        return;
+    if (config->capture->fd >= 0)
+        close(config->capture->fd);
+    free(config->capture);
+    config->capture = NULL;
+}
@@ -3,7 +3,11 @@
  *
  * Provided here are functions to retrieve boolean, numeric, and string
  * settings from krb5.conf.  This wraps the somewhat awkward
- * krb5_appdefaults_* functions.
+ * krb5_appdefaults_* functions.  The default realm, which they need in a
+ * form that differs between MIT and Heimdal, is obtained once for all of the
+ * settings read together rather than for each setting.  The settings of a
+ * target of ad_targets are read from its own section, falling back on the
+ * krb5-sync section for anything not set there.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2013
@@ -105,14 +109,90 @@ free_default_realm(krb5_context ctx UNUSED, realm_type realm)
 #endif /* !HAVE_KRB5_REALM */
 
 
+/*
+ * The state shared by the calls reading a set of settings, which is the
+ * default realm in the form needed by krb5_appdefault_* and the section to
+ * look in before krb5-sync, if any.  The realm is NULL if there is no default
+ * realm, in which case only settings that aren't realm-specific are found.
+ */
+struct sync_appdefaults {
+    realm_type realm;
+    char *section;
+};
+
+
+/*
+ * Start reading settings from krb5.conf, looking in section first if it is
+ * not NULL.  Returns NULL on memory allocation failure.
+ */
+struct sync_appdefaults *
+sync_appdefaults_new(krb5_context ctx, const char *section)
+{
+    struct sync_appdefaults *defaults;
+
+    defaults = calloc(1, sizeof(*defaults));
+    if (defaults == NULL)
+        return NULL;
+    if (section != NULL) {
+        defaults->section = strdup(section);
+        if (defaults->section == NULL) {
+            free(defaults);
+            return NULL;
+        }
+    }
+    defaults->realm = default_realm(ctx);
+    return defaults;
+}
+
+
+/*
+ * Finish reading settings from krb5.conf and free the shared state.
+ */
+void
+sync_appdefaults_free(krb5_context ctx, struct sync_appdefaults *defaults)
+{
+    if (defaults == NULL)
+        return;
+    if (defaults->realm != NULL)
+        free_default_realm(ctx, defaults->realm);
+    free(defaults->section);
+    free(defaults);
+}
+
+
+/*
+ * Obtain an option from Kerberos appdefaults as a string, from the section
+ * of the shared state if there is one and the option is set there, and from
+ * the krb5-sync section otherwise.  Sets value to NULL or a string to free
+ * with krb5_free_string, which is empty if the option isn't set.
+ */
+static void
+config_get(krb5_context ctx, struct sync_appdefaults *defaults,
+           const char *opt, char **value)
+{
+    *value = NULL;
+    if (defaults->section != NULL) {
+        krb5_appdefault_string(ctx, defaults->section, defaults->realm, opt,
+                               "", value);
+        if (*value != NULL && (*value)[0] != '\0')
+            return;
+        if (*value != NULL)
+            krb5_free_string(ctx, *value);
+        *value = NULL;
+    }
+    krb5_appdefault_string(ctx, "krb5-sync", defaults->realm, opt, "",
+                           value);
+}
+
+
 /*
  * Load a boolean option from Kerberos appdefaults.  Takes the Kerberos
- * context, the option, and the result location.
+ * context, the shared state, the option, and the result location.
  */
 void
-sync_config_boolean(krb5_context ctx, const char *opt, bool *result)
+sync_config_boolean(krb5_context ctx, struct sync_appdefaults *defaults,
+                    const char *opt, bool *result)
 {
-    realm_type realm;
     int tmp;
 
     /*
@@ -120,17 +200,19 @@ sync_config_boolean(krb5_context ctx, const char *opt, bool *result)
      * Heimdal version takes a krb5_boolean *, so hope that Heimdal always
      * defines krb5_boolean to int or this will require more portability work.
      */
-    realm = default_realm(ctx);
-    krb5_appdefault_boolean(ctx, "krb5-sync", realm, opt, *result, &tmp);
+    krb5_appdefault_boolean(ctx, "krb5-sync", defaults->realm, opt, *result,
+                            &tmp);
+    if (defaults->section != NULL)
+        krb5_appdefault_boolean(ctx, defaults->section, defaults->realm, opt,
+                                tmp, &tmp);
     *result = tmp;
-    free_default_realm(ctx, realm);
 }
 
 
 /*
  * Load a list option from Kerberos appdefaults.  Takes the Kerberos context,
- * the option, and the result location.  The option is read as a string and
- * the split on spaces and tabs into a list.
+ * the shared state, the option, and the result location.  The option is read
+ * as a string and the split on spaces and tabs into a list.
  *
  * This requires an annoying workaround because one cannot specify a default
  * value of NULL with MIT Kerberos, since MIT Kerberos unconditionally calls
@@ -138,15 +220,13 @@ sync_config_boolean(krb5_context ctx, const char *opt, bool *result)
  * allocation failed while parsing or while setting the default value.
  */
 krb5_error_code
-sync_config_list(krb5_context ctx, const char *opt, struct vector **result)
+sync_config_list(krb5_context ctx, struct sync_appdefaults *defaults,
+                 const char *opt, struct vector **result)
 {
-    realm_type realm;
     char *value = NULL;
 
     /* Obtain the string from [appdefaults]. */
-    realm = default_realm(ctx);
-    krb5_appdefault_string(ctx, "krb5-sync", realm, opt, "", &value);
-    free_default_realm(ctx, realm);
+    config_get(ctx, defaults, opt, &value);
 
     /* If we got something back, store it in result. */
     if (value != NULL) {
@@ -161,9 +241,46 @@ sync_config_list(krb5_context ctx, const char *opt, struct vector **result)
 }
 
 
+/*
+ * Load a numeric option from Kerberos appdefaults.  Takes the Kerberos
+ * context, the shared state, the option, and the result location, which
+ * should be set to the default value beforehand.  There is no
+ * krb5_appdefault_* function for numbers, so the option is read as a string
+ * and then parsed.  Returns a configuration error if the value isn't a
+ * non-negative integer.
+ */
+krb5_error_code
+sync_config_number(krb5_context ctx, struct sync_appdefaults *defaults,
+                   const char *opt, long *result)
+{
+    char *value = NULL;
+    char *end;
+    long number;
+    krb5_error_code code = 0;
+
+    /* Obtain the string from [appdefaults]. */
+    config_get(ctx, defaults, opt, &value);
+
+    /* If we got something back, parse it and store it in result. */
+    if (value != NULL) {
+        if (value[0] != '\0') {
+            errno = 0;
+            number = strtol(value, &end, 10);
+            if (errno != 0 || *end != '\0' || number < 0)
+                code = sync_error_config(ctx, "invalid number %s for %s",
+                                         value, opt);
+            else
+                *result = number;
+        }
+        krb5_free_string(ctx, value);
+    }
+    return code;
+}
+
+
 /*
  * Load a string option from Kerberos appdefaults.  Takes the Kerberos
- * context, the option, and the result location.
+ * context, the shared state, the option, and the result location.
  *
  * This requires an annoying workaround because one cannot specify a default
  * value of NULL with MIT Kerberos, since MIT Kerberos unconditionally calls
@@ -172,15 +289,13 @@ sync_config_list(krb5_context ctx, const char *opt, struct vector **result)
  * don't return an error code.
  */
 void
-sync_config_string(krb5_context ctx, const char *opt, char **result)
+sync_config_string(krb5_context ctx, struct sync_appdefaults *defaults,
+                   const char *opt, char **result)
 {
-    realm_type realm;
     char *value = NULL;
 
     /* Obtain the string from [appdefaults]. */
-    realm = default_realm(ctx);
-    krb5_appdefault_string(ctx, "krb5-sync", realm, opt, "", &value);
-    free_default_realm(ctx, realm);
+    config_get(ctx, defaults, opt, &value);
 
     /* If we got something back, store it in result. */
     if (value != NULL) {
@@ -0,0 +1,341 @@
+/*
+ * Active Directory credential management.
+ *
+ * Obtains and caches the credentials used to authenticate to Active Directory
+ * for both password changes and account status updates.  Credentials are
+ * obtained from the configured keytab and stored in a memory credential
+ * cache, which is kept across calls until shortly before the credentials
+ * expire so that most changes don't need a new authentication.  If
+ * ad_warmup is set, the refresher in warmup.c replaces them earlier still,
+ * so that changes don't have to wait for new credentials at all.
+ *
+ * Other threads may be using the memory cache at any time, so it is never
+ * emptied in place.  New credentials are written to a temporary memory cache
+ * that replaces the cached one with krb5_cc_move, and discarded credentials
+ * are only marked as expired until they are replaced.
+ *
+ * If shared_state is set, the credentials are instead stored in a file
+ * credential cache in queue_dir and their expiration time in the shared state
+ * file, so that every process of a forking kadmind reuses them.  New
+ * credentials are written to a temporary cache that is renamed over the
+ * shared one, so other processes never see a partially written cache.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Based on code developed by Derrick Brashear and Ken Hornstein of Sine
+ *     Nomine Associates, on behalf of Stanford University.
+ * Copyright 2006, 2007, 2010, 2012, 2013
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+#include <util/macros.h>
+
+/*
+ * How long before the expiration of the cached AD credentials we obtain new
+ * ones.  This needs to be long enough that a ticket obtained from the cached
+ * TGT won't expire in the middle of a kpasswd exchange or an LDAP operation.
+ */
+#define CREDS_REFRESH_MARGIN (5 * 60)
+
+
+/* The prefix of the name of a file credential cache. */
+#define CREDS_FILE_PREFIX "FILE:"
+
+
+/*
+ * Discard any cached AD credentials so that the next call to sync_ad_creds
+ * will obtain new ones.  Called when AD rejects our credentials, since that
+ * may mean the cached tickets are no longer usable even if they haven't
+ * expired, and when the configuration they depend on changes.  The cache is
+ * left in place, since other threads or processes may be using it, and is
+ * replaced by the next refresh.
+ */
+void
+sync_ad_creds_reset(kadm5_hook_modinfo *config, krb5_context ctx UNUSED)
+{
+    __atomic_store_n(sync_shared_creds_expires(config), 0, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Destroy the memory cache holding our AD credentials when shutting down or
+ * when a reload changes the settings the credentials came from, whether or
+ * not the credentials in it are still usable.  Nothing else may be using it
+ * by then.  A configuration that never stored credentials, such as one
+ * just read by a reload, leaves the cache alone, since it may have the same
+ * name as the one in use.  A shared cache is left in place for the other
+ * processes.
+ */
+void
+sync_ad_creds_close(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    krb5_ccache cc;
+
+    if (config->shared != NULL || !config->ad_creds_stored)
+        return;
+    config->ad_creds_expires = 0;
+    config->ad_creds_stored = false;
+    if (krb5_cc_resolve(ctx, config->ad_ccache_name, &cc) == 0)
+        krb5_cc_destroy(ctx, cc);
+}
+
+
+/*
+ * Counter used to make the names of temporary caches unique, since the
+ * warm-up refresher may store new credentials at the same time as a change.
+ */
+static unsigned long creds_serial;
+
+
+/*
+ * Store new credentials in the memory cache by writing them to a temporary
+ * memory cache and moving that over the cached one, so that other threads
+ * using the cache see either the old or the new credentials and never an
+ * empty cache.  Then resolve the cache into cc.  Returns a Kerberos status
+ * code.
+ */
+static krb5_error_code
+creds_store_memory(kadm5_hook_modinfo *config, krb5_context ctx,
+                   krb5_creds *creds, krb5_ccache *cc)
+{
+    char *tmp;
+    krb5_ccache tmp_cc;
+    krb5_error_code code;
+
+    if (asprintf(&tmp, "%s.%lu", config->ad_ccache_name,
+                 __atomic_fetch_add(&creds_serial, 1, __ATOMIC_RELAXED)) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    code = krb5_cc_resolve(ctx, tmp, &tmp_cc);
+    free(tmp);
+    if (code != 0)
+        return code;
+    code = krb5_cc_initialize(ctx, tmp_cc, config->ad_client);
+    if (code == 0)
+        code = krb5_cc_store_cred(ctx, tmp_cc, creds);
+    if (code == 0)
+        code = krb5_cc_resolve(ctx, config->ad_ccache_name, cc);
+    if (code != 0) {
+        krb5_cc_destroy(ctx, tmp_cc);
+        return code;
+    }
+
+    /* On success, krb5_cc_move destroys the temporary cache. */
+    __atomic_store_n(&config->ad_creds_stored, true, __ATOMIC_RELAXED);
+    code = krb5_cc_move(ctx, tmp_cc, *cc);
+    if (code != 0) {
+        krb5_cc_destroy(ctx, tmp_cc);
+        krb5_cc_close(ctx, *cc);
+        *cc = NULL;
+    }
+    return code;
+}
+
+
+/*
+ * Store new credentials in the shared file credential cache by writing them
+ * to a temporary cache next to it and renaming it into place, and then
+ * resolve the shared cache into cc.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+creds_store_shared(kadm5_hook_modinfo *config, krb5_context ctx,
+                   krb5_creds *creds, krb5_ccache *cc)
+{
+    const char *path = config->ad_ccache_name + strlen(CREDS_FILE_PREFIX);
+    char *tmp;
+    krb5_ccache tmp_cc;
+    krb5_error_code code;
+
+    if (asprintf(&tmp, "%s.%lu.%lu", config->ad_ccache_name,
+                 (unsigned long) getpid(),
+                 __atomic_fetch_add(&creds_serial, 1, __ATOMIC_RELAXED)) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    code = krb5_cc_resolve(ctx, tmp, &tmp_cc);
+    if (code != 0)
+        goto done;
+    code = krb5_cc_initialize(ctx, tmp_cc, config->ad_client);
+    if (code == 0)
+        code = krb5_cc_store_cred(ctx, tmp_cc, creds);
+    krb5_cc_close(ctx, tmp_cc);
+    if (code != 0)
+        goto done;
+    if (rename(tmp + strlen(CREDS_FILE_PREFIX), path) < 0) {
+        code = sync_error_system(ctx, "cannot rename %s to %s",
+                                 tmp + strlen(CREDS_FILE_PREFIX), path);
+        goto done;
+    }
+    code = krb5_cc_resolve(ctx, config->ad_ccache_name, cc);
+
+done:
+    if (code != 0)
+        unlink(tmp + strlen(CREDS_FILE_PREFIX));
+    free(tmp);
+    return code;
+}
+
+
+/*
+ * Returns true if the Kerberos error code indicates that our AD credentials
+ * were rejected or are no longer valid, in which case it's worth discarding
+ * them and trying again with fresh credentials.
+ */
+bool
+sync_ad_creds_error(krb5_error_code code)
+{
+    switch (code) {
+    case KRB5KRB_AP_ERR_TKT_EXPIRED:
+    case KRB5KRB_AP_ERR_TKT_NYV:
+    case KRB5KRB_AP_ERR_MODIFIED:
+    case KRB5KRB_AP_ERR_BAD_INTEGRITY:
+    case KRB5KDC_ERR_TGT_REVOKED:
+    case KRB5KDC_ERR_CLIENT_REVOKED:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/*
+ * Obtain new credentials for the AD principal from the keytab and store them
+ * in the credential cache, replacing whatever was cached before, and return
+ * the cache in cc.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+creds_obtain(kadm5_hook_modinfo *config, krb5_context ctx, krb5_ccache *cc)
+{
+    krb5_error_code code;
+    krb5_get_init_creds_opt *opts = NULL;
+    krb5_creds creds;
+    struct timeval start;
+    time_t *expires = sync_shared_creds_expires(config);
+    bool creds_valid = false;
+    const char *realm UNUSED;
+
+    /* Set our credential acquisition options. */
+    *cc = NULL;
+    code = krb5_get_init_creds_opt_alloc(ctx, &opts);
+    if (code != 0)
+        goto fail;
+    realm = krb5_principal_get_realm(ctx, config->ad_client);
+    krb5_get_init_creds_opt_set_default_flags(ctx, "krb5-sync", realm, opts);
+
+    /* Obtain credentials. */
+    memset(&creds, 0, sizeof(creds));
+    sync_stats_start(config, &start);
+    code = krb5_get_init_creds_keytab(ctx, &creds, config->ad_client,
+                                      config->ad_kt, 0, NULL, opts);
+    sync_stats_record(config, SYNC_STATS_CREDS, &start, code);
+    if (code != 0)
+        goto fail;
+    krb5_get_init_creds_opt_free(ctx, opts);
+    opts = NULL;
+    creds_valid = true;
+
+    /* Store them in the credential cache. */
+    if (config->shared != NULL)
+        code = creds_store_shared(config, ctx, &creds, cc);
+    else
+        code = creds_store_memory(config, ctx, &creds, cc);
+    if (code != 0)
+        goto fail;
+
+    /* Remember when these credentials expire, clean up, and return. */
+    __atomic_store_n(expires, (time_t) creds.times.endtime, __ATOMIC_RELAXED);
+    krb5_free_cred_contents(ctx, &creds);
+    return 0;
+
+fail:
+    if (opts != NULL)
+        krb5_get_init_creds_opt_free(ctx, opts);
+    if (creds_valid)
+        krb5_free_cred_contents(ctx, &creds);
+    return code;
+}
+
+
+/*
+ * Given the plugin options, a Kerberos context, and a pointer to krb5_ccache
+ * storage, return a memory cache containing credentials for the configured
+ * AD principal.  If the cache from a previous call still holds credentials
+ * that won't expire soon, reuse it.  Otherwise, initialize the memory cache
+ * using the configured keytab to obtain initial credentials.  The caller
+ * should krb5_cc_close the cache, not destroy it.  Returns a Kerberos status
+ * code.
+ *
+ * Only the expiration time of the TGT is tracked.  Service tickets for
+ * kpasswd and LDAP are obtained from that TGT and can't outlive it, so
+ * refreshing before the TGT expires also covers them.
+ */
+krb5_error_code
+sync_ad_creds(kadm5_hook_modinfo *config, krb5_context ctx, krb5_ccache *cc)
+{
+    krb5_error_code code;
+    time_t *expires;
+
+    /* Initialize the credential cache pointer to NULL. */
+    *cc = NULL;
+
+    /*
+     * Ensure the configuration is sane.  The keytab and principal are
+     * resolved and parsed by sync_config_read.
+     */
+    if (config->ad_kt == NULL)
+        return sync_error_config(ctx, "configuration setting ad_keytab"
+                                 " missing");
+    if (config->ad_client == NULL)
+        return sync_error_config(ctx, "configuration setting ad_principal"
+                                 " missing");
+
+    /* Reuse the cached credentials if they're still good. */
+    expires = sync_shared_creds_expires(config);
+    if (__atomic_load_n(expires, __ATOMIC_RELAXED)
+        > time(NULL) + CREDS_REFRESH_MARGIN) {
+        code = krb5_cc_resolve(ctx, config->ad_ccache_name, cc);
+        if (code == 0)
+            return 0;
+        *cc = NULL;
+    }
+    __atomic_store_n(expires, 0, __ATOMIC_RELAXED);
+
+    /* Getting new credentials talks to AD, so it counts against ad_timeout. */
+    code = sync_ad_deadline(config, ctx, 0, NULL);
+    if (code != 0)
+        return code;
+    return creds_obtain(config, ctx, cc);
+}
+
+
+/*
+ * Obtain new AD credentials if the cached ones expire within margin seconds.
+ * The cached credentials stay usable until the new ones replace them, since
+ * both the memory and the shared cache are replaced in one step.  Used
+ * by the warm-up refresher so that changes rarely have to wait for new
+ * credentials, and doesn't count against the deadline of any change in
+ * progress.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_ad_creds_refresh(kadm5_hook_modinfo *config, krb5_context ctx,
+                      time_t margin)
+{
+    krb5_ccache cc;
+    krb5_error_code code;
+
+    if (config->ad_kt == NULL || config->ad_client == NULL)
+        return 0;
+    if (__atomic_load_n(sync_shared_creds_expires(config), __ATOMIC_RELAXED)
+        > time(NULL) + margin)
+        return 0;
+    code = creds_obtain(config, ctx, &cc);
+    if (code == 0)
+        krb5_cc_close(ctx, cc);
+    return code;
+}
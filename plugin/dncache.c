@@ -0,0 +1,649 @@
+/*
+ * Cache of Active Directory DNs for principals.
+ *
+ * Finding the DN of an account in Active Directory requires a subtree search
+ * from ad_ldap_base on userPrincipalName, which is slow in a large tree.
+ * Cache the results in a bounded hash table with least-recently-used
+ * eviction so that later status changes for the same account can read the
+ * entry directly by DN.  Callers must remove entries that turn out to be
+ * stale.
+ *
+ * Optionally, the cache is loaded from and saved to a file in queue_dir so
+ * that it survives restarts and is shared (loosely) between the separate
+ * processes that Heimdal kadmind forks for each connection.  Each line of the
+ * file contains the AD principal and the DN separated by a tab.
+ *
+ * If shared_state is set, the cache in the shared state file is used instead
+ * (see shared.c), which every process sees at once, and the file isn't used.
+ *
+ * The kadmind hooks, the background worker and the batch thread may all use
+ * the cache at once, so every entry point takes the mutex of the cache, and
+ * lookups return a copy of the DN that belongs to the caller's request.
+ *
+ * If ad_dn_cache_status is set, each entry also remembers the status last
+ * written to or read from the account and when, so that a repeated status
+ * change that would write the same value again can be skipped without any
+ * LDAP call.  The status is only trusted for ad_dn_cache_status seconds,
+ * since the account may be changed by someone else or by another kadmind
+ * process, and is only kept in memory, not in the file or the shared state.
+ *
+ * If ad_dn_cache_missing is set, a search that finds no account for a
+ * principal is remembered as an entry with an empty DN and the time of the
+ * search, so that changes for principals that don't exist in Active
+ * Directory fail at once for ad_dn_cache_missing seconds rather than
+ * searching again each time.  Finding the account, such as when listing all
+ * accounts, replaces the entry.  Missing principals are saved in the file
+ * with an empty DN followed by a tab and the time, and are kept in the shared
+ * state if that is used.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/*
+ * Name of the file in queue_dir used to persist the cache, followed by a
+ * hyphen and the target name for a target of ad_targets.
+ */
+#define DNCACHE_FILE ".dn-cache"
+
+/*
+ * A single cache entry, on both a hash chain and the LRU list.  status_time
+ * is when enabled was last known to be the status of the account, or 0 if
+ * it isn't known.  The DN is empty if the principal was found to be missing
+ * from Active Directory at missing_time.
+ */
+struct dncache_entry {
+    char *principal;
+    char *dn;
+    bool enabled;
+    time_t status_time;
+    time_t missing_time;
+    struct dncache_entry *chain;
+    struct dncache_entry *prev;
+    struct dncache_entry *next;
+};
+
+/*
+ * The cache.  head is the most recently used entry and tail the least.
+ * mutex protects everything else.
+ */
+struct sync_dncache {
+    pthread_mutex_t mutex;
+    size_t max;
+    size_t count;
+    size_t nbuckets;
+    struct dncache_entry **buckets;
+    struct dncache_entry *head;
+    struct dncache_entry *tail;
+    bool loaded;
+    bool dirty;
+};
+
+
+/*
+ * Create a new, empty cache, sizing the hash table to the maximum number of
+ * entries.  Returns NULL on memory allocation failure.
+ */
+static struct sync_dncache *
+dncache_new(size_t max)
+{
+    struct sync_dncache *cache;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        return NULL;
+    cache->max = max;
+    for (cache->nbuckets = 16; cache->nbuckets < max; cache->nbuckets *= 2)
+        ;
+    cache->buckets = calloc(cache->nbuckets, sizeof(struct dncache_entry *));
+    if (cache->buckets == NULL) {
+        free(cache);
+        return NULL;
+    }
+    if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+
+/*
+ * Find the entry for a principal, returning NULL if there is none.  If prevp
+ * is not NULL, it is set to the location of the pointer to the entry in its
+ * hash chain, for use in unlinking.
+ */
+static struct dncache_entry *
+dncache_find(struct sync_dncache *cache, const char *principal,
+             struct dncache_entry ***prevp)
+{
+    struct dncache_entry **link, *entry;
+    size_t bucket;
+
+    bucket = sync_hash_string(principal) & (cache->nbuckets - 1);
+    for (link = &cache->buckets[bucket]; *link != NULL; link = &entry->chain) {
+        entry = *link;
+        if (strcmp(entry->principal, principal) == 0) {
+            if (prevp != NULL)
+                *prevp = link;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Unlink an entry from the LRU list.
+ */
+static void
+dncache_unlink(struct sync_dncache *cache, struct dncache_entry *entry)
+{
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+
+/*
+ * Put an entry at the head of the LRU list.
+ */
+static void
+dncache_push(struct sync_dncache *cache, struct dncache_entry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL)
+        cache->head->prev = entry;
+    cache->head = entry;
+    if (cache->tail == NULL)
+        cache->tail = entry;
+}
+
+
+/*
+ * Remove an entry from the cache entirely and free it.
+ */
+static void
+dncache_delete(struct sync_dncache *cache, struct dncache_entry *entry)
+{
+    struct dncache_entry **link;
+
+    if (dncache_find(cache, entry->principal, &link) == entry)
+        *link = entry->chain;
+    dncache_unlink(cache, entry);
+    free(entry->principal);
+    free(entry->dn);
+    free(entry);
+    cache->count--;
+}
+
+
+/*
+ * Free a cache and all of its entries without saving it.
+ */
+static void
+dncache_destroy(struct sync_dncache *cache)
+{
+    while (cache->head != NULL)
+        dncache_delete(cache, cache->head);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->buckets);
+    free(cache);
+}
+
+
+/*
+ * Add or replace an entry in the cache, evicting the least recently used
+ * entry if the cache is full.  Returns false on memory allocation failure.
+ */
+static bool
+dncache_add(struct sync_dncache *cache, const char *principal, const char *dn)
+{
+    struct dncache_entry *entry;
+    size_t bucket;
+    char *copy;
+
+    entry = dncache_find(cache, principal, NULL);
+    if (entry != NULL) {
+        if (strcmp(entry->dn, dn) != 0) {
+            copy = strdup(dn);
+            if (copy == NULL)
+                return false;
+            free(entry->dn);
+            entry->dn = copy;
+            entry->status_time = 0;
+            entry->missing_time = 0;
+        }
+        dncache_unlink(cache, entry);
+        dncache_push(cache, entry);
+        return true;
+    }
+    if (cache->count >= cache->max && cache->tail != NULL)
+        dncache_delete(cache, cache->tail);
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        return false;
+    entry->principal = strdup(principal);
+    entry->dn = strdup(dn);
+    if (entry->principal == NULL || entry->dn == NULL) {
+        free(entry->principal);
+        free(entry->dn);
+        free(entry);
+        return false;
+    }
+    bucket = sync_hash_string(principal) & (cache->nbuckets - 1);
+    entry->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    dncache_push(cache, entry);
+    cache->count++;
+    return true;
+}
+
+
+/*
+ * Load the persistent cache file from queue_dir, if there is one.  Entries
+ * are added oldest first, so the file should be written from the tail of the
+ * LRU list.  Missing principals are only loaded if they are still to be
+ * trusted.  Any problems are ignored, since this is only a cache.
+ */
+static void
+dncache_load(kadm5_hook_modinfo *config, struct sync_dncache *cache)
+{
+    struct dncache_entry *entry;
+    char *path, *line = NULL, *tab;
+    size_t size = 0;
+    ssize_t length;
+    time_t now, missing;
+    FILE *file;
+
+    cache->loaded = true;
+    if (!config->ad_dn_cache_persist || config->queue_dir == NULL)
+        return;
+    if (asprintf(&path, "%s/%s%s%s", config->queue_dir, DNCACHE_FILE,
+                 config->target == NULL ? "" : "-",
+                 config->target == NULL ? "" : config->target) < 0)
+        return;
+    file = fopen(path, "r");
+    free(path);
+    if (file == NULL)
+        return;
+    now = time(NULL);
+    while ((length = getline(&line, &size, file)) > 0) {
+        if (line[length - 1] == '\n')
+            line[length - 1] = '\0';
+        tab = strchr(line, '\t');
+        if (tab == NULL)
+            continue;
+        *tab = '\0';
+        if (tab[1] != '\t') {
+            if (!dncache_add(cache, line, tab + 1))
+                break;
+            continue;
+        }
+        missing = (time_t) strtol(tab + 2, NULL, 10);
+        if (config->ad_dn_cache_missing <= 0 || missing <= 0
+            || missing + config->ad_dn_cache_missing <= now)
+            continue;
+        if (!dncache_add(cache, line, ""))
+            break;
+        entry = dncache_find(cache, line, NULL);
+        entry->missing_time = missing;
+    }
+    free(line);
+    fclose(file);
+}
+
+
+/*
+ * Save the cache to queue_dir if persistence is enabled and it has changed.
+ * Write to a temporary file and rename it into place so that other processes
+ * never see a partial file.  Problems are logged and otherwise ignored.
+ */
+static void
+dncache_save(kadm5_hook_modinfo *config, struct sync_dncache *cache)
+{
+    char *path = NULL, *tmp = NULL;
+    struct dncache_entry *entry;
+    FILE *file = NULL;
+    int fd = -1;
+
+    if (!config->ad_dn_cache_persist || config->queue_dir == NULL)
+        return;
+    if (!cache->dirty)
+        return;
+    if (asprintf(&path, "%s/%s%s%s", config->queue_dir, DNCACHE_FILE,
+                 config->target == NULL ? "" : "-",
+                 config->target == NULL ? "" : config->target) < 0)
+        goto fail;
+    if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+        tmp = NULL;
+        goto fail;
+    }
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        goto fail;
+    file = fdopen(fd, "w");
+    if (file == NULL)
+        goto fail;
+    fd = -1;
+    for (entry = cache->tail; entry != NULL; entry = entry->prev) {
+        if (strpbrk(entry->principal, "\t\n") != NULL)
+            continue;
+        if (strchr(entry->dn, '\n') != NULL)
+            continue;
+        if (entry->dn[0] == '\0')
+            fprintf(file, "%s\t\t%ld\n", entry->principal,
+                    (long) entry->missing_time);
+        else
+            fprintf(file, "%s\t%s\n", entry->principal, entry->dn);
+    }
+    if (fclose(file) != 0) {
+        file = NULL;
+        goto fail;
+    }
+    file = NULL;
+    if (rename(tmp, path) < 0)
+        goto fail;
+    cache->dirty = false;
+    free(tmp);
+    free(path);
+    return;
+
+fail:
+    sync_syslog_warning(config, "krb5-sync: cannot save DN cache %s: %s",
+                        path != NULL ? path : DNCACHE_FILE, strerror(errno));
+    if (file != NULL)
+        fclose(file);
+    if (fd >= 0)
+        close(fd);
+    if (tmp != NULL)
+        unlink(tmp);
+    free(tmp);
+    free(path);
+}
+
+
+/*
+ * Return the cache with its mutex locked, creating and loading it if needed.
+ * Several threads may do this at once, so the first to store its cache wins.
+ * Returns NULL, with nothing locked, if the cache is disabled or can't be
+ * created.
+ */
+static struct sync_dncache *
+dncache_lock(kadm5_hook_modinfo *config)
+{
+    struct sync_dncache *cache, *expected = NULL;
+
+    if (config->ad_dn_cache_size <= 0)
+        return NULL;
+    cache = __atomic_load_n(&config->dn_cache, __ATOMIC_ACQUIRE);
+    if (cache == NULL) {
+        cache = dncache_new((size_t) config->ad_dn_cache_size);
+        if (cache == NULL)
+            return NULL;
+        if (!__atomic_compare_exchange_n(&config->dn_cache, &expected, cache,
+                                         false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+            dncache_destroy(cache);
+            cache = expected;
+        }
+    }
+    pthread_mutex_lock(&cache->mutex);
+    if (!cache->loaded)
+        dncache_load(config, cache);
+    return cache;
+}
+
+
+/*
+ * Return the cache with its mutex locked if it already exists, without
+ * creating it, or NULL if it doesn't.
+ */
+static struct sync_dncache *
+dncache_lock_existing(kadm5_hook_modinfo *config)
+{
+    struct sync_dncache *cache;
+
+    cache = __atomic_load_n(&config->dn_cache, __ATOMIC_ACQUIRE);
+    if (cache != NULL)
+        pthread_mutex_lock(&cache->mutex);
+    return cache;
+}
+
+
+/*
+ * Look up the cached DN for an AD principal.  Returns NULL if there is no
+ * cached DN, and otherwise a copy of it that is freed with the request, since
+ * another thread may replace or remove the entry at any time.
+ */
+const char *
+sync_dncache_lookup(kadm5_hook_modinfo *config, struct sync_request *request,
+                    const char *principal)
+{
+    struct sync_dncache *cache;
+    struct dncache_entry *entry;
+    const char *dn = NULL;
+
+    if (config->shared != NULL)
+        return sync_shared_dn_lookup(config, request, principal);
+    cache = dncache_lock(config);
+    if (cache == NULL)
+        return NULL;
+    entry = dncache_find(cache, principal, NULL);
+    if (entry != NULL) {
+        dncache_unlink(cache, entry);
+        dncache_push(cache, entry);
+        if (entry->dn[0] != '\0')
+            dn = sync_request_printf(request, "%s", entry->dn);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return dn;
+}
+
+
+/*
+ * Store the DN for an AD principal in the cache.  Failure to allocate memory
+ * just means the DN isn't cached, so there is no return status.
+ */
+void
+sync_dncache_store(kadm5_hook_modinfo *config, const char *principal,
+                   const char *dn)
+{
+    struct sync_dncache *cache;
+
+    if (config->shared != NULL) {
+        sync_shared_dn_store(config, principal, dn);
+        return;
+    }
+    cache = dncache_lock(config);
+    if (cache == NULL)
+        return;
+    if (dncache_add(cache, principal, dn))
+        cache->dirty = true;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+
+/*
+ * Remove the cached DN for an AD principal, if any.  Called when AD reports
+ * that the cached DN no longer exists, and from the kadmind hooks when the
+ * principal is deleted or renamed.
+ */
+void
+sync_dncache_remove(kadm5_hook_modinfo *config, const char *principal)
+{
+    struct sync_dncache *cache;
+    struct dncache_entry *entry;
+
+    if (config->shared != NULL) {
+        sync_shared_dn_store(config, principal, NULL);
+        return;
+    }
+    cache = dncache_lock(config);
+    if (cache == NULL)
+        return;
+    entry = dncache_find(cache, principal, NULL);
+    if (entry != NULL) {
+        dncache_delete(cache, entry);
+        cache->dirty = true;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+
+/*
+ * Returns true if the account of an AD principal is known to have had the
+ * given status within the last ad_dn_cache_status seconds, in which case
+ * there is no need to write it again.
+ */
+bool
+sync_dncache_status(kadm5_hook_modinfo *config, const char *principal,
+                    bool enabled)
+{
+    struct sync_dncache *cache;
+    struct dncache_entry *entry;
+    bool known = false;
+
+    if (config->ad_dn_cache_status <= 0 || config->shared != NULL)
+        return false;
+    cache = dncache_lock_existing(config);
+    if (cache == NULL)
+        return false;
+    entry = dncache_find(cache, principal, NULL);
+    if (entry != NULL && entry->status_time != 0
+        && entry->status_time + config->ad_dn_cache_status > time(NULL))
+        known = (entry->enabled == enabled);
+    pthread_mutex_unlock(&cache->mutex);
+    return known;
+}
+
+
+/*
+ * Remember the status of the account of an AD principal, which has just been
+ * written or read, if its DN is cached.  If known is false, forget any
+ * remembered status instead, since a write may or may not have happened.
+ */
+void
+sync_dncache_set_status(kadm5_hook_modinfo *config, const char *principal,
+                        bool known, bool enabled)
+{
+    struct sync_dncache *cache;
+    struct dncache_entry *entry;
+
+    if (config->ad_dn_cache_status <= 0 || config->shared != NULL)
+        return;
+    cache = dncache_lock_existing(config);
+    if (cache == NULL)
+        return;
+    entry = dncache_find(cache, principal, NULL);
+    if (entry != NULL) {
+        entry->enabled = enabled;
+        entry->status_time = known ? time(NULL) : 0;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+
+/*
+ * Returns true if a search for the account of an AD principal found nothing
+ * within the last ad_dn_cache_missing seconds, in which case the account can
+ * be assumed not to exist without searching for it again.
+ */
+bool
+sync_dncache_missing(kadm5_hook_modinfo *config, const char *principal)
+{
+    struct sync_dncache *cache;
+    struct dncache_entry *entry;
+    time_t missing;
+
+    if (config->ad_dn_cache_missing <= 0)
+        return false;
+    if (config->shared != NULL)
+        missing = sync_shared_dn_missing(config, principal);
+    else {
+        cache = dncache_lock(config);
+        if (cache == NULL)
+            return false;
+        entry = dncache_find(cache, principal, NULL);
+        missing = 0;
+        if (entry != NULL && entry->dn[0] == '\0')
+            missing = entry->missing_time;
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    return (missing > 0 && missing + config->ad_dn_cache_missing > time(NULL));
+}
+
+
+/*
+ * Remember that a search found no account for an AD principal, or if missing
+ * is false, forget that, since the account has been seen.  A cached DN for
+ * the principal is replaced in the first case and kept in the second.
+ */
+void
+sync_dncache_set_missing(kadm5_hook_modinfo *config, const char *principal,
+                         bool missing)
+{
+    struct sync_dncache *cache;
+    struct dncache_entry *entry;
+
+    if (config->ad_dn_cache_missing <= 0)
+        return;
+    if (config->shared != NULL) {
+        if (missing)
+            sync_shared_dn_store(config, principal, "");
+        else if (sync_shared_dn_missing(config, principal) > 0)
+            sync_shared_dn_store(config, principal, NULL);
+        return;
+    }
+    cache = dncache_lock(config);
+    if (cache == NULL)
+        return;
+    if (missing) {
+        if (dncache_add(cache, principal, "")) {
+            entry = dncache_find(cache, principal, NULL);
+            entry->missing_time = time(NULL);
+            cache->dirty = true;
+        }
+    } else {
+        entry = dncache_find(cache, principal, NULL);
+        if (entry != NULL && entry->dn[0] == '\0') {
+            dncache_delete(cache, entry);
+            cache->dirty = true;
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+
+/*
+ * Save the cache if it's persistent and free it.  Nothing else may be using
+ * the cache by then.
+ */
+void
+sync_dncache_free(kadm5_hook_modinfo *config)
+{
+    struct sync_dncache *cache = config->dn_cache;
+
+    if (cache == NULL)
+        return;
+    dncache_save(config, cache);
+    dncache_destroy(cache);
+    config->dn_cache = NULL;
+}
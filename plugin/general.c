@@ -23,101 +23,743 @@
 #include <portable/krb5.h>
 #include <portable/system.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
 
 #include <plugin/internal.h>
 #include <util/macros.h>
 
 
 /*
- * Initialize the module.  This consists solely of loading our configuration
- * options from krb5.conf into a newly allocated struct stored in the second
- * argument to this function.  Returns 0 on success, non-zero on failure.
- * This function returns failure only if it could not allocate memory.
+ * Build the set of allowed instances from ad_base_instance, ad_instances, and
+ * the instances with a rule in ad_mapping_rules.  The set isn't changed
+ * afterwards.  Returns a Kerberos status code.
  */
-krb5_error_code
-sync_init(krb5_context ctx, kadm5_hook_modinfo **result)
+static krb5_error_code
+instance_compile(kadm5_hook_modinfo *config, krb5_context ctx)
 {
-    kadm5_hook_modinfo *config;
-    krb5_error_code code;
+    struct sync_strset *set;
+    const char *rule;
+    char *instance;
+    size_t i;
+    bool added;
 
-    /* Allocate our internal data. */
-    config = calloc(1, sizeof(*config));
-    if (config == NULL)
+    set = sync_strset_new();
+    if (set == NULL)
         return sync_error_system(ctx, "cannot allocate memory");
+    if (config->ad_base_instance != NULL)
+        if (!sync_strset_add(set, config->ad_base_instance))
+            goto fail;
+    if (config->ad_instances != NULL)
+        for (i = 0; i < config->ad_instances->count; i++)
+            if (!sync_strset_add(set, config->ad_instances->strings[i]))
+                goto fail;
+    if (config->ad_mapping_rules != NULL)
+        for (i = 0; i < config->ad_mapping_rules->count; i++) {
+            rule = config->ad_mapping_rules->strings[i];
+            instance = strndup(rule, strcspn(rule, ":"));
+            if (instance == NULL)
+                goto fail;
+            added = sync_strset_add(set, instance);
+            free(instance);
+            if (!added)
+                goto fail;
+        }
+    config->allowed_instances = set;
+    return 0;
+
+fail:
+    sync_strset_free(set);
+    return sync_error_system(ctx, "cannot allocate memory");
+}
+
+
+/*
+ * Load our configuration options from krb5.conf into config, using the given
+ * shared state for reading settings.  Returns 0 on success, non-zero on
+ * failure, in which case config may have been partly filled in.
+ */
+static krb5_error_code
+config_settings(krb5_context ctx, struct sync_appdefaults *defaults,
+                kadm5_hook_modinfo *config)
+{
+    const char *operation, *entry, *colon;
+    size_t i;
+    krb5_error_code code;
 
     /* Get Active Directory connection information from krb5.conf. */
-    sync_config_string(ctx, "ad_keytab", &config->ad_keytab);
-    sync_config_string(ctx, "ad_principal", &config->ad_principal);
-    sync_config_string(ctx, "ad_realm", &config->ad_realm);
-    sync_config_string(ctx, "ad_admin_server", &config->ad_admin_server);
-    sync_config_string(ctx, "ad_ldap_base", &config->ad_ldap_base);
+    sync_config_string(ctx, defaults, "ad_keytab", &config->ad_keytab);
+    sync_config_string(ctx, defaults, "ad_principal", &config->ad_principal);
+    sync_config_string(ctx, defaults, "ad_realm", &config->ad_realm);
+    sync_config_string(ctx, defaults, "ad_admin_server",
+                       &config->ad_admin_server);
+    sync_config_string(ctx, defaults, "ad_ldap_base", &config->ad_ldap_base);
+
+    /* Get the separate Active Directory targets to make changes in, if any. */
+    code = sync_config_list(ctx, defaults, "ad_targets", &config->ad_targets);
+    if (code != 0)
+        return code;
+
+    /* Get the maximum number of concurrent kpasswd exchanges. */
+    config->ad_kpasswd_concurrency = 1;
+    code = sync_config_number(ctx, defaults, "ad_kpasswd_concurrency",
+                              &config->ad_kpasswd_concurrency);
+    if (code != 0)
+        return code;
+    if (config->ad_kpasswd_concurrency < 1)
+        return sync_error_config(ctx, "ad_kpasswd_concurrency must be at"
+                                 " least 1");
+
+    /*
+     * See if the operations in flight should adapt to back-pressure from
+     * Active Directory, and how slow an operation shows it.
+     */
+    sync_config_boolean(ctx, defaults, "ad_adaptive_concurrency",
+                        &config->ad_adaptive_concurrency);
+    code = sync_config_number(ctx, defaults, "ad_adaptive_slow",
+                              &config->ad_adaptive_slow);
+    if (code != 0)
+        return code;
+
+    /* Get the maximum number of pooled LDAP connections. */
+    config->ad_ldap_connections = 2;
+    code = sync_config_number(ctx, defaults, "ad_ldap_connections",
+                              &config->ad_ldap_connections);
+    if (code != 0)
+        return code;
+
+    /* Get the Active Directory servers to use for LDAP, in order. */
+    code = sync_config_list(ctx, defaults, "ad_ldap_servers",
+                            &config->ad_ldap_servers);
+    if (code != 0)
+        return code;
+    sync_config_boolean(ctx, defaults, "ad_ldaps", &config->ad_ldaps);
+
+    /* See how accounts are found in Active Directory. */
+    sync_config_string(ctx, defaults, "ad_ldap_filter_attribute",
+                       &config->ad_ldap_filter_attribute);
+    if (config->ad_ldap_filter_attribute != NULL
+        && strcmp(config->ad_ldap_filter_attribute, "userPrincipalName") != 0
+        && strcmp(config->ad_ldap_filter_attribute, "sAMAccountName") != 0)
+        return sync_error_config(ctx, "unknown ad_ldap_filter_attribute %s",
+                                 config->ad_ldap_filter_attribute);
+    code = sync_config_list(ctx, defaults, "ad_ldap_instance_bases",
+                            &config->ad_ldap_instance_bases);
+    if (code != 0)
+        return code;
+    if (config->ad_ldap_instance_bases != NULL)
+        for (i = 0; i < config->ad_ldap_instance_bases->count; i++) {
+            entry = config->ad_ldap_instance_bases->strings[i];
+            colon = strchr(entry, ':');
+            if (colon == NULL || colon == entry || colon[1] == '\0')
+                return sync_error_config(ctx, "invalid ad_ldap_instance_bases"
+                                         " entry %s", entry);
+        }
+
+    /* See how passwords are set in Active Directory. */
+    sync_config_string(ctx, defaults, "ad_password_method",
+                       &config->ad_password_method);
+    if (config->ad_password_method != NULL
+        && strcmp(config->ad_password_method, "kpasswd") != 0
+        && strcmp(config->ad_password_method, "ldap") != 0)
+        return sync_error_config(ctx, "unknown ad_password_method %s",
+                                 config->ad_password_method);
+
+    /*
+     * Get the limits on the time for a whole change in Active Directory and
+     * for each LDAP call.
+     */
+    code = sync_config_number(ctx, defaults, "ad_timeout",
+                              &config->ad_timeout);
+    if (code == 0)
+        code = sync_config_number(ctx, defaults, "ad_ldap_timeout",
+                                  &config->ad_ldap_timeout);
+    if (code != 0)
+        return code;
+
+    /*
+     * Get the settings for the circuit breaker that queues changes without
+     * trying Active Directory while it keeps failing.
+     */
+    config->ad_breaker_threshold = 3;
+    config->ad_breaker_cooldown = 60;
+    code = sync_config_number(ctx, defaults, "ad_breaker_threshold",
+                              &config->ad_breaker_threshold);
+    if (code == 0)
+        code = sync_config_number(ctx, defaults, "ad_breaker_cooldown",
+                                  &config->ad_breaker_cooldown);
+    if (code == 0)
+        code = sync_config_number(ctx, defaults, "ad_breaker_slow",
+                                  &config->ad_breaker_slow);
+    if (code != 0)
+        return code;
+
+    /* Get the size of the DN cache and whether to save it in queue_dir. */
+    config->ad_dn_cache_size = 1000;
+    code = sync_config_number(ctx, defaults, "ad_dn_cache_size",
+                              &config->ad_dn_cache_size);
+    if (code != 0)
+        return code;
+    if (config->ad_dn_cache_size > 1048576)
+        return sync_error_config(ctx, "ad_dn_cache_size must be at most"
+                                 " 1048576");
+    sync_config_boolean(ctx, defaults, "ad_dn_cache_persist",
+                        &config->ad_dn_cache_persist);
+
+    /* Get how long to trust the remembered status of cached accounts. */
+    code = sync_config_number(ctx, defaults, "ad_dn_cache_status",
+                              &config->ad_dn_cache_status);
+    if (code != 0)
+        return code;
+
+    /* Get how long to remember that an account is missing from AD. */
+    code = sync_config_number(ctx, defaults, "ad_dn_cache_missing",
+                              &config->ad_dn_cache_missing);
+    if (code != 0)
+        return code;
+
+    /* Get the list of accounts to synchronize, if any. */
+    sync_config_string(ctx, defaults, "ad_account_list",
+                       &config->ad_account_list);
 
     /* Get allowed instances from krb5.conf. */
-    code = sync_config_list(ctx, "ad_instances", &config->ad_instances);
-    if (code != 0) {
-        sync_close(ctx, config);
+    code = sync_config_list(ctx, defaults, "ad_instances",
+                            &config->ad_instances);
+    if (code != 0)
         return code;
-    }
 
     /* See if we're propagating an instance to the base account in AD. */
-    sync_config_string(ctx, "ad_base_instance", &config->ad_base_instance);
+    sync_config_string(ctx, defaults, "ad_base_instance",
+                       &config->ad_base_instance);
+
+    /* Get and compile the rules for mapping other instances to AD. */
+    code = sync_config_list(ctx, defaults, "ad_mapping_rules",
+                            &config->ad_mapping_rules);
+    if (code != 0)
+        return code;
+    code = sync_mapping_compile(config, ctx);
+    if (code != 0)
+        return code;
+
+    /* Build the set of allowed instances for instance_allowed. */
+    code = instance_compile(config, ctx);
+    if (code != 0)
+        return code;
 
     /* See if we're forcing queuing of all changes. */
-    sync_config_boolean(ctx, "ad_queue_only", &config->ad_queue_only);
+    sync_config_boolean(ctx, defaults, "ad_queue_only",
+                        &config->ad_queue_only);
+
+    /* See if changes should be made by a background thread. */
+    sync_config_boolean(ctx, defaults, "ad_async", &config->ad_async);
+
+    /* Get how long to collect status changes into a batch, if at all. */
+    code = sync_config_number(ctx, defaults, "ad_status_window",
+                              &config->ad_status_window);
+    if (code != 0)
+        return code;
+
+    /* Get the most LDAP operations in flight for a batch of them. */
+    config->ad_status_depth = 32;
+    code = sync_config_number(ctx, defaults, "ad_status_depth",
+                              &config->ad_status_depth);
+    if (code != 0)
+        return code;
+    if (config->ad_status_depth < 1 || config->ad_status_depth > 256)
+        return sync_error_config(ctx, "ad_status_depth must be between 1 and"
+                                 " 256");
+
+    /* See if AD credentials and connections should be set up in advance. */
+    sync_config_boolean(ctx, defaults, "ad_warmup", &config->ad_warmup);
 
     /* Get the directory for queued changes from krb5.conf. */
-    sync_config_string(ctx, "queue_dir", &config->queue_dir);
+    sync_config_string(ctx, defaults, "queue_dir", &config->queue_dir);
+
+    /* Get the maximum delay before retrying a failed queued change. */
+    code = sync_config_number(ctx, defaults, "queue_backoff",
+                              &config->queue_backoff);
+    if (code != 0)
+        return code;
+    if (config->queue_backoff < 0)
+        return sync_error_config(ctx, "queue_backoff must not be negative");
+
+    /* See if superseded queued changes should be discarded. */
+    sync_config_boolean(ctx, defaults, "queue_coalesce",
+                        &config->queue_coalesce);
+
+    /* See how queued changes are stored. */
+    sync_config_string(ctx, defaults, "queue_format", &config->queue_format);
+    if (config->queue_format != NULL
+        && strcmp(config->queue_format, "journal") == 0) {
+        config->journal = sync_journal_new();
+        if (config->journal == NULL)
+            return sync_error_system(ctx, "cannot allocate memory");
+    } else if (config->queue_format != NULL
+               && strcmp(config->queue_format, "directory") != 0) {
+        return sync_error_config(ctx, "unknown queue_format %s",
+                                 config->queue_format);
+    }
+
+    /* See what to do with new changes once the queue is full. */
+    sync_config_string(ctx, defaults, "queue_full_policy",
+                       &config->queue_full_policy);
+    if (config->queue_full_policy != NULL
+        && strcmp(config->queue_full_policy, "fail") != 0
+        && strcmp(config->queue_full_policy, "drop-superseded") != 0)
+        return sync_error_config(ctx, "unknown queue_full_policy %s",
+                                 config->queue_full_policy);
+
+    /* See if flushes of queued changes should be shared between writers. */
+    sync_config_boolean(ctx, defaults, "queue_group_commit",
+                        &config->queue_group_commit);
+
+    /* Get the hard limits on the number and size of queued changes. */
+    code = sync_config_number(ctx, defaults, "queue_hard_bytes",
+                              &config->queue_hard_bytes);
+    if (code != 0)
+        return code;
+    code = sync_config_number(ctx, defaults, "queue_hard_limit",
+                              &config->queue_hard_limit);
+    if (code != 0)
+        return code;
+    if (config->queue_hard_bytes < 0 || config->queue_hard_limit < 0)
+        return sync_error_config(ctx, "queue_hard_bytes and queue_hard_limit"
+                                 " must not be negative");
+
+    /* Get the partitions of the queue to lease to processing nodes. */
+    code = sync_config_number(ctx, defaults, "queue_lease_partitions",
+                              &config->queue_lease_partitions);
+    if (code != 0)
+        return code;
+    if (config->queue_lease_partitions < 0
+        || config->queue_lease_partitions > 1024)
+        return sync_error_config(ctx, "queue_lease_partitions must be"
+                                 " between 0 and 1024");
+    if (config->queue_lease_partitions > 0 && config->journal != NULL)
+        return sync_error_config(ctx, "queue_lease_partitions cannot be used"
+                                 " with queue_format journal");
+    config->queue_lease_time = 60;
+    code = sync_config_number(ctx, defaults, "queue_lease_time",
+                              &config->queue_lease_time);
+    if (code != 0)
+        return code;
+    if (config->queue_lease_time < 2)
+        return sync_error_config(ctx, "queue_lease_time must be at least 2");
+
+    /* Get the order in which to make queued changes of each type. */
+    code = sync_config_list(ctx, defaults, "queue_priority",
+                            &config->queue_priority);
+    if (code != 0)
+        return code;
+    if (config->queue_priority != NULL)
+        for (i = 0; i < config->queue_priority->count; i++) {
+            operation = config->queue_priority->strings[i];
+            if (strcmp(operation, "disable") != 0
+                && strcmp(operation, "enable") != 0
+                && strcmp(operation, "password") != 0)
+                return sync_error_config(ctx, "unknown operation %s in"
+                                         " queue_priority", operation);
+        }
+
+    /* Get the number of subdirectories to spread queue files across. */
+    code = sync_config_number(ctx, defaults, "queue_shards",
+                              &config->queue_shards);
+    if (code != 0)
+        return code;
+    if (config->queue_shards < 0 || config->queue_shards > 256)
+        return sync_error_config(ctx, "queue_shards must be between 0 and"
+                                 " 256");
+
+    /* Get the soft limits on the number and size of queued changes. */
+    code = sync_config_number(ctx, defaults, "queue_soft_bytes",
+                              &config->queue_soft_bytes);
+    if (code != 0)
+        return code;
+    code = sync_config_number(ctx, defaults, "queue_soft_limit",
+                              &config->queue_soft_limit);
+    if (code != 0)
+        return code;
+    if (config->queue_soft_bytes < 0 || config->queue_soft_limit < 0)
+        return sync_error_config(ctx, "queue_soft_bytes and queue_soft_limit"
+                                 " must not be negative");
+
+    /* Get the number of worker processes for krb5-sync -q. */
+    config->queue_workers = 1;
+    code = sync_config_number(ctx, defaults, "queue_workers",
+                              &config->queue_workers);
+    if (code != 0)
+        return code;
+    if (config->queue_workers < 1 || config->queue_workers > 256)
+        return sync_error_config(ctx, "queue_workers must be between 1 and"
+                                 " 256");
+
+    /* See if runtime state should be shared between processes. */
+    sync_config_boolean(ctx, defaults, "shared_state", &config->shared_state);
+
+    /* Get the file to capture hook events to for replay. */
+    sync_config_string(ctx, defaults, "capture_file", &config->capture_file);
+
+    /* Get the file to write latency histograms and outcome counts to. */
+    sync_config_string(ctx, defaults, "stats_file", &config->stats_file);
 
     /* Whether to log informational and warning messages to syslog. */
     config->syslog = true;
-    sync_config_boolean(ctx, "syslog", &config->syslog);
+    sync_config_boolean(ctx, defaults, "syslog", &config->syslog);
+
+    /* Get the limit on similar syslog messages per minute. */
+    code = sync_config_number(ctx, defaults, "syslog_limit",
+                              &config->syslog_limit);
+    if (code != 0)
+        return code;
+    if (config->syslog_limit < 0)
+        return sync_error_config(ctx, "syslog_limit must not be negative");
+
+    /* See if the configuration should be reloaded when krb5.conf changes. */
+    sync_config_boolean(ctx, defaults, "config_reload",
+                        &config->config_reload);
+
+    return 0;
+}
+
+
+/*
+ * Compute the values derived from the configuration that are used for every
+ * change.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+config_derive(krb5_context ctx, kadm5_hook_modinfo *config)
+{
+    struct vector *servers = config->ad_ldap_servers;
+    char *uri;
+    size_t i;
+    krb5_error_code code;
+
+    /* Parse the principal and resolve the keytab for AD credentials. */
+    if (config->ad_principal != NULL) {
+        code = krb5_parse_name(ctx, config->ad_principal, &config->ad_client);
+        if (code != 0)
+            return code;
+    }
+    if (config->ad_keytab != NULL) {
+        code = krb5_kt_resolve(ctx, config->ad_keytab, &config->ad_kt);
+        if (code != 0)
+            return code;
+    }
+    if (config->ad_realm != NULL)
+        config->ad_realm_length = strlen(config->ad_realm);
+
+    /*
+     * Map the state shared between processes and choose the credential cache
+     * for AD, which has to be a file in queue_dir if it is shared.  Each
+     * target of ad_targets has its own, named after the target.
+     */
+    if (config->shared_state) {
+        code = sync_shared_open(config, ctx);
+        if (code != 0)
+            return code;
+        if (asprintf(&config->ad_ccache_name, "FILE:%s/%s%s%s",
+                     config->queue_dir, SYNC_CACHE_FILE,
+                     config->target == NULL ? "" : "-",
+                     config->target == NULL ? "" : config->target) < 0)
+            config->ad_ccache_name = NULL;
+    } else if (config->target != NULL) {
+        if (asprintf(&config->ad_ccache_name, "%s-%s", SYNC_CACHE_NAME,
+                     config->target) < 0)
+            config->ad_ccache_name = NULL;
+    } else {
+        config->ad_ccache_name = strdup(SYNC_CACHE_NAME);
+    }
+    if (config->ad_ccache_name == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+
+    /* Set up the token buckets for syslog_limit. */
+    if (config->syslog_limit > 0) {
+        config->log = sync_syslog_new();
+        if (config->log == NULL)
+            return sync_error_system(ctx, "cannot allocate memory");
+    }
+
+    /* Set up the counts for stats_file. */
+    if (config->stats_file != NULL) {
+        config->stats = sync_stats_new();
+        if (config->stats == NULL)
+            return sync_error_system(ctx, "cannot allocate memory");
+    }
+
+    /* Build the LDAP URIs of the servers. */
+    if (servers == NULL || servers->count == 0)
+        servers = NULL;
+    if (servers == NULL && config->ad_admin_server == NULL)
+        return 0;
+    config->ad_ldap_uris = sync_vector_new();
+    if (config->ad_ldap_uris == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    for (i = 0; i < (servers == NULL ? 1 : servers->count); i++) {
+        if (asprintf(&uri, "%s://%s", config->ad_ldaps ? "ldaps" : "ldap",
+                     servers == NULL ? config->ad_admin_server
+                                     : servers->strings[i]) < 0)
+            return sync_error_system(ctx, "cannot allocate memory");
+        if (!sync_vector_add(config->ad_ldap_uris, uri)) {
+            free(uri);
+            return sync_error_system(ctx, "cannot allocate memory");
+        }
+        free(uri);
+    }
+    return 0;
+}
+
+
+/*
+ * Returns true if name is valid as the name of a target of ad_targets.  It
+ * is used in queue file names, between hyphens, and in the names of files in
+ * queue_dir, so only ASCII letters, digits, and underscores are allowed.
+ */
+static bool
+target_valid(const char *name)
+{
+    const char *p;
+
+    if (*name == '\0')
+        return false;
+    for (p = name; *p != '\0'; p++)
+        if (!isascii((unsigned char) *p)
+            || (!isalnum((unsigned char) *p) && *p != '_'))
+            return false;
+    return true;
+}
+
+
+/*
+ * Read the configuration of each target of ad_targets from its own
+ * krb5-sync-<target> section of krb5.conf, falling back on the krb5-sync
+ * section for settings not found there.  Queued changes, stats, logging
+ * limits, and reloading are handled by the configuration the targets belong
+ * to, so those settings are cleared in each target.  Returns a Kerberos
+ * status code.
+ */
+static krb5_error_code
+config_targets(krb5_context ctx, kadm5_hook_modinfo *config)
+{
+    struct sync_appdefaults *defaults;
+    kadm5_hook_modinfo *target;
+    const char *name;
+    char *section;
+    size_t i;
+    krb5_error_code code;
+
+    if (config->ad_targets == NULL || config->ad_targets->count == 0)
+        return 0;
+    config->targets = calloc(config->ad_targets->count,
+                             sizeof(*config->targets));
+    if (config->targets == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    for (i = 0; i < config->ad_targets->count; i++) {
+        name = config->ad_targets->strings[i];
+        if (!target_valid(name))
+            return sync_error_config(ctx, "invalid target name %s in"
+                                     " ad_targets", name);
+        if (sync_target_find(config, name) != NULL)
+            return sync_error_config(ctx, "duplicate target %s in"
+                                     " ad_targets", name);
+        target = calloc(1, sizeof(*target));
+        if (target == NULL)
+            return sync_error_system(ctx, "cannot allocate memory");
+        config->targets[config->target_count++] = target;
+        target->parent = config;
+        target->target = strdup(name);
+        if (target->target == NULL)
+            return sync_error_system(ctx, "cannot allocate memory");
+
+        /* Read its settings. */
+        if (asprintf(&section, "krb5-sync-%s", name) < 0)
+            return sync_error_system(ctx, "cannot allocate memory");
+        defaults = sync_appdefaults_new(ctx, section);
+        free(section);
+        if (defaults == NULL)
+            return sync_error_system(ctx, "cannot allocate memory");
+        code = config_settings(ctx, defaults, target);
+        sync_appdefaults_free(ctx, defaults);
+        if (code != 0)
+            return code;
+
+        /* Clear what the parent configuration handles. */
+        sync_journal_free(target->journal);
+        target->journal = NULL;
+        free(target->capture_file);
+        target->capture_file = NULL;
+        free(target->stats_file);
+        target->stats_file = NULL;
+        target->syslog_limit = 0;
+        target->config_reload = false;
+        sync_vector_free(target->ad_targets);
+        target->ad_targets = NULL;
+        code = config_derive(ctx, target);
+        if (code != 0)
+            return code;
+    }
+    return 0;
+}
+
+
+/*
+ * Load our configuration options from krb5.conf into a newly allocated struct
+ * stored in the second argument to this function.  This is used both to
+ * initialize the module and to reload its configuration.  Returns 0 on
+ * success, non-zero on failure.
+ */
+krb5_error_code
+sync_config_read(krb5_context ctx, kadm5_hook_modinfo **result)
+{
+    kadm5_hook_modinfo *config;
+    struct sync_appdefaults *defaults;
+    krb5_error_code code;
+
+    /* Allocate our internal data. */
+    config = calloc(1, sizeof(*config));
+    if (config == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    defaults = sync_appdefaults_new(ctx, NULL);
+    if (defaults == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        sync_close(ctx, config);
+        return code;
+    }
+
+    /* Read the settings. */
+    code = config_settings(ctx, defaults, config);
+    sync_appdefaults_free(ctx, defaults);
+    if (code == 0)
+        code = config_derive(ctx, config);
+    if (code == 0)
+        code = config_targets(ctx, config);
+    if (code != 0) {
+        sync_close(ctx, config);
+        return code;
+    }
+    *result = config;
+    return 0;
+}
+
+
+/*
+ * Initialize the module.  This consists of loading our configuration options
+ * from krb5.conf into a newly allocated struct stored in the second argument
+ * to this function and, if config_reload is set, remembering the krb5.conf
+ * files to watch for changes.  The AD credentials and connections aren't
+ * warmed up here, since krb5-sync may fork workers that must not share the
+ * connections, so the kadmind hooks start that separately.  Returns 0 on
+ * success, non-zero on failure.
+ */
+krb5_error_code
+sync_init(krb5_context ctx, kadm5_hook_modinfo **result)
+{
+    kadm5_hook_modinfo *config;
+    krb5_error_code code;
 
-    /* Initialized.  Set data and return. */
+    code = sync_config_read(ctx, &config);
+    if (code != 0)
+        return code;
+    if (config->config_reload) {
+        code = sync_reload_init(config, ctx);
+        if (code != 0) {
+            sync_close(ctx, config);
+            return code;
+        }
+    }
     *result = config;
     return 0;
 }
 
 
 /*
- * Shut down the module.  This just means freeing our configuration struct,
- * since we don't store any other local state.
+ * Shut down the module.  This means making any batched status changes,
+ * stopping the background worker and the warm-up refresher, no longer
+ * watching krb5.conf for changes, closing any pooled LDAP connections,
+ * freeing the server health tracking, closing the kadm5 handle for the local
+ * KDB, saving and freeing the DN cache, discarding any cached AD
+ * credentials, closing the queue journal, freeing the cached queue contents,
+ * writing the final stats, and freeing our configuration struct, and doing
+ * all that for each target of ad_targets.
  */
 void
-sync_close(krb5_context ctx UNUSED, kadm5_hook_modinfo *config)
+sync_close(krb5_context ctx, kadm5_hook_modinfo *config)
 {
+    size_t i;
+
+    sync_batch_stop(config);
+    sync_worker_stop(config);
+    sync_warmup_stop(config);
+    sync_reload_close(config);
+    sync_ldap_close(config);
+    sync_server_close(config);
+    sync_instance_close(config);
+    sync_strset_free(config->instance_set);
+    free(config->instance_realm);
+    sync_strset_free(config->allowed_instances);
+    sync_accounts_close(config);
+    sync_dncache_free(config);
+    sync_limit_close(config);
+    if (config->status_principal != NULL)
+        krb5_free_principal(ctx, config->status_principal);
+    sync_ad_creds_close(config, ctx);
+    free(config->ad_ccache_name);
+    if (config->ad_client != NULL)
+        krb5_free_principal(ctx, config->ad_client);
+    if (config->ad_kt != NULL)
+        krb5_kt_close(ctx, config->ad_kt);
+    sync_vector_free(config->ad_ldap_uris);
+    free(config->ad_account_list);
     free(config->ad_admin_server);
     free(config->ad_base_instance);
     sync_vector_free(config->ad_instances);
     free(config->ad_keytab);
     free(config->ad_ldap_base);
+    free(config->ad_ldap_filter_attribute);
+    sync_vector_free(config->ad_ldap_instance_bases);
+    sync_vector_free(config->ad_mapping_rules);
+    sync_mapping_free(config->mapping);
+    free(config->ad_password_method);
+    sync_vector_free(config->ad_ldap_servers);
     free(config->ad_principal);
+    sync_vector_free(config->queue_priority);
     free(config->ad_realm);
+    sync_journal_free(config->journal);
+    sync_queue_close(config);
     free(config->queue_dir);
+    free(config->queue_format);
+    free(config->queue_full_policy);
+    free(config->queue_cursor);
+    sync_lease_release(config);
+    sync_stats_close(config);
+    free(config->stats_file);
+    sync_capture_close(config);
+    free(config->capture_file);
+    sync_shared_close(config);
+    sync_syslog_close(config);
+    for (i = 0; i < config->target_count; i++)
+        sync_close(ctx, config->targets[i]);
+    free(config->targets);
+    sync_vector_free(config->ad_targets);
+    free(config->target);
     free(config);
 }
 
 
 /*
  * Given the configuration and the instance of a principal, returns true if
- * that instance is allowed and false otherwise.
+ * that instance is allowed and false otherwise.  The allowed instances are
+ * ad_base_instance and ad_instances, which instance_compile puts in a set at
+ * initialization so that this doesn't depend on the length of the list.
  */
 static bool
 instance_allowed(kadm5_hook_modinfo *config, const char *instance)
 {
-    size_t i;
-
-    if (instance == NULL)
+    if (instance == NULL || config->allowed_instances == NULL)
         return false;
-    if (config->ad_base_instance)
-        if (strcmp(config->ad_base_instance, instance) == 0)
-            return true;
-    if (config->ad_instances == NULL)
-        return false;
-    for (i = 0; i < config->ad_instances->count; i++)
-        if (strcmp(config->ad_instances->strings[i], instance) == 0)
-            return true;
-    return false;
+    return sync_strset_contains(config->allowed_instances, instance);
 }
 
 
@@ -126,8 +768,10 @@ instance_allowed(kadm5_hook_modinfo *config, const char *instance)
  * status.  Takes a flag, which is true for a password change and false for
  * other types of changes, since password changes use ad_base_instance.
  *
- * If it contains a non-null instance, we don't want to propagate the change;
- * we only want to change passwords for regular users.
+ * If ad_account_list is set, only the principals listed in that file are
+ * propagated.  Otherwise, if it contains a non-null instance other than those
+ * in ad_instances, we don't want to propagate the change; we only want to
+ * change passwords for regular users.
  *
  * If it is a single-part principal name, ad_base_instance is set, and the
  * equivalent principal with that instance also exists, we don't propagate
@@ -138,18 +782,36 @@ instance_allowed(kadm5_hook_modinfo *config, const char *instance)
  * Kerberos status code for more serious errors.  If we shouldn't proceed,
  * logs a debug-level message to syslog.
  */
-static krb5_error_code
-principal_allowed(kadm5_hook_modinfo *config, krb5_context ctx,
-                  krb5_principal principal, bool pwchange, bool *allowed)
+krb5_error_code
+sync_principal_allowed(kadm5_hook_modinfo *config, krb5_context ctx,
+                       struct sync_request *request, bool pwchange,
+                       bool *allowed)
 {
-    char *display;
+    krb5_principal principal = request->principal;
+    const char *display;
     krb5_error_code code;
     int ncomp;
     bool exists = false;
+    bool listed;
 
     /* Default to propagating. */
     *allowed = true;
 
+    /* If there is a list of accounts, the principal has to be in it. */
+    if (config->ad_account_list != NULL) {
+        code = sync_request_user(ctx, request, &display);
+        if (code != 0)
+            return code;
+        code = sync_accounts_check(config, ctx, display, &listed);
+        if (code == 0 && !listed) {
+            sync_syslog_debug(config, "krb5-sync: ignoring principal \"%s\""
+                              " not in %s", display, config->ad_account_list);
+            *allowed = false;
+        }
+        if (code != 0 || !listed)
+            return code;
+    }
+
     /* Get the number of components. */
     ncomp = krb5_principal_get_num_comp(ctx, principal);
 
@@ -158,31 +820,29 @@ principal_allowed(kadm5_hook_modinfo *config, krb5_context ctx,
      * Otherwise, if the principal is multi-part, check the instance.
      */
     if (pwchange && ncomp == 1 && config->ad_base_instance != NULL) {
-        code = sync_instance_exists(ctx, principal, config->ad_base_instance,
-                                    &exists);
+        code = sync_instance_exists(config, ctx, principal,
+                                    config->ad_base_instance, &exists);
         if (code != 0)
             return code;
         if (exists) {
-            code = krb5_unparse_name(ctx, principal, &display);
+            code = sync_request_name(ctx, request, &display);
             if (code != 0)
                 return code;
             sync_syslog_debug(config, "krb5-sync: ignoring principal \"%s\""
                               " because %s instance exists", display,
                               config->ad_base_instance);
-            krb5_free_unparsed_name(ctx, display);
             *allowed = false;
         }
-    } else if (ncomp > 1) {
+    } else if (ncomp > 1 && config->ad_account_list == NULL) {
         const char *instance;
 
         instance = krb5_principal_get_comp_string(ctx, principal, 1);
         if (!instance_allowed(config, instance)) {
-            code = krb5_unparse_name(ctx, principal, &display);
+            code = sync_request_name(ctx, request, &display);
             if (code != 0)
                 return code;
             sync_syslog_debug(config, "krb5-sync: ignoring principal \"%s\""
                               " with non-null instance", display);
-            krb5_free_unparsed_name(ctx, display);
             *allowed = false;
         }
     }
@@ -190,18 +850,365 @@ principal_allowed(kadm5_hook_modinfo *config, krb5_context ctx,
 }
 
 
+/*
+ * Return the configuration used for changes in the given target.  Without
+ * ad_targets, the only target is "ad", which uses the configuration itself.
+ */
+kadm5_hook_modinfo *
+sync_target_find(kadm5_hook_modinfo *config, const char *name)
+{
+    size_t i;
+
+    if (config->targets == NULL)
+        return (strcmp(name, "ad") == 0) ? config : NULL;
+    for (i = 0; i < config->target_count; i++)
+        if (strcmp(config->targets[i]->target, name) == 0)
+            return config->targets[i];
+    return NULL;
+}
+
+
+/*
+ * Returns true if the configuration has the settings needed to make password
+ * changes, if pwchange is true, or status changes in Active Directory.
+ */
+static bool
+change_configured(kadm5_hook_modinfo *config, bool pwchange)
+{
+    if (config->ad_realm == NULL)
+        return false;
+    if (pwchange)
+        return true;
+    return ((config->ad_admin_server != NULL
+             || config->ad_ldap_servers != NULL)
+            && config->ad_keytab != NULL
+            && config->ad_ldap_base != NULL
+            && config->ad_principal != NULL);
+}
+
+
+/*
+ * Returns true if any target has the settings needed to make password
+ * changes, if pwchange is true, or status changes.
+ */
+static bool
+change_wanted(kadm5_hook_modinfo *config, bool pwchange)
+{
+    size_t i;
+
+    if (config->targets == NULL)
+        return change_configured(config, pwchange);
+    for (i = 0; i < config->target_count; i++)
+        if (change_configured(config->targets[i], pwchange))
+            return true;
+    return false;
+}
+
+
+/*
+ * Returns true if a change should be tried in Active Directory rather than
+ * queued without trying, following the circuit breaker.  The breaker opens
+ * after ad_breaker_threshold consecutive failures, and then changes are
+ * queued without trying Active Directory for ad_breaker_cooldown seconds.
+ * After that, the next change is tried as a probe.  If it works, the breaker
+ * closes again, and otherwise it stays open for another cooldown period.
+ *
+ * kadmind calls the plugin from only one thread, so only one probe can be in
+ * progress at a time in each process.  With shared_state, the failure count
+ * and the end of the cooldown are shared, so each process of a forking
+ * kadmind may send one probe when the cooldown ends.
+ */
+static bool
+breaker_allow(kadm5_hook_modinfo *config)
+{
+    unsigned long failures;
+    time_t until;
+
+    if (config->ad_breaker_threshold <= 0)
+        return true;
+    failures = __atomic_load_n(sync_shared_failures(config), __ATOMIC_RELAXED);
+    if (failures < (unsigned long) config->ad_breaker_threshold)
+        return true;
+    until = __atomic_load_n(sync_shared_breaker_until(config),
+                            __ATOMIC_RELAXED);
+    return time(NULL) >= until;
+}
+
+
+/*
+ * Record the result of a change tried in Active Directory, given its status
+ * and the time at which it started.  A change that took longer than
+ * ad_breaker_slow milliseconds, if that is set, counts as a failure even if
+ * it worked, since kadmind had to wait for it.
+ */
+void
+sync_breaker_report(kadm5_hook_modinfo *config, krb5_error_code code,
+                    const struct timeval *start)
+{
+    struct timeval now;
+    long msec = 0;
+    unsigned long threshold, failures;
+    unsigned long *count;
+
+    if (config->ad_breaker_threshold <= 0)
+        return;
+    threshold = (unsigned long) config->ad_breaker_threshold;
+    if (gettimeofday(&now, NULL) == 0)
+        msec = (now.tv_sec - start->tv_sec) * 1000
+            + (now.tv_usec - start->tv_usec) / 1000;
+    count = sync_shared_failures(config);
+    if (code == 0 && (config->ad_breaker_slow <= 0
+                      || msec <= config->ad_breaker_slow)) {
+        failures = __atomic_exchange_n(count, 0, __ATOMIC_RELAXED);
+        if (failures >= threshold)
+            sync_syslog_notice(config, "krb5-sync: Active Directory is"
+                               " working again, no longer queuing all"
+                               " changes");
+        return;
+    }
+    failures = __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+    if (failures >= threshold) {
+        if (failures == threshold)
+            sync_syslog_notice(config, "krb5-sync: %lu consecutive Active"
+                               " Directory failures, queuing all changes"
+                               " for %ld seconds", failures,
+                               config->ad_breaker_cooldown);
+        __atomic_store_n(sync_shared_breaker_until(config),
+                         time(NULL) + config->ad_breaker_cooldown,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * A change to be made in one target, with its own request, since the form of
+ * the principal in Active Directory and the queue file names depend on the
+ * target.  attempt is set if the change should be tried in Active Directory
+ * and queue if it should be queued, which it also is if the attempt fails.
+ * A change tried in a thread of its own has its own Kerberos context.
+ */
+struct target_change {
+    kadm5_hook_modinfo *config;
+    struct sync_request request;
+    const char *operation;
+    const char *password;
+    bool attempt;
+    bool queue;
+    bool threaded;
+    krb5_context ctx;
+    pthread_t thread;
+    krb5_error_code code;
+};
+
+
+/*
+ * Try a change in the Active Directory of its target, following up with the
+ * circuit breaker of that target, and mark it to be queued if it fails.
+ */
+static void
+change_attempt(struct target_change *change, krb5_context ctx)
+{
+    kadm5_hook_modinfo *config = change->config;
+    struct timeval start;
+    const char *message;
+    krb5_error_code code;
+
+    if (gettimeofday(&start, NULL) < 0)
+        start.tv_sec = start.tv_usec = 0;
+    if (change->password != NULL)
+        code = sync_ad_chpass(config, ctx, &change->request,
+                              change->password);
+    else
+        code = sync_ad_status(config, ctx, &change->request,
+                              strcmp(change->operation, "enable") == 0);
+    sync_breaker_report(config, code, &start);
+    if (code == 0)
+        sync_request_lag(config, ctx, &change->request);
+    else {
+        message = krb5_get_error_message(ctx, code);
+        sync_syslog_notice(config, "krb5-sync: AD %s change%s%s failed,"
+                           " queuing: %s",
+                           change->password != NULL ? "password" : "status",
+                           config->target == NULL ? "" : " in ",
+                           config->target == NULL ? "" : config->target,
+                           message);
+        krb5_free_error_message(ctx, message);
+        change->queue = true;
+    }
+}
+
+
+/*
+ * The body of a thread trying a change in one target.
+ */
+static void *
+change_thread(void *data)
+{
+    struct target_change *change = data;
+
+    change_attempt(change, change->ctx);
+    return NULL;
+}
+
+
+/*
+ * Try the changes marked for an attempt in Active Directory.  The first is
+ * tried in the calling thread and each of the others in a thread of its own
+ * with its own Kerberos context, so that a change in several targets takes
+ * about as long as in the slowest of them.  Since each target has its own
+ * credentials, connections, and server health, the threads share nothing but
+ * the stats and the log.  Without gss_krb5_ccache_name, the credential cache
+ * for LDAP binds is set in the environment of the whole process, so the
+ * changes are tried one after another instead, as they also are for any
+ * target whose thread can't be started.
+ */
+static void
+change_attempt_all(struct target_change *changes, size_t count,
+                   krb5_context ctx)
+{
+    size_t i;
+#ifdef HAVE_GSS_KRB5_CCACHE_NAME
+    bool first = true;
+
+    for (i = 0; i < count; i++) {
+        if (!changes[i].attempt)
+            continue;
+        if (first) {
+            first = false;
+            continue;
+        }
+        if (krb5_init_context(&changes[i].ctx) != 0)
+            continue;
+        if (pthread_create(&changes[i].thread, NULL, change_thread,
+                           &changes[i]) != 0) {
+            krb5_free_context(changes[i].ctx);
+            continue;
+        }
+        changes[i].threaded = true;
+    }
+#endif
+    for (i = 0; i < count; i++)
+        if (changes[i].attempt && !changes[i].threaded)
+            change_attempt(&changes[i], ctx);
+    for (i = 0; i < count; i++)
+        if (changes[i].threaded) {
+            pthread_join(changes[i].thread, NULL);
+            krb5_free_context(changes[i].ctx);
+        }
+}
+
+
+/*
+ * Make a change in every target that has the settings for it: each of
+ * ad_targets if that is set, and otherwise the only Active Directory.  For
+ * each target, the change is queued for the background worker thread if
+ * ad_async is set, queued without trying if a change for the same user and
+ * operation is already queued for that target (checked and queued in one
+ * step), if ad_queue_only is set for it (without checking, since it's queued
+ * anyway), or if its circuit breaker is open, and otherwise tried in Active
+ * Directory and queued if that fails.  If ad_status_window is set, a status
+ * change that would be tried is added to the pending batch instead, and one
+ * that is queued replaces any pending one.  The queue is only used from the
+ * calling thread.  The change in each target carries the trace of the request
+ * for the hook.  Returns the first error, after doing what can be done in the
+ * other targets.
+ */
+static krb5_error_code
+change_dispatch(kadm5_hook_modinfo *config, krb5_context ctx,
+                struct sync_request *request, const char *operation,
+                const char *password)
+{
+    krb5_principal principal = request->principal;
+    kadm5_hook_modinfo **targets;
+    struct target_change *changes, *change;
+    size_t count, i;
+    bool queued, notify = false;
+    krb5_error_code code = 0;
+
+    if (config->targets == NULL) {
+        targets = &config;
+        count = 1;
+    } else {
+        targets = config->targets;
+        count = config->target_count;
+    }
+    changes = calloc(count, sizeof(*changes));
+    if (changes == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+
+    /* Decide what to do in each target. */
+    for (i = 0; i < count; i++) {
+        change = &changes[i];
+        change->config = targets[i];
+        change->operation = operation;
+        change->password = password;
+        sync_request_init(&change->request, principal);
+        sync_request_trace(&change->request, request);
+        change->request.domain = targets[i]->target;
+        if (!change_configured(targets[i], password != NULL))
+            continue;
+        if (config->ad_async && !targets[i]->ad_queue_only) {
+            change->queue = true;
+            notify = true;
+            continue;
+        }
+        queued = false;
+        if (!targets[i]->ad_queue_only) {
+            change->code = sync_queue_conflict_write(config, ctx,
+                                                     &change->request,
+                                                     operation, password,
+                                                     &queued);
+            if (change->code != 0)
+                continue;
+        }
+        if (queued || targets[i]->ad_queue_only
+            || !breaker_allow(targets[i])) {
+            change->queue = !queued;
+            if (password == NULL)
+                sync_batch_cancel(config, targets[i]->target, principal);
+        } else if (password == NULL && config->ad_status_window > 0
+                   && sync_batch_add(config, targets[i]->target, principal,
+                                     strcmp(operation, "enable") == 0))
+            continue;
+        else
+            change->attempt = true;
+    }
+
+    /* Try the changes and queue the ones that weren't made. */
+    change_attempt_all(changes, count, ctx);
+    for (i = 0; i < count; i++) {
+        change = &changes[i];
+        if (change->queue)
+            change->code = sync_queue_write(config, ctx, &change->request,
+                                            operation, password);
+        if (change->code != 0 && code == 0)
+            code = change->code;
+        sync_request_free(ctx, &change->request);
+    }
+    if (notify)
+        sync_worker_notify(config);
+    free(changes);
+    return code;
+}
+
+
 /*
  * Actions to take before the password is changed in the local database.
  *
  * Push the new password to Active Directory if we have the necessary
  * configuration information and return any error it returns, but skip any
  * principals with a non-NULL instance since those are kept separately in each
- * realm.
+ * realm.  If ad_targets is set, the password is pushed to each target at the
+ * same time.
  *
- * If a password change is already queued for this usequeue this password
+ * If a password change is already queued for this user, queue this password
  * change as well.  If the password change fails for a reason that may mean
  * that the user doesn't already exist, also queue this change.
  *
+ * If ad_async is set, always queue the change and let the background worker
+ * thread make it, so that kadmind doesn't wait for Active Directory.  If
+ * Active Directory has been failing, queue the change without trying it.
+ *
  * If the new password is NULL, that means that the keys are being randomized.
  * Currently, we can't do anything in that case, so just skip it.
  */
@@ -209,48 +1216,90 @@ krb5_error_code
 sync_chpass(kadm5_hook_modinfo *config, krb5_context ctx,
             krb5_principal principal, const char *password)
 {
+    struct sync_request request;
     krb5_error_code code;
-    const char *message;
+    struct timeval total;
     bool allowed = false;
-    bool conflict = true;
+
+    /* Wait for any batch of status changes and pick up config changes. */
+    sync_batch_lock(config);
+    sync_reload_check(config, ctx);
 
     /* Do nothing if we don't have required configuration. */
-    if (config->ad_realm == NULL)
+    if (!change_wanted(config, true)) {
+        sync_batch_unlock(config);
         return 0;
+    }
 
     /* If there was no password, this is probably a key randomization. */
-    if (password == NULL)
+    if (password == NULL) {
+        sync_batch_unlock(config);
         return 0;
+    }
 
-    /* Check if this principal should be synchronized. */
-    code = principal_allowed(config, ctx, principal, true, &allowed);
-    if (code != 0)
-        return code;
-    if (!allowed)
-        return 0;
+    /* Check if this principal should be synchronized, and if so, do it. */
+    sync_stats_start(config, &total);
+    sync_request_init(&request, principal);
+    sync_request_trace(&request, NULL);
+    code = sync_principal_allowed(config, ctx, &request, true, &allowed);
+    if (code == 0 && allowed)
+        code = change_dispatch(config, ctx, &request, "password", password);
+    sync_capture_event(config, ctx, &request, "password");
+    sync_request_free(ctx, &request);
+    sync_stats_record(config, SYNC_STATS_CHPASS, &total, code);
+    sync_batch_unlock(config);
+    return code;
+}
 
-    /* Check if there was a queue conflict or if we always queue. */
-    code = sync_queue_conflict(config, ctx, principal, "password", &conflict);
-    if (code != 0)
-        return code;
-    if (conflict)
-        goto queue;
-    if (config->ad_queue_only)
-        goto queue;
 
-    /* Do the password change, and queue if it fails. */
-    code = sync_ad_chpass(config, ctx, principal, password);
-    if (code != 0) {
-        message = krb5_get_error_message(ctx, code);
-        sync_syslog_notice(config, "krb5-sync: AD password change failed,"
-                           " queuing: %s", message);
-        krb5_free_error_message(ctx, message);
-        goto queue;
+/*
+ * Actions to take before a principal's attributes are changed in the local
+ * database.
+ *
+ * Remember whether the principal is currently disabled, so that sync_status
+ * can skip the change in Active Directory if the modification didn't change
+ * DISALLOW_ALL_TIX.  If the current state can't be read, nothing is
+ * remembered and the status is pushed as before.
+ */
+void
+sync_status_precommit(kadm5_hook_modinfo *config, krb5_context ctx,
+                      krb5_principal principal)
+{
+    bool disabled;
+
+    if (config->status_principal != NULL) {
+        krb5_free_principal(ctx, config->status_principal);
+        config->status_principal = NULL;
     }
-    return 0;
+    if (!change_wanted(config, false))
+        return;
+    if (sync_instance_disabled(config, ctx, principal, &disabled) != 0)
+        return;
+    if (krb5_copy_principal(ctx, principal, &config->status_principal) != 0)
+        return;
+    config->status_disabled = disabled;
+}
+
+
+/*
+ * Given the new status of a principal, return true if sync_status_precommit
+ * recorded the same status for it before the modification, and forget what
+ * it recorded.
+ */
+static bool
+status_unchanged(kadm5_hook_modinfo *config, krb5_context ctx,
+                 krb5_principal principal, bool enabled)
+{
+    bool unchanged;
 
-queue:
-    return sync_queue_write(config, ctx, principal, "password", password);
+    if (config->status_principal == NULL)
+        return false;
+    unchanged = krb5_principal_compare(ctx, config->status_principal,
+                                       principal)
+        && config->status_disabled == !enabled;
+    krb5_free_principal(ctx, config->status_principal);
+    config->status_principal = NULL;
+    return unchanged;
 }
 
 
@@ -258,56 +1307,159 @@ queue:
  * Actions to take after the account status is changed in the local database.
  *
  * Push the new account status to Active Directory if so configured, but skip
- * principals with non-NULL instances.  Return any error that it returns.
+ * principals with non-NULL instances.  Return any error that it returns.  If
+ * ad_targets is set, the status is pushed to each target at the same time.
  *
  * If a status change is already queued, or if making the status change fails,
- * queue it for later processing.
+ * queue it for later processing.  If ad_async is set, always queue it for the
+ * background worker thread.  If Active Directory has been failing, queue it
+ * without trying it.  If ad_status_window is set, add it to the pending batch
+ * of status changes rather than making it now.  If the modification didn't
+ * change DISALLOW_ALL_TIX, as recorded by sync_status_precommit, do nothing.
  */
 krb5_error_code
 sync_status(kadm5_hook_modinfo *config, krb5_context ctx,
             krb5_principal principal, bool enabled)
 {
+    struct sync_request request;
     krb5_error_code code;
-    const char *message;
+    struct timeval total;
     bool allowed = false;
-    bool conflict = true;
-
-    /* Do nothing if we don't have the required configuration. */
-    if (config->ad_admin_server == NULL
-        || config->ad_keytab == NULL
-        || config->ad_ldap_base == NULL
-        || config->ad_principal == NULL
-        || config->ad_realm == NULL)
-        return 0;
 
-    /* Check if this principal should be synchronized. */
-    code = principal_allowed(config, ctx, principal, false, &allowed);
-    if (code != 0)
-        return code;
-    if (!allowed)
+    /* Wait for any batch of status changes and pick up config changes. */
+    sync_batch_lock(config);
+    sync_reload_check(config, ctx);
+
+    /*
+     * Do nothing if we don't have the required configuration or if the
+     * status didn't change.
+     */
+    if (status_unchanged(config, ctx, principal, enabled)) {
+        sync_syslog_debug(config, "krb5-sync: account status unchanged, not"
+                          " updating Active Directory");
+        sync_batch_unlock(config);
+        return 0;
+    }
+    if (!change_wanted(config, false)) {
+        sync_batch_unlock(config);
         return 0;
+    }
 
-    /* Check if there was a queue conflict or if we always queue. */
-    code = sync_queue_conflict(config, ctx, principal, "enable", &conflict);
-    if (code != 0)
-        return code;
-    if (conflict)
-        goto queue;
-    if (config->ad_queue_only)
-        goto queue;
+    /* Check if this principal should be synchronized, and if so, do it. */
+    sync_stats_start(config, &total);
+    sync_request_init(&request, principal);
+    sync_request_trace(&request, NULL);
+    code = sync_principal_allowed(config, ctx, &request, false, &allowed);
+    if (code == 0 && allowed)
+        code = change_dispatch(config, ctx, &request,
+                               enabled ? "enable" : "disable", NULL);
+    sync_capture_event(config, ctx, &request, enabled ? "enable" : "disable");
+    sync_request_free(ctx, &request);
+    sync_stats_record(config, SYNC_STATS_STATUS, &total, code);
+    sync_batch_unlock(config);
+    return code;
+}
 
-    /* Synchronize the status. */
-    code = sync_ad_status(config, ctx, principal, enabled);
-    if (code != 0) {
-        message = krb5_get_error_message(ctx, code);
-        sync_syslog_notice(config, "krb5-sync: AD status change failed,"
-                           " queuing: %s", message);
-        krb5_free_error_message(ctx, message);
-        goto queue;
+
+/*
+ * Forget the changes for a principal that was deleted from the local
+ * database, or, if renamed is not NULL, move them to that principal because
+ * the principal was renamed.  For each target, this cancels any pending
+ * status change in the batch, forgets the cached DN of the old account, and
+ * removes or moves the queued password and status changes.  A queued change
+ * that would no longer be made for the new principal, such as because it is
+ * now an instance that isn't synchronized, is removed rather than moved.
+ * Returns the first error, after doing what can be done in the other
+ * targets.
+ */
+static krb5_error_code
+principal_forget(kadm5_hook_modinfo *config, krb5_context ctx,
+                 krb5_principal principal, krb5_principal renamed)
+{
+    static const char *const operations[] = { "password", "enable" };
+    kadm5_hook_modinfo **targets;
+    struct sync_request request, target;
+    krb5_principal ad_principal;
+    const char *name;
+    size_t count, i, j;
+    bool allowed;
+    krb5_error_code code = 0, status;
+
+    if (config->targets == NULL) {
+        targets = &config;
+        count = 1;
+    } else {
+        targets = config->targets;
+        count = config->target_count;
     }
-    return 0;
+    for (i = 0; i < count; i++) {
+        sync_batch_cancel(config, targets[i]->target, principal);
+        sync_request_init(&request, principal);
+        request.domain = targets[i]->target;
+        if (change_configured(targets[i], true)
+            && sync_request_ad_principal(targets[i], ctx, &request,
+                                         &ad_principal, &name) == 0)
+            sync_dncache_remove(targets[i], name);
+        for (j = 0; config->queue_dir != NULL && j < 2; j++) {
+            allowed = false;
+            sync_request_init(&target, renamed);
+            target.domain = targets[i]->target;
+            status = 0;
+            if (renamed != NULL)
+                status = sync_principal_allowed(targets[i], ctx, &target,
+                                                j == 0, &allowed);
+            if (status == 0)
+                status = sync_queue_move(config, ctx, &request,
+                                         operations[j],
+                                         allowed ? &target : NULL);
+            if (status != 0 && code == 0)
+                code = status;
+            sync_request_free(ctx, &target);
+        }
+        sync_request_free(ctx, &request);
+    }
+    return code;
+}
+
+
+/*
+ * Actions to take after a principal is deleted from the local database.
+ *
+ * Drop the queued and pending changes for it, so that they aren't retried
+ * against Active Directory for an account that no longer has a principal,
+ * and forget its cached DN.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_remove(kadm5_hook_modinfo *config, krb5_context ctx,
+            krb5_principal principal)
+{
+    krb5_error_code code;
+
+    sync_batch_lock(config);
+    sync_reload_check(config, ctx);
+    code = principal_forget(config, ctx, principal, NULL);
+    sync_batch_unlock(config);
+    return code;
+}
+
+
+/*
+ * Actions to take after a principal is renamed in the local database.
+ *
+ * Move the queued changes for the old principal to the new one, so that they
+ * are made for the account of the principal under its new name, and drop
+ * any pending status change and the cached DN for the old name.  Returns a
+ * Kerberos status code.
+ */
+krb5_error_code
+sync_rename(kadm5_hook_modinfo *config, krb5_context ctx,
+            krb5_principal principal, krb5_principal renamed)
+{
+    krb5_error_code code;
 
-queue:
-    return sync_queue_write(config, ctx, principal,
-                            enabled ? "enable" : "disable", NULL);
+    sync_batch_lock(config);
+    sync_reload_check(config, ctx);
+    code = principal_forget(config, ctx, principal, renamed);
+    sync_batch_unlock(config);
+    return code;
 }
@@ -0,0 +1,197 @@
+/*
+ * String hashing and string sets.
+ *
+ * A simple, fast string hash function used by the in-memory caches and
+ * lookup tables in the plugin, and a set of strings built on it.  The hash is
+ * the 32-bit FNV-1a hash, which is good enough for hash tables keyed on
+ * principal names and doesn't need to resist deliberate collisions, since
+ * all keys come from the local KDC.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <plugin/internal.h>
+
+/* FNV-1a parameters for 32-bit hashes. */
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME        16777619U
+
+/*
+ * A set of strings, implemented as a hash table with chained buckets.  The
+ * number of buckets is always a power of two and is doubled whenever the
+ * number of strings exceeds it.
+ */
+struct strset_entry {
+    char *string;
+    struct strset_entry *next;
+};
+
+struct sync_strset {
+    size_t count;
+    size_t nbuckets;
+    struct strset_entry **buckets;
+};
+
+/* Initial number of buckets in a string set. */
+#define STRSET_MIN_BUCKETS 64
+
+
+/*
+ * Hash a nul-terminated string.
+ */
+uint32_t
+sync_hash_string(const char *string)
+{
+    const unsigned char *p;
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    for (p = (const unsigned char *) string; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+
+/*
+ * Create a new, empty string set.  Returns NULL on memory allocation failure.
+ */
+struct sync_strset *
+sync_strset_new(void)
+{
+    struct sync_strset *set;
+
+    set = calloc(1, sizeof(*set));
+    if (set == NULL)
+        return NULL;
+    set->nbuckets = STRSET_MIN_BUCKETS;
+    set->buckets = calloc(set->nbuckets, sizeof(struct strset_entry *));
+    if (set->buckets == NULL) {
+        free(set);
+        return NULL;
+    }
+    return set;
+}
+
+
+/*
+ * Double the number of buckets in a string set and rehash all of its
+ * entries.  If memory allocation fails, leave the set alone, since it still
+ * works, just more slowly.
+ */
+static void
+strset_grow(struct sync_strset *set)
+{
+    struct strset_entry **buckets, *entry, *next;
+    size_t nbuckets, i, bucket;
+
+    nbuckets = set->nbuckets * 2;
+    buckets = calloc(nbuckets, sizeof(struct strset_entry *));
+    if (buckets == NULL)
+        return;
+    for (i = 0; i < set->nbuckets; i++)
+        for (entry = set->buckets[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            bucket = sync_hash_string(entry->string) & (nbuckets - 1);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+        }
+    free(set->buckets);
+    set->buckets = buckets;
+    set->nbuckets = nbuckets;
+}
+
+
+/*
+ * Returns true if the string is in the set.
+ */
+bool
+sync_strset_contains(const struct sync_strset *set, const char *string)
+{
+    struct strset_entry *entry;
+    size_t bucket;
+
+    bucket = sync_hash_string(string) & (set->nbuckets - 1);
+    for (entry = set->buckets[bucket]; entry != NULL; entry = entry->next)
+        if (strcmp(entry->string, string) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Add a string to the set, doing nothing if it's already present.  Returns
+ * false on memory allocation failure.
+ */
+bool
+sync_strset_add(struct sync_strset *set, const char *string)
+{
+    struct strset_entry *entry;
+    size_t bucket;
+
+    if (sync_strset_contains(set, string))
+        return true;
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        return false;
+    entry->string = strdup(string);
+    if (entry->string == NULL) {
+        free(entry);
+        return false;
+    }
+    bucket = sync_hash_string(string) & (set->nbuckets - 1);
+    entry->next = set->buckets[bucket];
+    set->buckets[bucket] = entry;
+    set->count++;
+    if (set->count > set->nbuckets)
+        strset_grow(set);
+    return true;
+}
+
+
+/*
+ * Remove a string from the set, if present.
+ */
+void
+sync_strset_remove(struct sync_strset *set, const char *string)
+{
+    struct strset_entry **link, *entry;
+    size_t bucket;
+
+    bucket = sync_hash_string(string) & (set->nbuckets - 1);
+    for (link = &set->buckets[bucket]; *link != NULL; link = &entry->next) {
+        entry = *link;
+        if (strcmp(entry->string, string) == 0) {
+            *link = entry->next;
+            free(entry->string);
+            free(entry);
+            set->count--;
+            return;
+        }
+    }
+}
+
+
+/*
+ * Free a string set and all of its strings.
+ */
+void
+sync_strset_free(struct sync_strset *set)
+{
+    struct strset_entry *entry, *next;
+    size_t i;
+
+    if (set == NULL)
+        return;
+    for (i = 0; i < set->nbuckets; i++)
+        for (entry = set->buckets[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry->string);
+            free(entry);
+        }
+    free(set->buckets);
+    free(set);
+}
@@ -50,12 +50,19 @@ typedef struct kadm5_hook {
 
 /*
  * Initialize the plugin.  Calls the pwupdate_init() function and returns the
- * resulting data object.
+ * resulting data object, and then warms up the AD credentials and
+ * connections if ad_warmup is set.
  */
 static krb5_error_code
 init(krb5_context ctx, void **data)
 {
-    return sync_init(ctx, (kadm5_hook_modinfo **) data);
+    krb5_error_code code;
+
+    code = sync_init(ctx, (kadm5_hook_modinfo **) data);
+    if (code != 0)
+        return code;
+    sync_warmup_start(*data, ctx);
+    return 0;
 }
 
 
@@ -96,13 +103,16 @@ chpass(krb5_context ctx, void *data, enum kadm5_hook_stage stage,
  * Handle a principal creation.
  *
  * We only care about synchronizing the password, so we just call the same
- * hooks as we did for a password change.
+ * hooks as we did for a password change, after noting the new principal for
+ * the ad_base_instance checks.
  */
 static krb5_error_code
 create(krb5_context ctx, void *data, enum kadm5_hook_stage stage,
        kadm5_principal_ent_t entry, uint32_t mask UNUSED,
        const char *password)
 {
+    if (stage == KADM5_HOOK_STAGE_POSTCOMMIT)
+        sync_instance_created(data, ctx, entry->principal);
     return chpass(ctx, data, stage, entry->principal, password);
 }
 
@@ -110,9 +120,10 @@ create(krb5_context ctx, void *data, enum kadm5_hook_stage stage,
 /*
  * Handle a principal modification.
  *
- * We only care about changes to the DISALLOW_ALL_TIX flag, and we only
- * support status postcommit.  Check whether that's what's being changed and
- * call the appropriate hook.
+ * We only care about changes to the DISALLOW_ALL_TIX flag.  Check whether
+ * the attributes are being changed, remember the old status in precommit,
+ * and call the appropriate hook postcommit, which does nothing unless the
+ * flag actually changed.
  */
 static krb5_error_code
 modify(krb5_context ctx, void *data, enum kadm5_hook_stage stage,
@@ -120,6 +131,8 @@ modify(krb5_context ctx, void *data, enum kadm5_hook_stage stage,
 {
     bool enabled;
 
+    if (mask & KADM5_ATTRIBUTES && stage == KADM5_HOOK_STAGE_PRECOMMIT)
+        sync_status_precommit(data, ctx, entry->principal);
     if (mask & KADM5_ATTRIBUTES && stage == KADM5_HOOK_STAGE_POSTCOMMIT) {
         enabled = !(entry->attributes & KRB5_KDB_DISALLOW_ALL_TIX);
         return sync_status(data, ctx, entry->principal, enabled);
@@ -3,7 +3,19 @@
  *
  * The functions in this file use the Kerberos kadm5srv library API to look up
  * information about instances of a principal in the local Kerberos KDC
- * database.
+ * database.  The kadm5 handle used for this, and the separate Kerberos
+ * context it uses, are opened on first use and kept in the plugin
+ * configuration for later calls, since opening the KDB is far more expensive
+ * than a single principal lookup.
+ *
+ * For ad_base_instance, which is checked on every password change of a
+ * single-component principal, we also keep a set of the base names that have
+ * that instance.  It is loaded from the KDB on first use and then kept up to
+ * date by the create, remove, and rename hooks, so that the common case of a
+ * principal without that instance needs no KDB read at all.
+ *
+ * The same handle is also used by krb5-sync to list principals and read
+ * their status for bulk synchronization.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2013
@@ -20,25 +32,252 @@
 #include <plugin/internal.h>
 #include <util/macros.h>
 
+/*
+ * Heimdal's kadm5_free_name_list takes a pointer to the count, while MIT's
+ * takes the count itself.  We use the krb5_realm type as a proxy for whether
+ * we're building with Heimdal.
+ */
+#ifdef HAVE_KRB5_REALM
+# define INSTANCE_FREE_NAMES(h, n, c) kadm5_free_name_list((h), (n), &(c))
+#else
+# define INSTANCE_FREE_NAMES(h, n, c) kadm5_free_name_list((h), (n), (c))
+#endif
+
+
+/*
+ * Close the cached kadm5 handle and its Kerberos context, if any.  Safe to
+ * call even if no handle has been opened.
+ */
+void
+sync_instance_close(kadm5_hook_modinfo *config)
+{
+    if (config->kadm_handle != NULL)
+        kadm5_destroy(config->kadm_handle);
+    if (config->kadm_ctx != NULL)
+        krb5_free_context(config->kadm_ctx);
+    free(config->kadm_realm);
+    config->kadm_handle = NULL;
+    config->kadm_ctx = NULL;
+    config->kadm_realm = NULL;
+}
+
+
+/*
+ * Open a kadm5 handle for the local KDB of the given realm and store it in
+ * the plugin configuration, closing any handle for a different realm.  Does
+ * nothing if a handle for that realm is already open.  Errors are reported in
+ * the caller's Kerberos context.  Returns a Kerberos status code.
+ *
+ * We need to use a separate Kerberos context from the one passed in by our
+ * caller.  Otherwise, on MIT Kerberos, we tromp on kadmind's copy of the KDB,
+ * with bad results.
+ */
+static krb5_error_code
+instance_open(kadm5_hook_modinfo *config, krb5_context ctx, const char *realm)
+{
+    krb5_context kadm_ctx = NULL;
+    kadm5_config_params params;
+    void *handle = NULL;
+    krb5_error_code code;
+
+    /* Reuse the existing handle if it's for the right realm. */
+    if (config->kadm_handle != NULL) {
+        if (strcmp(config->kadm_realm, realm) == 0)
+            return 0;
+        sync_instance_close(config);
+    }
+
+    /* Open the local KDB. */
+    code = kadm5_init_krb5_context(&kadm_ctx);
+    if (code != 0)
+        return code;
+    memset(&params, 0, sizeof(params));
+    params.realm = (char *) realm;
+    params.mask = KADM5_CONFIG_REALM;
+    code = kadm5_init_with_skey_ctx(kadm_ctx, (char *) "kadmin/admin", NULL,
+                                    NULL, &params, KADM5_STRUCT_VERSION,
+                                    KADM5_API_VERSION_2, &handle);
+    if (code != 0) {
+        krb5_free_context(kadm_ctx);
+        return code;
+    }
+    config->kadm_realm = strdup(realm);
+    if (config->kadm_realm == NULL) {
+        kadm5_destroy(handle);
+        krb5_free_context(kadm_ctx);
+        return sync_error_system(ctx, "cannot allocate memory");
+    }
+    config->kadm_ctx = kadm_ctx;
+    config->kadm_handle = handle;
+    return 0;
+}
+
+
+/*
+ * Look up a principal using the cached kadm5 handle, opening it if needed.
+ * Sets exists to true if the principal was found.  Returns a Kerberos status
+ * code.
+ */
+static krb5_error_code
+instance_lookup(kadm5_hook_modinfo *config, krb5_context ctx,
+                const char *realm, krb5_principal princ, bool *exists)
+{
+    kadm5_principal_ent_rec ent;
+    int mask;
+    krb5_error_code code;
+
+    code = instance_open(config, ctx, realm);
+    if (code != 0)
+        return code;
+    mask = KADM5_ATTRIBUTES | KADM5_PW_EXPIRATION;
+    code = kadm5_get_principal(config->kadm_handle, princ, &ent, mask);
+    if (code == KADM5_UNK_PRINC)
+        return 0;
+    if (code != 0)
+        return code;
+    *exists = true;
+    kadm5_free_principal_ent(config->kadm_handle, &ent);
+    return 0;
+}
+
+
+/*
+ * Load the set of base names that have ad_base_instance in the given realm
+ * from the KDB, using the cached kadm5 handle.  If this fails, leave the set
+ * unset, which causes sync_instance_exists to look up each principal
+ * directly.
+ */
+static void
+instance_load(kadm5_hook_modinfo *config, krb5_context ctx, const char *realm)
+{
+    char *expr = NULL;
+    char **names = NULL;
+    int count = 0, i;
+    struct sync_strset *set = NULL;
+    krb5_principal princ;
+    const char *name;
+    krb5_error_code code;
+
+    /* Get the list of principals with that instance. */
+    if (instance_open(config, ctx, realm) != 0)
+        return;
+    if (asprintf(&expr, "*/%s@%s", config->ad_base_instance, realm) < 0)
+        return;
+    code = kadm5_get_principals(config->kadm_handle, expr, &names, &count);
+    free(expr);
+    if (code != 0)
+        return;
+
+    /* Build the set of base names from the first component. */
+    set = sync_strset_new();
+    if (set == NULL)
+        goto fail;
+    for (i = 0; i < count; i++) {
+        if (krb5_parse_name(config->kadm_ctx, names[i], &princ) != 0)
+            continue;
+        if (krb5_principal_get_num_comp(config->kadm_ctx, princ) == 2) {
+            name = krb5_principal_get_comp_string(config->kadm_ctx, princ, 0);
+            if (!sync_strset_add(set, name)) {
+                krb5_free_principal(config->kadm_ctx, princ);
+                goto fail;
+            }
+        }
+        krb5_free_principal(config->kadm_ctx, princ);
+    }
+    config->instance_realm = strdup(realm);
+    if (config->instance_realm == NULL)
+        goto fail;
+    config->instance_set = set;
+    INSTANCE_FREE_NAMES(config->kadm_handle, names, count);
+    sync_syslog_debug(config, "krb5-sync: loaded %d principals with %s"
+                      " instance", count, config->ad_base_instance);
+    return;
+
+fail:
+    sync_strset_free(set);
+    INSTANCE_FREE_NAMES(config->kadm_handle, names, count);
+}
+
+
+/*
+ * Update the set of base names with ad_base_instance for a principal that was
+ * created or removed.  Does nothing if the set hasn't been loaded or the
+ * principal doesn't have that instance, and discards the set (falling back on
+ * direct lookups) if memory allocation fails.
+ */
+static void
+instance_update(kadm5_hook_modinfo *config, krb5_context ctx,
+                krb5_principal principal, bool exists)
+{
+    const char *instance, *realm;
+
+    if (config->instance_set == NULL || config->ad_base_instance == NULL)
+        return;
+    if (krb5_principal_get_num_comp(ctx, principal) != 2)
+        return;
+    instance = krb5_principal_get_comp_string(ctx, principal, 1);
+    if (strcmp(instance, config->ad_base_instance) != 0)
+        return;
+    realm = krb5_principal_get_realm(ctx, principal);
+    if (realm == NULL || strcmp(realm, config->instance_realm) != 0)
+        return;
+    if (!exists)
+        sync_strset_remove(config->instance_set,
+                           krb5_principal_get_comp_string(ctx, principal, 0));
+    else if (!sync_strset_add(config->instance_set,
+                              krb5_principal_get_comp_string(ctx, principal,
+                                                             0))) {
+        sync_strset_free(config->instance_set);
+        free(config->instance_realm);
+        config->instance_set = NULL;
+        config->instance_realm = NULL;
+    }
+}
+
+
+/*
+ * Called when a principal has been created or removed, to keep the set of
+ * base names with ad_base_instance up to date.
+ */
+void
+sync_instance_created(kadm5_hook_modinfo *config, krb5_context ctx,
+                      krb5_principal principal)
+{
+    instance_update(config, ctx, principal, true);
+}
+
+void
+sync_instance_removed(kadm5_hook_modinfo *config, krb5_context ctx,
+                      krb5_principal principal)
+{
+    instance_update(config, ctx, principal, false);
+}
+
 
 /*
  * Given a principal and an instance, return true if the principal is a
  * one-part name and the principal formed by adding the instance as a second
  * part is found in the local Kerberos database.  Returns false if it is not
  * or on any other error.
+ *
+ * If the lookup fails with the cached kadm5 handle, the handle may have gone
+ * stale, so close it and retry once with a newly opened handle.
+ *
+ * For ad_base_instance, consult the set of base names first.  A principal
+ * not in the set can't have the instance.  A principal in the set is still
+ * checked against the KDB, since principals may have been removed without
+ * our knowledge (Heimdal has no remove hook), and dropped from the set if
+ * the instance is gone.
  */
 krb5_error_code
-sync_instance_exists(krb5_context ctx, krb5_principal base,
-                     const char *instance, bool *exists)
+sync_instance_exists(kadm5_hook_modinfo *config, krb5_context ctx,
+                     krb5_principal base, const char *instance, bool *exists)
 {
     krb5_principal princ = NULL;
     krb5_error_code code;
-    const char *realm;
-    krb5_context kadm_ctx = NULL;
-    kadm5_config_params params;
-    void *handle = NULL;
-    int mask;
-    kadm5_principal_ent_rec ent;
+    const char *realm, *name;
+    struct timeval start;
+    bool cached, use_set;
 
     /* Default to assuming the principal doesn't exist. */
     *exists = false;
@@ -46,54 +285,119 @@ sync_instance_exists(krb5_context ctx, krb5_principal base,
     /* Principals must have exactly one component. */
     if (krb5_principal_get_num_comp(ctx, base) != 1)
         return 0;
-    
-    /* Form a new principal from the old principal plus the instance. */
+
+    /* Get the realm, in which we'll look for the new principal. */
     realm = krb5_principal_get_realm(ctx, base);
     if (realm == NULL) {
         code = KADM5_BAD_PRINCIPAL;
         krb5_set_error_message(ctx, code, "cannot get realm of principal");
-        goto fail;
+        return code;
+    }
+
+    /* Check the set of base names with ad_base_instance, if we can. */
+    name = krb5_principal_get_comp_string(ctx, base, 0);
+    use_set = (config->ad_base_instance != NULL
+               && strcmp(instance, config->ad_base_instance) == 0);
+    if (use_set) {
+        if (config->instance_set == NULL)
+            instance_load(config, ctx, realm);
+        if (config->instance_set == NULL)
+            use_set = false;
+        else if (strcmp(config->instance_realm, realm) != 0)
+            use_set = false;
+        else if (!sync_strset_contains(config->instance_set, name))
+            return 0;
     }
-    code = krb5_build_principal(ctx, &princ, strlen(realm), realm,
-                                krb5_principal_get_comp_string(ctx, base, 0),
+
+    /* Form a new principal from the old principal plus the instance. */
+    code = krb5_build_principal(ctx, &princ, strlen(realm), realm, name,
                                 instance, (char *) 0);
     if (code != 0)
-        goto fail;
+        return code;
 
-    /*
-     * Open the local KDB and look up this new principal.  We need to use a
-     * separate Kerberos context from the one passed in by our caller.
-     * Otherwise, on MIT Kerberos, we tromp on kadmind's copy of the KDB,
-     * with bad results.
-     */
-    code = kadm5_init_krb5_context(&kadm_ctx);
-    if (code != 0)
-        goto fail;
-    memset(&params, 0, sizeof(params));
-    params.realm = (char *) realm;
-    params.mask = KADM5_CONFIG_REALM;
-    code = kadm5_init_with_skey_ctx(kadm_ctx, (char *) "kadmin/admin", NULL,
-                                    NULL, &params, KADM5_STRUCT_VERSION,
-                                    KADM5_API_VERSION_2, &handle);
-    if (code != 0)
-        goto fail;
-    mask = KADM5_ATTRIBUTES | KADM5_PW_EXPIRATION;
-    code = kadm5_get_principal(handle, princ, &ent, mask);
-    if (code != 0 && code != KADM5_UNK_PRINC)
-        goto fail;
-    if (code == 0) {
-        *exists = true;
-        kadm5_free_principal_ent(handle, &ent);
+    /* Look up the new principal, retrying once on a new handle. */
+    cached = (config->kadm_handle != NULL);
+    sync_stats_start(config, &start);
+    code = instance_lookup(config, ctx, realm, princ, exists);
+    if (code != 0 && cached) {
+        sync_instance_close(config);
+        code = instance_lookup(config, ctx, realm, princ, exists);
     }
-    kadm5_destroy(handle);
-    krb5_free_context(kadm_ctx);
+    sync_stats_record(config, SYNC_STATS_INSTANCE, &start, code);
+    if (code != 0)
+        sync_instance_close(config);
+    else if (use_set && !*exists)
+        sync_strset_remove(config->instance_set, name);
     krb5_free_principal(ctx, princ);
-    return 0;
+    return code;
+}
 
-fail:
-    if (kadm_ctx != NULL)
-        krb5_free_context(kadm_ctx);
-    if (princ != NULL)
-        krb5_free_principal(ctx, princ);
+
+/*
+ * List the principals in the local KDB of the given realm that match a glob
+ * pattern, as understood by kadm5_get_principals, storing their names in a
+ * newly allocated vector.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_instance_list(kadm5_hook_modinfo *config, krb5_context ctx,
+                   const char *realm, const char *pattern,
+                   struct vector **principals)
+{
+    char **names = NULL;
+    int count = 0, i;
+    krb5_error_code code;
+
+    *principals = NULL;
+    code = instance_open(config, ctx, realm);
+    if (code != 0)
+        return code;
+    code = kadm5_get_principals(config->kadm_handle, (char *) pattern,
+                                &names, &count);
+    if (code != 0)
+        return code;
+    *principals = sync_vector_new();
+    if (*principals == NULL)
+        code = sync_error_system(ctx, "cannot allocate memory");
+    for (i = 0; code == 0 && i < count; i++)
+        if (!sync_vector_add(*principals, names[i]))
+            code = sync_error_system(ctx, "cannot allocate memory");
+    INSTANCE_FREE_NAMES(config->kadm_handle, names, count);
+    if (code != 0) {
+        sync_vector_free(*principals);
+        *principals = NULL;
+    }
     return code;
 }
+
+
+/*
+ * Look up a principal in the local KDB of its realm and set disabled to
+ * whether it has DISALLOW_ALL_TIX set, which is what the plugin pushes to
+ * Active Directory as the account status.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_instance_disabled(kadm5_hook_modinfo *config, krb5_context ctx,
+                       krb5_principal principal, bool *disabled)
+{
+    kadm5_principal_ent_rec ent;
+    const char *realm;
+    krb5_error_code code;
+
+    *disabled = false;
+    realm = krb5_principal_get_realm(ctx, principal);
+    if (realm == NULL) {
+        code = KADM5_BAD_PRINCIPAL;
+        krb5_set_error_message(ctx, code, "cannot get realm of principal");
+        return code;
+    }
+    code = instance_open(config, ctx, realm);
+    if (code != 0)
+        return code;
+    code = kadm5_get_principal(config->kadm_handle, principal, &ent,
+                               KADM5_PRINCIPAL | KADM5_ATTRIBUTES);
+    if (code != 0)
+        return code;
+    *disabled = (ent.attributes & KRB5_KDB_DISALLOW_ALL_TIX) != 0;
+    kadm5_free_principal_ent(config->kadm_handle, &ent);
+    return 0;
+}
@@ -18,12 +18,92 @@
 #include <portable/macros.h>
 #include <portable/stdbool.h>
 
+#include <ldap.h>
+#include <sys/time.h>
+#include <time.h>
+
 #ifdef HAVE_KRB5_KADM5_HOOK_PLUGIN
 # include <krb5/kadm5_hook_plugin.h>
 #else
 typedef struct kadm5_hook_modinfo_st kadm5_hook_modinfo;
 #endif
 
+/* Forward declarations of types used only in pointers. */
+struct sync_accounts;
+struct sync_appdefaults;
+struct sync_batch;
+struct sync_capture;
+struct sync_dncache;
+struct sync_journal;
+struct sync_lease;
+struct sync_ldap_pool;
+struct sync_limits;
+struct sync_log;
+struct sync_mapping;
+struct sync_queue_cache;
+struct sync_reload;
+struct sync_request_block;
+struct sync_servers;
+struct sync_shared;
+struct sync_stats;
+struct sync_strset;
+struct sync_warmup;
+struct sync_worker;
+
+/*
+ * The memory cache name used to store credentials for AD, and the name of
+ * the file cache in queue_dir used instead if shared_state is set.
+ */
+#define SYNC_CACHE_NAME "MEMORY:krb5_sync"
+#define SYNC_CACHE_FILE ".krb5cc"
+
+/* Size of the buffer for temporary strings kept in each request. */
+#define SYNC_REQUEST_BUFFER 1024
+
+/* Size of the request ID of a change traced for sync lag, with the nul. */
+#define SYNC_REQUEST_TRACE 48
+
+/*
+ * The stages of a change that are timed if stats_file is set.  The whole
+ * password and status changes come first, followed by the steps within them
+ * and then by the sync lag of changes traced with sync_request_trace, from
+ * the call of the hook to the change being made in Active Directory.
+ */
+enum sync_stats_stage {
+    SYNC_STATS_CHPASS,
+    SYNC_STATS_STATUS,
+    SYNC_STATS_CREDS,
+    SYNC_STATS_KPASSWD,
+    SYNC_STATS_LDAP_BIND,
+    SYNC_STATS_LDAP_SEARCH,
+    SYNC_STATS_LDAP_MODIFY,
+    SYNC_STATS_INSTANCE,
+    SYNC_STATS_QUEUE_LOCK,
+    SYNC_STATS_QUEUE_WRITE,
+    SYNC_STATS_LAG_DIRECT,      /* Hook entry to AD, made directly. */
+    SYNC_STATS_LAG_QUEUED,      /* Hook entry to AD, made from the queue. */
+    SYNC_STATS_STAGES           /* Number of stages, not a stage. */
+};
+
+/*
+ * The counts kept for each stage if stats_file is set.  buckets holds the
+ * number of times in each histogram bucket, not cumulative, where bucket i
+ * counts times of at most 2^i milliseconds not counted by an earlier bucket,
+ * and usec is the sum of all the times in microseconds.  All members have
+ * the same type so that they can be updated atomically in shared memory.
+ * The steps of a change only use the first SYNC_STATS_STEP_BUCKETS buckets,
+ * up to about half a minute, while the sync lag of a queued change may be
+ * hours.
+ */
+#define SYNC_STATS_BUCKETS      24
+#define SYNC_STATS_STEP_BUCKETS 16
+struct sync_stats_counts {
+    unsigned long long buckets[SYNC_STATS_BUCKETS];
+    unsigned long long success;
+    unsigned long long failure;
+    unsigned long long usec;
+};
+
 /* Used to store a list of strings, managed by the sync_vector_* functions. */
 struct vector {
     size_t count;
@@ -31,6 +111,88 @@ struct vector {
     char **strings;
 };
 
+/*
+ * A held queue lock, managed by sync_queue_lock and sync_queue_unlock.  global
+ * is the shared lock on queue_dir/.lock, and fd is the exclusive lock on the
+ * per-id lock file at path.  Unheld locks have both file descriptors set to
+ * -1.
+ */
+struct sync_queue_lock {
+    int global;
+    int fd;
+    char *path;
+};
+
+/*
+ * The kinds of Active Directory operations whose concurrency is adapted if
+ * ad_adaptive_concurrency is set, and an operation of one of them in flight,
+ * managed by sync_limit_start and sync_limit_finish.  epoch is the count of
+ * decreases of the window when it started.
+ */
+enum sync_limit_kind {
+    SYNC_LIMIT_KPASSWD,
+    SYNC_LIMIT_LDAP,
+    SYNC_LIMIT_MAX
+};
+struct sync_limit_op {
+    unsigned long epoch;
+    struct timeval start;
+};
+
+/*
+ * The contents of a queue file, read by sync_queue_read_record.  data holds
+ * the whole file with each newline replaced by a nul, and the other fields
+ * point into it.  password is NULL unless the operation is password, and
+ * trace is the trace line written by sync_queue_write or NULL.  data is
+ * cleared when the record is freed with sync_queue_record_free.
+ */
+struct sync_queue_record {
+    char *data;
+    size_t size;
+    const char *user;
+    const char *domain;
+    const char *operation;
+    const char *password;
+    const char *trace;
+};
+
+/*
+ * A password or status change being handled, for the principal that it
+ * changes.  The next fields hold forms of that principal, which are computed
+ * when first needed by the sync_request_* functions and then reused for the
+ * rest of the change.
+ *
+ * domain is the name of the target of ad_targets the change is for, which is
+ * used in its queue file names, or NULL for the single Active Directory of a
+ * configuration without targets, which uses "ad".
+ *
+ * The temporary strings needed while handling the change are made with
+ * sync_request_printf.  They are put in buffer while it has room and in
+ * separately allocated blocks after that, and all of them are cleared and
+ * released together when the request is freed.
+ *
+ * trace is the request ID of a change traced for sync lag, or empty if it
+ * isn't traced, and the times are when the hook was called, when the change
+ * was queued, and when a queued change was picked up to be made, with zero
+ * for the times that don't apply.
+ */
+struct sync_request {
+    krb5_principal principal;
+    char *name;                 /* Unparsed principal. */
+    char *user;                 /* Unparsed principal without the realm. */
+    char *queue_user;           /* user with slashes changed to periods. */
+    krb5_principal ad_principal;
+    char *ad_name;              /* Unparsed ad_principal. */
+    const char *domain;         /* Target name, or NULL for "ad". */
+    size_t used;                /* Bytes of buffer in use. */
+    struct sync_request_block *blocks;
+    char trace[SYNC_REQUEST_TRACE];
+    struct timeval entered;
+    struct timeval queued;
+    struct timeval picked;
+    char buffer[SYNC_REQUEST_BUFFER];
+};
+
 /*
  * Local configuration information for the module.  This contains all the
  * parameters that are read from the krb5-sync sub-section of the appdefaults
@@ -41,16 +203,166 @@ struct vector {
  * at least the MIT plugin.
  */
 struct kadm5_hook_modinfo_st {
+    char *ad_account_list;
+    bool ad_adaptive_concurrency;
+    long ad_adaptive_slow;
     char *ad_admin_server;
+    bool ad_async;
     char *ad_base_instance;
+    long ad_breaker_cooldown;
+    long ad_breaker_slow;
+    long ad_breaker_threshold;
+    long ad_dn_cache_missing;
+    bool ad_dn_cache_persist;
+    long ad_dn_cache_size;
+    long ad_dn_cache_status;
     struct vector *ad_instances;
     char *ad_keytab;
+    long ad_kpasswd_concurrency;
     char *ad_ldap_base;
+    long ad_ldap_connections;
+    char *ad_ldap_filter_attribute;
+    struct vector *ad_ldap_instance_bases;
+    struct vector *ad_ldap_servers;
+    long ad_ldap_timeout;
+    bool ad_ldaps;
+    struct vector *ad_mapping_rules;
+    char *ad_password_method;
     char *ad_principal;
     bool ad_queue_only;
     char *ad_realm;
+    long ad_status_depth;
+    long ad_status_window;
+    struct vector *ad_targets;
+    long ad_timeout;
+    bool ad_warmup;
+    char *capture_file;
+    bool config_reload;
+    long queue_backoff;
+    bool queue_coalesce;
     char *queue_dir;
+    char *queue_format;
+    char *queue_full_policy;
+    bool queue_group_commit;
+    long queue_hard_bytes;
+    long queue_hard_limit;
+    long queue_lease_partitions;
+    long queue_lease_time;
+    struct vector *queue_priority;
+    long queue_shards;
+    long queue_soft_bytes;
+    long queue_soft_limit;
+    long queue_workers;
+    bool shared_state;
+    char *stats_file;
     bool syslog;
+    long syslog_limit;
+
+    /*
+     * Values derived from the configuration by sync_config_read so that
+     * changes don't have to compute them again.  ad_client is ad_principal
+     * parsed, ad_kt is the resolved ad_keytab, ad_realm_length is the
+     * length of ad_realm, and ad_ldap_uris holds the LDAP URIs of the
+     * servers, in the same order as sync_server_name.  ad_ccache_name is the
+     * credential cache used for the AD credentials, which is in queue_dir
+     * if shared_state is set.
+     *
+     * If ad_targets is set, targets holds a configuration for each target,
+     * read from its own section of krb5.conf, and is used for everything
+     * done in Active Directory.  In those, target is the name of the target
+     * and parent is the configuration they belong to.
+     */
+    krb5_principal ad_client;
+    krb5_keytab ad_kt;
+    size_t ad_realm_length;
+    struct vector *ad_ldap_uris;
+    char *ad_ccache_name;
+    kadm5_hook_modinfo **targets;
+    size_t target_count;
+    char *target;
+    kadm5_hook_modinfo *parent;
+
+    /*
+     * Runtime state, not configuration.  ad_creds_expires is the end time of
+     * the AD credentials in the memory cache, or 0 if there are no usable
+     * cached credentials, and ad_creds_stored is true once this
+     * configuration has stored credentials in its memory cache, which then
+     * has to be destroyed even if they are no longer usable.  ad_failures
+     * is the number of consecutive changes that failed in Active Directory,
+     * and ad_breaker_until is the end of the cooldown period once that
+     * reaches ad_breaker_threshold.
+     * ad_deadline is the time by which the change in progress in Active
+     * Directory has to finish, or has a tv_sec of 0 if there is none.
+     * ldap_pool holds bound LDAP connections to Active Directory and is
+     * created on first use.  dn_cache maps AD principals to their DNs in
+     * Active Directory.  kadm_handle is a kadm5 handle for the local KDB of
+     * kadm_realm, using its own Kerberos context kadm_ctx, and is opened on
+     * first use by sync_instance_exists.
+     * instance_set holds the base names that have ad_base_instance in
+     * instance_realm, and is loaded on first use.  allowed_instances holds
+     * ad_base_instance, ad_instances, and the instances of ad_mapping_rules
+     * and is built by sync_init, which also compiles ad_mapping_rules into
+     * mapping.  accounts is the mapped ad_account_list file, mapped on first
+     * use.  worker is the background thread that processes the queue if
+     * ad_async is set.  journal is the index of the queue journal, which is
+     * only created if queue_format is set to journal.  queue_cache holds the
+     * contents of the queue directories as last read by sync_queue_conflict.
+     * servers tracks the health of the Active Directory servers and is created
+     * on first use.  reload holds the krb5.conf files watched for changes if
+     * config_reload is set.  stats holds the latency histograms and outcome
+     * counts written to stats_file, if that is set.  shared is the mapping of
+     * the state shared between processes if shared_state is set, in which case
+     * the credential expiration, circuit breaker state, DN cache, and stats
+     * counts there are used instead (see the sync_shared_* functions).  log
+     * holds the token buckets used to rate-limit syslog messages if
+     * syslog_limit is set.  warmup is the background thread that keeps the AD
+     * credentials and pooled connections fresh if ad_warmup is set.  batch
+     * holds the pending status changes and the thread that makes them if
+     * ad_status_window is set, and is created on first use.  queue_cursor, if
+     * not NULL, is set by a caller of sync_queue_process that processes the
+     * queue in bounded runs: changes are made starting after the queue file
+     * with that name and wrapping around, and it is updated to the name of the
+     * last change reached.  capture is the open capture_file and is created on
+     * first use.  lease holds the leases on partitions of the queue held by
+     * this node if queue_lease_partitions is set, and exists only while the
+     * queue is being processed.  limits holds the adaptive windows of
+     * operations in flight if ad_adaptive_concurrency is set, and is created
+     * on first use.  status_principal, if not NULL, is the principal whose
+     * attributes are being modified, and status_disabled whether it was
+     * disabled before the modification, as recorded by
+     * sync_status_precommit.
+     */
+    time_t ad_creds_expires;
+    bool ad_creds_stored;
+    unsigned long ad_failures;
+    time_t ad_breaker_until;
+    struct timeval ad_deadline;
+    struct sync_dncache *dn_cache;
+    struct sync_ldap_pool *ldap_pool;
+    krb5_context kadm_ctx;
+    void *kadm_handle;
+    char *kadm_realm;
+    struct sync_strset *instance_set;
+    char *instance_realm;
+    struct sync_strset *allowed_instances;
+    struct sync_mapping *mapping;
+    struct sync_accounts *accounts;
+    struct sync_worker *worker;
+    struct sync_journal *journal;
+    struct sync_queue_cache *queue_cache;
+    struct sync_servers *servers;
+    struct sync_reload *reload;
+    struct sync_stats *stats;
+    struct sync_shared *shared;
+    struct sync_log *log;
+    struct sync_warmup *warmup;
+    struct sync_batch *batch;
+    char *queue_cursor;
+    struct sync_capture *capture;
+    struct sync_lease *lease;
+    struct sync_limits *limits;
+    krb5_principal status_principal;
+    bool status_disabled;
 };
 
 BEGIN_DECLS
@@ -61,6 +373,9 @@ BEGIN_DECLS
 /* Initialize the plugin and set up configuration. */
 krb5_error_code sync_init(krb5_context, kadm5_hook_modinfo **);
 
+/* Read the configuration without setting up anything else. */
+krb5_error_code sync_config_read(krb5_context, kadm5_hook_modinfo **);
+
 /* Free the internal plugin state. */
 void sync_close(krb5_context, kadm5_hook_modinfo *);
 
@@ -68,37 +383,580 @@ void sync_close(krb5_context, kadm5_hook_modinfo *);
 krb5_error_code sync_chpass(kadm5_hook_modinfo *, krb5_context,
                             krb5_principal, const char *password);
 
-/* Handle an account status change. */
+/*
+ * Handle an account status change.  sync_status_precommit records the status
+ * before a modification so that sync_status can skip unchanged statuses.
+ */
+void sync_status_precommit(kadm5_hook_modinfo *, krb5_context,
+                           krb5_principal);
 krb5_error_code sync_status(kadm5_hook_modinfo *, krb5_context,
                             krb5_principal, bool enabled);
 
-/* Password changing in Active Directory. */
+/*
+ * Handle a principal deletion or rename by dropping its queued and pending
+ * changes or moving them to the new name.
+ */
+krb5_error_code sync_remove(kadm5_hook_modinfo *, krb5_context,
+                            krb5_principal);
+krb5_error_code sync_rename(kadm5_hook_modinfo *, krb5_context,
+                            krb5_principal, krb5_principal renamed);
+
+/*
+ * Set allowed to whether changes to the principal of the request are
+ * synchronized to Active Directory, given whether the change is a password
+ * change.
+ */
+krb5_error_code sync_principal_allowed(kadm5_hook_modinfo *, krb5_context,
+                                       struct sync_request *, bool pwchange,
+                                       bool *allowed);
+
+/*
+ * Report the result of a change tried in Active Directory, which started at
+ * the given time, to the circuit breaker of its target.
+ */
+void sync_breaker_report(kadm5_hook_modinfo *, krb5_error_code,
+                         const struct timeval *start);
+
+/*
+ * Return the configuration used for changes in the given target, which is
+ * one of ad_targets or, if that isn't set, "ad" for the only Active
+ * Directory.  Returns NULL if there is no such target.
+ */
+kadm5_hook_modinfo *sync_target_find(kadm5_hook_modinfo *,
+                                     const char *name);
+
+/*
+ * Set up and free a request for a change to a principal, and get forms of its
+ * principal, computing them the first time they're needed.  The principal
+ * must remain valid until the request is freed.
+ */
+void sync_request_init(struct sync_request *, krb5_principal);
+krb5_error_code sync_request_name(krb5_context, struct sync_request *,
+                                  const char **name);
+krb5_error_code sync_request_user(krb5_context, struct sync_request *,
+                                  const char **user);
+krb5_error_code sync_request_queue_user(krb5_context, struct sync_request *,
+                                        const char **user);
+krb5_error_code sync_request_ad_principal(kadm5_hook_modinfo *, krb5_context,
+                                          struct sync_request *,
+                                          krb5_principal *,
+                                          const char **name);
+void sync_request_free(krb5_context, struct sync_request *);
+
+/*
+ * Trace a change for sync lag.  sync_request_trace gives the request a new
+ * request ID and stores the current time as the time the hook was called,
+ * or copies both from another request if from isn't NULL.
+ * sync_request_trace_line returns the trace line for the queue file of the
+ * change, stamped as queued now, or NULL if the change isn't traced or on
+ * failure to allocate memory.  sync_request_trace_read restores the trace
+ * from such a line, stamping the change as picked up now, and ignores lines
+ * it can't parse.  sync_request_lag, called once the change has been made
+ * in Active Directory, logs its lag record and counts its sync lag in the
+ * stats, and does nothing for changes that aren't traced.
+ */
+void sync_request_trace(struct sync_request *,
+                        const struct sync_request *from);
+const char *sync_request_trace_line(struct sync_request *);
+void sync_request_trace_read(struct sync_request *, const char *line);
+void sync_request_lag(kadm5_hook_modinfo *, krb5_context,
+                      struct sync_request *);
+
+/*
+ * Format a temporary string that lasts until the request is freed.  Returns
+ * NULL on failure.
+ */
+char *sync_request_printf(struct sync_request *, const char *format, ...)
+    __attribute__((__nonnull__, __format__(printf, 2, 3)));
+
+/*
+ * Clear memory that may hold a password in a way that the compiler won't
+ * optimize away.
+ */
+void sync_wipe(void *, size_t);
+
+/*
+ * Password changing in Active Directory.  sync_ad_chpass uses kpasswd unless
+ * ad_password_method is set to ldap, in which case it calls
+ * sync_ad_chpass_ldap, which sets unicodePwd over a pooled LDAP connection.
+ * sync_ad_password_ldap returns true if passwords are set over LDAP.
+ */
 krb5_error_code sync_ad_chpass(kadm5_hook_modinfo *, krb5_context,
-                               krb5_principal, const char *password);
+                               struct sync_request *, const char *password);
+krb5_error_code sync_ad_chpass_ldap(kadm5_hook_modinfo *, krb5_context,
+                                    struct sync_request *,
+                                    const char *password);
+bool sync_ad_password_ldap(kadm5_hook_modinfo *);
 
 /* Account status update in Active Directory. */
 krb5_error_code sync_ad_status(kadm5_hook_modinfo *, krb5_context,
-                               krb5_principal, bool enabled);
+                               struct sync_request *, bool enabled);
+
+/*
+ * Change the status of many accounts in Active Directory with pipelined LDAP
+ * operations on one connection.  The report function is called with the data
+ * pointer, the index of each change, and its result as each one finishes.
+ */
+struct sync_ad_change {
+    struct sync_request *request;
+    bool enabled;
+};
+typedef void (*sync_ad_report_func)(void *, size_t, krb5_error_code);
+krb5_error_code sync_ad_status_batch(kadm5_hook_modinfo *, krb5_context,
+                                     struct sync_ad_change *, size_t count,
+                                     sync_ad_report_func, void *data);
+
+/*
+ * Change the passwords of many accounts in Active Directory with up to
+ * ad_kpasswd_concurrency kpasswd exchanges in flight at once, each in its
+ * own thread, or one at a time over LDAP if passwords are set over LDAP.
+ * Changes for the same account are made in order, and results are reported
+ * as for sync_ad_status_batch.
+ */
+struct sync_ad_password {
+    struct sync_request *request;
+    const char *password;
+};
+krb5_error_code sync_ad_chpass_batch(kadm5_hook_modinfo *, krb5_context,
+                                     struct sync_ad_password *, size_t count,
+                                     sync_ad_report_func, void *data);
+
+/*
+ * List the accounts in Active Directory under ad_ldap_base with a paged
+ * search, calling the function with the data pointer, the userPrincipalName
+ * of the account, and whether it is enabled.  If incremental is true, only
+ * accounts changed since the last listing from the same domain controller
+ * are listed if possible, and incremental is set to whether that was done.
+ */
+typedef void (*sync_ad_account_func)(void *, const char *upn, bool enabled);
+krb5_error_code sync_ad_accounts(kadm5_hook_modinfo *, krb5_context,
+                                 bool *incremental, sync_ad_account_func,
+                                 void *data);
+
+/*
+ * Check the deadline of the change in progress in Active Directory and store
+ * the time allowed for the next call, capped at limit seconds if positive.
+ */
+krb5_error_code sync_ad_deadline(kadm5_hook_modinfo *, krb5_context,
+                                 long limit, struct timeval *left);
+
+/*
+ * Obtain a memory credential cache with credentials for Active Directory,
+ * reusing cached credentials if they're still valid.  The cache should be
+ * closed, not destroyed, by the caller.  sync_ad_creds_refresh obtains new
+ * credentials if the cached ones expire within margin seconds.
+ * sync_ad_creds_reset discards any cached credentials, leaving them usable
+ * by other threads until they are replaced, sync_ad_creds_close destroys
+ * the memory cache at shutdown, and sync_ad_creds_error returns true if an
+ * error code indicates that our credentials were rejected and new ones may
+ * help.
+ */
+krb5_error_code sync_ad_creds(kadm5_hook_modinfo *, krb5_context,
+                              krb5_ccache *);
+krb5_error_code sync_ad_creds_refresh(kadm5_hook_modinfo *, krb5_context,
+                                      time_t margin);
+void sync_ad_creds_reset(kadm5_hook_modinfo *, krb5_context);
+void sync_ad_creds_close(kadm5_hook_modinfo *, krb5_context);
+bool sync_ad_creds_error(krb5_error_code);
+
+/*
+ * Get a bound LDAP connection to Active Directory from the connection pool
+ * and return it to the pool when done, setting broken if the connection
+ * should be discarded.  sync_ldap_limit sets the timeouts of a connection for
+ * the next call on it from ad_ldap_timeout and the deadline of the change in
+ * progress.  sync_ldap_down returns true if an LDAP result code indicates the
+ * connection was lost.  sync_ldap_keepalive keeps idle pooled connections
+ * from being dropped by the server, and sync_ldap_close closes all pooled
+ * connections.
+ */
+krb5_error_code sync_ldap_get(kadm5_hook_modinfo *, krb5_context, LDAP **);
+void sync_ldap_release(kadm5_hook_modinfo *, LDAP *, bool broken);
+krb5_error_code sync_ldap_limit(kadm5_hook_modinfo *, krb5_context, LDAP *);
+bool sync_ldap_down(int);
+void sync_ldap_keepalive(kadm5_hook_modinfo *);
+void sync_ldap_close(kadm5_hook_modinfo *);
+
+/*
+ * Track the health of the Active Directory servers.  sync_server_pick stores
+ * the index of the best LDAP server for a new connection, setting found to
+ * false if all of them failed recently, and sync_server_name returns the name
+ * of the server with that index.  sync_server_report records the result of a
+ * connection to a server and, on success, how long it took.
+ * sync_kpasswd_check returns an error if password changes couldn't reach
+ * Active Directory recently, and sync_kpasswd_report records the result of a
+ * password change.  sync_server_close frees the state.
+ */
+krb5_error_code sync_server_pick(kadm5_hook_modinfo *, krb5_context,
+                                 size_t *index, bool *found);
+const char *sync_server_name(kadm5_hook_modinfo *, size_t index);
+void sync_server_report(kadm5_hook_modinfo *, size_t index, bool success,
+                        unsigned long msec);
+krb5_error_code sync_kpasswd_check(kadm5_hook_modinfo *, krb5_context);
+void sync_kpasswd_report(kadm5_hook_modinfo *, krb5_error_code);
+void sync_server_close(kadm5_hook_modinfo *);
+
+/*
+ * Reload the configuration when krb5.conf changes.  sync_reload_init starts
+ * watching the krb5.conf files, sync_reload_check reads the configuration
+ * again and switches to it if any of them have changed, and
+ * sync_reload_close stops watching.
+ */
+krb5_error_code sync_reload_init(kadm5_hook_modinfo *, krb5_context);
+void sync_reload_check(kadm5_hook_modinfo *, krb5_context);
+void sync_reload_close(kadm5_hook_modinfo *);
+
+/*
+ * Capture hook events for replay if capture_file is set.  sync_capture_event
+ * appends a change, given its request and operation, to capture_file, and
+ * does nothing if that isn't set.  sync_capture_close closes the file.
+ */
+void sync_capture_event(kadm5_hook_modinfo *, krb5_context,
+                        struct sync_request *, const char *operation);
+void sync_capture_close(kadm5_hook_modinfo *);
+
+/*
+ * Time the stages of changes for stats_file.  sync_stats_start stores the
+ * start time of a stage, and sync_stats_record counts its result when it
+ * finishes, writing stats_file from time to time.  Both do nothing if
+ * stats_file isn't set.  sync_stats_write writes stats_file immediately, and
+ * sync_stats_close writes it and frees the counts.  sync_stats_new returns
+ * NULL on failure.
+ */
+struct sync_stats *sync_stats_new(void)
+    __attribute__((__malloc__));
+void sync_stats_start(kadm5_hook_modinfo *, struct timeval *);
+void sync_stats_record(kadm5_hook_modinfo *, enum sync_stats_stage,
+                       const struct timeval *start, krb5_error_code);
+void sync_stats_write(kadm5_hook_modinfo *);
+void sync_stats_close(kadm5_hook_modinfo *);
+
+/*
+ * State shared between processes in a mapped file in queue_dir if
+ * shared_state is set.  sync_shared_open maps the file, creating it if
+ * needed, and sync_shared_close unmaps it.  The creds_expires, failures, and
+ * breaker_until functions return the location of that runtime state, which
+ * is in the configuration if shared_state isn't set, and it should be
+ * accessed with atomic operations.  sync_shared_stats returns NULL if
+ * shared_state isn't set.  The DN cache functions may only be called with
+ * shared_state set; sync_shared_dn_lookup returns a copy of the DN freed
+ * with the request, sync_shared_dn_missing returns when the principal was
+ * found to be missing or 0, and sync_shared_dn_store removes the entry if dn
+ * is NULL and records the principal as missing if dn is empty.
+ */
+krb5_error_code sync_shared_open(kadm5_hook_modinfo *, krb5_context);
+void sync_shared_close(kadm5_hook_modinfo *);
+time_t *sync_shared_creds_expires(kadm5_hook_modinfo *);
+unsigned long *sync_shared_failures(kadm5_hook_modinfo *);
+time_t *sync_shared_breaker_until(kadm5_hook_modinfo *);
+struct sync_stats_counts *sync_shared_stats(kadm5_hook_modinfo *,
+                                           time_t **next_write);
+const char *sync_shared_dn_lookup(kadm5_hook_modinfo *,
+                                  struct sync_request *,
+                                  const char *principal);
+time_t sync_shared_dn_missing(kadm5_hook_modinfo *, const char *principal);
+void sync_shared_dn_store(kadm5_hook_modinfo *, const char *principal,
+                          const char *dn);
+
+/*
+ * Cache of DNs of accounts in Active Directory, keyed by AD principal.
+ * sync_dncache_lookup returns NULL if there is no cached DN, and otherwise a
+ * copy of it that is freed with the request.  All of these may be called
+ * from several threads at once.
+ * sync_dncache_free saves the cache if it's persistent and frees it.
+ * sync_dncache_status returns true if the account is known to have had the
+ * given status within ad_dn_cache_status seconds, and sync_dncache_set_status
+ * remembers the status of an account with a cached DN, or forgets it if
+ * known is false.  sync_dncache_missing returns true if no account was found
+ * for the principal within ad_dn_cache_missing seconds, and
+ * sync_dncache_set_missing remembers that, or forgets it if missing is
+ * false.
+ */
+const char *sync_dncache_lookup(kadm5_hook_modinfo *, struct sync_request *,
+                                const char *principal);
+void sync_dncache_store(kadm5_hook_modinfo *, const char *principal,
+                        const char *dn);
+void sync_dncache_remove(kadm5_hook_modinfo *, const char *principal);
+bool sync_dncache_status(kadm5_hook_modinfo *, const char *principal,
+                         bool enabled);
+void sync_dncache_set_status(kadm5_hook_modinfo *, const char *principal,
+                             bool known, bool enabled);
+bool sync_dncache_missing(kadm5_hook_modinfo *, const char *principal);
+void sync_dncache_set_missing(kadm5_hook_modinfo *, const char *principal,
+                              bool missing);
+void sync_dncache_free(kadm5_hook_modinfo *);
+
+/*
+ * Look up a principal, without its realm, in the list of accounts to
+ * synchronize from ad_account_list.  sync_accounts_close unmaps the list.
+ */
+krb5_error_code sync_accounts_check(kadm5_hook_modinfo *, krb5_context,
+                                    const char *name, bool *found);
+void sync_accounts_close(kadm5_hook_modinfo *);
+
+/*
+ * Map principals with an instance to Active Directory using the rules of
+ * ad_mapping_rules.  sync_mapping_compile compiles the rules into the
+ * mapping table of the configuration when it is loaded.  The others apply
+ * the rule for the principal of a request, if there is one:
+ * sync_mapping_principal stores its Active Directory principal, to be freed
+ * by the caller, sync_mapping_base returns the search base for its account,
+ * and sync_mapping_dn stores the DN of its account, which lasts until the
+ * request is freed.  Each sets its result to NULL if no rule gives it.
+ */
+krb5_error_code sync_mapping_compile(kadm5_hook_modinfo *, krb5_context);
+krb5_error_code sync_mapping_principal(kadm5_hook_modinfo *, krb5_context,
+                                       struct sync_request *,
+                                       krb5_principal *);
+const char *sync_mapping_base(kadm5_hook_modinfo *, krb5_context,
+                              struct sync_request *);
+krb5_error_code sync_mapping_dn(kadm5_hook_modinfo *, krb5_context,
+                                struct sync_request *, const char **dn);
+void sync_mapping_free(struct sync_mapping *);
+
+/* Hash a string for use in the plugin's hash tables. */
+uint32_t sync_hash_string(const char *);
+
+/*
+ * Manage sets of strings.  sync_strset_new returns NULL and sync_strset_add
+ * returns false if memory allocation fails.
+ */
+struct sync_strset *sync_strset_new(void)
+    __attribute__((__malloc__));
+bool sync_strset_add(struct sync_strset *, const char *)
+    __attribute__((__nonnull__));
+bool sync_strset_contains(const struct sync_strset *, const char *)
+    __attribute__((__nonnull__));
+void sync_strset_remove(struct sync_strset *, const char *)
+    __attribute__((__nonnull__));
+void sync_strset_free(struct sync_strset *);
 
 /*
  * Sets exists true to true if the principal has only one component and
  * two-component principal with instance added exists in the Kerberos
  * database, false otherwise.  Returns an error if we cannot determine whether
- * the principal exists.
+ * the principal exists.  The kadm5 handle used for the lookup is kept open
+ * for later calls until sync_instance_close is called.
+ */
+krb5_error_code sync_instance_exists(kadm5_hook_modinfo *, krb5_context,
+                                     krb5_principal, const char *instance,
+                                     bool *exists);
+void sync_instance_close(kadm5_hook_modinfo *);
+
+/*
+ * For bulk synchronization, list the principals in the local Kerberos
+ * database of the given realm that match a glob pattern, storing them in a
+ * newly allocated vector, and look up whether a principal is disabled (has
+ * DISALLOW_ALL_TIX set).  These use the same kadm5 handle as
+ * sync_instance_exists.
  */
-krb5_error_code sync_instance_exists(krb5_context, krb5_principal,
-                                     const char *instance, bool *exists);
+krb5_error_code sync_instance_list(kadm5_hook_modinfo *, krb5_context,
+                                   const char *realm, const char *pattern,
+                                   struct vector **);
+krb5_error_code sync_instance_disabled(kadm5_hook_modinfo *, krb5_context,
+                                       krb5_principal, bool *disabled);
+
+/*
+ * Notify the instance code that a principal was created or removed, so that
+ * it can keep its set of base names with ad_base_instance up to date.
+ */
+void sync_instance_created(kadm5_hook_modinfo *, krb5_context,
+                           krb5_principal);
+void sync_instance_removed(kadm5_hook_modinfo *, krb5_context,
+                           krb5_principal);
 
 /* Returns true if there is a queue conflict for this operation. */
 krb5_error_code sync_queue_conflict(kadm5_hook_modinfo *, krb5_context,
-                                    krb5_principal, const char *operation,
-                                    bool *conflict);
+                                    struct sync_request *,
+                                    const char *operation, bool *conflict);
+
+/* Frees the cached contents of the queue used by sync_queue_conflict. */
+void sync_queue_close(kadm5_hook_modinfo *);
 
 /* Writes an operation to the queue. */
 krb5_error_code sync_queue_write(kadm5_hook_modinfo *, krb5_context,
-                                 krb5_principal, const char *operation,
+                                 struct sync_request *, const char *operation,
                                  const char *password);
 
+/*
+ * Removes the queued changes for a request and operation because the
+ * principal was deleted, or, if the final request isn't NULL, moves them to
+ * its principal because the principal was renamed.
+ */
+krb5_error_code sync_queue_move(kadm5_hook_modinfo *, krb5_context,
+                                struct sync_request *, const char *operation,
+                                struct sync_request *renamed);
+
+/*
+ * Writes an operation to the queue only if there is a queue conflict for it,
+ * and sets queued to whether it did.
+ */
+krb5_error_code sync_queue_conflict_write(kadm5_hook_modinfo *, krb5_context,
+                                          struct sync_request *,
+                                          const char *operation,
+                                          const char *password, bool *queued);
+
+/*
+ * Counts the queue files again for the queue limits, after the queue has
+ * been processed.
+ */
+krb5_error_code sync_queue_recount(kadm5_hook_modinfo *, krb5_context);
+
+/*
+ * Lock and unlock the queue for one user, domain, and operation id.
+ * sync_queue_lock fills in the lock, which must be passed to
+ * sync_queue_unlock.
+ */
+krb5_error_code sync_queue_lock(kadm5_hook_modinfo *, krb5_context,
+                                const char *id, struct sync_queue_lock *);
+void sync_queue_unlock(struct sync_queue_lock *);
+
+/*
+ * Flush a change written to the queue journal to disk, sharing the flush with
+ * concurrent writers if queue_group_commit is set.
+ */
+krb5_error_code sync_queue_commit(kadm5_hook_modinfo *, krb5_context, int fd);
+
+/*
+ * Lock the whole queue against all other changes, for maintenance that
+ * affects every id.  The lock is released with sync_queue_unlock.
+ */
+krb5_error_code sync_queue_lock_all(kadm5_hook_modinfo *, krb5_context,
+                                    struct sync_queue_lock *);
+
+/*
+ * Read and validate a queue file with a single read, storing its fields in
+ * the provided record, which must be freed with sync_queue_record_free.  The
+ * lines may be of any length.
+ */
+krb5_error_code sync_queue_read_record(krb5_context, const char *path,
+                                       struct sync_queue_record *);
+void sync_queue_record_free(struct sync_queue_record *);
+
+/* Lists the files in the queue in the order in which they should be run. */
+krb5_error_code sync_queue_list(kadm5_hook_modinfo *, krb5_context,
+                                struct vector **);
+
+/*
+ * Make all queued changes in Active Directory, skipping later changes for the
+ * same user and operation after a failure.  The stop function, if not NULL,
+ * is called before each change and processing stops if it returns true.  The
+ * report function, if not NULL, is called after each change is attempted
+ * with the name of the queue file and the resulting status code.  failed is
+ * set to the number of changes that failed.
+ */
+typedef bool (*sync_queue_stop_func)(kadm5_hook_modinfo *);
+typedef void (*sync_queue_report_func)(kadm5_hook_modinfo *, krb5_context,
+                                       const char *, krb5_error_code);
+krb5_error_code sync_queue_process(kadm5_hook_modinfo *, krb5_context,
+                                   sync_queue_stop_func,
+                                   sync_queue_report_func,
+                                   unsigned long *failed);
+
+/*
+ * The same, but partition the changes by user, domain, and operation among
+ * the given number of forked worker processes, each of which calls the stop
+ * function.  Not for use in kadmind.
+ */
+krb5_error_code sync_queue_process_parallel(kadm5_hook_modinfo *,
+                                            krb5_context,
+                                            unsigned long workers,
+                                            sync_queue_stop_func,
+                                            sync_queue_report_func,
+                                            unsigned long *failed);
+
+/*
+ * Adaptive limits on the operations in flight at once in Active Directory.
+ * sync_limit_window returns how many operations of a kind may be in flight,
+ * given the configured maximum, and sync_limit_start and sync_limit_finish
+ * are called around each operation, with whether the server signalled
+ * back-pressure, to adjust it.  These may be called from several threads.
+ */
+size_t sync_limit_window(kadm5_hook_modinfo *, enum sync_limit_kind,
+                         size_t max);
+void sync_limit_start(kadm5_hook_modinfo *, enum sync_limit_kind,
+                      struct sync_limit_op *);
+void sync_limit_finish(kadm5_hook_modinfo *, enum sync_limit_kind,
+                       const struct sync_limit_op *, bool busy);
+void sync_limit_close(kadm5_hook_modinfo *);
+
+/*
+ * Leases on partitions of the queue for processing it from several hosts if
+ * queue_lease_partitions is set.  sync_lease_acquire takes this node's share
+ * of the partitions not leased by another live node, sync_lease_held returns
+ * whether the change with the given id is in a partition this node holds,
+ * renewing the leases as needed, and sync_lease_release gives them all up.
+ */
+krb5_error_code sync_lease_acquire(kadm5_hook_modinfo *, krb5_context);
+bool sync_lease_held(kadm5_hook_modinfo *, const char *id);
+void sync_lease_release(kadm5_hook_modinfo *);
+
+/*
+ * Storage of queued changes in an append-only journal, used instead of queue
+ * files if queue_format is set to journal.  The sync_queue_* functions call
+ * these as appropriate, and callers hold the queue lock for the id of the
+ * change except for sync_journal_conflict, sync_journal_list, and
+ * sync_journal_compact.
+ * sync_journal_read sets the user to NULL if the change is no longer pending.
+ * sync_journal_move marks the changes with a prefix as done and, if the new
+ * prefix isn't NULL, queues them again under it for a renamed principal.
+ * sync_journal_compact takes the lock on the whole queue itself.
+ */
+struct sync_journal *sync_journal_new(void)
+    __attribute__((__malloc__));
+void sync_journal_free(struct sync_journal *);
+krb5_error_code sync_journal_conflict(kadm5_hook_modinfo *, krb5_context,
+                                      const char *id, bool *conflict);
+krb5_error_code sync_journal_write(kadm5_hook_modinfo *, krb5_context,
+                                   const char *prefix, const char *name,
+                                   const char *user, const char *operation,
+                                   const char *password, bool coalesce);
+krb5_error_code sync_journal_depth(kadm5_hook_modinfo *, krb5_context,
+                                   unsigned long *changes,
+                                   unsigned long *bytes);
+krb5_error_code sync_journal_list(kadm5_hook_modinfo *, krb5_context,
+                                  struct vector *);
+krb5_error_code sync_journal_read(kadm5_hook_modinfo *, krb5_context,
+                                  const char *name, char **user,
+                                  char **operation, char **password);
+krb5_error_code sync_journal_remove(kadm5_hook_modinfo *, krb5_context,
+                                    const char *name);
+krb5_error_code sync_journal_move(kadm5_hook_modinfo *, krb5_context,
+                                  const char *prefix, const char *new_prefix,
+                                  const char *user);
+krb5_error_code sync_journal_compact(kadm5_hook_modinfo *, krb5_context);
+
+/*
+ * Wake up the background worker thread for ad_async, starting it if needed,
+ * and stop it, waiting for it to finish the change it's working on.
+ */
+void sync_worker_notify(kadm5_hook_modinfo *);
+void sync_worker_stop(kadm5_hook_modinfo *);
+
+/*
+ * Collect status changes from the hooks into batches for ad_status_window.
+ * The hooks hold the batch lock for the whole of each change, and while they
+ * do, status changes can be added to the pending batch, which returns false
+ * if the change should be made directly instead, or removed from it because
+ * a newer one is being queued.  Stopping makes any pending changes first.
+ */
+void sync_batch_lock(kadm5_hook_modinfo *);
+void sync_batch_unlock(kadm5_hook_modinfo *);
+bool sync_batch_add(kadm5_hook_modinfo *, const char *domain, krb5_principal,
+                    bool enabled);
+void sync_batch_cancel(kadm5_hook_modinfo *, const char *domain,
+                       krb5_principal);
+void sync_batch_stop(kadm5_hook_modinfo *);
+
+/*
+ * Obtain AD credentials and bind a pooled LDAP connection in advance for
+ * ad_warmup and start the thread that keeps them fresh, and stop it again.
+ * sync_init doesn't start it, so that callers that fork workers can skip it.
+ * sync_warmup_running returns true if this process has started it.
+ */
+void sync_warmup_start(kadm5_hook_modinfo *, krb5_context);
+bool sync_warmup_running(kadm5_hook_modinfo *);
+void sync_warmup_stop(kadm5_hook_modinfo *);
+
 /*
  * Manage vectors, which are counted lists of strings.  The functions that
  * return a boolean return false if memory allocation fails.
@@ -126,15 +984,28 @@ struct vector *sync_vector_split_multi(const char *string, const char *seps,
 
 /*
  * Obtain configuration settings from krb5.conf.  These are wrappers around
- * the krb5_appdefault_* APIs that handle setting the section name, obtaining
- * the local default realm and using it to find settings, and doing any
- * necessary conversion.
+ * the krb5_appdefault_* APIs that handle setting the section name, using the
+ * local default realm to find settings, and doing any necessary conversion.
+ * sync_appdefaults_new obtains the default realm once for a set of settings
+ * and returns NULL on memory allocation failure, and sync_appdefaults_free
+ * frees it again.  If section is not NULL, settings are looked for there
+ * first and then in the krb5-sync section.
  */
-void sync_config_boolean(krb5_context, const char *, bool *)
+struct sync_appdefaults *sync_appdefaults_new(krb5_context,
+                                             const char *section)
+    __attribute__((__malloc__));
+void sync_appdefaults_free(krb5_context, struct sync_appdefaults *);
+void sync_config_boolean(krb5_context, struct sync_appdefaults *,
+                         const char *, bool *)
+    __attribute__((__nonnull__));
+krb5_error_code sync_config_list(krb5_context, struct sync_appdefaults *,
+                                 const char *, struct vector **)
     __attribute__((__nonnull__));
-krb5_error_code sync_config_list(krb5_context, const char *, struct vector **)
+krb5_error_code sync_config_number(krb5_context, struct sync_appdefaults *,
+                                   const char *, long *)
     __attribute__((__nonnull__));
-void sync_config_string(krb5_context, const char *, char **)
+void sync_config_string(krb5_context, struct sync_appdefaults *,
+                        const char *, char **)
     __attribute__((__nonnull__));
 
 /*
@@ -151,7 +1022,15 @@ krb5_error_code sync_error_ldap(krb5_context, int, const char *format, ...)
 krb5_error_code sync_error_system(krb5_context, const char *format, ...)
     __attribute__((__nonnull__, __format__(printf, 2, 3)));
 
-/* Log messages to syslog if configured to do so. */
+/*
+ * Log messages to syslog if configured to do so.  If syslog_limit is set,
+ * messages with the same format are limited to that many a minute, and the
+ * number of messages suppressed is logged before the next one allowed or on
+ * close.  sync_syslog_new allocates the state for that, returning NULL on
+ * failure, and sync_syslog_close logs any pending counts and frees it.
+ */
+struct sync_log *sync_syslog_new(void);
+void sync_syslog_close(kadm5_hook_modinfo *);
 void sync_syslog_debug(kadm5_hook_modinfo *, const char *format, ...)
     __attribute__((__nonnull__, __format__(printf, 2, 3)));
 void sync_syslog_info(kadm5_hook_modinfo *, const char *format, ...)
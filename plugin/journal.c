@@ -0,0 +1,946 @@
+/*
+ * Journal storage for the change queue.
+ *
+ * If queue_format is set to journal, queued changes are stored in a single
+ * append-only file, queue_dir/.journal, rather than one file per change.
+ * Each record is one line.  A queued change is recorded as
+ *
+ *     +<tab><name><tab><user><tab><operation>[<tab><password>]
+ *
+ * where name is the name the change would have as a queue file, and a change
+ * that has been made (or discarded) is recorded as
+ *
+ *     -<tab><name>
+ *
+ * so queuing or finishing a change is a single sequential append.  Each
+ * process keeps an in-memory index of the pending changes by name and of the
+ * number of pending changes for each id (user, domain, and operation), and
+ * brings it up to date by reading only the records appended since it last
+ * looked.  Conflict checks are therefore a hash lookup rather than a scan of
+ * the queue.
+ *
+ * Records for finished changes are dropped by compacting the journal, which
+ * writes the pending changes to a new file and renames it over the old one
+ * while holding the exclusive lock on the whole queue.  Other processes
+ * notice the new file by its inode and read it again from the start.
+ *
+ * Callers hold the queue lock for the id of any change they read or write,
+ * which serializes changes for the same id across processes.  Conflict
+ * checks only consult the index and don't need the lock.  The index is
+ * also protected by a mutex, since with ad_async it is shared between the
+ * background worker thread and kadmind.  Queue locks are always taken before
+ * the mutex.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+
+/* Name of the journal file in queue_dir. */
+#define JOURNAL_FILE ".journal"
+
+/* Initial number of buckets in each table of the index. */
+#define JOURNAL_MIN_BUCKETS 64
+
+/*
+ * An entry in one of the tables of the index.  Entries for pending changes
+ * are keyed by name and hold the user, operation, and password (which may be
+ * NULL).  Entries for ids hold only the number of pending changes.
+ */
+struct journal_entry {
+    char *key;
+    char *user;
+    char *operation;
+    char *password;
+    unsigned long count;
+    struct journal_entry *next;
+};
+
+/*
+ * A hash table with chained buckets.  The number of buckets is always a power
+ * of two and is doubled whenever the number of entries exceeds it.
+ */
+struct journal_table {
+    size_t count;
+    size_t nbuckets;
+    struct journal_entry **buckets;
+};
+
+/*
+ * The index of the journal.  fd is open to the journal file identified by dev
+ * and ino, offset is the length of the part of it that has been read, and
+ * records is the number of records in that part.
+ */
+struct sync_journal {
+    pthread_mutex_t mutex;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;
+    unsigned long records;
+    struct journal_table changes;
+    struct journal_table ids;
+};
+
+
+/*
+ * Free an entry in the index, clearing any password first.
+ */
+static void
+journal_entry_free(struct journal_entry *entry)
+{
+    free(entry->key);
+    free(entry->user);
+    free(entry->operation);
+    if (entry->password != NULL) {
+        sync_wipe(entry->password, strlen(entry->password));
+        free(entry->password);
+    }
+    free(entry);
+}
+
+
+/*
+ * Find the entry for a key in a table, returning NULL if there is none.  If
+ * linkp is not NULL, it is set to the location of the pointer to the entry in
+ * its hash chain, for use in unlinking.
+ */
+static struct journal_entry *
+journal_find(struct journal_table *table, const char *key,
+             struct journal_entry ***linkp)
+{
+    struct journal_entry **link, *entry;
+    size_t bucket;
+
+    bucket = sync_hash_string(key) & (table->nbuckets - 1);
+    for (link = &table->buckets[bucket]; *link != NULL; link = &entry->next) {
+        entry = *link;
+        if (strcmp(entry->key, key) == 0) {
+            if (linkp != NULL)
+                *linkp = link;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Add a new entry to a table, doubling the number of buckets if the table is
+ * getting full.  If memory allocation for the larger table fails, keep the
+ * old one, since it still works, just more slowly.
+ */
+static void
+journal_insert(struct journal_table *table, struct journal_entry *entry)
+{
+    struct journal_entry **buckets, *next;
+    size_t nbuckets, i, bucket;
+
+    bucket = sync_hash_string(entry->key) & (table->nbuckets - 1);
+    entry->next = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+    table->count++;
+    if (table->count <= table->nbuckets)
+        return;
+    nbuckets = table->nbuckets * 2;
+    buckets = calloc(nbuckets, sizeof(struct journal_entry *));
+    if (buckets == NULL)
+        return;
+    for (i = 0; i < table->nbuckets; i++)
+        for (entry = table->buckets[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            bucket = sync_hash_string(entry->key) & (nbuckets - 1);
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+        }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->nbuckets = nbuckets;
+}
+
+
+/*
+ * Free all entries in a table, leaving it empty.
+ */
+static void
+journal_clear(struct journal_table *table)
+{
+    struct journal_entry *entry, *next;
+    size_t i;
+
+    for (i = 0; i < table->nbuckets; i++) {
+        for (entry = table->buckets[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            journal_entry_free(entry);
+        }
+        table->buckets[i] = NULL;
+    }
+    table->count = 0;
+}
+
+
+/*
+ * Given the name of a queued change, store its id in a newly allocated
+ * string.  This is the part of the name before the third hyphen, or the whole
+ * name if it doesn't have that many.  Returns NULL on memory allocation
+ * failure.
+ */
+static char *
+journal_id(const char *name)
+{
+    const char *p = name;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        p = strchr(p, '-');
+        if (p == NULL)
+            return strdup(name);
+        p++;
+    }
+    return strndup(name, (size_t) (p - name - 1));
+}
+
+
+/*
+ * Add a pending change to the index.  A change whose name is already pending
+ * is ignored.  Returns false on memory allocation failure.
+ */
+static bool
+journal_add(struct sync_journal *journal, const char *name, const char *user,
+            const char *operation, const char *password)
+{
+    struct journal_entry *entry, *id = NULL;
+    char *key;
+
+    if (journal_find(&journal->changes, name, NULL) != NULL)
+        return true;
+    key = journal_id(name);
+    if (key == NULL)
+        return false;
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        goto fail;
+    entry->key = strdup(name);
+    entry->user = strdup(user);
+    entry->operation = strdup(operation);
+    if (password != NULL)
+        entry->password = strdup(password);
+    if (entry->key == NULL || entry->user == NULL || entry->operation == NULL
+        || (password != NULL && entry->password == NULL))
+        goto fail;
+    id = journal_find(&journal->ids, key, NULL);
+    if (id == NULL) {
+        id = calloc(1, sizeof(*id));
+        if (id == NULL)
+            goto fail;
+        id->key = key;
+        key = NULL;
+        journal_insert(&journal->ids, id);
+    }
+    id->count++;
+    journal_insert(&journal->changes, entry);
+    free(key);
+    return true;
+
+fail:
+    if (entry != NULL)
+        journal_entry_free(entry);
+    free(key);
+    return false;
+}
+
+
+/*
+ * Remove a change from the index, doing nothing if it isn't pending.
+ */
+static void
+journal_remove(struct sync_journal *journal, const char *name)
+{
+    struct journal_entry **link, *entry, *id;
+    char *key;
+
+    entry = journal_find(&journal->changes, name, &link);
+    if (entry == NULL)
+        return;
+    *link = entry->next;
+    journal->changes.count--;
+    journal_entry_free(entry);
+    key = journal_id(name);
+    if (key == NULL)
+        return;
+    id = journal_find(&journal->ids, key, &link);
+    if (id != NULL && --id->count == 0) {
+        *link = id->next;
+        journal->ids.count--;
+        journal_entry_free(id);
+    }
+    free(key);
+}
+
+
+/*
+ * Apply one record from the journal, without its trailing newline, to the
+ * index.  Malformed records are ignored.  Returns false on memory allocation
+ * failure.
+ */
+static bool
+journal_apply(struct sync_journal *journal, char *record)
+{
+    char *name, *user, *operation, *password;
+
+    if (record[0] == '\0' || record[1] != '\t')
+        return true;
+    name = record + 2;
+    if (record[0] == '-') {
+        journal_remove(journal, name);
+        return true;
+    }
+    if (record[0] != '+')
+        return true;
+    user = strchr(name, '\t');
+    if (user == NULL)
+        return true;
+    *user++ = '\0';
+    operation = strchr(user, '\t');
+    if (operation == NULL)
+        return true;
+    *operation++ = '\0';
+    password = strchr(operation, '\t');
+    if (password != NULL)
+        *password++ = '\0';
+    return journal_add(journal, name, user, operation, password);
+}
+
+
+/*
+ * Close the journal file and forget everything in the index, so that the
+ * next update reads the journal from the start.
+ */
+static void
+journal_reset(struct sync_journal *journal)
+{
+    if (journal->fd >= 0)
+        close(journal->fd);
+    journal->fd = -1;
+    journal->offset = 0;
+    journal->records = 0;
+    journal_clear(&journal->changes);
+    journal_clear(&journal->ids);
+}
+
+
+/*
+ * Bring the index up to date with the journal file, creating the file if it
+ * doesn't exist.  If the file has been replaced by compaction, or is shorter
+ * than the part already read, start over from the beginning.  A partial
+ * record at the end of the file, which is still being appended, is left for
+ * the next update.  Must be called with the mutex held.  Returns a Kerberos
+ * status code.
+ */
+static krb5_error_code
+journal_update(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_journal *journal = config->journal;
+    char *path = NULL, *buffer = NULL, *start, *end;
+    struct stat st;
+    size_t length, done;
+    ssize_t status;
+    krb5_error_code code = 0;
+
+    /* Reopen the file if it was replaced. */
+    if (asprintf(&path, "%s/%s", config->queue_dir, JOURNAL_FILE) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    if (journal->fd >= 0) {
+        if (stat(path, &st) < 0) {
+            if (errno != ENOENT) {
+                code = sync_error_system(ctx, "cannot stat %s", path);
+                goto done;
+            }
+            journal_reset(journal);
+        } else if (st.st_dev != journal->dev || st.st_ino != journal->ino)
+            journal_reset(journal);
+    }
+    if (journal->fd < 0) {
+        journal->fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0600);
+        if (journal->fd < 0) {
+            code = sync_error_system(ctx, "cannot open %s", path);
+            goto done;
+        }
+    }
+    if (fstat(journal->fd, &st) < 0) {
+        code = sync_error_system(ctx, "cannot stat %s", path);
+        goto done;
+    }
+    journal->dev = st.st_dev;
+    journal->ino = st.st_ino;
+    if (st.st_size < journal->offset) {
+        journal_reset(journal);
+        free(path);
+        return journal_update(config, ctx);
+    }
+    if (st.st_size == journal->offset)
+        goto done;
+
+    /* Read everything appended since the last update. */
+    length = (size_t) (st.st_size - journal->offset);
+    buffer = malloc(length + 1);
+    if (buffer == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    for (done = 0; done < length; done += (size_t) status) {
+        status = pread(journal->fd, buffer + done, length - done,
+                       journal->offset + (off_t) done);
+        if (status < 0) {
+            code = sync_error_system(ctx, "cannot read %s", path);
+            goto done;
+        }
+        if (status == 0)
+            break;
+    }
+    length = done;
+    buffer[length] = '\0';
+
+    /* Apply each complete record to the index. */
+    start = buffer;
+    while ((end = memchr(start, '\n', length - (size_t) (start - buffer)))
+           != NULL) {
+        *end = '\0';
+        if (!journal_apply(journal, start)) {
+            code = sync_error_system(ctx, "cannot allocate memory");
+            goto done;
+        }
+        journal->records++;
+        journal->offset += end - start + 1;
+        start = end + 1;
+    }
+
+done:
+    if (buffer != NULL) {
+        sync_wipe(buffer, length);
+        free(buffer);
+    }
+    free(path);
+    return code;
+}
+
+
+/*
+ * Append records to the journal and flush them to disk, so that they survive
+ * a crash before we report success, sharing the flush with other writers if
+ * queue_group_commit is set.  The index is then brought up to date,
+ * which applies the new records.  Must be called with the mutex held.
+ * Returns a Kerberos status code.
+ */
+static krb5_error_code
+journal_append(kadm5_hook_modinfo *config, krb5_context ctx,
+               const char *records)
+{
+    struct sync_journal *journal = config->journal;
+    size_t length, done;
+    ssize_t status;
+    krb5_error_code code;
+
+    length = strlen(records);
+    for (done = 0; done < length; done += (size_t) status) {
+        status = write(journal->fd, records + done, length - done);
+        if (status < 0)
+            return sync_error_system(ctx, "cannot write queue journal");
+    }
+    code = sync_queue_commit(config, ctx, journal->fd);
+    if (code != 0)
+        return code;
+    return journal_update(config, ctx);
+}
+
+
+/*
+ * Format the record for a pending change in a newly allocated string.
+ * Returns NULL on memory allocation failure.
+ */
+static char *
+journal_record(const char *name, const char *user, const char *operation,
+               const char *password)
+{
+    char *record;
+
+    if (asprintf(&record, "+\t%s\t%s\t%s%s%s\n", name, user, operation,
+                 (password == NULL) ? "" : "\t",
+                 (password == NULL) ? "" : password) < 0)
+        return NULL;
+    return record;
+}
+
+
+/*
+ * Free a string that may contain a password, clearing it first.
+ */
+static void
+journal_free_secret(char *string)
+{
+    if (string == NULL)
+        return;
+    sync_wipe(string, strlen(string));
+    free(string);
+}
+
+
+/*
+ * Create a new, empty journal index.  The journal file itself is opened on
+ * first use.  Returns NULL on failure.
+ */
+struct sync_journal *
+sync_journal_new(void)
+{
+    struct sync_journal *journal;
+
+    journal = calloc(1, sizeof(*journal));
+    if (journal == NULL)
+        return NULL;
+    journal->fd = -1;
+    journal->changes.nbuckets = JOURNAL_MIN_BUCKETS;
+    journal->ids.nbuckets = JOURNAL_MIN_BUCKETS;
+    journal->changes.buckets
+        = calloc(JOURNAL_MIN_BUCKETS, sizeof(struct journal_entry *));
+    journal->ids.buckets
+        = calloc(JOURNAL_MIN_BUCKETS, sizeof(struct journal_entry *));
+    if (journal->changes.buckets == NULL || journal->ids.buckets == NULL)
+        goto fail;
+    if (pthread_mutex_init(&journal->mutex, NULL) != 0)
+        goto fail;
+    return journal;
+
+fail:
+    free(journal->changes.buckets);
+    free(journal->ids.buckets);
+    free(journal);
+    return NULL;
+}
+
+
+/*
+ * Close the journal and free the index.
+ */
+void
+sync_journal_free(struct sync_journal *journal)
+{
+    if (journal == NULL)
+        return;
+    journal_reset(journal);
+    pthread_mutex_destroy(&journal->mutex);
+    free(journal->changes.buckets);
+    free(journal->ids.buckets);
+    free(journal);
+}
+
+
+/*
+ * Check whether there are any pending changes for an id, storing the result
+ * in conflict.  The caller doesn't need to hold the queue lock for the id,
+ * since writers only append complete records and partial ones are left for
+ * the next update.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_journal_conflict(kadm5_hook_modinfo *config, krb5_context ctx,
+                      const char *id, bool *conflict)
+{
+    struct sync_journal *journal = config->journal;
+    krb5_error_code code;
+
+    *conflict = false;
+    pthread_mutex_lock(&journal->mutex);
+    code = journal_update(config, ctx);
+    if (code == 0)
+        *conflict = (journal_find(&journal->ids, id, NULL) != NULL);
+    pthread_mutex_unlock(&journal->mutex);
+    return code;
+}
+
+
+/*
+ * Queue a change in the journal.  Takes the queue file prefix and the name of
+ * the change, the user, the operation, the password (which may be NULL), and
+ * whether to coalesce.  If coalesce is true, any other pending changes with
+ * the same prefix are marked as done in the same append.  The caller holds
+ * the queue lock for the id.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_journal_write(kadm5_hook_modinfo *config, krb5_context ctx,
+                   const char *prefix, const char *name, const char *user,
+                   const char *operation, const char *password,
+                   bool coalesce)
+{
+    struct sync_journal *journal = config->journal;
+    struct journal_entry *entry;
+    char *record = NULL, *records = NULL, *old;
+    size_t i;
+    krb5_error_code code;
+
+    /* Records are lines of tab-separated fields, so check the contents. */
+    if (strpbrk(user, "\t\n") != NULL)
+        return sync_error_generic(ctx, "cannot queue change for %s: invalid"
+                                  " character in user", user);
+    if (password != NULL && strchr(password, '\n') != NULL)
+        return sync_error_generic(ctx, "cannot queue password change for %s:"
+                                  " password contains a newline", user);
+
+    /* Names come from the queue sequence, so should never be reused. */
+    pthread_mutex_lock(&journal->mutex);
+    code = journal_update(config, ctx);
+    if (code != 0)
+        goto done;
+    if (journal_find(&journal->changes, name, NULL) != NULL) {
+        code = sync_error_generic(ctx, "queued change %s already exists",
+                                  name);
+        goto done;
+    }
+
+    /* Build the records, starting with any superseded changes. */
+    records = strdup("");
+    if (records == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    if (coalesce)
+        for (i = 0; i < journal->changes.nbuckets; i++)
+            for (entry = journal->changes.buckets[i]; entry != NULL;
+                 entry = entry->next) {
+                if (strncmp(entry->key, prefix, strlen(prefix)) != 0)
+                    continue;
+                old = records;
+                if (asprintf(&records, "%s-\t%s\n", old, entry->key) < 0)
+                    records = NULL;
+                free(old);
+                if (records == NULL) {
+                    code = sync_error_system(ctx, "cannot allocate memory");
+                    goto done;
+                }
+                sync_syslog_debug(config, "krb5-sync: removed superseded"
+                                  " queued change %s", entry->key);
+            }
+    record = journal_record(name, user, operation, password);
+    if (record == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    old = records;
+    if (asprintf(&records, "%s%s", old, record) < 0)
+        records = NULL;
+    free(old);
+    if (records == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    code = journal_append(config, ctx, records);
+
+done:
+    pthread_mutex_unlock(&journal->mutex);
+    journal_free_secret(record);
+    journal_free_secret(records);
+    return code;
+}
+
+
+/*
+ * Store the number of pending changes in the journal in changes and the size
+ * of the journal in bytes.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_journal_depth(kadm5_hook_modinfo *config, krb5_context ctx,
+                   unsigned long *changes, unsigned long *bytes)
+{
+    struct sync_journal *journal = config->journal;
+    krb5_error_code code;
+
+    pthread_mutex_lock(&journal->mutex);
+    code = journal_update(config, ctx);
+    *changes = journal->changes.count;
+    *bytes = (unsigned long) journal->offset;
+    pthread_mutex_unlock(&journal->mutex);
+    return code;
+}
+
+
+/*
+ * Add the names of all pending changes in the journal to a vector, in no
+ * particular order.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_journal_list(kadm5_hook_modinfo *config, krb5_context ctx,
+                  struct vector *list)
+{
+    struct sync_journal *journal = config->journal;
+    struct journal_entry *entry;
+    size_t i;
+    krb5_error_code code;
+
+    pthread_mutex_lock(&journal->mutex);
+    code = journal_update(config, ctx);
+    if (code != 0)
+        goto done;
+    for (i = 0; i < journal->changes.nbuckets; i++)
+        for (entry = journal->changes.buckets[i]; entry != NULL;
+             entry = entry->next)
+            if (!sync_vector_add(list, entry->key)) {
+                code = sync_error_system(ctx, "cannot allocate memory");
+                goto done;
+            }
+
+done:
+    pthread_mutex_unlock(&journal->mutex);
+    return code;
+}
+
+
+/*
+ * Read a pending change from the journal, storing newly allocated copies of
+ * its user, operation, and password (which may be NULL).  If the change is no
+ * longer pending, user is set to NULL.  The caller holds the queue lock for
+ * the id.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_journal_read(kadm5_hook_modinfo *config, krb5_context ctx,
+                  const char *name, char **user, char **operation,
+                  char **password)
+{
+    struct sync_journal *journal = config->journal;
+    struct journal_entry *entry;
+    krb5_error_code code;
+
+    *user = NULL;
+    *operation = NULL;
+    *password = NULL;
+    pthread_mutex_lock(&journal->mutex);
+    code = journal_update(config, ctx);
+    if (code != 0)
+        goto done;
+    entry = journal_find(&journal->changes, name, NULL);
+    if (entry == NULL)
+        goto done;
+    *user = strdup(entry->user);
+    *operation = strdup(entry->operation);
+    if (entry->password != NULL)
+        *password = strdup(entry->password);
+    if (*user == NULL || *operation == NULL
+        || (entry->password != NULL && *password == NULL)) {
+        free(*user);
+        free(*operation);
+        journal_free_secret(*password);
+        *user = NULL;
+        *operation = NULL;
+        *password = NULL;
+        code = sync_error_system(ctx, "cannot allocate memory");
+    }
+
+done:
+    pthread_mutex_unlock(&journal->mutex);
+    return code;
+}
+
+
+/*
+ * Mark a change as done.  The caller holds the queue lock for the id.
+ * Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_journal_remove(kadm5_hook_modinfo *config, krb5_context ctx,
+                    const char *name)
+{
+    struct sync_journal *journal = config->journal;
+    char *record;
+    krb5_error_code code;
+
+    if (asprintf(&record, "-\t%s\n", name) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    pthread_mutex_lock(&journal->mutex);
+    code = journal_append(config, ctx, record);
+    pthread_mutex_unlock(&journal->mutex);
+    free(record);
+    return code;
+}
+
+
+/*
+ * Mark all pending changes with the given prefix as done, and if new_prefix
+ * is not NULL, queue each of them again under the same name with new_prefix
+ * in place of prefix and with user as its user, all in one append.  Used
+ * when a principal is deleted or renamed.  The caller holds the queue locks
+ * for both prefixes.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_journal_move(kadm5_hook_modinfo *config, krb5_context ctx,
+                  const char *prefix, const char *new_prefix,
+                  const char *user)
+{
+    struct sync_journal *journal = config->journal;
+    struct journal_entry *entry;
+    char *records = NULL, *record, *name, *old;
+    size_t i;
+    int status;
+    krb5_error_code code;
+
+    /* Records are lines of tab-separated fields, so check the user. */
+    if (new_prefix != NULL && strpbrk(user, "\t\n") != NULL)
+        return sync_error_generic(ctx, "cannot queue change for %s: invalid"
+                                  " character in user", user);
+
+    /* Build the records for every pending change with that prefix. */
+    pthread_mutex_lock(&journal->mutex);
+    code = journal_update(config, ctx);
+    if (code != 0)
+        goto done;
+    records = strdup("");
+    if (records == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    for (i = 0; i < journal->changes.nbuckets; i++)
+        for (entry = journal->changes.buckets[i]; entry != NULL;
+             entry = entry->next) {
+            if (strncmp(entry->key, prefix, strlen(prefix)) != 0)
+                continue;
+            record = NULL;
+            if (new_prefix != NULL) {
+                if (asprintf(&name, "%s%s", new_prefix,
+                             entry->key + strlen(prefix)) < 0) {
+                    code = sync_error_system(ctx, "cannot allocate memory");
+                    goto done;
+                }
+                record = journal_record(name, user, entry->operation,
+                                        entry->password);
+                free(name);
+                if (record == NULL) {
+                    code = sync_error_system(ctx, "cannot allocate memory");
+                    goto done;
+                }
+            }
+            old = records;
+            status = asprintf(&records, "%s-\t%s\n%s", old, entry->key,
+                              (record == NULL) ? "" : record);
+            journal_free_secret(old);
+            journal_free_secret(record);
+            if (status < 0) {
+                records = NULL;
+                code = sync_error_system(ctx, "cannot allocate memory");
+                goto done;
+            }
+            sync_syslog_debug(config, "krb5-sync: %s queued change %s",
+                              (new_prefix == NULL) ? "removed" : "moved",
+                              entry->key);
+        }
+    if (records[0] != '\0')
+        code = journal_append(config, ctx, records);
+
+done:
+    pthread_mutex_unlock(&journal->mutex);
+    journal_free_secret(records);
+    return code;
+}
+
+
+/*
+ * Compact the journal if at least half of its records are for changes that
+ * are no longer pending, by writing the pending changes to a new file and
+ * renaming it into place.  Takes the exclusive lock on the whole queue, so
+ * this must not be called with any queue lock held.  Returns a Kerberos
+ * status code.
+ */
+krb5_error_code
+sync_journal_compact(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_journal *journal = config->journal;
+    struct sync_queue_lock lock = { -1, -1, NULL };
+    struct journal_entry *entry;
+    char *path = NULL, *tmp = NULL, *record;
+    unsigned long dead;
+    size_t i, length;
+    int fd = -1;
+    krb5_error_code code;
+
+    code = sync_queue_lock_all(config, ctx, &lock);
+    if (code != 0)
+        return code;
+    pthread_mutex_lock(&journal->mutex);
+    code = journal_update(config, ctx);
+    if (code != 0)
+        goto done;
+    dead = journal->records - (unsigned long) journal->changes.count;
+    if (dead == 0 || dead < journal->changes.count)
+        goto done;
+
+    /* Write the pending changes to a new file. */
+    if (asprintf(&path, "%s/%s", config->queue_dir, JOURNAL_FILE) < 0) {
+        path = NULL;
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+        tmp = NULL;
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        code = sync_error_system(ctx, "cannot create %s", tmp);
+        goto done;
+    }
+    for (i = 0; i < journal->changes.nbuckets; i++)
+        for (entry = journal->changes.buckets[i]; entry != NULL;
+             entry = entry->next) {
+            record = journal_record(entry->key, entry->user, entry->operation,
+                                    entry->password);
+            if (record == NULL) {
+                code = sync_error_system(ctx, "cannot allocate memory");
+                goto done;
+            }
+            length = strlen(record);
+            if (write(fd, record, length) != (ssize_t) length) {
+                journal_free_secret(record);
+                code = sync_error_system(ctx, "cannot write %s", tmp);
+                goto done;
+            }
+            journal_free_secret(record);
+        }
+    if (fsync(fd) < 0 || close(fd) < 0) {
+        fd = -1;
+        code = sync_error_system(ctx, "cannot write %s", tmp);
+        goto done;
+    }
+    fd = -1;
+
+    /* Replace the journal and read it again. */
+    if (rename(tmp, path) < 0) {
+        code = sync_error_system(ctx, "cannot rename %s to %s", tmp, path);
+        goto done;
+    }
+    free(tmp);
+    tmp = NULL;
+    fd = open(config->queue_dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    fd = -1;
+    journal_reset(journal);
+    code = journal_update(config, ctx);
+
+done:
+    if (fd >= 0)
+        close(fd);
+    if (tmp != NULL)
+        unlink(tmp);
+    pthread_mutex_unlock(&journal->mutex);
+    sync_queue_unlock(&lock);
+    free(tmp);
+    free(path);
+    return code;
+}
@@ -0,0 +1,452 @@
+/*
+ * Leases on partitions of the queue, for processing it from several hosts.
+ *
+ * The queue lock only coordinates the processes of one host, so if
+ * queue_lease_partitions is set, the ids of the queued changes are divided
+ * by hash into that many partitions and a change is only made by the node
+ * holding the lease on its partition.  Nodes on any number of hosts sharing
+ * queue_dir can then drain disjoint partitions concurrently, and since each
+ * id is in a single partition, its changes are still made in order.
+ *
+ * Leases are files in the .leases subdirectory of queue_dir named
+ * <partition>-<generation>.  A lease is held until the modification time of
+ * its file plus queue_lease_time, and the holder renews it by touching the
+ * file once half of that has passed.  A node takes a partition whose newest
+ * lease file has expired by creating the file for the next generation with
+ * O_EXCL, so that only one of several nodes trying at once gets it, and then
+ * removes the old file.  A holder that finds its file gone, a newer
+ * generation present, or its lease expired before it renewed it has lost the
+ * partition and stops making its changes, so a node that dies or hangs loses
+ * its partitions once its leases expire.  Released leases are marked expired
+ * rather than removed, so that generations only increase.
+ *
+ * Each node also touches the file node-<hostname> whenever it acquires
+ * leases.  The nodes whose files are newer than queue_lease_time are
+ * counted as live, and each node takes at most its share of the partitions,
+ * starting at a partition chosen by the hash of its name so that nodes
+ * prefer different partitions, and releases any it holds beyond that share.
+ *
+ * This relies on the clocks of the nodes and the file server agreeing, and
+ * on each change taking well under half of queue_lease_time.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <utime.h>
+
+#include <plugin/internal.h>
+
+/* The subdirectory of queue_dir holding the lease files. */
+#define LEASE_DIR ".leases"
+
+/* The prefix of the names of node heartbeat files. */
+#define LEASE_NODE "node-"
+
+/*
+ * The lease state of this node: its name, the number of partitions, the
+ * generation of the lease held on each partition or 0 if it isn't held, and
+ * the time the held leases were last renewed.
+ */
+struct sync_lease {
+    char *node;
+    unsigned long partitions;
+    unsigned long *held;
+    time_t renewed;
+};
+
+
+/*
+ * Return the path of a lease file for a partition and generation in newly
+ * allocated memory, or NULL on failure to allocate memory.
+ */
+static char *
+lease_path(kadm5_hook_modinfo *config, unsigned long partition,
+           unsigned long generation)
+{
+    char *path;
+
+    if (asprintf(&path, "%s/%s/%lu-%lu", config->queue_dir, LEASE_DIR,
+                 partition, generation) < 0)
+        return NULL;
+    return path;
+}
+
+
+/*
+ * Return true if the lease file for the given partition and generation
+ * exists.
+ */
+static bool
+lease_exists(kadm5_hook_modinfo *config, unsigned long partition,
+             unsigned long generation)
+{
+    char *path;
+    bool exists;
+
+    path = lease_path(config, partition, generation);
+    if (path == NULL)
+        return false;
+    exists = (access(path, F_OK) == 0);
+    free(path);
+    return exists;
+}
+
+
+/*
+ * Give up the lease on a partition, marking its file expired so that any
+ * node can take it at once.  Setting the time fails harmlessly if another
+ * node already took the partition and removed the file.
+ */
+static void
+lease_drop(kadm5_hook_modinfo *config, unsigned long partition)
+{
+    struct sync_lease *lease = config->lease;
+    struct utimbuf expired = { 0, 0 };
+    char *path;
+
+    if (lease->held[partition] == 0)
+        return;
+    path = lease_path(config, partition, lease->held[partition]);
+    if (path != NULL)
+        utime(path, &expired);
+    free(path);
+    lease->held[partition] = 0;
+}
+
+
+/*
+ * Renew the held leases, dropping any that have been lost: those that expired
+ * before being renewed, since another node may already have taken them, and
+ * those whose file is gone or has a newer generation.  The newer generation
+ * is checked after touching the file, so that a node taking the partition
+ * either sees the renewal or is seen by it.
+ */
+static void
+lease_renew(kadm5_hook_modinfo *config, time_t now)
+{
+    struct sync_lease *lease = config->lease;
+    unsigned long i;
+    bool expired;
+    char *path;
+
+    expired = (now >= lease->renewed + config->queue_lease_time);
+    for (i = 0; i < lease->partitions; i++) {
+        if (lease->held[i] == 0)
+            continue;
+        path = lease_path(config, i, lease->held[i]);
+        if (expired || path == NULL || utime(path, NULL) < 0
+            || lease_exists(config, i, lease->held[i] + 1)) {
+            sync_syslog_warning(config, "krb5-sync: lost lease on queue"
+                                " partition %lu", i);
+            lease->held[i] = 0;
+        }
+        free(path);
+    }
+    lease->renewed = now;
+}
+
+
+/*
+ * Create the lease state for the configuration, including the lease
+ * directory, if it doesn't exist yet.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+lease_init(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_lease *lease;
+    char host[256];
+    char *path;
+
+    if (config->lease != NULL)
+        return 0;
+    if (asprintf(&path, "%s/%s", config->queue_dir, LEASE_DIR) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        free(path);
+        return sync_error_system(ctx, "cannot create %s/%s",
+                                 config->queue_dir, LEASE_DIR);
+    }
+    free(path);
+    if (gethostname(host, sizeof(host)) < 0)
+        return sync_error_system(ctx, "cannot get hostname");
+    host[sizeof(host) - 1] = '\0';
+    lease = calloc(1, sizeof(*lease));
+    if (lease == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    lease->partitions = (unsigned long) config->queue_lease_partitions;
+    lease->held = calloc(lease->partitions, sizeof(*lease->held));
+    lease->node = strdup(host);
+    if (lease->held == NULL || lease->node == NULL) {
+        free(lease->held);
+        free(lease->node);
+        free(lease);
+        return sync_error_system(ctx, "cannot allocate memory");
+    }
+    config->lease = lease;
+    return 0;
+}
+
+
+/*
+ * Scan the lease directory, storing the newest generation of each partition
+ * and the modification time of its file in the provided arrays and setting
+ * nodes to the number of live nodes.  Older generations and expired node
+ * files are removed.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+lease_scan(kadm5_hook_modinfo *config, krb5_context ctx, time_t now,
+           unsigned long *generation, time_t *mtime, unsigned long *nodes)
+{
+    struct sync_lease *lease = config->lease;
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    unsigned long partition, number, old;
+    char *path = NULL, *dirpath;
+    char extra;
+
+    *nodes = 0;
+    if (asprintf(&dirpath, "%s/%s", config->queue_dir, LEASE_DIR) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    dir = opendir(dirpath);
+    if (dir == NULL) {
+        free(dirpath);
+        return sync_error_system(ctx, "cannot open %s/%s", config->queue_dir,
+                                 LEASE_DIR);
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        free(path);
+        if (asprintf(&path, "%s/%s", dirpath, entry->d_name) < 0) {
+            path = NULL;
+            break;
+        }
+        if (strncmp(entry->d_name, LEASE_NODE, strlen(LEASE_NODE)) == 0) {
+            if (stat(path, &st) < 0)
+                continue;
+            if (st.st_mtime + config->queue_lease_time > now)
+                (*nodes)++;
+            else
+                unlink(path);
+            continue;
+        }
+        if (sscanf(entry->d_name, "%lu-%lu%c", &partition, &number, &extra)
+                != 2
+            || partition >= lease->partitions || number == 0)
+            continue;
+        if (number < generation[partition]) {
+            unlink(path);
+            continue;
+        }
+        if (stat(path, &st) < 0)
+            continue;
+        old = generation[partition];
+        generation[partition] = number;
+        mtime[partition] = st.st_mtime;
+        if (old > 0) {
+            free(path);
+            path = lease_path(config, partition, old);
+            if (path != NULL)
+                unlink(path);
+        }
+    }
+    closedir(dir);
+    free(dirpath);
+    free(path);
+    return 0;
+}
+
+
+/*
+ * Touch the heartbeat file of this node, creating it if needed.  Returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+lease_heartbeat(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    char *path;
+    int fd;
+
+    if (asprintf(&path, "%s/%s/%s%s", config->queue_dir, LEASE_DIR,
+                 LEASE_NODE, config->lease->node) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    fd = open(path, O_WRONLY | O_CREAT, 0600);
+    if (fd < 0 || utime(path, NULL) < 0) {
+        if (fd >= 0)
+            close(fd);
+        free(path);
+        return sync_error_system(ctx, "cannot update %s/%s/%s%s",
+                                 config->queue_dir, LEASE_DIR, LEASE_NODE,
+                                 config->lease->node);
+    }
+    close(fd);
+    free(path);
+    return 0;
+}
+
+
+/*
+ * Take the lease on a partition whose newest lease file, of the given
+ * generation, has expired or which has no lease file.  Returns true if the
+ * lease was taken, and false if another node took it first or on error.
+ */
+static bool
+lease_take(kadm5_hook_modinfo *config, unsigned long partition,
+           unsigned long generation)
+{
+    struct sync_lease *lease = config->lease;
+    char *path;
+    int fd;
+
+    path = lease_path(config, partition, generation + 1);
+    if (path == NULL)
+        return false;
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    free(path);
+    if (fd < 0)
+        return false;
+    if (write(fd, lease->node, strlen(lease->node)) < 0)
+        sync_syslog_debug(config, "krb5-sync: cannot write lease on queue"
+                          " partition %lu", partition);
+    close(fd);
+    lease->held[partition] = generation + 1;
+    if (generation > 0) {
+        path = lease_path(config, partition, generation);
+        if (path != NULL)
+            unlink(path);
+        free(path);
+    }
+    sync_syslog_debug(config, "krb5-sync: took lease on queue partition %lu",
+                      partition);
+    return true;
+}
+
+
+/*
+ * Acquire this node's share of the partitions of the queue, renewing the
+ * leases already held and releasing those beyond its share.  Does nothing if
+ * queue_lease_partitions isn't set.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_lease_acquire(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_lease *lease;
+    unsigned long *generation = NULL;
+    time_t *mtime = NULL;
+    unsigned long i, p, nodes, share, count;
+    time_t now;
+    krb5_error_code code;
+
+    if (config->queue_lease_partitions <= 0)
+        return 0;
+    code = lease_init(config, ctx);
+    if (code != 0)
+        return code;
+    lease = config->lease;
+    now = time(NULL);
+    lease_renew(config, now);
+    code = lease_heartbeat(config, ctx);
+    if (code != 0)
+        return code;
+    generation = calloc(lease->partitions, sizeof(*generation));
+    mtime = calloc(lease->partitions, sizeof(*mtime));
+    if (generation == NULL || mtime == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    code = lease_scan(config, ctx, now, generation, mtime, &nodes);
+    if (code != 0)
+        goto done;
+
+    /* Work out our share, counting ourselves even if our file is new. */
+    if (nodes == 0)
+        nodes = 1;
+    share = (lease->partitions + nodes - 1) / nodes;
+
+    /*
+     * Walk the partitions starting at our preferred one, keeping the held
+     * leases up to our share and taking free ones until we have it.
+     */
+    count = 0;
+    p = sync_hash_string(lease->node) % lease->partitions;
+    for (i = 0; i < lease->partitions; i++, p = (p + 1) % lease->partitions) {
+        if (lease->held[p] != 0) {
+            if (count < share)
+                count++;
+            else
+                lease_drop(config, p);
+            continue;
+        }
+        if (count >= share)
+            continue;
+        if (generation[p] != 0
+            && mtime[p] + config->queue_lease_time > now)
+            continue;
+        if (lease_take(config, p, generation[p]))
+            count++;
+    }
+    sync_syslog_debug(config, "krb5-sync: holding leases on %lu of %lu queue"
+                      " partitions with %lu nodes", count, lease->partitions,
+                      nodes);
+
+done:
+    free(generation);
+    free(mtime);
+    return code;
+}
+
+
+/*
+ * Return whether this node may make the queued change with the given id,
+ * renewing the held leases first if half of queue_lease_time has passed.  An
+ * id of NULL, for a queue file with an invalid name, is in partition 0.
+ * Always returns true if queue_lease_partitions isn't set.
+ */
+bool
+sync_lease_held(kadm5_hook_modinfo *config, const char *id)
+{
+    struct sync_lease *lease = config->lease;
+    unsigned long partition;
+    time_t now;
+
+    if (config->queue_lease_partitions <= 0)
+        return true;
+    if (lease == NULL)
+        return false;
+    now = time(NULL);
+    if (now >= lease->renewed + config->queue_lease_time / 2)
+        lease_renew(config, now);
+    partition = (id == NULL) ? 0 : sync_hash_string(id) % lease->partitions;
+    return lease->held[partition] != 0;
+}
+
+
+/*
+ * Release all the leases held by this node and free the lease state, so that
+ * other nodes can take the partitions at once.  The heartbeat file is left
+ * to expire, so that other nodes don't take this node's share of the
+ * partitions if it's only between runs.
+ */
+void
+sync_lease_release(kadm5_hook_modinfo *config)
+{
+    struct sync_lease *lease = config->lease;
+    unsigned long i;
+
+    if (lease == NULL)
+        return;
+    for (i = 0; i < lease->partitions; i++)
+        lease_drop(config, i);
+    free(lease->held);
+    free(lease->node);
+    free(lease);
+    config->lease = NULL;
+}
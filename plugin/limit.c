@@ -0,0 +1,211 @@
+/*
+ * Adaptive limits on the Active Directory operations in flight at once.
+ *
+ * Batches of password changes keep up to ad_kpasswd_concurrency kpasswd
+ * exchanges in flight, and batches of status changes up to ad_status_depth
+ * LDAP operations.  A fixed number either leaves capacity unused or
+ * overloads the domain controllers, which then answer with busy errors.  If
+ * ad_adaptive_concurrency is set, those settings are maximums instead, and
+ * the number of operations in flight for each kind of operation and target
+ * is adjusted by additive increase and multiplicative decrease, as TCP does
+ * for its congestion window.
+ *
+ * The window starts at one operation.  Each operation that finishes without
+ * a sign of back-pressure grows it, by one until the first back-pressure and
+ * by one per window's worth of operations after that.  Back-pressure is a
+ * busy or unavailable server, a timeout, or, if ad_adaptive_slow is set, an
+ * operation taking longer than that, and halves the window.  Operations
+ * started before the last decrease don't decrease it again, so that a burst
+ * of failures from one overload only halves it once.
+ *
+ * The window is kept across batches in the configuration of each target, so
+ * the limits of each Active Directory are learned separately, and is updated
+ * by the threads of a batch of password changes, so it is locked.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+
+/*
+ * The window for one kind of operation.  slow_start is true until the first
+ * back-pressure, and epoch counts the decreases.
+ */
+struct limit_window {
+    double size;
+    bool slow_start;
+    unsigned long epoch;
+};
+
+/* The windows of a configuration and the mutex protecting them. */
+struct sync_limits {
+    pthread_mutex_t mutex;
+    struct limit_window windows[SYNC_LIMIT_MAX];
+};
+
+/* Names of the kinds of operations for log messages. */
+static const char *const limit_names[SYNC_LIMIT_MAX] = {
+    "kpasswd", "LDAP"
+};
+
+
+/*
+ * Get the windows of the configuration, creating them if needed.  Several
+ * threads may do this at once, so the first to store its windows wins.
+ * Returns NULL on failure to allocate memory.
+ */
+static struct sync_limits *
+limit_state(kadm5_hook_modinfo *config)
+{
+    struct sync_limits *limits, *expected = NULL;
+    size_t i;
+
+    limits = __atomic_load_n(&config->limits, __ATOMIC_ACQUIRE);
+    if (limits != NULL)
+        return limits;
+    limits = calloc(1, sizeof(*limits));
+    if (limits == NULL)
+        return NULL;
+    if (pthread_mutex_init(&limits->mutex, NULL) != 0) {
+        free(limits);
+        return NULL;
+    }
+    for (i = 0; i < SYNC_LIMIT_MAX; i++) {
+        limits->windows[i].size = 1;
+        limits->windows[i].slow_start = true;
+    }
+    if (!__atomic_compare_exchange_n(&config->limits, &expected, limits,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        pthread_mutex_destroy(&limits->mutex);
+        free(limits);
+        return expected;
+    }
+    return limits;
+}
+
+
+/*
+ * Return the number of operations of a kind that may be in flight at once
+ * for the configuration, given the configured maximum.  This is the maximum
+ * unless ad_adaptive_concurrency is set, and is always at least 1.
+ */
+size_t
+sync_limit_window(kadm5_hook_modinfo *config, enum sync_limit_kind kind,
+                  size_t max)
+{
+    struct sync_limits *limits;
+    struct limit_window *window;
+    size_t size;
+
+    if (max < 1)
+        max = 1;
+    if (!config->ad_adaptive_concurrency)
+        return max;
+    limits = limit_state(config);
+    if (limits == NULL)
+        return 1;
+    window = &limits->windows[kind];
+    pthread_mutex_lock(&limits->mutex);
+    if (window->size > (double) max)
+        window->size = (double) max;
+    size = (size_t) window->size;
+    pthread_mutex_unlock(&limits->mutex);
+    return (size < 1) ? 1 : size;
+}
+
+
+/*
+ * Record the start of an operation of a kind, filling in op, which is then
+ * passed to sync_limit_finish.
+ */
+void
+sync_limit_start(kadm5_hook_modinfo *config, enum sync_limit_kind kind,
+                 struct sync_limit_op *op)
+{
+    struct sync_limits *limits;
+
+    memset(op, 0, sizeof(*op));
+    if (!config->ad_adaptive_concurrency)
+        return;
+    limits = limit_state(config);
+    if (limits == NULL)
+        return;
+    pthread_mutex_lock(&limits->mutex);
+    op->epoch = limits->windows[kind].epoch;
+    pthread_mutex_unlock(&limits->mutex);
+    gettimeofday(&op->start, NULL);
+}
+
+
+/*
+ * Record the end of an operation started with sync_limit_start, given
+ * whether the server signalled back-pressure, and adjust the window.  An
+ * operation slower than ad_adaptive_slow also counts as back-pressure.
+ */
+void
+sync_limit_finish(kadm5_hook_modinfo *config, enum sync_limit_kind kind,
+                  const struct sync_limit_op *op, bool busy)
+{
+    struct sync_limits *limits;
+    struct limit_window *window;
+    struct timeval now;
+    long elapsed;
+    size_t size;
+    bool decreased = false;
+
+    if (!config->ad_adaptive_concurrency || op->start.tv_sec == 0)
+        return;
+    limits = limit_state(config);
+    if (limits == NULL)
+        return;
+    if (config->ad_adaptive_slow > 0) {
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - op->start.tv_sec) * 1000
+            + (now.tv_usec - op->start.tv_usec) / 1000;
+        if (elapsed > config->ad_adaptive_slow)
+            busy = true;
+    }
+    window = &limits->windows[kind];
+    pthread_mutex_lock(&limits->mutex);
+    if (busy && op->epoch == window->epoch) {
+        decreased = (window->size >= 2);
+        window->size /= 2;
+        if (window->size < 1)
+            window->size = 1;
+        window->slow_start = false;
+        window->epoch++;
+    } else if (!busy)
+        window->size += window->slow_start ? 1 : 1 / window->size;
+    size = (size_t) window->size;
+    pthread_mutex_unlock(&limits->mutex);
+    if (decreased)
+        sync_syslog_notice(config, "krb5-sync: %s%s%s is overloaded, reducing"
+                           " %s concurrency to %lu",
+                           config->ad_realm == NULL ? "Active Directory"
+                                                    : config->ad_realm,
+                           config->target == NULL ? "" : " for target ",
+                           config->target == NULL ? "" : config->target,
+                           limit_names[kind], (unsigned long) size);
+}
+
+
+/*
+ * Free the windows of the configuration.
+ */
+void
+sync_limit_close(kadm5_hook_modinfo *config)
+{
+    if (config->limits == NULL)
+        return;
+    pthread_mutex_destroy(&config->limits->mutex);
+    free(config->limits);
+    config->limits = NULL;
+}
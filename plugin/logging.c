@@ -7,6 +7,14 @@
  * anything.  In those cases, we log directly to syslog unless the syslog
  * configuration option is set to false.
  *
+ * During an Active Directory outage, every change logs the same message about
+ * queuing.  If syslog_limit is set, each message format, which identifies a
+ * class of similar messages, therefore gets a token bucket holding up to
+ * syslog_limit tokens and refilled at syslog_limit tokens a minute.  Messages
+ * for which no token is left are dropped before they are formatted, and the
+ * number dropped is logged before the next message of that class that is
+ * allowed, or when the plugin is unloaded.
+ *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2015 Russ Allbery <eagle@eyrie.org>
  * Copyright 2013
@@ -18,10 +26,146 @@
 #include <config.h>
 #include <portable/system.h>
 
+#include <pthread.h>
+#include <sys/time.h>
 #include <syslog.h>
 
 #include <plugin/internal.h>
 
+/*
+ * The number of message formats tracked.  Formats beyond this many aren't
+ * rate-limited, which is fine since only a few are logged for every change.
+ */
+#define LOG_CLASSES 32
+
+/*
+ * The token bucket for one message format.  tokens is the number of messages
+ * that may be logged now, last is when it was last refilled, and suppressed
+ * is the number of messages dropped since the last one logged.
+ */
+struct log_class {
+    const char *format;
+    int priority;
+    double tokens;
+    struct timeval last;
+    unsigned long suppressed;
+};
+
+/*
+ * The token buckets.  Messages may also be logged by the ad_async worker
+ * thread, so they are protected by a mutex, which is reinitialized if the
+ * process forked since pid initialized it.
+ */
+struct sync_log {
+    pthread_mutex_t mutex;
+    pid_t pid;
+    struct log_class classes[LOG_CLASSES];
+};
+
+
+/*
+ * Allocate the token buckets for a configuration with syslog_limit set.
+ * Returns NULL on failure.
+ */
+struct sync_log *
+sync_syslog_new(void)
+{
+    struct sync_log *log;
+
+    log = calloc(1, sizeof(*log));
+    if (log == NULL)
+        return NULL;
+    if (pthread_mutex_init(&log->mutex, NULL) != 0) {
+        free(log);
+        return NULL;
+    }
+    log->pid = getpid();
+    return log;
+}
+
+
+/*
+ * Lock the token buckets, reinitializing the mutex first if we have forked
+ * since it was initialized, since it may have been held by a thread that
+ * doesn't exist in this process.
+ */
+static void
+log_lock(struct sync_log *log)
+{
+    if (log->pid != getpid()) {
+        pthread_mutex_init(&log->mutex, NULL);
+        log->pid = getpid();
+    }
+    pthread_mutex_lock(&log->mutex);
+}
+
+
+/*
+ * Take a token from the bucket for a message format.  Returns true if the
+ * message should be logged, in which case suppressed is set to the number of
+ * messages of that format dropped since the last one logged.
+ */
+static bool
+log_allow(kadm5_hook_modinfo *config, int priority, const char *format,
+          unsigned long *suppressed)
+{
+    struct sync_log *log = config->log;
+    struct log_class *class = NULL;
+    struct timeval now;
+    double limit = (double) config->syslog_limit;
+    double elapsed;
+    size_t i, start;
+    bool allow = true;
+
+    *suppressed = 0;
+    if (gettimeofday(&now, NULL) < 0)
+        return true;
+    start = ((uintptr_t) format >> 3) % LOG_CLASSES;
+    log_lock(log);
+    for (i = 0; i < LOG_CLASSES; i++) {
+        class = &log->classes[(start + i) % LOG_CLASSES];
+        if (class->format == format || class->format == NULL)
+            break;
+    }
+    if (i == LOG_CLASSES)
+        goto done;
+    if (class->format == NULL) {
+        class->format = format;
+        class->priority = priority;
+        class->tokens = limit;
+    } else {
+        elapsed = (double) (now.tv_sec - class->last.tv_sec)
+            + (double) (now.tv_usec - class->last.tv_usec) / 1000000;
+        class->tokens += elapsed * limit / 60;
+        if (class->tokens > limit)
+            class->tokens = limit;
+    }
+    class->last = now;
+    if (class->tokens < 1) {
+        class->suppressed++;
+        allow = false;
+    } else {
+        class->tokens--;
+        *suppressed = class->suppressed;
+        class->suppressed = 0;
+    }
+
+done:
+    pthread_mutex_unlock(&log->mutex);
+    return allow;
+}
+
+
+/*
+ * Log the number of suppressed messages of a format.
+ */
+static void
+log_suppressed(int priority, const char *format, unsigned long suppressed)
+{
+    syslog(priority, "krb5-sync: %lu messages like \"%s\" suppressed",
+           suppressed, format);
+}
+
 
 /*
  * Log a message to syslog.  This is a helper function used to implement all
@@ -35,10 +179,16 @@ log_syslog(kadm5_hook_modinfo *config, int priority, const char *fmt,
 {
     char *message;
     int status;
+    unsigned long suppressed = 0;
 
-    /* If configured not to log, do nothing. */
+    /* If configured not to log, or over the rate limit, do nothing. */
     if (!config->syslog)
         return;
+    if (config->log != NULL && config->syslog_limit > 0
+        && !log_allow(config, priority, fmt, &suppressed))
+        return;
+    if (suppressed > 0)
+        log_suppressed(priority, fmt, suppressed);
 
     /* Log the message. */
     status = vasprintf(&message, fmt, args);
@@ -65,3 +215,28 @@ SYSLOG_FUNCTION(debug,   DEBUG)
 SYSLOG_FUNCTION(info,    INFO)
 SYSLOG_FUNCTION(notice,  NOTICE)
 SYSLOG_FUNCTION(warning, WARNING)
+
+
+/*
+ * Log the number of messages suppressed since the last one of each format
+ * and free the token buckets.
+ */
+void
+sync_syslog_close(kadm5_hook_modinfo *config)
+{
+    struct sync_log *log = config->log;
+    struct log_class *class;
+    size_t i;
+
+    if (log == NULL)
+        return;
+    config->log = NULL;
+    for (i = 0; i < LOG_CLASSES; i++) {
+        class = &log->classes[i];
+        if (class->suppressed > 0 && config->syslog)
+            log_suppressed(class->priority, class->format, class->suppressed);
+    }
+    if (log->pid == getpid())
+        pthread_mutex_destroy(&log->mutex);
+    free(log);
+}
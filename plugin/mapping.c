@@ -0,0 +1,490 @@
+/*
+ * Rules mapping principals with an instance to Active Directory.
+ *
+ * By default, the Active Directory principal of a change is the local
+ * principal with the realm replaced, or the base name for ad_base_instance.
+ * ad_mapping_rules gives rules for other instances, each of the form:
+ *
+ *     <instance>:<principal>[:<base>[:<dn>]]
+ *
+ * where <principal> is a template for the Active Directory principal without
+ * the realm, <base> is the LDAP search base for its account, and <dn> is a
+ * template for the DN of its account.  Any field after the instance may be
+ * empty to keep the default.  In the templates, %n is replaced with the
+ * first component of the local principal, %i with its instance, and %% with
+ * a literal percent sign.  The values are escaped as RFC 4514 requires when
+ * put into a DN.
+ *
+ * The rules are compiled when the configuration is loaded into a hash table
+ * keyed by instance, with the templates checked and split into their parts,
+ * so finding and applying the rule for a change takes constant time no
+ * matter how many rules there are.  With a DN template, the account of a
+ * change is read directly by DN rather than searched for.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <plugin/internal.h>
+
+/*
+ * A part of a compiled template: literal text, the first component of the
+ * principal, or its instance.
+ */
+enum mapping_part_type {
+    MAPPING_TEXT,
+    MAPPING_NAME,
+    MAPPING_INSTANCE
+};
+
+struct mapping_part {
+    enum mapping_part_type type;
+    char *text;
+};
+
+/* A compiled template, as a list of parts, or no template if count is 0. */
+struct mapping_template {
+    size_t count;
+    struct mapping_part *parts;
+};
+
+/*
+ * The compiled rule for one instance.  base is NULL if the rule doesn't set
+ * a search base.
+ */
+struct mapping_rule {
+    char *instance;
+    struct mapping_template principal;
+    char *base;
+    struct mapping_template dn;
+    struct mapping_rule *next;
+};
+
+/*
+ * The compiled rules, as a hash table with chained buckets.  The number of
+ * buckets is a power of two at least the number of rules.
+ */
+struct sync_mapping {
+    size_t nbuckets;
+    struct mapping_rule **buckets;
+};
+
+
+/*
+ * Free the parts of a compiled template.
+ */
+static void
+mapping_template_free(struct mapping_template *template)
+{
+    size_t i;
+
+    for (i = 0; i < template->count; i++)
+        free(template->parts[i].text);
+    free(template->parts);
+    template->count = 0;
+    template->parts = NULL;
+}
+
+
+/*
+ * Add a part to a compiled template, copying length bytes of text for a
+ * literal part.  Returns false on failure to allocate memory.
+ */
+static bool
+mapping_template_add(struct mapping_template *template,
+                     enum mapping_part_type type, const char *text,
+                     size_t length)
+{
+    struct mapping_part *parts;
+
+    parts = reallocarray(template->parts, template->count + 1,
+                         sizeof(*parts));
+    if (parts == NULL)
+        return false;
+    template->parts = parts;
+    parts[template->count].type = type;
+    parts[template->count].text = NULL;
+    if (type == MAPPING_TEXT) {
+        parts[template->count].text = strndup(text, length);
+        if (parts[template->count].text == NULL)
+            return false;
+    }
+    template->count++;
+    return true;
+}
+
+
+/*
+ * Compile the template from start to end into template, given the rule it
+ * is part of for error messages.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+mapping_template_compile(krb5_context ctx, const char *rule,
+                         const char *start, const char *end,
+                         struct mapping_template *template)
+{
+    const char *p, *text;
+    enum mapping_part_type type;
+
+    for (p = start, text = start; p < end; p++) {
+        if (*p != '%')
+            continue;
+        if (p > text
+            && !mapping_template_add(template, MAPPING_TEXT, text,
+                                     (size_t) (p - text)))
+            return sync_error_system(ctx, "cannot allocate memory");
+        if (p + 1 < end && p[1] == '%') {
+            text = p + 1;
+            p++;
+            continue;
+        }
+        if (p + 1 < end && p[1] == 'n')
+            type = MAPPING_NAME;
+        else if (p + 1 < end && p[1] == 'i')
+            type = MAPPING_INSTANCE;
+        else
+            return sync_error_config(ctx, "invalid template in"
+                                     " ad_mapping_rules entry %s", rule);
+        if (!mapping_template_add(template, type, NULL, 0))
+            return sync_error_system(ctx, "cannot allocate memory");
+        p++;
+        text = p + 1;
+    }
+    if (p > text
+        && !mapping_template_add(template, MAPPING_TEXT, text,
+                                 (size_t) (p - text)))
+        return sync_error_system(ctx, "cannot allocate memory");
+    return 0;
+}
+
+
+/*
+ * Append a value to a DN being expanded at out, escaping it as RFC 4514
+ * requires: the special characters anywhere, and a leading space or number
+ * sign or a trailing space.  The caller provides enough room for every
+ * character to be escaped.  Returns the new end of the DN.
+ */
+static char *
+mapping_dn_escape(char *out, const char *value)
+{
+    const char *p;
+
+    for (p = value; *p != '\0'; p++) {
+        if (strchr(",+\"\\<>;=", *p) != NULL
+            || (p == value && (*p == ' ' || *p == '#'))
+            || (p[1] == '\0' && *p == ' '))
+            *out++ = '\\';
+        *out++ = *p;
+    }
+    *out = '\0';
+    return out;
+}
+
+
+/*
+ * Expand a compiled template for a principal, given its first component and
+ * instance, into a string allocated for the request, escaping the values as
+ * DN attribute values if dn is true.  Returns NULL on failure to allocate
+ * memory.
+ */
+static char *
+mapping_expand(struct sync_request *request,
+               const struct mapping_template *template, const char *name,
+               const char *instance, bool dn)
+{
+    const struct mapping_part *part;
+    const char *value;
+    char *result, *out;
+    size_t i, length = 1;
+
+    for (i = 0; i < template->count; i++) {
+        part = &template->parts[i];
+        if (part->type == MAPPING_TEXT)
+            length += strlen(part->text);
+        else {
+            value = (part->type == MAPPING_NAME) ? name : instance;
+            length += strlen(value) * (dn ? 2 : 1);
+        }
+    }
+    result = sync_request_printf(request, "%*s", (int) length - 1, "");
+    if (result == NULL)
+        return NULL;
+    out = result;
+    for (i = 0; i < template->count; i++) {
+        part = &template->parts[i];
+        value = part->text;
+        if (part->type != MAPPING_TEXT)
+            value = (part->type == MAPPING_NAME) ? name : instance;
+        if (dn && part->type != MAPPING_TEXT)
+            out = mapping_dn_escape(out, value);
+        else {
+            memcpy(out, value, strlen(value) + 1);
+            out += strlen(value);
+        }
+    }
+    *out = '\0';
+    return result;
+}
+
+
+/*
+ * Free one compiled rule.
+ */
+static void
+mapping_rule_free(struct mapping_rule *rule)
+{
+    free(rule->instance);
+    mapping_template_free(&rule->principal);
+    free(rule->base);
+    mapping_template_free(&rule->dn);
+    free(rule);
+}
+
+
+/*
+ * Compile one entry of ad_mapping_rules into a new rule.  Returns a Kerberos
+ * status code.
+ */
+static krb5_error_code
+mapping_rule_compile(krb5_context ctx, const char *entry,
+                     struct mapping_rule **result)
+{
+    struct mapping_rule *rule;
+    const char *fields[4], *ends[4];
+    const char *p;
+    size_t count = 0, i;
+    krb5_error_code code;
+
+    /* Split the entry on colons. */
+    fields[0] = entry;
+    for (p = entry; *p != '\0'; p++)
+        if (*p == ':') {
+            if (count == 3)
+                return sync_error_config(ctx, "too many fields in"
+                                         " ad_mapping_rules entry %s",
+                                         entry);
+            ends[count++] = p;
+            fields[count] = p + 1;
+        }
+    ends[count++] = p;
+    if (count < 2 || ends[0] == fields[0])
+        return sync_error_config(ctx, "invalid ad_mapping_rules entry %s",
+                                 entry);
+
+    /* Compile the fields. */
+    rule = calloc(1, sizeof(*rule));
+    if (rule == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    rule->instance = strndup(fields[0], (size_t) (ends[0] - fields[0]));
+    if (rule->instance == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto fail;
+    }
+    code = mapping_template_compile(ctx, entry, fields[1], ends[1],
+                                    &rule->principal);
+    if (code != 0)
+        goto fail;
+    for (i = 0, p = fields[1]; p < ends[1]; p++)
+        if (*p == '/')
+            i++;
+    if (i > 1) {
+        code = sync_error_config(ctx, "principal in ad_mapping_rules entry"
+                                 " %s has more than two components", entry);
+        goto fail;
+    }
+    if (count > 2 && ends[2] > fields[2]) {
+        rule->base = strndup(fields[2], (size_t) (ends[2] - fields[2]));
+        if (rule->base == NULL) {
+            code = sync_error_system(ctx, "cannot allocate memory");
+            goto fail;
+        }
+    }
+    if (count > 3) {
+        code = mapping_template_compile(ctx, entry, fields[3], ends[3],
+                                        &rule->dn);
+        if (code != 0)
+            goto fail;
+    }
+    *result = rule;
+    return 0;
+
+fail:
+    mapping_rule_free(rule);
+    return code;
+}
+
+
+/*
+ * Compile ad_mapping_rules into the mapping table of the configuration.
+ * Does nothing if there are no rules.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_mapping_compile(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_mapping *mapping;
+    struct mapping_rule *rule, *other;
+    size_t i, bucket;
+    krb5_error_code code;
+
+    if (config->ad_mapping_rules == NULL
+        || config->ad_mapping_rules->count == 0)
+        return 0;
+    mapping = calloc(1, sizeof(*mapping));
+    if (mapping == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    for (mapping->nbuckets = 16;
+         mapping->nbuckets < config->ad_mapping_rules->count; )
+        mapping->nbuckets *= 2;
+    mapping->buckets = calloc(mapping->nbuckets, sizeof(*mapping->buckets));
+    if (mapping->buckets == NULL) {
+        free(mapping);
+        return sync_error_system(ctx, "cannot allocate memory");
+    }
+    for (i = 0; i < config->ad_mapping_rules->count; i++) {
+        code = mapping_rule_compile(ctx, config->ad_mapping_rules->strings[i],
+                                    &rule);
+        if (code != 0)
+            goto fail;
+        bucket = sync_hash_string(rule->instance) & (mapping->nbuckets - 1);
+        for (other = mapping->buckets[bucket]; other != NULL;
+             other = other->next)
+            if (strcmp(other->instance, rule->instance) == 0) {
+                code = sync_error_config(ctx, "more than one"
+                                         " ad_mapping_rules entry for"
+                                         " instance %s", rule->instance);
+                mapping_rule_free(rule);
+                goto fail;
+            }
+        rule->next = mapping->buckets[bucket];
+        mapping->buckets[bucket] = rule;
+    }
+    config->mapping = mapping;
+    return 0;
+
+fail:
+    sync_mapping_free(mapping);
+    return code;
+}
+
+
+/*
+ * Return the rule for the principal of a request, or NULL if it has no
+ * instance or there is no rule for its instance.  Stores its first component
+ * and instance in name and instance.
+ */
+static struct mapping_rule *
+mapping_find(kadm5_hook_modinfo *config, krb5_context ctx,
+             krb5_const_principal principal, const char **name,
+             const char **instance)
+{
+    struct mapping_rule *rule;
+    size_t bucket;
+
+    if (config->mapping == NULL
+        || krb5_principal_get_num_comp(ctx, principal) != 2)
+        return NULL;
+    *name = krb5_principal_get_comp_string(ctx, principal, 0);
+    *instance = krb5_principal_get_comp_string(ctx, principal, 1);
+    bucket = sync_hash_string(*instance) & (config->mapping->nbuckets - 1);
+    for (rule = config->mapping->buckets[bucket]; rule != NULL;
+         rule = rule->next)
+        if (strcmp(rule->instance, *instance) == 0)
+            return rule;
+    return NULL;
+}
+
+
+/*
+ * Store in principal the Active Directory principal given by the rule for
+ * the principal of a request, which must be freed by the caller, or NULL if
+ * no rule gives one.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_mapping_principal(kadm5_hook_modinfo *config, krb5_context ctx,
+                       struct sync_request *request,
+                       krb5_principal *principal)
+{
+    struct mapping_rule *rule;
+    const char *name, *instance;
+    char *mapped, *slash;
+
+    *principal = NULL;
+    rule = mapping_find(config, ctx, request->principal, &name, &instance);
+    if (rule == NULL || rule->principal.count == 0)
+        return 0;
+    mapped = mapping_expand(request, &rule->principal, name, instance,
+                            false);
+    if (mapped == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    slash = strchr(mapped, '/');
+    if (slash == NULL)
+        return krb5_build_principal(ctx, principal, config->ad_realm_length,
+                                    config->ad_realm, mapped, (char *) 0);
+    *slash = '\0';
+    return krb5_build_principal(ctx, principal, config->ad_realm_length,
+                                config->ad_realm, mapped, slash + 1,
+                                (char *) 0);
+}
+
+
+/*
+ * Return the search base given by the rule for the principal of a request,
+ * or NULL if no rule gives one.
+ */
+const char *
+sync_mapping_base(kadm5_hook_modinfo *config, krb5_context ctx,
+                  struct sync_request *request)
+{
+    struct mapping_rule *rule;
+    const char *name, *instance;
+
+    rule = mapping_find(config, ctx, request->principal, &name, &instance);
+    return (rule == NULL) ? NULL : rule->base;
+}
+
+
+/*
+ * Store in dn the DN of the account given by the rule for the principal of
+ * a request, which lasts until the request is freed, or NULL if no rule
+ * gives one.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_mapping_dn(kadm5_hook_modinfo *config, krb5_context ctx,
+                struct sync_request *request, const char **dn)
+{
+    struct mapping_rule *rule;
+    const char *name, *instance;
+
+    *dn = NULL;
+    rule = mapping_find(config, ctx, request->principal, &name, &instance);
+    if (rule == NULL || rule->dn.count == 0)
+        return 0;
+    *dn = mapping_expand(request, &rule->dn, name, instance, true);
+    if (*dn == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    return 0;
+}
+
+
+/*
+ * Free the compiled rules.
+ */
+void
+sync_mapping_free(struct sync_mapping *mapping)
+{
+    struct mapping_rule *rule, *next;
+    size_t i;
+
+    if (mapping == NULL)
+        return;
+    for (i = 0; i < mapping->nbuckets; i++)
+        for (rule = mapping->buckets[i]; rule != NULL; rule = next) {
+            next = rule->next;
+            mapping_rule_free(rule);
+        }
+    free(mapping->buckets);
+    free(mapping);
+}
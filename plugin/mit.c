@@ -44,12 +44,19 @@ krb5_error_code kadm5_hook_sync_initvt(krb5_context, int, int,
 
 /*
  * Initialize the plugin.  Calls the pwupdate_init() function and returns the
- * resulting data object.
+ * resulting data object, and then warms up the AD credentials and
+ * connections if ad_warmup is set.
  */
 static kadm5_ret_t
 init(krb5_context ctx, kadm5_hook_modinfo **data)
 {
-    return sync_init(ctx, data);
+    krb5_error_code code;
+
+    code = sync_init(ctx, data);
+    if (code != 0)
+        return code;
+    sync_warmup_start(*data, ctx);
+    return 0;
 }
 
 
@@ -92,13 +99,16 @@ chpass(krb5_context ctx, kadm5_hook_modinfo *data, int stage,
  * Handle a principal creation.
  *
  * We only care about synchronizing the password, so we just call the same
- * hooks as we did for a password change.
+ * hooks as we did for a password change, after noting the new principal for
+ * the ad_base_instance checks.
  */
 static kadm5_ret_t
 create(krb5_context ctx, kadm5_hook_modinfo *data, int stage,
        kadm5_principal_ent_t entry, long mask UNUSED, int n_ks_tuple UNUSED,
        krb5_key_salt_tuple *ks_tuple UNUSED, const char *password)
 {
+    if (stage == KADM5_HOOK_STAGE_POSTCOMMIT)
+        sync_instance_created(data, ctx, entry->principal);
     return chpass(ctx, data, stage, entry->principal, false, n_ks_tuple,
                   ks_tuple, password);
 }
@@ -107,9 +117,10 @@ create(krb5_context ctx, kadm5_hook_modinfo *data, int stage,
 /*
  * Handle a principal modification.
  *
- * We only care about changes to the DISALLOW_ALL_TIX flag, and we only
- * support status postcommit.  Check whether that's what's being changed and
- * call the appropriate hook.
+ * We only care about changes to the DISALLOW_ALL_TIX flag.  Check whether
+ * the attributes are being changed, remember the old status in precommit,
+ * and call the appropriate hook postcommit, which does nothing unless the
+ * flag actually changed.
  */
 static kadm5_ret_t
 modify(krb5_context ctx, kadm5_hook_modinfo *data, int stage,
@@ -117,6 +128,8 @@ modify(krb5_context ctx, kadm5_hook_modinfo *data, int stage,
 {
     bool enabled;
 
+    if (mask & KADM5_ATTRIBUTES && stage == KADM5_HOOK_STAGE_PRECOMMIT)
+        sync_status_precommit(data, ctx, entry->principal);
     if (mask & KADM5_ATTRIBUTES && stage == KADM5_HOOK_STAGE_POSTCOMMIT) {
         enabled = !(entry->attributes & KRB5_KDB_DISALLOW_ALL_TIX);
         return sync_status(data, ctx, entry->principal, enabled);
@@ -126,11 +139,47 @@ modify(krb5_context ctx, kadm5_hook_modinfo *data, int stage,
 
 
 /*
- * The public interface called by the kadmin hook code in MIT Kerberos.
+ * Handle a principal deletion.  Note the removed principal for the
+ * ad_base_instance checks and drop any changes still queued for it.
+ */
+static kadm5_ret_t
+remove_hook(krb5_context ctx, kadm5_hook_modinfo *data, int stage,
+            krb5_principal princ)
+{
+    if (stage == KADM5_HOOK_STAGE_POSTCOMMIT) {
+        sync_instance_removed(data, ctx, princ);
+        return sync_remove(data, ctx, princ);
+    }
+    return 0;
+}
+
+
+#ifdef HAVE_KADM5_HOOK_VFTABLE_1_RENAME
+/*
+ * Handle a principal rename.  Update the ad_base_instance checks and move any
+ * changes still queued for the old name to the new one.
+ */
+static kadm5_ret_t
+rename_hook(krb5_context ctx, kadm5_hook_modinfo *data, int stage,
+            krb5_principal oprinc, krb5_principal nprinc)
+{
+    if (stage == KADM5_HOOK_STAGE_POSTCOMMIT) {
+        sync_instance_removed(data, ctx, oprinc);
+        sync_instance_created(data, ctx, nprinc);
+        return sync_rename(data, ctx, oprinc, nprinc);
+    }
+    return 0;
+}
+#endif
+
+
+/*
+ * The public interface called by the kadmin hook code in MIT Kerberos.  The
+ * rename hook was added in minor version 1 of the interface.
  */
 krb5_error_code
 kadm5_hook_sync_initvt(krb5_context ctx UNUSED, int maj_ver,
-                       int min_ver UNUSED, krb5_plugin_vtable vtable)
+                       int min_ver, krb5_plugin_vtable vtable)
 {
     kadm5_hook_vftable_1 *vt = (kadm5_hook_vftable_1 *) vtable;
 
@@ -142,6 +191,12 @@ kadm5_hook_sync_initvt(krb5_context ctx UNUSED, int maj_ver,
     vt->chpass = chpass;
     vt->create = create;
     vt->modify = modify;
+    vt->remove = remove_hook;
+    if (min_ver >= 1) {
+#ifdef HAVE_KADM5_HOOK_VFTABLE_1_RENAME
+        vt->rename = rename_hook;
+#endif
+    }
     return 0;
 }
 
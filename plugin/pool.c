@@ -0,0 +1,622 @@
+/*
+ * Pool of LDAP connections to Active Directory.
+ *
+ * Binding to Active Directory with GSSAPI costs several round trips, so
+ * rather than binding for every account status change, keep a small pool of
+ * bound LDAP connections to Active Directory and reuse them.  Connections are
+ * checked before reuse and discarded if the server has closed them or if
+ * they've been idle long enough that Active Directory has probably dropped
+ * them.
+ *
+ * New connections go to the server chosen by sync_server_pick from
+ * ad_ldap_servers or ad_admin_server.  If that server can't be reached, it is
+ * marked as failed and the next best server is tried, so a server that is
+ * down only costs one timeout until its backoff period is over.
+ *
+ * If ad_warmup is set, the refresher in warmup.c also uses the pool to keep
+ * idle connections from being dropped by Active Directory, so the pool is
+ * protected by a mutex.  Binding a new connection is done without holding
+ * it, with the slot for the connection reserved by marking it in use.
+ *
+ * A process that forks after binding connections, such as Heimdal kadmind
+ * forking a child for each connection, shares their sockets and GSSAPI
+ * contexts with the child.  The child therefore abandons the connections it
+ * inherited the first time it uses the pool, without unbinding them, and
+ * binds its own.
+ *
+ * If ad_ldaps is set, the connections use LDAPS, and if passwords are set
+ * over LDAP (see ad_password_method), they are required to be encrypted.
+ *
+ * The GSSAPI bind is pointed at the AD credential cache with
+ * gss_krb5_ccache_name, which sets the cache for the calling thread only, so
+ * the ad_async worker thread and the threads of a password batch can bind or
+ * make changes at the same time as other threads without touching the
+ * environment of the process.
+ *
+ * Written by Russ Allbery <eagle@eyrie.org>
+ * Based on code developed by Derrick Brashear and Ken Hornstein of Sine
+ *     Nomine Associates, on behalf of Stanford University.
+ * Copyright 2006, 2007, 2010, 2012, 2013
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#ifdef HAVE_GSS_KRB5_CCACHE_NAME
+# ifdef HAVE_GSSAPI_GSSAPI_KRB5_H
+#  include <gssapi/gssapi_krb5.h>
+# else
+#  include <gssapi.h>
+# endif
+#endif
+#include <lber.h>
+#include <ldap.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+#include <util/macros.h>
+
+/*
+ * Discard pooled connections that have been idle for longer than this many
+ * seconds.  Active Directory closes idle LDAP connections after fifteen
+ * minutes by default (MaxConnIdleTime), so stay comfortably under that.
+ */
+#define POOL_IDLE_MAX (10 * 60)
+
+/*
+ * sync_ldap_keepalive checks idle connections that haven't been used for this
+ * many seconds, which resets the Active Directory idle timer.
+ */
+#define POOL_KEEPALIVE (POOL_IDLE_MAX / 2)
+
+/*
+ * The minimum SASL security strength factor required if passwords are set
+ * over LDAP without LDAPS, which makes GSSAPI encrypt the connection.
+ */
+#define POOL_SSF_MIN 56
+
+/* A single pooled connection. */
+struct pool_conn {
+    LDAP *ld;
+    time_t last_used;
+    bool in_use;
+};
+
+/*
+ * The pool of connections to Active Directory.  The mutex is reinitialized
+ * and the connections abandoned if the process forked since pid initialized
+ * it.
+ */
+struct sync_ldap_pool {
+    pthread_mutex_t mutex;
+    pid_t pid;
+    size_t size;
+    struct pool_conn *conns;
+};
+
+
+/*
+ * Empty SASL callback function to satisfy the requirements of the LDAP SASL
+ * bind interface.  Hopefully it won't need anything.
+ */
+static int
+pool_interact_sasl(LDAP *ld UNUSED, unsigned flags UNUSED,
+                   void *defaults UNUSED, void *interact UNUSED)
+{
+    return 0;
+}
+
+
+/*
+ * Create the connection pool.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+pool_new(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_ldap_pool *pool;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    pool->size = (config->ad_ldap_connections > 0)
+        ? (size_t) config->ad_ldap_connections : 1;
+    pool->conns = calloc(pool->size, sizeof(struct pool_conn));
+    if (pool->conns == NULL) {
+        free(pool);
+        return sync_error_system(ctx, "cannot allocate memory");
+    }
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool->conns);
+        free(pool);
+        return sync_error_system(ctx, "cannot initialize mutex");
+    }
+    pool->pid = getpid();
+    config->ldap_pool = pool;
+    return 0;
+}
+
+
+/*
+ * If we have forked since the pool was created, reinitialize the mutex, since
+ * it may have been held by a thread that doesn't exist in this process, and
+ * forget the connections inherited from the parent.  They can't be unbound,
+ * since that would end the session of the parent, which is still using them,
+ * so only the copy of each socket in this process is closed and the LDAP
+ * handles are leaked.  Slots reserved by threads of the parent are freed.
+ */
+static void
+pool_forked(struct sync_ldap_pool *pool)
+{
+    struct pool_conn *conn;
+    size_t i;
+    int fd, status;
+
+    if (pool->pid == getpid())
+        return;
+    pthread_mutex_init(&pool->mutex, NULL);
+    for (i = 0; i < pool->size; i++) {
+        conn = &pool->conns[i];
+        if (conn->ld != NULL) {
+            fd = -1;
+            status = ldap_get_option(conn->ld, LDAP_OPT_DESC, &fd);
+            if (status == LDAP_OPT_SUCCESS && fd >= 0)
+                close(fd);
+        }
+        conn->ld = NULL;
+        conn->in_use = false;
+    }
+    pool->pid = getpid();
+}
+
+
+/*
+ * Lock the pool, first dealing with a fork since it was created.
+ */
+static void
+pool_lock(struct sync_ldap_pool *pool)
+{
+    pool_forked(pool);
+    pthread_mutex_lock(&pool->mutex);
+}
+
+
+/*
+ * Point the GSSAPI mechanism used by SASL at our credential cache for the
+ * calling thread.  Without gss_krb5_ccache_name, fall back on setting
+ * KRB5CCNAME, which changes the environment of the whole process and so
+ * isn't safe with other threads running.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+pool_ccache(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+#ifdef HAVE_GSS_KRB5_CCACHE_NAME
+    OM_uint32 major, minor;
+
+    major = gss_krb5_ccache_name(&minor, config->ad_ccache_name, NULL);
+    if (GSS_ERROR(major))
+        return sync_error_generic(ctx, "cannot set GSS-API credential cache"
+                                  " to %s", config->ad_ccache_name);
+    return 0;
+#else
+    if (setenv("KRB5CCNAME", config->ad_ccache_name, 1) != 0)
+        return sync_error_system(ctx, "setenv of KRB5CCNAME failed");
+    return 0;
+#endif
+}
+
+
+/*
+ * Return the number of milliseconds since start.
+ */
+static unsigned long
+pool_elapsed(const struct timeval *start)
+{
+    struct timeval now;
+    long msec;
+
+    if (gettimeofday(&now, NULL) < 0)
+        return 0;
+    msec = (now.tv_sec - start->tv_sec) * 1000
+        + (now.tv_usec - start->tv_usec) / 1000;
+    return (msec > 0) ? (unsigned long) msec : 0;
+}
+
+
+/*
+ * Open a new LDAP connection to the server with the given index and bind
+ * with GSSAPI using our AD credentials.  If the bind fails in a way that
+ * indicates a problem with our credentials, discard them and retry once with
+ * new credentials.  The result is reported to the server health tracking,
+ * and down is set to true if the server couldn't be reached.  Returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+pool_connect(kadm5_hook_modinfo *config, krb5_context ctx, size_t server,
+             LDAP **result, bool *down)
+{
+    krb5_ccache ccache = NULL;
+    LDAP *ld = NULL;
+    const char *uri;
+    struct timeval start, bind_start;
+    int option;
+    ber_len_t ssf;
+    krb5_error_code code;
+
+    /* Get the credentials we'll use to bind to AD. */
+    *result = NULL;
+    *down = false;
+    if (config->ad_ldap_uris == NULL || server >= config->ad_ldap_uris->count)
+        return sync_error_config(ctx, "configuration setting ad_admin_server"
+                                 " missing");
+    uri = config->ad_ldap_uris->strings[server];
+    code = sync_ad_creds(config, ctx, &ccache);
+    if (code != 0)
+        return code;
+    if (gettimeofday(&start, NULL) < 0) {
+        start.tv_sec = 0;
+        start.tv_usec = 0;
+    }
+
+    /* Point SASL at our credential cache. */
+    code = pool_ccache(config, ctx);
+    if (code != 0)
+        goto fail;
+
+    /* Now, bind to the directory server using GSSAPI. */
+    code = ldap_initialize(&ld, uri);
+    if (code != LDAP_SUCCESS) {
+        code = sync_error_ldap(ctx, code, "LDAP initialization failed");
+        goto fail;
+    }
+    option = LDAP_VERSION3;
+    code = ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &option);
+    if (code != LDAP_SUCCESS) {
+        code = sync_error_ldap(ctx, code, "LDAP protocol selection failed");
+        goto fail;
+    }
+
+    /*
+     * Active Directory only allows setting passwords over an encrypted
+     * connection.  Over LDAPS, TLS does that and Active Directory rejects a
+     * GSSAPI security layer on top of it, so turn the layer off.  Otherwise,
+     * if passwords are set over LDAP, require GSSAPI to encrypt.
+     */
+    if (config->ad_ldaps || sync_ad_password_ldap(config)) {
+        ssf = config->ad_ldaps ? 0 : POOL_SSF_MIN;
+        code = ldap_set_option(ld, config->ad_ldaps ? LDAP_OPT_X_SASL_SSF_MAX
+                                                    : LDAP_OPT_X_SASL_SSF_MIN,
+                               &ssf);
+        if (code != LDAP_SUCCESS) {
+            code = sync_error_ldap(ctx, code, "LDAP SASL security setup"
+                                   " failed");
+            goto fail;
+        }
+    }
+    code = sync_ldap_limit(config, ctx, ld);
+    if (code != 0)
+        goto fail;
+    sync_stats_start(config, &bind_start);
+    code = ldap_sasl_interactive_bind_s(ld, NULL, "GSSAPI", NULL, NULL,
+                                       LDAP_SASL_QUIET, pool_interact_sasl,
+                                       NULL);
+
+    /*
+     * A GSSAPI bind failure usually means that AD didn't like our cached
+     * credentials.  Discard them and retry once with new credentials.
+     */
+    if (code == LDAP_LOCAL_ERROR || code == LDAP_INVALID_CREDENTIALS) {
+        krb5_cc_close(ctx, ccache);
+        ccache = NULL;
+        sync_ad_creds_reset(config, ctx);
+        code = sync_ad_creds(config, ctx, &ccache);
+        if (code != 0)
+            goto fail;
+        code = ldap_sasl_interactive_bind_s(ld, NULL, "GSSAPI", NULL, NULL,
+                                           LDAP_SASL_QUIET,
+                                           pool_interact_sasl, NULL);
+    }
+    sync_stats_record(config, SYNC_STATS_LDAP_BIND, &bind_start, code);
+    if (sync_ldap_down(code)) {
+        *down = true;
+        sync_server_report(config, server, false, 0);
+    }
+    if (code != LDAP_SUCCESS) {
+        code = sync_error_ldap(ctx, code, "LDAP bind to %s failed",
+                               sync_server_name(config, server));
+        goto fail;
+    }
+    sync_server_report(config, server, true, pool_elapsed(&start));
+    krb5_cc_close(ctx, ccache);
+    *result = ld;
+    return 0;
+
+fail:
+    if (ccache != NULL)
+        krb5_cc_close(ctx, ccache);
+    if (ld != NULL)
+        ldap_unbind_ext_s(ld, NULL, NULL);
+    return code;
+}
+
+
+/*
+ * Check whether an idle pooled connection is still usable.  The connection
+ * should have no outstanding requests, so if the socket is readable, the
+ * server has either closed it or sent a notice of disconnection.  This costs
+ * one poll system call and no network traffic.
+ */
+static bool
+pool_conn_alive(struct pool_conn *conn, time_t now)
+{
+    struct pollfd pfd;
+    int fd = -1;
+
+    if (now - conn->last_used > POOL_IDLE_MAX)
+        return false;
+    if (ldap_get_option(conn->ld, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS)
+        return false;
+    if (fd < 0)
+        return false;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+
+/*
+ * Get a bound LDAP connection to Active Directory from the pool, binding a
+ * new one if there are no idle connections left.  The connection must be
+ * returned to the pool with sync_ldap_release.  Returns a Kerberos status
+ * code.
+ */
+krb5_error_code
+sync_ldap_get(kadm5_hook_modinfo *config, krb5_context ctx, LDAP **ld)
+{
+    struct sync_ldap_pool *pool;
+    struct pool_conn *conn, *slot = NULL;
+    LDAP *new_ld = NULL;
+    time_t now;
+    size_t i, server;
+    bool found, down;
+    krb5_error_code code, status;
+
+    /* Ensure the pool exists. */
+    *ld = NULL;
+    if (config->ldap_pool == NULL) {
+        code = pool_new(config, ctx);
+        if (code != 0)
+            return code;
+    }
+    pool = config->ldap_pool;
+
+    /* Look for an idle connection that's still alive. */
+    now = time(NULL);
+    pool_lock(pool);
+    for (i = 0; i < pool->size; i++) {
+        conn = &pool->conns[i];
+        if (conn->in_use)
+            continue;
+        if (conn->ld != NULL && !pool_conn_alive(conn, now)) {
+            ldap_unbind_ext_s(conn->ld, NULL, NULL);
+            conn->ld = NULL;
+        }
+        if (conn->ld != NULL) {
+            conn->in_use = true;
+            *ld = conn->ld;
+            pthread_mutex_unlock(&pool->mutex);
+            return 0;
+        }
+        if (slot == NULL)
+            slot = conn;
+    }
+
+    /*
+     * No usable idle connections, so bind a new one in a free slot, which
+     * we reserve so that no other thread uses it while we bind.
+     */
+    if (slot == NULL) {
+        pthread_mutex_unlock(&pool->mutex);
+        return sync_error_generic(ctx, "all %lu LDAP connections to Active"
+                                  " Directory are in use",
+                                  (unsigned long) pool->size);
+    }
+    slot->in_use = true;
+    pthread_mutex_unlock(&pool->mutex);
+
+    /*
+     * Try the best server, moving on to the next best if it can't be
+     * reached.  Each failure makes that server back off, so this ends.  If
+     * we run out of servers after trying some, return the last error.
+     */
+    code = 0;
+    while (1) {
+        status = sync_server_pick(config, ctx, &server, &found);
+        if (status != 0) {
+            code = status;
+            break;
+        }
+        if (!found && code == 0)
+            code = sync_error_generic(ctx, "all Active Directory LDAP"
+                                      " servers failed recently");
+        if (!found)
+            break;
+        code = pool_connect(config, ctx, server, &new_ld, &down);
+        if (code == 0 || !down)
+            break;
+    }
+    pool_lock(pool);
+    if (code == 0)
+        slot->ld = new_ld;
+    else
+        slot->in_use = false;
+    pthread_mutex_unlock(&pool->mutex);
+    *ld = new_ld;
+    return code;
+}
+
+
+/*
+ * Return a connection obtained from sync_ldap_get to the pool.  If broken is
+ * true, the caller saw an error indicating the connection is no longer
+ * usable, and the connection is closed instead of kept for reuse.
+ */
+void
+sync_ldap_release(kadm5_hook_modinfo *config, LDAP *ld, bool broken)
+{
+    struct sync_ldap_pool *pool = config->ldap_pool;
+    struct pool_conn *conn;
+    size_t i;
+
+    if (pool == NULL || ld == NULL)
+        return;
+    pool_lock(pool);
+    for (i = 0; i < pool->size; i++) {
+        conn = &pool->conns[i];
+        if (conn->ld != ld)
+            continue;
+        conn->in_use = false;
+        conn->last_used = time(NULL);
+        if (broken) {
+            ldap_unbind_ext_s(conn->ld, NULL, NULL);
+            conn->ld = NULL;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/*
+ * Keep idle pooled connections open by reading the root DSE on each one that
+ * hasn't been used for POOL_KEEPALIVE seconds, which resets the Active
+ * Directory idle timer, and close any that fail.  Each connection is marked
+ * in use while it is checked, so this can run in another thread at the same
+ * time as changes.  Connections that were closed aren't reopened, since that
+ * would need the server health tracking, and are bound again on next use.
+ */
+void
+sync_ldap_keepalive(kadm5_hook_modinfo *config)
+{
+    struct sync_ldap_pool *pool = config->ldap_pool;
+    struct pool_conn *conn;
+    static char *attrs[] = { (char *) "1.1", NULL };
+    struct timeval timeout;
+    LDAPMessage *res;
+    time_t now;
+    size_t i;
+    int status;
+
+    if (pool == NULL)
+        return;
+    timeout.tv_sec = (config->ad_ldap_timeout > 0)
+        ? config->ad_ldap_timeout : POOL_KEEPALIVE;
+    timeout.tv_usec = 0;
+    for (i = 0; i < pool->size; i++) {
+        conn = &pool->conns[i];
+        now = time(NULL);
+        pool_lock(pool);
+        if (conn->in_use || conn->ld == NULL
+            || now - conn->last_used < POOL_KEEPALIVE) {
+            pthread_mutex_unlock(&pool->mutex);
+            continue;
+        }
+        if (!pool_conn_alive(conn, now)) {
+            ldap_unbind_ext_s(conn->ld, NULL, NULL);
+            conn->ld = NULL;
+            pthread_mutex_unlock(&pool->mutex);
+            continue;
+        }
+        conn->in_use = true;
+        pthread_mutex_unlock(&pool->mutex);
+        res = NULL;
+        status = ldap_set_option(conn->ld, LDAP_OPT_TIMEOUT, &timeout);
+        if (status == LDAP_OPT_SUCCESS)
+            status = ldap_search_ext_s(conn->ld, "", LDAP_SCOPE_BASE,
+                                       "(objectClass=*)", attrs, 0, NULL,
+                                       NULL, &timeout, 1, &res);
+        if (res != NULL)
+            ldap_msgfree(res);
+        pool_lock(pool);
+        conn->in_use = false;
+        conn->last_used = time(NULL);
+        if (status != LDAP_SUCCESS) {
+            ldap_unbind_ext_s(conn->ld, NULL, NULL);
+            conn->ld = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+
+/*
+ * Set the timeouts of an LDAP connection for the next call on it, which is
+ * the time left before the deadline of the change in progress, capped at
+ * ad_ldap_timeout seconds.  Returns an error if the deadline has already
+ * passed.
+ */
+krb5_error_code
+sync_ldap_limit(kadm5_hook_modinfo *config, krb5_context ctx, LDAP *ld)
+{
+    struct timeval left;
+    struct timeval *timeout = &left;
+    krb5_error_code code;
+    int status;
+
+    /* With no limit, restore the library default of waiting forever. */
+    code = sync_ad_deadline(config, ctx, config->ad_ldap_timeout, &left);
+    if (code != 0)
+        return code;
+    if (left.tv_sec < 0)
+        timeout = NULL;
+    status = ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, timeout);
+    if (status == LDAP_OPT_SUCCESS)
+        status = ldap_set_option(ld, LDAP_OPT_TIMEOUT, timeout);
+    if (status != LDAP_OPT_SUCCESS)
+        return sync_error_ldap(ctx, status, "cannot set LDAP timeout");
+    return 0;
+}
+
+
+/*
+ * Returns true if an LDAP result code indicates that the connection to the
+ * server was lost or the server stopped responding, meaning the connection
+ * should be discarded and the operation can be retried on a new connection.
+ */
+bool
+sync_ldap_down(int code)
+{
+    return code == LDAP_SERVER_DOWN || code == LDAP_CONNECT_ERROR
+        || code == LDAP_TIMEOUT;
+}
+
+
+/*
+ * Close all pooled connections and free the pool.  Connections inherited
+ * across a fork are abandoned rather than unbound.
+ */
+void
+sync_ldap_close(kadm5_hook_modinfo *config)
+{
+    struct sync_ldap_pool *pool = config->ldap_pool;
+    size_t i;
+
+    if (pool == NULL)
+        return;
+    pool_forked(pool);
+    for (i = 0; i < pool->size; i++)
+        if (pool->conns[i].ld != NULL)
+            ldap_unbind_ext_s(pool->conns[i].ld, NULL, NULL);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->conns);
+    free(pool);
+    config->ldap_pool = NULL;
+}
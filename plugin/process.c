@@ -0,0 +1,1525 @@
+/*
+ * Processing of queued changes.
+ *
+ * Queued changes are made in Active Directory in the sorted order of their
+ * file names, which for a given user and operation is the order in which
+ * they were queued.  If a change fails, all later changes for the same user,
+ * domain, and operation are skipped, so that a failed change is never undone
+ * by an older one or overtaken by a newer one.  This is the same algorithm as
+ * the process command of krb5-sync-backend, and the same queue lock for the
+ * id of each file is held while it is processed, so the two can safely be
+ * run at the same time.
+ *
+ * If queue_backoff is set, the number of failed attempts at each change and
+ * the time of the next attempt are kept in a file named after the change in
+ * the .retry subdirectory of queue_dir.  A change that isn't due yet is
+ * skipped like a failed one, so that repeated attempts at changes that keep
+ * failing don't use up each run.
+ *
+ * Changes are scheduled by priority rather than strictly by name, so that
+ * after an outage urgent changes such as disables reach Active Directory
+ * before a backlog of password changes.  The operations are ranked by
+ * queue_priority, disable, enable, and then password by default, and the
+ * changes are made in order of rank and then name.  To keep the changes for
+ * each id in order, a change is ranked as the most urgent of itself and the
+ * later changes with the same id.
+ *
+ * For draining a large queue, sync_queue_process_parallel partitions the
+ * changes by id across several worker processes.  If ad_kpasswd_concurrency
+ * is more than 1, runs of password changes are also collected into batches,
+ * holding the queue lock of each, and made with that many kpasswd exchanges
+ * in flight at once.  A batch holds at most one change per id and is made
+ * before any change that can't join it, so the scheduled order and the
+ * skipping of later changes after a failure are unaffected.
+ *
+ * If ad_targets is set, each change is made in the target named by the
+ * domain of its queue file, and a batch only holds changes for one target.
+ *
+ * A caller that processes the queue in bounded runs, stopping after some
+ * number of changes or some time, sets queue_cursor to the name of the last
+ * change reached by the previous run.  The scheduled changes are then made
+ * starting with those sorting by name after it and wrapping around to the
+ * rest, so that changes that keep failing at the start of the queue don't
+ * use up every run.  All the changes for an id are in the same part, which
+ * keeps them in order.
+ *
+ * If queue_lease_partitions is set, the queue is processed from several
+ * hosts sharing queue_dir, and only the changes in the partitions of the
+ * queue leased to this node are made (see lease.c).  The leases are acquired
+ * before the queue is listed and released once it has been processed.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/* The subdirectory of queue_dir holding the retry state of changes. */
+#define PROCESS_RETRY_DIR ".retry"
+
+/* The delay in seconds before the first retry of a failed change. */
+#define PROCESS_BACKOFF_BASE 60
+
+/* The number of password changes batched per concurrent kpasswd exchange. */
+#define PROCESS_BATCH_FACTOR 4
+
+/* A queued change being scheduled, with its id and rank. */
+struct process_entry {
+    char *id;
+    size_t index;
+    size_t rank;
+};
+
+/*
+ * A queued password change held for a batch, with its index in the list of
+ * queue files, its id and the queue lock for it, its path unless queue_format
+ * is journal, its count of failed attempts, and what it records.  done is set
+ * once the change has been finished and its lock released.
+ */
+struct process_pending {
+    size_t index;
+    char *id;
+    char *path;
+    unsigned long attempts;
+    struct sync_queue_lock lock;
+    char *user;
+    char *operation;
+    char *password;
+    char *trace;
+    bool done;
+};
+
+/*
+ * A batch of queued password changes and what is needed to finish each of
+ * them once its result is known.  map maps the changes passed to
+ * sync_ad_chpass_batch to the pending changes, requests holds their
+ * requests, and code holds the first error other than the failure of a
+ * change.
+ */
+struct process_batch {
+    kadm5_hook_modinfo *config;
+    krb5_context ctx;
+    struct vector *files;
+    sync_queue_report_func report;
+    struct sync_strset *skip;
+    unsigned long *failed;
+    struct process_pending *pending;
+    size_t count;
+    size_t size;
+    size_t *map;
+    struct sync_request *requests;
+    krb5_error_code code;
+};
+
+/* The default priority of operations, most urgent first. */
+static const char *const process_priority[] = {
+    "disable", "enable", "password", NULL
+};
+
+
+/*
+ * Split the next line off the data of a queue record, replacing its newline
+ * with a nul.  Returns the line, or NULL if there is no complete line left,
+ * and advances start past it.
+ */
+static const char *
+record_line(char **start, char *end)
+{
+    char *line = *start;
+    char *newline;
+
+    if (line >= end)
+        return NULL;
+    newline = memchr(line, '\n', (size_t) (end - line));
+    if (newline == NULL)
+        return NULL;
+    *newline = '\0';
+    *start = newline + 1;
+    return line;
+}
+
+
+/*
+ * Read a queue file and validate its contents.  The format is:
+ *
+ *     <principal>
+ *     ad | <target>
+ *     enable | disable | password
+ *     [<password>]
+ *     [trace <id> <entered> <queued>]
+ *
+ * where the last line is the trace line of a change traced for sync lag.
+ * The whole file is read into memory with, normally, a single read, and the
+ * fields are split in place, so lines may be of any length and the only copy
+ * of the password is cleared by sync_queue_record_free.  Whether the domain
+ * is a known target is checked when the change is made.  Returns a Kerberos
+ * status code.
+ */
+krb5_error_code
+sync_queue_read_record(krb5_context ctx, const char *path,
+                       struct sync_queue_record *record)
+{
+    struct stat st;
+    char *start, *end;
+    size_t length = 0;
+    ssize_t status;
+    int fd;
+    krb5_error_code code = 0;
+
+    memset(record, 0, sizeof(*record));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return sync_error_system(ctx, "cannot open queue file %s", path);
+    if (fstat(fd, &st) < 0) {
+        code = sync_error_system(ctx, "cannot stat queue file %s", path);
+        goto done;
+    }
+    record->size = (size_t) st.st_size + 1;
+    record->data = malloc(record->size);
+    if (record->data == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+
+    /*
+     * Read up to one byte more than the size of the file, so that a file
+     * that grew since the fstat is seen as incomplete rather than silently
+     * truncated.
+     */
+    do {
+        status = read(fd, record->data + length, record->size - length);
+        if (status < 0 && errno != EINTR) {
+            code = sync_error_system(ctx, "cannot read queue file %s", path);
+            goto done;
+        }
+        if (status > 0)
+            length += (size_t) status;
+    } while (status != 0 && length < record->size);
+    if (length == record->size) {
+        code = sync_error_generic(ctx, "queue file %s changed while being"
+                                  " read", path);
+        goto done;
+    }
+
+    /* Split and check the fields. */
+    start = record->data;
+    end = record->data + length;
+    record->user = record_line(&start, end);
+    record->domain = record_line(&start, end);
+    record->operation = record_line(&start, end);
+    if (record->operation == NULL) {
+        code = sync_error_generic(ctx, "incomplete queue file %s", path);
+        goto done;
+    }
+    if (*record->domain == '\0') {
+        code = sync_error_generic(ctx, "missing target system in queue file"
+                                  " %s", path);
+        goto done;
+    }
+    if (strcmp(record->operation, "password") == 0) {
+        record->password = record_line(&start, end);
+        if (record->password == NULL)
+            code = sync_error_generic(ctx, "incomplete queue file %s", path);
+    }
+    if (code == 0) {
+        record->trace = record_line(&start, end);
+        if (record->trace != NULL && strncmp(record->trace, "trace ", 6) != 0)
+            record->trace = NULL;
+    }
+
+done:
+    close(fd);
+    if (code != 0)
+        sync_queue_record_free(record);
+    return code;
+}
+
+
+/*
+ * Free a queue record, clearing the password along with everything else.
+ */
+void
+sync_queue_record_free(struct sync_queue_record *record)
+{
+    if (record->data != NULL) {
+        sync_wipe(record->data, record->size);
+        free(record->data);
+    }
+    memset(record, 0, sizeof(*record));
+}
+
+
+/*
+ * Given the name or id of a queued change, return the start of its domain,
+ * the part between the first and second hyphens ignoring any shard
+ * subdirectory, and store its length in length.  Returns NULL if the name
+ * has no domain.
+ */
+static const char *
+process_domain(const char *name, size_t *length)
+{
+    const char *domain, *end;
+
+    domain = strrchr(name, '/');
+    domain = (domain == NULL) ? name : domain + 1;
+    domain = strchr(domain, '-');
+    if (domain == NULL)
+        return NULL;
+    domain++;
+    end = strchr(domain, '-');
+    if (end == NULL)
+        return NULL;
+    *length = (size_t) (end - domain);
+    return domain;
+}
+
+
+/*
+ * Store in target the configuration for the target of a queued change, given
+ * its name or id.  Returns a Kerberos status code, which is an error if the
+ * target isn't known.
+ */
+static krb5_error_code
+process_target(kadm5_hook_modinfo *config, krb5_context ctx,
+               const char *name, kadm5_hook_modinfo **target)
+{
+    const char *domain;
+    char *copy;
+    size_t length;
+    krb5_error_code code = 0;
+
+    domain = process_domain(name, &length);
+    if (domain == NULL)
+        return sync_error_generic(ctx, "invalid queue file name %s", name);
+    copy = strndup(domain, length);
+    if (copy == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    *target = sync_target_find(config, copy);
+    if (*target == NULL)
+        code = sync_error_generic(ctx, "unknown target system %s in queue"
+                                  " file %s", copy, name);
+    free(copy);
+    return code;
+}
+
+
+/*
+ * Make one queued change in Active Directory, in the target named by the
+ * domain of the change, given its name for error messages and the user,
+ * operation, password (which may be NULL), and trace line (which may also be
+ * NULL) recorded for it.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+process_change(kadm5_hook_modinfo *config, krb5_context ctx, const char *name,
+               const char *user, const char *operation, const char *password,
+               const char *trace)
+{
+    kadm5_hook_modinfo *target;
+    krb5_principal principal = NULL;
+    struct sync_request request;
+    krb5_error_code code;
+
+    code = process_target(config, ctx, name, &target);
+    if (code != 0)
+        return code;
+    code = krb5_parse_name(ctx, user, &principal);
+    if (code != 0)
+        return code;
+    sync_request_init(&request, principal);
+    request.domain = target->target;
+    sync_request_trace_read(&request, trace);
+    if (strcmp(operation, "enable") == 0
+             || strcmp(operation, "disable") == 0)
+        code = sync_ad_status(target, ctx, &request,
+                              strcmp(operation, "enable") == 0);
+    else if (strcmp(operation, "password") != 0)
+        code = sync_error_generic(ctx, "unknown action %s in queue file %s",
+                                  operation, name);
+    else if (password == NULL)
+        code = sync_error_generic(ctx, "incomplete queue file %s", name);
+    else
+        code = sync_ad_chpass(target, ctx, &request, password);
+    if (code == 0)
+        sync_request_lag(target, ctx, &request);
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, principal);
+    return code;
+}
+
+
+/*
+ * Read a queue file and make the change that it records.  If the change
+ * succeeds, delete the queue file.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+process_file(kadm5_hook_modinfo *config, krb5_context ctx, const char *path)
+{
+    struct sync_queue_record record;
+    krb5_error_code code;
+
+    code = sync_queue_read_record(ctx, path, &record);
+    if (code != 0)
+        return code;
+    code = process_change(config, ctx, path, record.user, record.operation,
+                          record.password, record.trace);
+    sync_queue_record_free(&record);
+    if (code == 0 && unlink(path) < 0)
+        code = sync_error_system(ctx, "cannot unlink queue file %s", path);
+    return code;
+}
+
+
+/*
+ * Make a change queued in the journal, and mark it as done if it succeeds.
+ * Sets found to false without making any change if it is no longer pending.
+ * The caller holds the queue lock for its id.  Returns a Kerberos status
+ * code.
+ */
+static krb5_error_code
+process_journal(kadm5_hook_modinfo *config, krb5_context ctx,
+                const char *name, bool *found)
+{
+    char *user, *operation, *password;
+    krb5_error_code code;
+
+    *found = false;
+    code = sync_journal_read(config, ctx, name, &user, &operation, &password);
+    if (code != 0 || user == NULL)
+        return code;
+    *found = true;
+    code = process_change(config, ctx, name, user, operation, password,
+                          NULL);
+    if (code == 0)
+        code = sync_journal_remove(config, ctx, name);
+    free(user);
+    free(operation);
+    if (password != NULL) {
+        sync_wipe(password, strlen(password));
+        free(password);
+    }
+    return code;
+}
+
+
+/*
+ * Return the path to the retry state of a queued change in a newly allocated
+ * string, or NULL on failure to allocate memory.  The state is named after
+ * the change, without any shard subdirectory.
+ */
+static char *
+process_retry_path(kadm5_hook_modinfo *config, const char *name)
+{
+    const char *filename;
+    char *path;
+
+    filename = strrchr(name, '/');
+    filename = (filename == NULL) ? name : filename + 1;
+    if (asprintf(&path, "%s/%s/%s", config->queue_dir, PROCESS_RETRY_DIR,
+                 filename) < 0)
+        return NULL;
+    return path;
+}
+
+
+/*
+ * Read the retry state of a queued change, storing the number of failed
+ * attempts in attempts and returning the time of the next attempt.  Returns
+ * 0 with attempts set to 0 if the change has never failed or its state can't
+ * be read, so that it is attempted.
+ */
+static time_t
+process_retry_read(kadm5_hook_modinfo *config, const char *name,
+                   unsigned long *attempts)
+{
+    FILE *file;
+    char *path;
+    long next;
+
+    *attempts = 0;
+    path = process_retry_path(config, name);
+    if (path == NULL)
+        return 0;
+    file = fopen(path, "r");
+    free(path);
+    if (file == NULL)
+        return 0;
+    if (fscanf(file, "%lu %ld", attempts, &next) != 2) {
+        *attempts = 0;
+        next = 0;
+    }
+    fclose(file);
+    return (time_t) next;
+}
+
+
+/*
+ * Update the retry state of a queued change after an attempt, given the
+ * number of earlier failed attempts.  After a failure, the next attempt is
+ * scheduled with a delay starting at PROCESS_BACKOFF_BASE seconds and doubling
+ * with each failure up to queue_backoff.  After a success, or when the
+ * change is removed without being made, any state is removed.  Does nothing
+ * unless queue_backoff is set.  This is best effort, since the worst that can
+ * happen if the state is lost is an early retry, so failures are only logged.
+ */
+static void
+process_retry_update(kadm5_hook_modinfo *config, const char *name,
+                     unsigned long attempts, bool failed)
+{
+    FILE *file;
+    char *dir = NULL, *path;
+    long delay;
+    unsigned long i;
+
+    if (config->queue_backoff <= 0 || (!failed && attempts == 0))
+        return;
+    path = process_retry_path(config, name);
+    if (path == NULL)
+        return;
+    if (!failed) {
+        if (unlink(path) < 0 && errno != ENOENT)
+            sync_syslog_warning(config, "krb5-sync: cannot remove %s: %s",
+                                path, strerror(errno));
+        free(path);
+        return;
+    }
+    delay = PROCESS_BACKOFF_BASE;
+    for (i = 0; i < attempts && delay < config->queue_backoff; i++)
+        delay *= 2;
+    if (delay > config->queue_backoff)
+        delay = config->queue_backoff;
+    if (asprintf(&dir, "%s/%s", config->queue_dir, PROCESS_RETRY_DIR) >= 0)
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+            sync_syslog_warning(config, "krb5-sync: cannot create %s: %s",
+                                dir, strerror(errno));
+    free(dir);
+    file = fopen(path, "w");
+    if (file != NULL) {
+        fprintf(file, "%lu %ld\n", attempts + 1, (long) time(NULL) + delay);
+        if (fclose(file) == 0) {
+            free(path);
+            return;
+        }
+    }
+    sync_syslog_warning(config, "krb5-sync: cannot write %s: %s", path,
+                        strerror(errno));
+    free(path);
+}
+
+
+/*
+ * Returns true if queue_backoff is set and the queued change has failed
+ * before and isn't due for another attempt at the time now.  Stores the
+ * number of earlier failed attempts in attempts.
+ */
+static bool
+process_deferred(kadm5_hook_modinfo *config, const char *name, time_t now,
+                 unsigned long *attempts)
+{
+    *attempts = 0;
+    if (config->queue_backoff <= 0)
+        return false;
+    return process_retry_read(config, name, attempts) > now;
+}
+
+
+/*
+ * Given the name of a queue file, store the identifier used for skipping
+ * later changes after a failure in a newly allocated string.  This is the
+ * user, domain, and operation, or in other words the part of the file name
+ * before the third hyphen, ignoring any shard subdirectory.  Returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+process_id(krb5_context ctx, const char *name, char **id)
+{
+    const char *filename, *p;
+    int i;
+
+    filename = strrchr(name, '/');
+    filename = (filename == NULL) ? name : filename + 1;
+    p = filename;
+    for (i = 0; i < 3; i++) {
+        p = strchr(p, '-');
+        if (p == NULL || p == filename)
+            return sync_error_generic(ctx, "invalid queue file name %s",
+                                      name);
+        p++;
+    }
+    *id = strndup(filename, (size_t) (p - filename - 1));
+    if (*id == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    return 0;
+}
+
+
+/*
+ * Given the sorted list of queue files, store in superseded a newly
+ * allocated array of flags that are true for every queue file followed later
+ * in the list by another queue file with the same id.  Since only the final
+ * password or account status matters, those changes need not be made at all.
+ * Queue files with invalid names are never superseded.  Returns a Kerberos
+ * status code.
+ */
+static krb5_error_code
+process_superseded(krb5_context ctx, struct vector *files, bool **superseded)
+{
+    struct sync_strset *seen;
+    char *id;
+    size_t i;
+    krb5_error_code code = 0;
+
+    *superseded = calloc(files->count > 0 ? files->count : 1, sizeof(bool));
+    seen = sync_strset_new();
+    if (*superseded == NULL || seen == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    for (i = files->count; i > 0; i--) {
+        if (process_id(ctx, files->strings[i - 1], &id) != 0)
+            continue;
+        if (sync_strset_contains(seen, id))
+            (*superseded)[i - 1] = true;
+        else if (!sync_strset_add(seen, id)) {
+            free(id);
+            code = sync_error_system(ctx, "cannot allocate memory");
+            goto done;
+        }
+        free(id);
+    }
+
+done:
+    sync_strset_free(seen);
+    if (code != 0) {
+        free(*superseded);
+        *superseded = NULL;
+    }
+    return code;
+}
+
+
+/*
+ * Return the rank of an operation, by its position in queue_priority or the
+ * default priority.  Operations that aren't listed rank after all of those
+ * that are.
+ */
+static size_t
+process_rank(kadm5_hook_modinfo *config, const char *operation)
+{
+    size_t i;
+
+    if (config->queue_priority == NULL) {
+        for (i = 0; process_priority[i] != NULL; i++)
+            if (strcmp(process_priority[i], operation) == 0)
+                return i;
+        return i;
+    }
+    for (i = 0; i < config->queue_priority->count; i++)
+        if (strcmp(config->queue_priority->strings[i], operation) == 0)
+            return i;
+    return i;
+}
+
+
+/*
+ * Return the rank of a queued change, given its name and id.  Password
+ * changes can be ranked by their name, but enables and disables share an id
+ * and have to be read to tell them apart, so they are only read if the two
+ * rank differently.  A change that can't be read ranks as an enable; making
+ * it will report the error.
+ */
+static size_t
+process_rank_change(kadm5_hook_modinfo *config, krb5_context ctx,
+                    const char *name, const char *id)
+{
+    struct sync_queue_record record;
+    struct sync_queue_lock lock;
+    const char *operation;
+    char *path, *user, *journal_operation, *password;
+    size_t rank;
+
+    operation = strrchr(id, '-');
+    operation = (operation == NULL) ? id : operation + 1;
+    if (strcmp(operation, "enable") != 0)
+        return process_rank(config, operation);
+    rank = process_rank(config, "enable");
+    if (rank == process_rank(config, "disable"))
+        return rank;
+    if (config->journal != NULL) {
+        if (sync_queue_lock(config, ctx, id, &lock) != 0)
+            return rank;
+        if (sync_journal_read(config, ctx, name, &user, &journal_operation,
+                              &password) == 0
+            && user != NULL) {
+            rank = process_rank(config, journal_operation);
+            free(user);
+            free(journal_operation);
+            if (password != NULL) {
+                sync_wipe(password, strlen(password));
+                free(password);
+            }
+        }
+        sync_queue_unlock(&lock);
+    } else {
+        if (asprintf(&path, "%s/%s", config->queue_dir, name) < 0)
+            return rank;
+        if (sync_queue_read_record(ctx, path, &record) == 0) {
+            rank = process_rank(config, record.operation);
+            sync_queue_record_free(&record);
+        }
+        free(path);
+    }
+    return rank;
+}
+
+
+/*
+ * Compare two queued changes by id and then by position, with changes with
+ * invalid names sorted last, and compare two queued changes by rank and then
+ * by position.  Used with qsort.
+ */
+static int
+process_compare_id(const void *a, const void *b)
+{
+    const struct process_entry *first = a;
+    const struct process_entry *second = b;
+    int result = 0;
+
+    if (first->id != NULL && second->id != NULL)
+        result = strcmp(first->id, second->id);
+    else if (first->id != NULL || second->id != NULL)
+        result = (first->id == NULL) ? 1 : -1;
+    if (result == 0 && first->index != second->index)
+        result = (first->index < second->index) ? -1 : 1;
+    return result;
+}
+
+static int
+process_compare_rank(const void *a, const void *b)
+{
+    const struct process_entry *first = a;
+    const struct process_entry *second = b;
+
+    if (first->rank != second->rank)
+        return (first->rank < second->rank) ? -1 : 1;
+    if (first->index != second->index)
+        return (first->index < second->index) ? -1 : 1;
+    return 0;
+}
+
+
+/*
+ * Given the sorted list of queue files, store in order a newly allocated
+ * array of indexes into it giving the order in which to make the changes.
+ * Each change is ranked as the most urgent of itself and all later changes
+ * with the same id, so the changes for an id keep their order but are all
+ * moved ahead of less urgent changes together.  Queue files with invalid
+ * names are made last.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+process_schedule(kadm5_hook_modinfo *config, krb5_context ctx,
+                 struct vector *files, size_t **order)
+{
+    struct process_entry *entries;
+    size_t i, best = 0, last;
+    krb5_error_code code = 0;
+
+    *order = NULL;
+    entries = calloc(files->count > 0 ? files->count : 1, sizeof(*entries));
+    *order = calloc(files->count > 0 ? files->count : 1, sizeof(size_t));
+    if (entries == NULL || *order == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    last = process_rank(config, "");
+    for (i = 0; i < files->count; i++) {
+        entries[i].index = i;
+        if (process_id(ctx, files->strings[i], &entries[i].id) != 0) {
+            entries[i].id = NULL;
+            entries[i].rank = last + 1;
+        } else
+            entries[i].rank = process_rank_change(config, ctx,
+                                                  files->strings[i],
+                                                  entries[i].id);
+    }
+
+    /* Rank each change as the most urgent of the rest of its id. */
+    qsort(entries, files->count, sizeof(*entries), process_compare_id);
+    for (i = files->count; i > 0; i--) {
+        if (i == files->count || entries[i - 1].id == NULL
+            || entries[i].id == NULL
+            || strcmp(entries[i - 1].id, entries[i].id) != 0)
+            best = entries[i - 1].rank;
+        else if (entries[i - 1].rank < best)
+            best = entries[i - 1].rank;
+        entries[i - 1].rank = best;
+    }
+
+    /* Order by rank, keeping the order of names within a rank. */
+    qsort(entries, files->count, sizeof(*entries), process_compare_rank);
+    for (i = 0; i < files->count; i++)
+        (*order)[i] = entries[i].index;
+
+done:
+    if (entries != NULL)
+        for (i = 0; i < files->count; i++)
+            free(entries[i].id);
+    free(entries);
+    if (code != 0) {
+        free(*order);
+        *order = NULL;
+    }
+    return code;
+}
+
+
+/*
+ * Given the sorted list of queue files and the order from process_schedule,
+ * move the changes that sort by name after queue_cursor to the front, keeping
+ * the scheduled order within each part.  If the changes for an id straddle
+ * the cursor, they are all left with the changes before it.  Returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+process_resume(kadm5_hook_modinfo *config, krb5_context ctx,
+               struct vector *files, size_t *order)
+{
+    const char *name;
+    char *id = NULL, *next = NULL;
+    size_t *resumed;
+    size_t i, start, n = 0;
+    bool same;
+
+    /* Find the first queue file after the cursor, skipping its id. */
+    for (start = 0; start < files->count; start++) {
+        name = strrchr(files->strings[start], '/');
+        name = (name == NULL) ? files->strings[start] : name + 1;
+        if (strcmp(name, config->queue_cursor) > 0)
+            break;
+    }
+    if (start > 0 && process_id(ctx, files->strings[start - 1], &id) != 0)
+        id = NULL;
+    while (id != NULL && start < files->count) {
+        same = (process_id(ctx, files->strings[start], &next) == 0
+                && strcmp(id, next) == 0);
+        free(next);
+        if (!same)
+            break;
+        start++;
+    }
+    free(id);
+    if (start == 0 || start == files->count)
+        return 0;
+
+    /* Stably move the changes from start on to the front. */
+    resumed = calloc(files->count, sizeof(size_t));
+    if (resumed == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    for (i = 0; i < files->count; i++)
+        if (order[i] >= start)
+            resumed[n++] = order[i];
+    for (i = 0; i < files->count; i++)
+        if (order[i] < start)
+            resumed[n++] = order[i];
+    memcpy(order, resumed, files->count * sizeof(size_t));
+    free(resumed);
+    return 0;
+}
+
+
+/*
+ * Log the failure of a queued change, add its id (which may be NULL for
+ * invalid queue file names) to the set of ids to skip, and count it.
+ * Returns a Kerberos status code for failure to allocate memory.
+ */
+static krb5_error_code
+process_failed(kadm5_hook_modinfo *config, krb5_context ctx, const char *name,
+               const char *id, krb5_error_code code, struct sync_strset *skip,
+               unsigned long *failed)
+{
+    const char *message;
+
+    message = krb5_get_error_message(ctx, code);
+    sync_syslog_warning(config, "krb5-sync: processing queued change %s"
+                        " failed: %s", name, message);
+    krb5_free_error_message(ctx, message);
+    (*failed)++;
+    if (id != NULL && !sync_strset_add(skip, id))
+        return sync_error_system(ctx, "cannot allocate memory");
+    return 0;
+}
+
+
+/*
+ * Returns true if the id of a queued change is for a password change.
+ */
+static bool
+process_is_password(const char *id)
+{
+    const char *operation;
+
+    operation = strrchr(id, '-');
+    operation = (operation == NULL) ? id : operation + 1;
+    return strcmp(operation, "password") == 0;
+}
+
+
+/*
+ * Returns true if a change with the given id is in the batch.
+ */
+static bool
+process_batch_has(struct process_batch *batch, const char *id)
+{
+    size_t i;
+
+    for (i = 0; i < batch->count; i++)
+        if (strcmp(batch->pending[i].id, id) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Returns true if a change with the given id is for the same target as the
+ * changes already in the batch, which must not be empty.
+ */
+static bool
+process_batch_target(struct process_batch *batch, const char *id)
+{
+    const char *domain, *current;
+    size_t length, current_length;
+
+    domain = process_domain(id, &length);
+    current = process_domain(batch->pending[0].id, &current_length);
+    return (domain != NULL && current != NULL && length == current_length
+            && strncmp(domain, current, length) == 0);
+}
+
+
+/*
+ * Finish a change in the batch given its result: remove it from the queue if
+ * it succeeded, update its retry state, release its lock, and report it and
+ * count any failure in the same way as a change made on its own.
+ */
+static void
+process_finish(struct process_batch *batch, size_t n, krb5_error_code code)
+{
+    kadm5_hook_modinfo *config = batch->config;
+    krb5_context ctx = batch->ctx;
+    struct process_pending *pending = &batch->pending[n];
+    const char *name = batch->files->strings[pending->index];
+    krb5_error_code status;
+
+    if (code == 0) {
+        if (pending->path == NULL)
+            code = sync_journal_remove(config, ctx, name);
+        else if (unlink(pending->path) < 0)
+            code = sync_error_system(ctx, "cannot unlink queue file %s",
+                                     pending->path);
+    }
+    process_retry_update(config, name, pending->attempts, code != 0);
+    sync_queue_unlock(&pending->lock);
+    pending->done = true;
+    if (batch->report != NULL)
+        batch->report(config, ctx, name, code);
+    if (code != 0) {
+        status = process_failed(config, ctx, name, pending->id, code,
+                                batch->skip, batch->failed);
+        if (status != 0 && batch->code == 0)
+            batch->code = status;
+    }
+}
+
+
+/*
+ * Called by sync_ad_chpass_batch with the result of each change.
+ */
+static void
+process_batch_report(void *data, size_t n, krb5_error_code code)
+{
+    struct process_batch *batch = data;
+
+    if (code == 0)
+        sync_request_lag(batch->config, batch->ctx, &batch->requests[n]);
+    process_finish(batch, batch->map[n], code);
+}
+
+
+/*
+ * Empty the batch, releasing the locks of any changes that weren't finished
+ * without making them.
+ */
+static void
+process_batch_reset(struct process_batch *batch)
+{
+    struct process_pending *pending;
+    size_t i;
+
+    for (i = 0; i < batch->count; i++) {
+        pending = &batch->pending[i];
+        if (!pending->done)
+            sync_queue_unlock(&pending->lock);
+        free(pending->id);
+        free(pending->path);
+        free(pending->user);
+        free(pending->operation);
+        if (pending->password != NULL) {
+            sync_wipe(pending->password, strlen(pending->password));
+            free(pending->password);
+        }
+        free(pending->trace);
+        memset(pending, 0, sizeof(*pending));
+    }
+    batch->count = 0;
+}
+
+
+/*
+ * Lock the id of a queued password change and add it and what it records to
+ * the batch.  A change that is already gone, probably because some other job
+ * running in parallel made it, is skipped, and a change that can't be read
+ * is finished at once as a failure.  Returns a Kerberos status code for other
+ * failures.
+ */
+static krb5_error_code
+process_batch_add(struct process_batch *batch, size_t index, const char *id,
+                  unsigned long attempts)
+{
+    kadm5_hook_modinfo *config = batch->config;
+    krb5_context ctx = batch->ctx;
+    struct process_pending *pending = &batch->pending[batch->count];
+    const char *name = batch->files->strings[index];
+    struct sync_queue_record record;
+    bool found = true;
+    krb5_error_code code;
+
+    memset(pending, 0, sizeof(*pending));
+    pending->index = index;
+    pending->attempts = attempts;
+    pending->id = strdup(id);
+    if (pending->id == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    if (config->journal == NULL
+        && asprintf(&pending->path, "%s/%s", config->queue_dir, name) < 0) {
+        pending->path = NULL;
+        free(pending->id);
+        pending->id = NULL;
+        return sync_error_system(ctx, "cannot allocate memory");
+    }
+    code = sync_queue_lock(config, ctx, id, &pending->lock);
+    if (code != 0) {
+        free(pending->id);
+        free(pending->path);
+        memset(pending, 0, sizeof(*pending));
+        return code;
+    }
+    batch->count++;
+
+    /* Read the change. */
+    if (config->journal != NULL) {
+        code = sync_journal_read(config, ctx, name, &pending->user,
+                                 &pending->operation, &pending->password);
+        found = (code != 0 || pending->user != NULL);
+    } else if (access(pending->path, F_OK) != 0)
+        found = false;
+    else {
+        code = sync_queue_read_record(ctx, pending->path, &record);
+        if (code == 0) {
+            pending->user = strdup(record.user);
+            pending->operation = strdup(record.operation);
+            if (record.password != NULL)
+                pending->password = strdup(record.password);
+            if (record.trace != NULL)
+                pending->trace = strdup(record.trace);
+            if (pending->user == NULL || pending->operation == NULL
+                || (record.password != NULL && pending->password == NULL)
+                || (record.trace != NULL && pending->trace == NULL))
+                code = sync_error_system(ctx, "cannot allocate memory");
+            sync_queue_record_free(&record);
+        }
+    }
+
+    /* Drop changes that are gone and finish ones that can't be read. */
+    if (!found) {
+        batch->count--;
+        sync_queue_unlock(&pending->lock);
+        free(pending->id);
+        free(pending->path);
+        memset(pending, 0, sizeof(*pending));
+    } else if (code != 0)
+        process_finish(batch, batch->count - 1, code);
+    return 0;
+}
+
+
+/*
+ * Make the changes in the batch, with all the password changes made by
+ * sync_ad_chpass_batch and any change whose record turns out not to be a
+ * password change made on its own, and then empty the batch.  Returns a
+ * Kerberos status code for failures other than failures of changes.
+ */
+static krb5_error_code
+process_batch_flush(struct process_batch *batch)
+{
+    kadm5_hook_modinfo *config = batch->config;
+    kadm5_hook_modinfo *target;
+    krb5_context ctx = batch->ctx;
+    struct process_pending *pending;
+    struct sync_ad_password *changes = NULL;
+    struct sync_request *requests = NULL;
+    krb5_principal *principals = NULL;
+    size_t i, n = 0;
+    krb5_error_code code;
+
+    if (batch->count == 0)
+        return batch->code;
+    changes = calloc(batch->count, sizeof(*changes));
+    requests = calloc(batch->count, sizeof(*requests));
+    principals = calloc(batch->count, sizeof(*principals));
+    batch->map = calloc(batch->count, sizeof(*batch->map));
+    if (changes == NULL || requests == NULL || principals == NULL
+        || batch->map == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+
+    /* Collect the password changes. */
+    for (i = 0; i < batch->count; i++) {
+        pending = &batch->pending[i];
+        if (pending->done)
+            continue;
+        if (strcmp(pending->operation, "password") != 0
+            || pending->password == NULL) {
+            code = process_change(config, ctx,
+                                  batch->files->strings[pending->index],
+                                  pending->user, pending->operation,
+                                  pending->password, pending->trace);
+            process_finish(batch, i, code);
+            continue;
+        }
+        code = krb5_parse_name(ctx, pending->user, &principals[n]);
+        if (code != 0) {
+            principals[n] = NULL;
+            process_finish(batch, i, code);
+            continue;
+        }
+        sync_request_init(&requests[n], principals[n]);
+        sync_request_trace_read(&requests[n], pending->trace);
+        changes[n].request = &requests[n];
+        changes[n].password = pending->password;
+        batch->map[n] = i;
+        n++;
+    }
+
+    /*
+     * Make them in their target.  An error here, such as missing
+     * configuration, fails every change that wasn't reported, as it would
+     * have failed each change made on its own.
+     */
+    code = 0;
+    if (n > 0) {
+        code = process_target(config, ctx, batch->pending[batch->map[0]].id,
+                              &target);
+        batch->requests = requests;
+        for (i = 0; code == 0 && i < n; i++)
+            requests[i].domain = target->target;
+        if (code == 0)
+            code = sync_ad_chpass_batch(target, ctx, changes, n,
+                                        process_batch_report, batch);
+    }
+    if (code != 0)
+        for (i = 0; i < batch->count; i++)
+            if (!batch->pending[i].done)
+                process_finish(batch, i, code);
+    code = 0;
+    for (i = 0; i < n; i++) {
+        sync_request_free(ctx, &requests[i]);
+        krb5_free_principal(ctx, principals[i]);
+    }
+
+done:
+    process_batch_reset(batch);
+    free(changes);
+    free(requests);
+    free(principals);
+    free(batch->map);
+    batch->map = NULL;
+    batch->requests = NULL;
+    return (code != 0) ? code : batch->code;
+}
+
+
+/*
+ * Make the changes in a list of queue files.  Takes the plugin configuration,
+ * a Kerberos context, the list of queue files from sync_queue_list, the
+ * partition of the ids to process and the total number of partitions (0 and
+ * 1 to process every file), the optional stop and report functions, and a
+ * pointer to a count of failed changes.  Queue files with invalid names
+ * belong to partition 0.  If queue_cursor is set, it is updated to the last
+ * change reached.  Returns a Kerberos status code for failures other than
+ * failures of individual changes.
+ */
+static krb5_error_code
+process_files(kadm5_hook_modinfo *config, krb5_context ctx,
+              struct vector *files, unsigned long part, unsigned long parts,
+              sync_queue_stop_func stop, sync_queue_report_func report,
+              unsigned long *failed)
+{
+    struct sync_strset *skip = NULL;
+    struct sync_queue_lock lock;
+    struct process_batch batch;
+    char *id = NULL, *path = NULL;
+    const char *last = NULL, *name;
+    bool *superseded = NULL;
+    bool found, batchable;
+    size_t *order = NULL;
+    size_t i, n;
+    unsigned long owner, attempts = 0;
+    time_t now;
+    krb5_error_code code = 0, status;
+
+    *failed = 0;
+    now = time(NULL);
+    skip = sync_strset_new();
+    if (skip == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    memset(&batch, 0, sizeof(batch));
+    batch.config = config;
+    batch.ctx = ctx;
+    batch.files = files;
+    batch.report = report;
+    batch.skip = skip;
+    batch.failed = failed;
+    if (config->ad_kpasswd_concurrency > 1) {
+        batch.size = (size_t) config->ad_kpasswd_concurrency
+            * PROCESS_BATCH_FACTOR;
+        batch.pending = calloc(batch.size, sizeof(*batch.pending));
+        if (batch.pending == NULL) {
+            code = sync_error_system(ctx, "cannot allocate memory");
+            goto done;
+        }
+    }
+    if (config->queue_coalesce) {
+        code = process_superseded(ctx, files, &superseded);
+        if (code != 0)
+            goto done;
+    }
+
+    code = process_schedule(config, ctx, files, &order);
+    if (code == 0 && config->queue_cursor != NULL)
+        code = process_resume(config, ctx, files, order);
+    if (code != 0)
+        goto done;
+
+    /* Process each file in turn, skipping ids that have already failed. */
+    for (n = 0; n < files->count; n++) {
+        i = order[n];
+        if (stop != NULL && stop(config))
+            break;
+        free(id);
+        id = NULL;
+        code = process_id(ctx, files->strings[i], &id);
+        owner = (code == 0) ? sync_hash_string(id) % parts : 0;
+        if (owner != part || !sync_lease_held(config, code == 0 ? id : NULL)) {
+            code = 0;
+            continue;
+        }
+        last = files->strings[i];
+
+        /*
+         * Make the batched password changes before any change that can't
+         * join the batch, so that changes are still made in scheduled order,
+         * and before another change with an id already in the batch or for
+         * another target.
+         */
+        batchable = (code == 0 && batch.size > 0 && process_is_password(id)
+                     && (superseded == NULL || !superseded[i]));
+        if (batch.count > 0
+            && (!batchable || process_batch_has(&batch, id)
+                || !process_batch_target(&batch, id))) {
+            status = process_batch_flush(&batch);
+            if (status != 0) {
+                code = status;
+                goto done;
+            }
+        }
+        if (code == 0 && sync_strset_contains(skip, id))
+            continue;
+
+        /*
+         * A change that isn't due for another attempt is counted as failed
+         * and later changes with the same id are skipped, as if it had been
+         * attempted and failed again.  Superseded changes are still removed.
+         */
+        if (code == 0 && (superseded == NULL || !superseded[i])
+            && process_deferred(config, files->strings[i], now, &attempts)) {
+            sync_syslog_debug(config, "krb5-sync: deferring queued change %s"
+                              " after %lu failures", files->strings[i],
+                              attempts);
+            if (!sync_strset_add(skip, id)) {
+                code = sync_error_system(ctx, "cannot allocate memory");
+                goto done;
+            }
+            (*failed)++;
+            continue;
+        }
+        if (batchable) {
+            code = process_batch_add(&batch, i, id, attempts);
+            if (code == 0 && batch.count == batch.size)
+                code = process_batch_flush(&batch);
+            if (code != 0)
+                goto done;
+            continue;
+        }
+        if (code == 0 && config->journal != NULL) {
+            code = sync_queue_lock(config, ctx, id, &lock);
+            if (code != 0)
+                goto done;
+            if (superseded != NULL && superseded[i]) {
+                if (sync_journal_remove(config, ctx, files->strings[i]) == 0)
+                    sync_syslog_debug(config, "krb5-sync: removed superseded"
+                                      " queued change %s", files->strings[i]);
+                process_retry_update(config, files->strings[i], 1, false);
+                sync_queue_unlock(&lock);
+                code = 0;
+                continue;
+            }
+            code = process_journal(config, ctx, files->strings[i], &found);
+            process_retry_update(config, files->strings[i], attempts,
+                                 code != 0);
+            sync_queue_unlock(&lock);
+            if (code == 0 && !found)
+                continue;
+        } else if (code == 0) {
+            free(path);
+            if (asprintf(&path, "%s/%s", config->queue_dir,
+                         files->strings[i]) < 0) {
+                path = NULL;
+                code = sync_error_system(ctx, "cannot allocate memory");
+                goto done;
+            }
+
+            /*
+             * Hold the queue lock while processing the file, and skip it if
+             * it's already gone, since it was probably processed by some
+             * other job running in parallel.
+             */
+            code = sync_queue_lock(config, ctx, id, &lock);
+            if (code != 0)
+                goto done;
+            if (access(path, F_OK) != 0) {
+                sync_queue_unlock(&lock);
+                continue;
+            }
+
+            /*
+             * If a later change with the same id supersedes this one, delete
+             * this one without making it.
+             */
+            if (superseded != NULL && superseded[i]) {
+                if (unlink(path) == 0)
+                    sync_syslog_debug(config, "krb5-sync: removed superseded"
+                                      " queued change %s", files->strings[i]);
+                process_retry_update(config, files->strings[i], 1, false);
+                sync_queue_unlock(&lock);
+                continue;
+            }
+            code = process_file(config, ctx, path);
+            process_retry_update(config, files->strings[i], attempts,
+                                 code != 0);
+            sync_queue_unlock(&lock);
+        }
+        if (report != NULL)
+            report(config, ctx, files->strings[i], code);
+
+        /* On failure, log the error and skip conflicting changes. */
+        if (code != 0) {
+            code = process_failed(config, ctx, files->strings[i], id, code,
+                                  skip, failed);
+            if (code != 0)
+                goto done;
+        }
+    }
+
+    /* Make any password changes still in the batch. */
+    code = process_batch_flush(&batch);
+
+    /* Remember where this run stopped for the next one. */
+    if (code == 0 && config->queue_cursor != NULL && last != NULL) {
+        name = strrchr(last, '/');
+        name = (name == NULL) ? last : name + 1;
+        free(config->queue_cursor);
+        config->queue_cursor = strdup(name);
+        if (config->queue_cursor == NULL)
+            code = sync_error_system(ctx, "cannot allocate memory");
+    }
+
+done:
+    process_batch_reset(&batch);
+    free(batch.pending);
+    free(id);
+    free(path);
+    free(order);
+    free(superseded);
+    sync_strset_free(skip);
+    return code;
+}
+
+
+/*
+ * Process all changes currently in the queue.  Takes the plugin configuration
+ * and a Kerberos context, an optional function that is called before each
+ * change and returns true if processing should stop early, an optional
+ * function that is called with the name of each queue file and the status
+ * code after the change is attempted, and a pointer to a count of failed
+ * changes.  Individual failures are logged to syslog and counted but don't
+ * cause an error return.  Returns a Kerberos status code for failures to read
+ * the queue as a whole.
+ *
+ * If queue_format is journal, the journal is compacted afterwards if enough
+ * of it is for changes that have been made.  Otherwise, if there are queue
+ * limits, the queue is counted again afterwards.
+ */
+krb5_error_code
+sync_queue_process(kadm5_hook_modinfo *config, krb5_context ctx,
+                   sync_queue_stop_func stop, sync_queue_report_func report,
+                   unsigned long *failed)
+{
+    struct vector *files = NULL;
+    krb5_error_code code;
+
+    *failed = 0;
+    code = sync_lease_acquire(config, ctx);
+    if (code == 0)
+        code = sync_queue_list(config, ctx, &files);
+    if (code != 0) {
+        sync_lease_release(config);
+        return code;
+    }
+    code = process_files(config, ctx, files, 0, 1, stop, report, failed);
+    sync_vector_free(files);
+    sync_lease_release(config);
+    if (code == 0 && config->journal != NULL)
+        code = sync_journal_compact(config, ctx);
+    if (code == 0)
+        code = sync_queue_recount(config, ctx);
+    return code;
+}
+
+
+/*
+ * Process all changes currently in the queue with the given number of worker
+ * processes.  The ids of the queued changes are partitioned by hash among the
+ * workers, so changes for the same user, domain, and operation are still made
+ * in order by a single worker, but unrelated changes are made concurrently.
+ * Each worker reports its count of failed changes to the parent over a pipe,
+ * and failed is set to the total.  Takes the same arguments as
+ * sync_queue_process plus the number of workers, and each worker calls the
+ * stop function itself.  queue_cursor is only updated in the workers, not in
+ * the caller.  Returns a Kerberos status code.
+ *
+ * This forks, so it must not be called from kadmind.  The children make all
+ * changes with their own AD credentials and LDAP connections, so it should
+ * also be called before any changes are made in this process.
+ */
+krb5_error_code
+sync_queue_process_parallel(kadm5_hook_modinfo *config, krb5_context ctx,
+                            unsigned long workers,
+                            sync_queue_stop_func stop,
+                            sync_queue_report_func report,
+                            unsigned long *failed)
+{
+    struct vector *files = NULL;
+    pid_t *pids = NULL;
+    int *fds = NULL;
+    int fd[2], status;
+    unsigned long i, count, started = 0;
+    const char *message;
+    krb5_error_code code = 0;
+
+    /* With only one worker, just process the queue in this process. */
+    *failed = 0;
+    if (workers <= 1)
+        return sync_queue_process(config, ctx, stop, report, failed);
+
+    /*
+     * Acquire the leases, if any, and get the list of queued changes once,
+     * sharing both with the workers.
+     */
+    code = sync_lease_acquire(config, ctx);
+    if (code == 0)
+        code = sync_queue_list(config, ctx, &files);
+    if (code != 0) {
+        sync_lease_release(config);
+        return code;
+    }
+    pids = calloc(workers, sizeof(pid_t));
+    fds = calloc(workers, sizeof(int));
+    if (pids == NULL || fds == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+
+    /* Start the workers, each with a pipe to report its failures. */
+    fflush(NULL);
+    for (started = 0; started < workers; started++) {
+        if (pipe(fd) < 0) {
+            code = sync_error_system(ctx, "cannot create pipe");
+            break;
+        }
+        pids[started] = fork();
+        if (pids[started] < 0) {
+            code = sync_error_system(ctx, "cannot fork queue worker");
+            close(fd[0]);
+            close(fd[1]);
+            break;
+        }
+        if (pids[started] == 0) {
+            close(fd[0]);
+            code = process_files(config, ctx, files, started, workers, stop,
+                                 report, &count);
+            if (code != 0) {
+                message = krb5_get_error_message(ctx, code);
+                sync_syslog_warning(config, "krb5-sync: queue worker failed:"
+                                    " %s", message);
+                krb5_free_error_message(ctx, message);
+            }
+            status = (write(fd[1], &count, sizeof(count)) == sizeof(count));
+            fflush(NULL);
+            _exit((code == 0 && status) ? 0 : 1);
+        }
+        close(fd[1]);
+        fds[started] = fd[0];
+    }
+
+    /* Collect the results from every worker we started. */
+    for (i = 0; i < started; i++) {
+        if (read(fds[i], &count, sizeof(count)) == sizeof(count))
+            *failed += count;
+        close(fds[i]);
+        if (waitpid(pids[i], &status, 0) < 0)
+            status = -1;
+        if (code == 0 && (status < 0 || !WIFEXITED(status)
+                          || WEXITSTATUS(status) != 0))
+            code = sync_error_generic(ctx, "queue worker %lu failed", i);
+    }
+    if (code == 0 && config->journal != NULL)
+        code = sync_journal_compact(config, ctx);
+    if (code == 0)
+        code = sync_queue_recount(config, ctx);
+
+done:
+    sync_lease_release(config);
+    free(pids);
+    free(fds);
+    sync_vector_free(files);
+    return code;
+}
@@ -8,6 +8,26 @@
  * operation as well or fail our operation so that correct changes won't be
  * undone.
  *
+ * If queue_shards is set, queue files are spread across that many
+ * subdirectories of queue_dir, chosen by a hash of the user, so that the
+ * conflict check only has to read the (small) directory for one user.
+ *
+ * If queue_format is set to journal, the changes are instead stored in an
+ * append-only journal by the sync_journal_* functions, and these functions
+ * only handle naming and locking.
+ *
+ * The contents of the queue directories are cached for conflict checks,
+ * which happen before every change, and only read again when a directory
+ * changes.
+ *
+ * If any of the queue_soft_* or queue_hard_* limits are set, the number and
+ * size of the queued changes are checked before each change is queued.  For
+ * queue files, they are kept in queue_dir/.depth, which is updated by each
+ * write and counted again from the queue after it is processed, so that the
+ * check doesn't have to read the queue.  Changes queued or removed without
+ * the plugin, such as by krb5-sync-backend, aren't seen until then.  The
+ * journal index already has the counts.
+ *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2006, 2007, 2010, 2013
  *     The Board of Trustees of the Leland Stanford Junior University
@@ -23,16 +43,50 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <sys/stat.h>
 #include <time.h>
 
 #include <plugin/internal.h>
 
 /*
- * Maximum number of queue files we will permit for a given user and action
- * within a given timestamp, and longest string representation of the count.
+ * The cached contents of one queue directory, used by sync_queue_conflict.
+ * names holds the sorted names of the queue files in the directory identified
+ * by dev and ino when its modification time was mtime, or is NULL if nothing
+ * is cached.  stable is false if the directory may have been modified again
+ * without changing its modification time, in which case the names can't be
+ * reused.
  */
-#define MAX_QUEUE     100
-#define MAX_QUEUE_STR "99"
+struct queue_cache_dir {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    bool stable;
+    struct vector *names;
+};
+
+/*
+ * The cached contents of the queue, with one entry for queue_dir or, if
+ * queue_shards is set, one for each shard subdirectory.  This is only used by
+ * sync_queue_conflict, which is only called from kadmind's own thread, so it
+ * isn't locked.
+ */
+struct sync_queue_cache {
+    size_t count;
+    struct queue_cache_dir *dirs;
+};
+
+/* The number of queued changes and their total size in bytes. */
+struct queue_depth {
+    unsigned long changes;
+    unsigned long bytes;
+};
+
+/* The file in queue_dir holding the queue depth if there are limits. */
+#define QUEUE_DEPTH_FILE ".depth"
+
+/* The domain of a request in queue file names and contents. */
+#define QUEUE_DOMAIN(request) \
+    ((request)->domain == NULL ? "ad" : (request)->domain)
 
 /* Write out a string, checking that all of it was written. */
 #define WRITE_CHECK(fd, s)                                              \
@@ -47,67 +101,191 @@
 
 
 /*
- * Lock the queue directory and stores the file descriptor of the lock in the
- * secon argument.  This must be passed into unlock_queue when the queue
- * should be unlocked.  Returns a Kerberos status code.
+ * Lock the queue for changes to one user, domain, and operation, given as the
+ * first three hyphen-separated components of a queue file name, and store
+ * the held lock in the final argument.  This must be passed into
+ * sync_queue_unlock when the queue should be unlocked.  Returns a Kerberos
+ * status code.
+ *
+ * Changes with different ids never wait on each other.  Each id has its own
+ * lock file, queue_dir/.lock-<id>, which is removed again on unlock so that
+ * lock files don't accumulate.  Since another process may remove the lock
+ * file between our open and our flock, we check after locking that the file
+ * we locked is still the one at that path and otherwise try again.
+ *
+ * For compatibility with older versions of the plugin and krb5-sync-backend,
+ * which lock the whole queue by taking an exclusive lock on queue_dir/.lock,
+ * we also hold a shared lock on that file.  This doesn't block other holders
+ * of per-id locks but does wait for, and block, holders of the old lock.
  *
  * We have to use flock for compatibility with the Perl krb5-sync-backend
  * script.  Perl makes it very annoying to use fcntl locking on Linux.
  */
-static krb5_error_code
-lock_queue(kadm5_hook_modinfo *config, krb5_context ctx, int *result)
+krb5_error_code
+sync_queue_lock(kadm5_hook_modinfo *config, krb5_context ctx, const char *id,
+                struct sync_queue_lock *lock)
 {
     char *lockpath = NULL;
-    int fd = -1;
+    struct stat fst, pst;
+    struct timeval start;
     krb5_error_code code;
 
+    /* Take the shared lock on the global lock file. */
+    sync_stats_start(config, &start);
+    lock->global = -1;
+    lock->fd = -1;
+    lock->path = NULL;
     if (asprintf(&lockpath, "%s/.lock", config->queue_dir) < 0)
         return sync_error_system(ctx, "cannot allocate memory");
-    fd = open(lockpath, O_RDWR | O_CREAT, 0644);
-    if (fd < 0) {
+    lock->global = open(lockpath, O_RDWR | O_CREAT, 0644);
+    if (lock->global < 0) {
         code = sync_error_system(ctx, "cannot open lock file %s", lockpath);
         goto fail;
     }
-    if (flock(fd, LOCK_EX) < 0) {
+    if (flock(lock->global, LOCK_SH) < 0) {
         code = sync_error_system(ctx, "cannot flock lock file %s", lockpath);
         goto fail;
     }
     free(lockpath);
-    *result = fd;
+
+    /* Take the exclusive lock for this id. */
+    if (asprintf(&lock->path, "%s/.lock-%s", config->queue_dir, id) < 0) {
+        lock->path = NULL;
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto fail;
+    }
+    lockpath = NULL;
+    while (1) {
+        lock->fd = open(lock->path, O_RDWR | O_CREAT, 0644);
+        if (lock->fd < 0) {
+            code = sync_error_system(ctx, "cannot open lock file %s",
+                                     lock->path);
+            goto fail;
+        }
+        if (flock(lock->fd, LOCK_EX) < 0) {
+            code = sync_error_system(ctx, "cannot flock lock file %s",
+                                     lock->path);
+            goto fail;
+        }
+        if (fstat(lock->fd, &fst) < 0) {
+            code = sync_error_system(ctx, "cannot stat lock file %s",
+                                     lock->path);
+            goto fail;
+        }
+        if (stat(lock->path, &pst) == 0 && fst.st_dev == pst.st_dev
+            && fst.st_ino == pst.st_ino)
+            break;
+        close(lock->fd);
+        lock->fd = -1;
+    }
+    sync_stats_record(config, SYNC_STATS_QUEUE_LOCK, &start, 0);
     return 0;
 
 fail:
+    sync_stats_record(config, SYNC_STATS_QUEUE_LOCK, &start, code);
     free(lockpath);
-    if (fd >= 0)
-        close(fd);
+    if (lock->fd >= 0)
+        close(lock->fd);
+    if (lock->global >= 0)
+        close(lock->global);
+    free(lock->path);
+    lock->global = -1;
+    lock->fd = -1;
+    lock->path = NULL;
     return code;
 }
 
 
 /*
- * Unlock the queue directory.  Takes the file descriptor of the open lock
- * file, returned by lock_queue.  We assume that this function will never
- * fail.
+ * Unlock the queue.  Takes the lock filled in by sync_queue_lock, and does
+ * nothing if it isn't held.  The per-id lock file is removed before it is
+ * unlocked, so any process waiting on it will notice and create a new one.
+ * We assume that this function will never fail.
  */
-static void
-unlock_queue(int fd)
+void
+sync_queue_unlock(struct sync_queue_lock *lock)
 {
-    close(fd);
+    if (lock->fd >= 0) {
+        unlink(lock->path);
+        close(lock->fd);
+    }
+    if (lock->global >= 0)
+        close(lock->global);
+    free(lock->path);
+    lock->global = -1;
+    lock->fd = -1;
+    lock->path = NULL;
 }
 
 
 /*
- * Given a Kerberos principal, a context, and an operation, generate the
- * prefix for queue files as a newly allocated string.  Returns a Kerberos
- * status code.
+ * Lock the whole queue by taking an exclusive lock on queue_dir/.lock, which
+ * waits for all holders of per-id locks (which hold a shared lock on it) and
+ * blocks any new ones.  The lock is stored in the final argument and must be
+ * passed to sync_queue_unlock.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_queue_lock_all(kadm5_hook_modinfo *config, krb5_context ctx,
+                    struct sync_queue_lock *lock)
+{
+    char *lockpath = NULL;
+    krb5_error_code code;
+
+    lock->global = -1;
+    lock->fd = -1;
+    lock->path = NULL;
+    if (asprintf(&lockpath, "%s/.lock", config->queue_dir) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    lock->global = open(lockpath, O_RDWR | O_CREAT, 0644);
+    if (lock->global < 0) {
+        code = sync_error_system(ctx, "cannot open lock file %s", lockpath);
+        free(lockpath);
+        return code;
+    }
+    if (flock(lock->global, LOCK_EX) < 0) {
+        code = sync_error_system(ctx, "cannot flock lock file %s", lockpath);
+        close(lock->global);
+        lock->global = -1;
+        free(lockpath);
+        return code;
+    }
+    free(lockpath);
+    return 0;
+}
+
+
+/*
+ * Given a queue file prefix from queue_prefix, store the corresponding id for
+ * locking, which is the prefix without its trailing hyphen, in a string that
+ * lasts as long as the request.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+queue_id(krb5_context ctx, struct sync_request *request, const char *prefix,
+         const char **id)
+{
+    *id = sync_request_printf(request, "%.*s", (int) strlen(prefix) - 1,
+                              prefix);
+    if (*id == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    return 0;
+}
+
+
+/*
+ * Given a request, a context, and an operation, generate the prefix for queue
+ * files.  Also store in dir the directory in which queue files with that
+ * prefix go, which is queue_dir unless queue_shards is set.  In that case, it
+ * is a subdirectory of queue_dir named after the hash of the user part of the
+ * prefix, as two lowercase hex digits.  Both strings last as long as the
+ * request.  Returns a Kerberos status code.
  */
 static krb5_error_code
-queue_prefix(krb5_context ctx, krb5_principal principal,
-             const char *operation, char **prefix)
+queue_prefix(kadm5_hook_modinfo *config, krb5_context ctx,
+             struct sync_request *request, const char *operation,
+             const char **prefix, const char **dir)
 {
-    char *user = NULL;
-    char *p;
-    int oerrno;
+    const char *user;
+    unsigned long shard;
     krb5_error_code code;
 
     /* Enable and disable should go into the same queue. */
@@ -118,39 +296,120 @@ queue_prefix(krb5_context ctx, krb5_principal principal,
      * The first part of the queue file is the principal with the realm
      * stripped and any slashes converted to periods.
      */
-    code = krb5_unparse_name_flags(ctx, principal,
-                                   KRB5_PRINCIPAL_UNPARSE_NO_REALM, &user);
+    *prefix = NULL;
+    *dir = NULL;
+    code = sync_request_queue_user(ctx, request, &user);
     if (code != 0)
         return code;
-    while ((p = strchr(user, '/')) != NULL)
-        *p = '.';
 
     /*
-     * Add to that the domain and operation.  The domain is currently always
-     * forced to ad (afs used to be possible, but that support was dropped),
-     * but retained for possible future use.
+     * Add to that the domain and operation.  The domain is the target of
+     * ad_targets the change is for, or ad if there are no targets (afs used
+     * to be possible, but that support was dropped).
      */
-    if (asprintf(prefix, "%s-ad-%s-", user, operation) < 0) {
-        oerrno = errno;
-        krb5_free_unparsed_name(ctx, user);
-        errno = oerrno;
+    *prefix = sync_request_printf(request, "%s-%s-%s-", user,
+                                  QUEUE_DOMAIN(request), operation);
+    if (*prefix == NULL)
         return sync_error_system(ctx, "cannot create queue prefix");
+
+    /* Determine the directory. */
+    if (config->queue_shards > 0) {
+        shard = sync_hash_string(user) % (unsigned long) config->queue_shards;
+        *dir = sync_request_printf(request, "%s/%02lx", config->queue_dir,
+                                   shard);
+        if (*dir == NULL)
+            return sync_error_system(ctx, "cannot create queue prefix");
+    } else {
+        *dir = config->queue_dir;
+    }
+    return 0;
+}
+
+
+/*
+ * Record the number of shards in queue_dir/.shards so that krb5-sync-backend
+ * can put the changes it queues in the same place the plugin would.  Only
+ * rewrites the file if its contents are wrong.  Called with the queue locked.
+ * Returns a Kerberos status code.
+ */
+static krb5_error_code
+queue_mark_shards(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    char *path = NULL, *tmp = NULL;
+    char wanted[32], buffer[32];
+    FILE *file;
+    size_t length;
+    int fd = -1;
+    krb5_error_code code;
+
+    /* See if the file is already correct. */
+    snprintf(wanted, sizeof(wanted), "%ld\n", config->queue_shards);
+    if (asprintf(&path, "%s/.shards", config->queue_dir) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    file = fopen(path, "r");
+    if (file != NULL) {
+        length = fread(buffer, 1, sizeof(buffer) - 1, file);
+        buffer[length] = '\0';
+        fclose(file);
+        if (strcmp(buffer, wanted) == 0) {
+            free(path);
+            return 0;
+        }
+    }
+
+    /* Write out a new file and rename it into place. */
+    if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+        tmp = NULL;
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto fail;
+    }
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        code = sync_error_system(ctx, "cannot create %s", tmp);
+        goto fail;
+    }
+    length = strlen(wanted);
+    if (write(fd, wanted, length) != (ssize_t) length
+        || fchmod(fd, 0644) < 0) {
+        code = sync_error_system(ctx, "cannot write %s", tmp);
+        goto fail;
+    }
+    if (close(fd) < 0) {
+        fd = -1;
+        code = sync_error_system(ctx, "cannot write %s", tmp);
+        goto fail;
+    }
+    fd = -1;
+    if (rename(tmp, path) < 0) {
+        code = sync_error_system(ctx, "cannot rename %s to %s", tmp, path);
+        goto fail;
     }
-    krb5_free_unparsed_name(ctx, user);
+    free(tmp);
+    free(path);
     return 0;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    if (tmp != NULL)
+        unlink(tmp);
+    free(tmp);
+    free(path);
+    return code;
 }
 
 
 /*
- * Generate a timestamp from the current date and store it in the argument.
- * Uses the ISO timestamp format.  Returns a Kerberos status code.
+ * Generate a timestamp from the current date and store it in the argument, in
+ * a string that lasts as long as the request.  Uses the ISO timestamp format.
+ * Returns a Kerberos status code.
  */
 static krb5_error_code
-queue_timestamp(krb5_context ctx, char **timestamp)
+queue_timestamp(krb5_context ctx, struct sync_request *request,
+                const char **timestamp)
 {
     struct tm now;
     time_t seconds;
-    int status;
 
     seconds = time(NULL);
     if (seconds == (time_t) -1)
@@ -159,154 +418,1309 @@ queue_timestamp(krb5_context ctx, char **timestamp)
         return sync_error_system(ctx, "cannot get broken-down time");
     now.tm_mon++;
     now.tm_year += 1900;
-    status = asprintf(timestamp, "%04d%02d%02dT%02d%02d%02dZ", now.tm_year,
-                      now.tm_mon, now.tm_mday, now.tm_hour, now.tm_min,
-                      now.tm_sec);
-    if (status < 0)
+    *timestamp = sync_request_printf(request, "%04d%02d%02dT%02d%02d%02dZ",
+                                     now.tm_year, now.tm_mon, now.tm_mday,
+                                     now.tm_hour, now.tm_min, now.tm_sec);
+    if (*timestamp == NULL)
         return sync_error_system(ctx, "cannot create timestamp");
-    else
-        return 0;
+    return 0;
 }
 
 
 /*
- * Given a Kerberos context, a principal (assumed to have no instance), and an
- * operation, check whether there are any existing queued actions for that
- * combination, storing the result in the final boolean variable.  Returns a
+ * Get the next number from the queue sequence counter in queue_dir/.sequence
+ * and store it in the final argument.  The number follows the timestamp in
+ * the names of queued changes, so changes queued in the same second are
+ * still ordered and have unique names without probing for an unused one.
+ * The counter is updated under an exclusive lock on the file but isn't
+ * flushed to disk, since it only orders changes within one second.  Returns a
  * Kerberos status code.
  */
+static krb5_error_code
+queue_sequence(kadm5_hook_modinfo *config, krb5_context ctx,
+               unsigned long *sequence)
+{
+    char *path = NULL;
+    char buffer[32];
+    ssize_t length;
+    int fd;
+    krb5_error_code code = 0;
+
+    if (asprintf(&path, "%s/.sequence", config->queue_dir) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        code = sync_error_system(ctx, "cannot open %s", path);
+        free(path);
+        return code;
+    }
+    if (flock(fd, LOCK_EX) < 0) {
+        code = sync_error_system(ctx, "cannot flock %s", path);
+        goto done;
+    }
+    length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length < 0) {
+        code = sync_error_system(ctx, "cannot read %s", path);
+        goto done;
+    }
+    buffer[length] = '\0';
+    *sequence = strtoul(buffer, NULL, 10);
+    snprintf(buffer, sizeof(buffer), "%lu\n", *sequence + 1);
+    if (pwrite(fd, buffer, strlen(buffer), 0) < 0)
+        code = sync_error_system(ctx, "cannot write %s", path);
+
+done:
+    close(fd);
+    free(path);
+    return code;
+}
+
+
+/*
+ * Flush a queue directory itself to disk so that a newly created queue file
+ * survives a crash.  This is best effort, since not all file systems support
+ * fsync on directories.
+ */
+static void
+queue_sync_dir(const char *dir)
+{
+    int fd;
+
+    fd = open(dir, O_RDONLY);
+    if (fd < 0)
+        return;
+    fsync(fd);
+    close(fd);
+}
+
+
+/*
+ * Read the number of completed group commits from the commit file, treating
+ * an empty file as zero.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+queue_commit_read(krb5_context ctx, int fd, unsigned long *count)
+{
+    char buffer[32];
+    ssize_t length;
+
+    length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length < 0)
+        return sync_error_system(ctx, "cannot read queue commit file");
+    buffer[length] = '\0';
+    *count = strtoul(buffer, NULL, 10);
+    return 0;
+}
+
+
+/*
+ * Make sure that a queued change written to fd is on disk before we report
+ * success, since the caller may be relying on the queue to make the change
+ * later.  dir, if not NULL, is the directory holding fd, which also has to be
+ * flushed since the file is new.  Returns a Kerberos status code.
+ *
+ * Normally this flushes fd and dir directly.  If queue_group_commit is set,
+ * concurrent writers share flushes instead.  Each writer reads the number of
+ * completed flushes from queue_dir/.commit under a shared lock and then takes
+ * an exclusive lock on it.  If another flush completed in the meantime, it
+ * started after our write and covered it, so we're done.  Otherwise we flush
+ * on behalf of everyone waiting and increment the count, so all the writers
+ * that arrive during one flush wait for only one more.
+ *
+ * For the journal, every writer appends to the same file, so an fsync by one
+ * covers the records of all of them.  For queue files, the flush is a syncfs
+ * of the file system holding the queue, which covers every writer's files and
+ * directory entries, so group commit of queue files requires syncfs and
+ * otherwise falls back to flushing each file.
+ */
+static krb5_error_code
+queue_commit(kadm5_hook_modinfo *config, krb5_context ctx, const char *dir,
+             int fd)
+{
+    char *path = NULL;
+    char buffer[32];
+    unsigned long seen, count;
+    int commit = -1, status;
+    krb5_error_code code = 0;
+
+#ifndef HAVE_SYNCFS
+    if (dir != NULL) {
+        if (fsync(fd) < 0)
+            return sync_error_system(ctx, "cannot flush queue file");
+        queue_sync_dir(dir);
+        return 0;
+    }
+#endif
+    if (!config->queue_group_commit) {
+        if (fsync(fd) < 0)
+            return sync_error_system(ctx, "cannot flush queue file");
+        if (dir != NULL)
+            queue_sync_dir(dir);
+        return 0;
+    }
+
+    /* Open the commit file and see how many flushes have completed. */
+    if (asprintf(&path, "%s/.commit", config->queue_dir) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    commit = open(path, O_RDWR | O_CREAT, 0644);
+    if (commit < 0) {
+        code = sync_error_system(ctx, "cannot open %s", path);
+        goto done;
+    }
+    if (flock(commit, LOCK_SH) < 0) {
+        code = sync_error_system(ctx, "cannot flock %s", path);
+        goto done;
+    }
+    code = queue_commit_read(ctx, commit, &seen);
+    if (code != 0)
+        goto done;
+
+    /* Wait for our turn and flush unless someone else already did. */
+    if (flock(commit, LOCK_EX) < 0) {
+        code = sync_error_system(ctx, "cannot flock %s", path);
+        goto done;
+    }
+    code = queue_commit_read(ctx, commit, &count);
+    if (code != 0 || count > seen)
+        goto done;
+#ifdef HAVE_SYNCFS
+    status = (dir != NULL) ? syncfs(fd) : fsync(fd);
+#else
+    status = fsync(fd);
+#endif
+    if (status < 0) {
+        code = sync_error_system(ctx, "cannot flush queue");
+        goto done;
+    }
+    snprintf(buffer, sizeof(buffer), "%lu\n", count + 1);
+    if (pwrite(commit, buffer, strlen(buffer), 0) < 0)
+        code = sync_error_system(ctx, "cannot write %s", path);
+
+done:
+    if (commit >= 0)
+        close(commit);
+    free(path);
+    return code;
+}
+
+
+/*
+ * Flush a queued change written to the journal to disk, sharing the flush
+ * with concurrent writers if queue_group_commit is set.  This is the same as
+ * the flush of new queue files, but without a directory.  Returns a Kerberos
+ * status code.
+ */
 krb5_error_code
-sync_queue_conflict(kadm5_hook_modinfo *config, krb5_context ctx,
-                    krb5_principal principal, const char *operation,
-                    bool *conflict)
+sync_queue_commit(kadm5_hook_modinfo *config, krb5_context ctx, int fd)
+{
+    return queue_commit(config, ctx, NULL, fd);
+}
+
+
+/*
+ * Comparison function for qsort to sort an array of queue file names, which
+ * may be in shard subdirectories, by the name of the file.
+ */
+static int
+queue_compare(const void *a, const void *b)
+{
+    const char *const *s1 = a;
+    const char *const *s2 = b;
+    const char *n1, *n2;
+
+    n1 = strrchr(*s1, '/');
+    n1 = (n1 == NULL) ? *s1 : n1 + 1;
+    n2 = strrchr(*s2, '/');
+    n2 = (n2 == NULL) ? *s2 : n2 + 1;
+    return strcmp(n1, n2);
+}
+
+
+/*
+ * Returns true if a name in queue_dir is that of a shard subdirectory, which
+ * is two lowercase hex digits.
+ */
+static bool
+queue_is_shard(const char *name)
+{
+    return strlen(name) == 2 && strspn(name, "0123456789abcdef") == 2;
+}
+
+
+/*
+ * Add the names of all queue files in a directory to a vector, ignoring
+ * files whose names start with a period.  If shard is not NULL, it is the
+ * name of the shard subdirectory being read, which is prepended to each file
+ * name; otherwise, shard subdirectories are read recursively.  Returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+queue_read_dir(kadm5_hook_modinfo *config, krb5_context ctx, const char *shard,
+               struct vector *list)
 {
-    int lock = -1;
-    char *prefix = NULL;
-    DIR *queue = NULL;
+    char *path = NULL, *name;
+    DIR *dir;
     struct dirent *entry;
-    krb5_error_code code;
+    krb5_error_code code = 0;
+    int status;
 
-    if (config->queue_dir == NULL)
-        return sync_error_config(ctx, "configuration setting queue_dir"
-                                 " missing");
-    code = queue_prefix(ctx, principal, operation, &prefix);
-    if (code != 0)
+    if (shard == NULL)
+        path = strdup(config->queue_dir);
+    else if (asprintf(&path, "%s/%s", config->queue_dir, shard) < 0)
+        path = NULL;
+    if (path == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    dir = opendir(path);
+    if (dir == NULL) {
+        code = sync_error_system(ctx, "cannot open %s", path);
+        free(path);
         return code;
-    code = lock_queue(config, ctx, &lock);
-    if (code != 0)
-        goto fail;
-    queue = opendir(config->queue_dir);
-    if (queue == NULL) {
-        code = sync_error_system(ctx, "cannot open %s", config->queue_dir);
-        goto fail;
     }
-    *conflict = false;
-    while ((entry = readdir(queue)) != NULL) {
-        if (strncmp(prefix, entry->d_name, strlen(prefix)) == 0) {
-            *conflict = true;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (shard == NULL && queue_is_shard(entry->d_name)) {
+            code = queue_read_dir(config, ctx, entry->d_name, list);
+            if (code != 0)
+                break;
+            continue;
+        }
+        if (shard == NULL)
+            status = sync_vector_add(list, entry->d_name) ? 0 : -1;
+        else {
+            status = asprintf(&name, "%s/%s", shard, entry->d_name);
+            if (status >= 0) {
+                status = sync_vector_add(list, name) ? 0 : -1;
+                free(name);
+            }
+        }
+        if (status < 0) {
+            code = sync_error_system(ctx, "cannot allocate memory");
             break;
         }
     }
-    unlock_queue(lock);
-    closedir(queue);
-    free(prefix);
-    return 0;
-
-fail:
-    if (lock >= 0)
-        unlock_queue(lock);
-    if (queue != NULL)
-        closedir(queue);
-    free(prefix);
+    closedir(dir);
+    free(path);
     return code;
 }
 
 
 /*
- * Queue an action.  Takes the plugin configuration, the Kerberos context, the
- * principal, the operation, and a password (which may be NULL for enable and
- * disable).  Returns a Kerberos error code.
+ * List the files in the queue, ignoring files whose names start with a
+ * period, and store them in a newly allocated vector sorted by file name.
+ * This is the order in which queued changes should be made.  Files in shard
+ * subdirectories are included as the shard name, a slash, and the file name.
+ * Both layouts are always read, so that changes queued before queue_shards
+ * was changed are still processed.  If queue_format is journal, the names of
+ * the pending changes in the journal are listed instead.  Returns a Kerberos
+ * status code.
+ *
+ * No lock is held, since the caller has to lock each change and check that
+ * it still exists before acting on it anyway.
  */
 krb5_error_code
-sync_queue_write(kadm5_hook_modinfo *config, krb5_context ctx,
-                 krb5_principal principal, const char *operation,
-                 const char *password)
+sync_queue_list(kadm5_hook_modinfo *config, krb5_context ctx,
+                struct vector **files)
 {
-    char *prefix = NULL, *timestamp = NULL, *path = NULL, *user = NULL;
-    unsigned int i;
+    struct vector *list = NULL;
     krb5_error_code code;
-    int lock = -1, fd = -1;
 
+    *files = NULL;
     if (config->queue_dir == NULL)
         return sync_error_config(ctx, "configuration setting queue_dir"
                                  " missing");
-    code = queue_prefix(ctx, principal, operation, &prefix);
-    if (code != 0)
-        return code;
-
-    /*
-     * Lock the queue before the timestamp so that another writer coming up
-     * at the same time can't get an earlier timestamp.
-     */
-    code = lock_queue(config, ctx, &lock);
-    if (code != 0)
-        goto fail;
-    code = queue_timestamp(ctx, &timestamp);
+    list = sync_vector_new();
+    if (list == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    if (config->journal != NULL)
+        code = sync_journal_list(config, ctx, list);
+    else
+        code = queue_read_dir(config, ctx, NULL, list);
     if (code != 0)
         goto fail;
+    if (list->count > 0)
+        qsort(list->strings, list->count, sizeof(char *), queue_compare);
+    *files = list;
+    return 0;
 
-    /* Find a unique filename for the queue file. */
-    for (i = 0; i < MAX_QUEUE; i++) {
-        free(path);
-        path = NULL;
-        code = asprintf(&path, "%s/%s%s-%02d", config->queue_dir, prefix,
-                        timestamp, i);
-        if (code < 0) {
-            code = sync_error_system(ctx, "cannot create queue file name");
-            goto fail;
+fail:
+    sync_vector_free(list);
+    return code;
+}
+
+
+/*
+ * Free the cached contents of the queue directories.
+ */
+void
+sync_queue_close(kadm5_hook_modinfo *config)
+{
+    struct sync_queue_cache *cache = config->queue_cache;
+    size_t i;
+
+    if (cache == NULL)
+        return;
+    for (i = 0; i < cache->count; i++)
+        sync_vector_free(cache->dirs[i].names);
+    free(cache->dirs);
+    free(cache);
+    config->queue_cache = NULL;
+}
+
+
+/*
+ * Get the cached contents of one queue directory, which is queue_dir or, if
+ * queue_shards is set, one of its shard subdirectories, creating the cache if
+ * needed.  Returns NULL on memory allocation failure.
+ */
+static struct queue_cache_dir *
+queue_cache_dir(kadm5_hook_modinfo *config, const char *dir)
+{
+    struct sync_queue_cache *cache;
+    size_t count, slot = 0;
+
+    /* queue_shards may have changed since the cache was created. */
+    count = (config->queue_shards > 0) ? (size_t) config->queue_shards : 1;
+    if (config->queue_cache != NULL && config->queue_cache->count != count)
+        sync_queue_close(config);
+    if (config->queue_cache == NULL) {
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL)
+            return NULL;
+        cache->dirs = calloc(count, sizeof(struct queue_cache_dir));
+        if (cache->dirs == NULL) {
+            free(cache);
+            return NULL;
         }
-        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
-        if (fd >= 0)
-            break;
+        cache->count = count;
+        config->queue_cache = cache;
     }
 
-    /* Get the username from the principal without the realm. */
-    code = krb5_unparse_name_flags(ctx, principal,
-                                   KRB5_PRINCIPAL_UNPARSE_NO_REALM, &user);
-    if (code != 0)
-        goto fail;
+    /* The name of a shard subdirectory is its number in hex. */
+    if (config->queue_shards > 0)
+        slot = strtoul(dir + strlen(config->queue_dir) + 1, NULL, 16);
+    if (slot >= count)
+        slot = 0;
+    return &config->queue_cache->dirs[slot];
+}
 
-    /* Write out the queue data (with hard-coded "ad" domain). */
-    WRITE_CHECK(fd, user);
-    WRITE_CHECK(fd, "\nad\n");
-    WRITE_CHECK(fd, operation);
-    WRITE_CHECK(fd, "\n");
-    if (password != NULL) {
-        WRITE_CHECK(fd, password);
-        WRITE_CHECK(fd, "\n");
-    }
 
-    /* We're done. */
-    close(fd);
-    unlock_queue(lock);
-    krb5_free_unparsed_name(ctx, user);
-    free(prefix);
-    free(timestamp);
+/*
+ * Read the names of the queue files in a directory, ignoring files whose
+ * names start with a period, into a newly allocated vector sorted by name.
+ * Returns a Kerberos status code.
+ */
+static krb5_error_code
+queue_scan(krb5_context ctx, const char *dir, struct vector **names)
+{
+    struct vector *list;
+    DIR *queue;
+    struct dirent *entry;
+    krb5_error_code code;
+
+    *names = NULL;
+    list = sync_vector_new();
+    if (list == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    queue = opendir(dir);
+    if (queue == NULL) {
+        code = sync_error_system(ctx, "cannot open %s", dir);
+        sync_vector_free(list);
+        return code;
+    }
+    while ((entry = readdir(queue)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (!sync_vector_add(list, entry->d_name)) {
+            code = sync_error_system(ctx, "cannot allocate memory");
+            closedir(queue);
+            sync_vector_free(list);
+            return code;
+        }
+    }
+    closedir(queue);
+    if (list->count > 0)
+        qsort(list->strings, list->count, sizeof(char *), queue_compare);
+    *names = list;
+    return 0;
+}
+
+
+/*
+ * Returns true if any name in a sorted vector starts with prefix.
+ */
+static bool
+queue_has_prefix(const struct vector *names, const char *prefix)
+{
+    size_t low = 0, high = names->count, middle;
+    size_t length = strlen(prefix);
+
+    /* Find the first name that doesn't sort before the prefix. */
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (strcmp(names->strings[middle], prefix) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < names->count
+        && strncmp(names->strings[low], prefix, length) == 0;
+}
+
+
+/*
+ * Given a Kerberos context, a request for a principal (assumed to have no
+ * instance), and the queue file prefix and directory for an operation from
+ * queue_prefix, check whether there are any existing queued actions for that
+ * combination, storing the result in the final boolean variable.  Returns a
+ * Kerberos status code.
+ *
+ * This is done before every change, and the queue is almost always empty, so
+ * it has to be cheap.  The names of the queue files in each directory are
+ * cached, and the cache is used as long as the modification time of the
+ * directory hasn't changed, so usually the check is only a stat.  Since a
+ * directory can be changed more than once within the resolution of its
+ * modification time, the cache isn't trusted if the directory was modified
+ * in the second before it was read.
+ *
+ * No queue lock is taken.  Each queue file is created and removed atomically
+ * and is only removed after its change is made, so a change that is being
+ * queued or made while we check is seen either as queued or as finished,
+ * just as if it had happened before or after the check.  Not locking also
+ * means our own per-id lock files don't change the directory.
+ *
+ * If queue_shards is set, only the shard for this user is read, and a missing
+ * shard directory means there are no conflicts.  If queue_format is journal,
+ * the journal index is checked instead.
+ */
+static krb5_error_code
+queue_conflict(kadm5_hook_modinfo *config, krb5_context ctx,
+               struct sync_request *request, const char *prefix,
+               const char *dir, bool *conflict)
+{
+    const char *id;
+    struct queue_cache_dir *cached;
+    struct vector *names = NULL;
+    struct stat st;
+    time_t now;
+    krb5_error_code code;
+
+    *conflict = false;
+    if (config->journal != NULL) {
+        code = queue_id(ctx, request, prefix, &id);
+        if (code != 0)
+            return code;
+        return sync_journal_conflict(config, ctx, id, conflict);
+    }
+    cached = queue_cache_dir(config, dir);
+    if (cached == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+
+    /* Use the cached names if the directory hasn't changed. */
+    now = time(NULL);
+    if (stat(dir, &st) < 0) {
+        if (errno != ENOENT || config->queue_shards <= 0)
+            return sync_error_system(ctx, "cannot stat %s", dir);
+        sync_vector_free(cached->names);
+        cached->names = NULL;
+        return 0;
+    }
+    if (cached->names != NULL && cached->stable && cached->dev == st.st_dev
+        && cached->ino == st.st_ino && cached->mtime == st.st_mtime) {
+        *conflict = queue_has_prefix(cached->names, prefix);
+        return 0;
+    }
+
+    /* Otherwise, read the directory again. */
+    code = queue_scan(ctx, dir, &names);
+    if (code != 0)
+        return code;
+    *conflict = queue_has_prefix(names, prefix);
+    sync_vector_free(cached->names);
+    cached->names = names;
+    cached->dev = st.st_dev;
+    cached->ino = st.st_ino;
+    cached->mtime = st.st_mtime;
+    cached->stable = (st.st_mtime < now - 1);
+    return 0;
+}
+
+
+/*
+ * Check whether there are any existing queued actions for a request and
+ * operation, storing the result in the final boolean variable.  See
+ * queue_conflict for the details.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_queue_conflict(kadm5_hook_modinfo *config, krb5_context ctx,
+                    struct sync_request *request, const char *operation,
+                    bool *conflict)
+{
+    const char *prefix, *dir;
+    krb5_error_code code;
+
+    *conflict = false;
+    if (config->queue_dir == NULL)
+        return sync_error_config(ctx, "configuration setting queue_dir"
+                                 " missing");
+    code = queue_prefix(config, ctx, request, operation, &prefix, &dir);
+    if (code != 0)
+        return code;
+    return queue_conflict(config, ctx, request, prefix, dir, conflict);
+}
+
+
+/*
+ * Remove all queue files in dir with the given prefix except the one named
+ * keep, since the newly queued change supersedes them.  Used when
+ * queue_coalesce is set, with the queue locked for that prefix.  The number
+ * and size of the removed files are stored in removed.  Failure to remove an
+ * old file only means that change is made again, so errors are ignored.
+ */
+static void
+queue_coalesce(kadm5_hook_modinfo *config, const char *dir,
+               const char *prefix, const char *keep,
+               struct queue_depth *removed)
+{
+    DIR *queue;
+    struct dirent *entry;
+    struct stat st;
+    char *path;
+
+    removed->changes = 0;
+    removed->bytes = 0;
+    queue = opendir(dir);
+    if (queue == NULL)
+        return;
+    while ((entry = readdir(queue)) != NULL) {
+        if (strncmp(prefix, entry->d_name, strlen(prefix)) != 0)
+            continue;
+        if (strcmp(entry->d_name, keep) == 0)
+            continue;
+        if (asprintf(&path, "%s/%s", dir, entry->d_name) < 0)
+            continue;
+        if (stat(path, &st) < 0)
+            st.st_size = 0;
+        if (unlink(path) == 0) {
+            sync_syslog_debug(config, "krb5-sync: removed superseded queued"
+                              " change %s", entry->d_name);
+            removed->changes++;
+            removed->bytes += (unsigned long) st.st_size;
+        }
+        free(path);
+    }
+    closedir(queue);
+    if (removed->changes > 0)
+        queue_sync_dir(dir);
+}
+
+
+/*
+ * Returns true if any limit on the queue depth is set.
+ */
+static bool
+queue_limited(kadm5_hook_modinfo *config)
+{
+    return config->queue_soft_limit > 0 || config->queue_soft_bytes > 0
+        || config->queue_hard_limit > 0 || config->queue_hard_bytes > 0;
+}
+
+
+/*
+ * Count the queue files and their total size by reading the queue.  Files
+ * that disappear while being counted are skipped.  Returns a Kerberos status
+ * code.
+ */
+static krb5_error_code
+queue_count(kadm5_hook_modinfo *config, krb5_context ctx,
+            struct queue_depth *depth)
+{
+    struct vector *files;
+    struct stat st;
+    char *path;
+    size_t i;
+    krb5_error_code code;
+
+    depth->changes = 0;
+    depth->bytes = 0;
+    code = sync_queue_list(config, ctx, &files);
+    if (code != 0)
+        return code;
+    for (i = 0; i < files->count; i++) {
+        if (asprintf(&path, "%s/%s", config->queue_dir,
+                     files->strings[i]) < 0) {
+            sync_vector_free(files);
+            return sync_error_system(ctx, "cannot allocate memory");
+        }
+        if (stat(path, &st) == 0) {
+            depth->changes++;
+            depth->bytes += (unsigned long) st.st_size;
+        }
+        free(path);
+    }
+    sync_vector_free(files);
+    return 0;
+}
+
+
+/*
+ * Write the queue depth to the open queue_dir/.depth file.  Returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+queue_depth_write(krb5_context ctx, int fd, const struct queue_depth *depth)
+{
+    char buffer[64];
+
+    snprintf(buffer, sizeof(buffer), "%lu %lu\n", depth->changes,
+             depth->bytes);
+    if (ftruncate(fd, 0) < 0 || pwrite(fd, buffer, strlen(buffer), 0) < 0)
+        return sync_error_system(ctx, "cannot write %s", QUEUE_DEPTH_FILE);
+    return 0;
+}
+
+
+/*
+ * Open and lock queue_dir/.depth and read the queue depth from it into
+ * depth, storing the open file descriptor in fd.  If the file is new or
+ * can't be parsed, the queue is counted instead and the file written.  The
+ * lock is released by queue_depth_unlock.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+queue_depth_lock(kadm5_hook_modinfo *config, krb5_context ctx, int *fd,
+                 struct queue_depth *depth)
+{
+    char *path = NULL;
+    char buffer[64];
+    ssize_t length;
+    krb5_error_code code = 0;
+
+    if (asprintf(&path, "%s/%s", config->queue_dir, QUEUE_DEPTH_FILE) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    *fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (*fd < 0) {
+        code = sync_error_system(ctx, "cannot open %s", path);
+        goto done;
+    }
+    if (flock(*fd, LOCK_EX) < 0) {
+        code = sync_error_system(ctx, "cannot flock %s", path);
+        goto done;
+    }
+    length = pread(*fd, buffer, sizeof(buffer) - 1, 0);
+    if (length < 0) {
+        code = sync_error_system(ctx, "cannot read %s", path);
+        goto done;
+    }
+    buffer[length] = '\0';
+    if (sscanf(buffer, "%lu %lu", &depth->changes, &depth->bytes) != 2) {
+        code = queue_count(config, ctx, depth);
+        if (code == 0)
+            code = queue_depth_write(ctx, *fd, depth);
+    }
+
+done:
+    if (code != 0 && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
     free(path);
+    return code;
+}
+
+
+/*
+ * Write the queue depth to queue_dir/.depth, unless depth is NULL, and
+ * release the lock taken by queue_depth_lock.  Returns a Kerberos status
+ * code.
+ */
+static krb5_error_code
+queue_depth_unlock(krb5_context ctx, int fd, const struct queue_depth *depth)
+{
+    krb5_error_code code = 0;
+
+    if (depth != NULL)
+        code = queue_depth_write(ctx, fd, depth);
+    close(fd);
+    return code;
+}
+
+
+/*
+ * Adjust the queue depth in queue_dir/.depth by the given number of changes
+ * and bytes, added and removed.  Returns a Kerberos status code.
+ */
+static krb5_error_code
+queue_depth_adjust(kadm5_hook_modinfo *config, krb5_context ctx,
+                   const struct queue_depth *added,
+                   const struct queue_depth *removed)
+{
+    struct queue_depth depth;
+    krb5_error_code code;
+    int fd;
+
+    code = queue_depth_lock(config, ctx, &fd, &depth);
+    if (code != 0)
+        return code;
+    depth.changes += added->changes;
+    depth.bytes += added->bytes;
+    depth.changes -= (removed->changes < depth.changes)
+        ? removed->changes : depth.changes;
+    depth.bytes -= (removed->bytes < depth.bytes)
+        ? removed->bytes : depth.bytes;
+    return queue_depth_unlock(ctx, fd, &depth);
+}
+
+
+/*
+ * Count the queue files again and store the result in queue_dir/.depth, so
+ * that changes removed since the last count are no longer counted.  Called
+ * after the queue is processed.  The counting is done without the lock on
+ * .depth, so that writers don't wait for it, and changes queued while
+ * counting are added back afterwards.  Does nothing if there are no queue
+ * limits or queue_format is journal.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_queue_recount(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct queue_depth before, after, depth;
+    krb5_error_code code;
+    int fd;
+
+    if (!queue_limited(config) || config->journal != NULL)
+        return 0;
+    code = queue_depth_lock(config, ctx, &fd, &before);
+    if (code != 0)
+        return code;
+    queue_depth_unlock(ctx, fd, NULL);
+    code = queue_count(config, ctx, &depth);
+    if (code != 0)
+        return code;
+    code = queue_depth_lock(config, ctx, &fd, &after);
+    if (code != 0)
+        return code;
+    if (after.changes > before.changes)
+        depth.changes += after.changes - before.changes;
+    if (after.bytes > before.bytes)
+        depth.bytes += after.bytes - before.bytes;
+    return queue_depth_unlock(ctx, fd, &depth);
+}
+
+
+/*
+ * Returns true if a queue limit is set and value has reached it.
+ */
+static bool
+queue_over(long limit, unsigned long value)
+{
+    return limit > 0 && value >= (unsigned long) limit;
+}
+
+
+/*
+ * Decide whether a change may be queued given the queue limits.  Takes the
+ * queue file prefix, directory, and id of the change, and sets coalesce to
+ * true if superseded changes should be removed when queuing it.  Above a
+ * soft limit, a warning is logged and superseded changes are removed even if
+ * queue_coalesce isn't set.  Above a hard limit, the change is refused if
+ * queue_full_policy is fail (the default) and, if it is drop-superseded,
+ * only accepted if it supersedes a change that is already queued.  The
+ * caller holds the queue lock for the id.  Returns a Kerberos status code,
+ * which is an error if the change is refused.
+ */
+static krb5_error_code
+queue_admit(kadm5_hook_modinfo *config, krb5_context ctx, const char *prefix,
+            const char *dir, const char *id, bool *coalesce)
+{
+    struct queue_depth depth;
+    struct vector *names = NULL;
+    bool soft, hard, superseded = false;
+    krb5_error_code code;
+    int fd;
+
+    if (config->journal != NULL)
+        code = sync_journal_depth(config, ctx, &depth.changes, &depth.bytes);
+    else {
+        code = queue_depth_lock(config, ctx, &fd, &depth);
+        if (code == 0)
+            queue_depth_unlock(ctx, fd, NULL);
+    }
+    if (code != 0)
+        return code;
+    soft = queue_over(config->queue_soft_limit, depth.changes)
+        || queue_over(config->queue_soft_bytes, depth.bytes);
+    hard = queue_over(config->queue_hard_limit, depth.changes)
+        || queue_over(config->queue_hard_bytes, depth.bytes);
+    if (!soft && !hard)
+        return 0;
+    *coalesce = true;
+    if (!hard) {
+        sync_syslog_warning(config, "krb5-sync: queue %s is above its soft"
+                            " limit (%lu changes, %lu bytes)",
+                            config->queue_dir, depth.changes, depth.bytes);
+        return 0;
+    }
+
+    /* Above a hard limit, only a change that supersedes another may go. */
+    if (config->queue_full_policy != NULL
+        && strcmp(config->queue_full_policy, "drop-superseded") == 0) {
+        if (config->journal != NULL)
+            code = sync_journal_conflict(config, ctx, id, &superseded);
+        else if (access(dir, F_OK) == 0) {
+            code = queue_scan(ctx, dir, &names);
+            if (code == 0)
+                superseded = queue_has_prefix(names, prefix);
+            sync_vector_free(names);
+        }
+        if (code != 0)
+            return code;
+    }
+    if (superseded)
+        return 0;
+    return sync_error_generic(ctx, "queue %s is full (%lu changes, %lu"
+                              " bytes), not queuing change for %s",
+                              config->queue_dir, depth.changes, depth.bytes,
+                              id);
+}
+
+
+/*
+ * Store a queue file with the given name and contents in dir, which is
+ * queue_dir or the shard subdirectory for its user, creating the shard
+ * subdirectory if needed.  The file is flushed to disk, along with its
+ * directory entry, before this returns.  Temporary strings last as long as
+ * the request.  The caller holds the queue lock for the id of the change.
+ * Returns a Kerberos error code.
+ */
+static krb5_error_code
+queue_store(kadm5_hook_modinfo *config, krb5_context ctx,
+            struct sync_request *request, const char *dir, const char *name,
+            const char *contents)
+{
+    char *path, *tmp;
+    krb5_error_code code;
+    int fd = -1;
+
+    /*
+     * If the queue is sharded, create the shard directory if needed and make
+     * sure krb5-sync-backend can tell which layout we're using.
+     */
+    if (config->queue_shards > 0) {
+        code = queue_mark_shards(config, ctx);
+        if (code != 0)
+            return code;
+        if (mkdir(dir, 0700) == 0)
+            queue_sync_dir(config->queue_dir);
+        else if (errno != EEXIST)
+            return sync_error_system(ctx, "cannot create %s", dir);
+    }
+
+    /*
+     * Write the queue file under a temporary name starting with a period,
+     * which readers skip, and then rename it into place, so that no reader
+     * ever sees a partly written change.  Neither name should ever already
+     * exist.
+     */
+    path = sync_request_printf(request, "%s/%s", dir, name);
+    tmp = sync_request_printf(request, "%s/.tmp-%s", dir, name);
+    if (path == NULL || tmp == NULL)
+        return sync_error_system(ctx, "cannot create queue file name");
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return sync_error_system(ctx, "cannot create queue file %s", path);
+    WRITE_CHECK(fd, contents);
+
+    /*
+     * Make sure the queued change is on disk before we report success, since
+     * the caller may be relying on the queue to make the change later.  The
+     * file is always flushed before it gets its real name, so that a crash
+     * never leaves a truncated change under a name that readers pick up.
+     * The directory is flushed after the rename so that the real name is on
+     * disk too, which with queue_group_commit is the flush shared between
+     * writers.  Once renamed, the change may already have been made, so it
+     * isn't withdrawn if flushing the directory fails.
+     */
+    if (fsync(fd) < 0) {
+        code = sync_error_system(ctx, "cannot flush queue file");
+        goto fail;
+    }
+    if (rename(tmp, path) < 0) {
+        code = sync_error_system(ctx, "cannot rename %s to %s", tmp, path);
+        goto fail;
+    }
+    if (config->queue_group_commit) {
+        code = queue_commit(config, ctx, dir, fd);
+        close(fd);
+        return code;
+    }
+    close(fd);
+    queue_sync_dir(dir);
     return 0;
 
 fail:
-    if (fd >= 0) {
-        if (path != NULL)
-            unlink(path);
-        close(fd);
+    unlink(tmp);
+    close(fd);
+    return code;
+}
+
+
+/*
+ * Queue an action.  Takes the plugin configuration, the Kerberos context, the
+ * request, the operation, a password (which may be NULL for enable and
+ * disable), and the queue file prefix and directory for the operation from
+ * queue_prefix.  Returns a Kerberos error code.
+ */
+static krb5_error_code
+queue_write(kadm5_hook_modinfo *config, krb5_context ctx,
+            struct sync_request *request, const char *operation,
+            const char *password, const char *prefix, const char *dir)
+{
+    const char *id, *timestamp, *user, *message, *trace;
+    char *name, *contents;
+    struct sync_queue_lock lock = { -1, -1, NULL };
+    struct queue_depth added, removed;
+    unsigned long sequence;
+    struct timeval start;
+    bool coalesce;
+    krb5_error_code code;
+
+    sync_stats_start(config, &start);
+
+    /*
+     * Lock the queue before the timestamp so that another writer coming up
+     * at the same time can't get an earlier timestamp.
+     */
+    code = queue_id(ctx, request, prefix, &id);
+    if (code != 0)
+        goto fail;
+    code = sync_queue_lock(config, ctx, id, &lock);
+    if (code != 0)
+        goto fail;
+
+    /* Check the queue limits, which may also ask for coalescing. */
+    coalesce = config->queue_coalesce;
+    if (queue_limited(config)) {
+        code = queue_admit(config, ctx, prefix, dir, id, &coalesce);
+        if (code != 0)
+            goto fail;
     }
-    if (lock >= 0)
-        unlock_queue(lock);
-    if (user != NULL)
-        krb5_free_unparsed_name(ctx, user);
-    free(prefix);
-    free(timestamp);
-    free(path);
+    code = queue_timestamp(ctx, request, &timestamp);
+    if (code != 0)
+        goto fail;
+    code = queue_sequence(config, ctx, &sequence);
+    if (code != 0)
+        goto fail;
+    name = sync_request_printf(request, "%s%s-%010lu", prefix, timestamp,
+                               sequence);
+    if (name == NULL) {
+        code = sync_error_system(ctx, "cannot create queue file name");
+        goto fail;
+    }
+
+    /* Get the username without the realm. */
+    code = sync_request_user(ctx, request, &user);
+    if (code != 0)
+        goto fail;
+
+    /* If using a journal, it handles the rest. */
+    if (config->journal != NULL) {
+        code = sync_journal_write(config, ctx, prefix, name, user, operation,
+                                  password, coalesce);
+        if (code != 0)
+            goto fail;
+        sync_queue_unlock(&lock);
+        sync_stats_record(config, SYNC_STATS_QUEUE_WRITE, &start, 0);
+        return 0;
+    }
+
+    /*
+     * Format the queue data so that it can be written at once, followed by
+     * the trace line if the change is traced.  It's cleared with the
+     * request, since it may contain the password.
+     */
+    trace = sync_request_trace_line(request);
+    contents = sync_request_printf(request, "%s\n%s\n%s\n%s%s%s%s", user,
+                                   QUEUE_DOMAIN(request), operation,
+                                   (password == NULL) ? "" : password,
+                                   (password == NULL) ? "" : "\n",
+                                   (trace == NULL) ? "" : trace,
+                                   (trace == NULL) ? "" : "\n");
+    if (contents == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto fail;
+    }
+    code = queue_store(config, ctx, request, dir, name, contents);
+    if (code != 0)
+        goto fail;
+
+    /* The new change supersedes any older ones with the same prefix. */
+    removed.changes = 0;
+    removed.bytes = 0;
+    if (coalesce)
+        queue_coalesce(config, dir, prefix, name, &removed);
+
+    /*
+     * Update the queue depth if there are limits.  The change has already
+     * been queued, so failure only means the depth is wrong until the queue
+     * is next processed.
+     */
+    if (queue_limited(config)) {
+        added.changes = 1;
+        added.bytes = strlen(contents);
+        code = queue_depth_adjust(config, ctx, &added, &removed);
+        if (code != 0) {
+            message = krb5_get_error_message(ctx, code);
+            sync_syslog_warning(config, "krb5-sync: cannot update queue"
+                                " depth: %s", message);
+            krb5_free_error_message(ctx, message);
+        }
+    }
+
+    /* We're done. */
+    sync_queue_unlock(&lock);
+    sync_stats_record(config, SYNC_STATS_QUEUE_WRITE, &start, 0);
+    return 0;
+
+fail:
+    sync_queue_unlock(&lock);
+    sync_stats_record(config, SYNC_STATS_QUEUE_WRITE, &start, code);
+    return code;
+}
+
+
+/*
+ * Queue an action.  Takes the plugin configuration, the Kerberos context, the
+ * request, the operation, and a password (which may be NULL for enable and
+ * disable).  Returns a Kerberos error code.
+ */
+krb5_error_code
+sync_queue_write(kadm5_hook_modinfo *config, krb5_context ctx,
+                 struct sync_request *request, const char *operation,
+                 const char *password)
+{
+    const char *prefix, *dir;
+    krb5_error_code code;
+
+    if (config->queue_dir == NULL)
+        return sync_error_config(ctx, "configuration setting queue_dir"
+                                 " missing");
+    code = queue_prefix(config, ctx, request, operation, &prefix, &dir);
+    if (code != 0)
+        return code;
+    return queue_write(config, ctx, request, operation, password, prefix,
+                       dir);
+}
+
+
+/*
+ * Queue an action if there are already queued actions for the same request
+ * and operation, and set queued to whether it was queued.  Takes the same
+ * arguments as sync_queue_write.  Returns a Kerberos error code.
+ *
+ * This is the check done before every change, so the queue file prefix is
+ * only computed once for both the check and the write, and the queue is only
+ * locked, once, if there is a conflict and the change is written.  The check
+ * itself doesn't need the lock; see queue_conflict.
+ */
+krb5_error_code
+sync_queue_conflict_write(kadm5_hook_modinfo *config, krb5_context ctx,
+                          struct sync_request *request,
+                          const char *operation, const char *password,
+                          bool *queued)
+{
+    const char *prefix, *dir;
+    bool conflict;
+    krb5_error_code code;
+
+    *queued = false;
+    if (config->queue_dir == NULL)
+        return sync_error_config(ctx, "configuration setting queue_dir"
+                                 " missing");
+    code = queue_prefix(config, ctx, request, operation, &prefix, &dir);
+    if (code != 0)
+        return code;
+    code = queue_conflict(config, ctx, request, prefix, dir, &conflict);
+    if (code != 0 || !conflict)
+        return code;
+    code = queue_write(config, ctx, request, operation, password, prefix,
+                       dir);
+    if (code == 0)
+        *queued = true;
+    return code;
+}
+
+
+/*
+ * Remove the queue files in dir with the given prefix, or if new_prefix is
+ * not NULL, move each of them to new_dir under the same name with new_prefix
+ * in place of prefix and with user as its user.  The number and size of the
+ * files written and removed are stored in added and removed.  Files that
+ * can't be read, such as ones queued by older versions without contents,
+ * are left alone.  Temporary strings last as long as the request.  The
+ * caller holds the queue locks for both prefixes.  Returns a Kerberos error
+ * code, stopping at the first change that can't be moved.
+ */
+static krb5_error_code
+queue_move_files(kadm5_hook_modinfo *config, krb5_context ctx,
+                 struct sync_request *request, const char *prefix,
+                 const char *dir, const char *new_prefix, const char *new_dir,
+                 const char *user, struct queue_depth *added,
+                 struct queue_depth *removed)
+{
+    struct vector *names = NULL;
+    struct sync_queue_record record;
+    struct stat st;
+    const char *name, *path, *contents, *password, *trace;
+    size_t i;
+    krb5_error_code code;
+
+    added->changes = 0;
+    added->bytes = 0;
+    removed->changes = 0;
+    removed->bytes = 0;
+    code = queue_scan(ctx, dir, &names);
+    if (code != 0)
+        return code;
+    for (i = 0; i < names->count; i++) {
+        if (strncmp(names->strings[i], prefix, strlen(prefix)) != 0)
+            continue;
+        path = sync_request_printf(request, "%s/%s", dir, names->strings[i]);
+        if (path == NULL) {
+            code = sync_error_system(ctx, "cannot allocate memory");
+            break;
+        }
+        if (new_prefix != NULL) {
+            if (sync_queue_read_record(ctx, path, &record) != 0)
+                continue;
+            name = sync_request_printf(request, "%s%s", new_prefix,
+                                       names->strings[i] + strlen(prefix));
+            password = record.password;
+            trace = record.trace;
+            contents = sync_request_printf(request, "%s\n%s\n%s\n%s%s%s%s",
+                                           user, record.domain,
+                                           record.operation,
+                                           (password == NULL) ? "" : password,
+                                           (password == NULL) ? "" : "\n",
+                                           (trace == NULL) ? "" : trace,
+                                           (trace == NULL) ? "" : "\n");
+            sync_queue_record_free(&record);
+            if (name == NULL || contents == NULL) {
+                code = sync_error_system(ctx, "cannot allocate memory");
+                break;
+            }
+            code = queue_store(config, ctx, request, new_dir, name, contents);
+            if (code != 0)
+                break;
+            added->changes++;
+            added->bytes += strlen(contents);
+            sync_syslog_debug(config, "krb5-sync: moved queued change %s to"
+                              " %s", names->strings[i], name);
+        }
+        if (stat(path, &st) < 0)
+            st.st_size = 0;
+        if (unlink(path) == 0) {
+            if (new_prefix == NULL)
+                sync_syslog_debug(config, "krb5-sync: removed queued change"
+                                  " %s for deleted principal",
+                                  names->strings[i]);
+            removed->changes++;
+            removed->bytes += (unsigned long) st.st_size;
+        }
+    }
+    sync_vector_free(names);
+    if (removed->changes > 0)
+        queue_sync_dir(dir);
+    return code;
+}
+
+
+/*
+ * Remove the queued changes for a request and operation because its
+ * principal was deleted, or if renamed is not NULL, move them to the
+ * principal of that request, which has the same domain, because the
+ * principal was renamed.  Moved changes keep their timestamps and sequence
+ * numbers, so they are still made in the order in which they were queued.
+ * Returns a Kerberos error code.
+ *
+ * The queue is only locked and read if the conflict check finds changes, so
+ * this is usually as cheap as that check.  Both ids are locked for a rename,
+ * in a fixed order so that two renames can't deadlock.
+ */
+krb5_error_code
+sync_queue_move(kadm5_hook_modinfo *config, krb5_context ctx,
+                struct sync_request *request, const char *operation,
+                struct sync_request *renamed)
+{
+    const char *prefix, *dir, *id, *user = NULL, *message;
+    const char *new_prefix = NULL, *new_dir = NULL, *new_id = NULL;
+    struct sync_queue_lock first = { -1, -1, NULL };
+    struct sync_queue_lock second = { -1, -1, NULL };
+    struct queue_depth added, removed;
+    bool conflict;
+    krb5_error_code code, status = 0;
+
+    if (config->queue_dir == NULL)
+        return sync_error_config(ctx, "configuration setting queue_dir"
+                                 " missing");
+    code = queue_prefix(config, ctx, request, operation, &prefix, &dir);
+    if (code != 0)
+        return code;
+    code = queue_conflict(config, ctx, request, prefix, dir, &conflict);
+    if (code != 0 || !conflict)
+        return code;
+    code = queue_id(ctx, request, prefix, &id);
+    if (code != 0)
+        return code;
+    if (renamed != NULL) {
+        code = queue_prefix(config, ctx, renamed, operation, &new_prefix,
+                            &new_dir);
+        if (code == 0)
+            code = queue_id(ctx, renamed, new_prefix, &new_id);
+        if (code == 0)
+            code = sync_request_user(ctx, renamed, &user);
+        if (code != 0)
+            return code;
+    }
+
+    /* Lock the ids, unless the principal has the same queue name. */
+    if (new_id != NULL && strcmp(id, new_id) == 0)
+        return 0;
+    if (new_id != NULL && strcmp(new_id, id) < 0) {
+        code = sync_queue_lock(config, ctx, new_id, &first);
+        if (code == 0)
+            code = sync_queue_lock(config, ctx, id, &second);
+    } else {
+        code = sync_queue_lock(config, ctx, id, &first);
+        if (code == 0 && new_id != NULL)
+            code = sync_queue_lock(config, ctx, new_id, &second);
+    }
+    if (code != 0)
+        goto done;
+
+    /* The journal handles the rest itself. */
+    if (config->journal != NULL) {
+        code = sync_journal_move(config, ctx, prefix, new_prefix, user);
+        goto done;
+    }
+
+    /*
+     * Move or remove the queue files and update the queue depth if there
+     * are limits.  As when queuing, failure to update the depth only means it
+     * is wrong until the queue is next processed.
+     */
+    code = queue_move_files(config, ctx, renamed == NULL ? request : renamed,
+                            prefix, dir, new_prefix, new_dir, user, &added,
+                            &removed);
+    if (queue_limited(config) && (added.changes > 0 || removed.changes > 0))
+        status = queue_depth_adjust(config, ctx, &added, &removed);
+    if (status != 0) {
+        message = krb5_get_error_message(ctx, status);
+        sync_syslog_warning(config, "krb5-sync: cannot update queue depth:"
+                            " %s", message);
+        krb5_free_error_message(ctx, message);
+    }
+
+done:
+    sync_queue_unlock(&second);
+    sync_queue_unlock(&first);
     return code;
 }
@@ -0,0 +1,516 @@
+/*
+ * Reloading the configuration when krb5.conf changes.
+ *
+ * Normally the configuration is read once when kadmind loads the plugin, so
+ * changing it means restarting kadmind.  If config_reload is set, the
+ * plugin instead remembers the krb5.conf files it was read from (those in
+ * KRB5_CONFIG, or the default krb5.conf) and checks them at the start of
+ * each password or status change.  If any of them has changed, the whole
+ * configuration is read again with a new Kerberos context, which sees the
+ * current files, and swapped in before the change is handled.
+ *
+ * The new settings replace those of the live configuration field by field,
+ * rather than being swapped in as a new configuration through one pointer,
+ * since the threads and targets each hold the configuration pointer itself.
+ * The swap happens at the start of a hook call in the kadmind thread, while
+ * no other thread reads the configuration.  The background worker and the
+ * warm-up refresher are stopped first, after the worker finishes its current
+ * change.  The worker is started again by the next queued change and the
+ * refresher right after the swap if it was running.  The ad_status_window
+ * batch thread only reads the configuration while holding the batch mutex,
+ * which the hook holds for the whole reload.  Nothing can therefore see a
+ * mix of old and new settings.  The keytab and principal that outlive the
+ * reload are resolved again with the context of the hook.  Caches, pooled
+ * connections, and other runtime state survive the reload unless a setting
+ * they depend on has changed, in which case they are discarded and rebuilt
+ * on next use.  If the new configuration can't be read, a warning is logged
+ * and the old configuration stays in use until the files change again.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/* The krb5.conf file read if KRB5_CONFIG isn't set. */
+#define RELOAD_DEFAULT_CONFIG "/etc/krb5.conf"
+
+/* Swap two values of the given type. */
+#define SWAP(type, a, b)        \
+    do {                        \
+        type swap_tmp_ = (a);   \
+        (a) = (b);              \
+        (b) = swap_tmp_;        \
+    } while (0)
+
+/*
+ * One watched file and its identity when last checked.  A missing file has
+ * exists set to false, so that creating it also counts as a change.  stable
+ * is false if the file was modified within a second of the check, since then
+ * a second modification in the same second wouldn't change its identity.
+ */
+struct reload_file {
+    char *path;
+    bool exists;
+    bool stable;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
+
+/* The set of watched files. */
+struct sync_reload {
+    size_t count;
+    struct reload_file *files;
+};
+
+
+/*
+ * Check a watched file, updating its recorded identity, and return true if
+ * it has changed since it was last checked.  A file that wasn't stable when
+ * last checked is always treated as changed.
+ */
+static bool
+reload_file_changed(struct reload_file *file)
+{
+    struct stat st;
+    time_t now;
+    bool changed;
+
+    now = time(NULL);
+    if (stat(file->path, &st) < 0) {
+        changed = file->exists;
+        file->exists = false;
+        return changed;
+    }
+    changed = !file->exists || !file->stable || file->dev != st.st_dev
+        || file->ino != st.st_ino || file->size != st.st_size
+        || file->mtime != st.st_mtime;
+    file->exists = true;
+    file->stable = st.st_mtime < now - 1;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->size = st.st_size;
+    file->mtime = st.st_mtime;
+    return changed;
+}
+
+
+/*
+ * Compare two strings, either of which may be NULL.
+ */
+static bool
+same_string(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+
+/*
+ * Compare two lists of strings, either of which may be NULL.
+ */
+static bool
+same_list(const struct vector *a, const struct vector *b)
+{
+    size_t i;
+
+    if (a == NULL || b == NULL)
+        return a == b;
+    if (a->count != b->count)
+        return false;
+    for (i = 0; i < a->count; i++)
+        if (strcmp(a->strings[i], b->strings[i]) != 0)
+            return false;
+    return true;
+}
+
+
+/*
+ * Replace the configuration settings in config with those in fresh, leaving
+ * the old settings in fresh to be freed by the caller.  First discard the
+ * runtime state that depends on settings that changed, while the settings it
+ * was built from are still in place, since some of it (such as the DN cache)
+ * is saved using them.
+ */
+static void
+reload_apply(kadm5_hook_modinfo *config, krb5_context ctx,
+             kadm5_hook_modinfo *fresh)
+{
+    bool shared, creds, ldap, dncache, queue;
+
+    /* Work out which runtime state depends on changed settings. */
+    shared = config->shared_state != fresh->shared_state
+        || (config->shared_state
+            && !same_string(config->queue_dir, fresh->queue_dir));
+    creds = shared
+        || !same_string(config->ad_keytab, fresh->ad_keytab)
+        || !same_string(config->ad_principal, fresh->ad_principal)
+        || !same_string(config->ad_realm, fresh->ad_realm);
+    ldap = creds
+        || !same_string(config->ad_admin_server, fresh->ad_admin_server)
+        || !same_list(config->ad_ldap_servers, fresh->ad_ldap_servers)
+        || config->ad_ldap_connections != fresh->ad_ldap_connections
+        || config->ad_ldaps != fresh->ad_ldaps
+        || !same_string(config->ad_password_method,
+                        fresh->ad_password_method);
+    dncache = shared
+        || !same_string(config->ad_realm, fresh->ad_realm)
+        || !same_string(config->ad_ldap_base, fresh->ad_ldap_base)
+        || !same_string(config->ad_ldap_filter_attribute,
+                        fresh->ad_ldap_filter_attribute)
+        || !same_list(config->ad_ldap_instance_bases,
+                      fresh->ad_ldap_instance_bases)
+        || !same_list(config->ad_mapping_rules, fresh->ad_mapping_rules)
+        || !same_string(config->queue_dir, fresh->queue_dir)
+        || config->ad_dn_cache_size != fresh->ad_dn_cache_size
+        || config->ad_dn_cache_persist != fresh->ad_dn_cache_persist;
+    queue = !same_string(config->queue_dir, fresh->queue_dir)
+        || !same_string(config->queue_format, fresh->queue_format)
+        || config->queue_shards != fresh->queue_shards;
+
+    /* Discard that state. */
+    if (ldap) {
+        sync_ldap_close(config);
+        sync_server_close(config);
+    }
+    if (creds) {
+        sync_ad_creds_close(config, ctx);
+        sync_ad_creds_reset(config, ctx);
+    }
+    if (dncache)
+        sync_dncache_free(config);
+    if (!same_string(config->ad_base_instance, fresh->ad_base_instance)) {
+        sync_strset_free(config->instance_set);
+        free(config->instance_realm);
+        config->instance_set = NULL;
+        config->instance_realm = NULL;
+    }
+    if (!same_string(config->ad_account_list, fresh->ad_account_list))
+        sync_accounts_close(config);
+    if (!same_string(config->capture_file, fresh->capture_file))
+        sync_capture_close(config);
+    if (queue) {
+        SWAP(struct sync_journal *, config->journal, fresh->journal);
+        sync_queue_close(config);
+    }
+    if (queue
+        || config->queue_lease_partitions != fresh->queue_lease_partitions)
+        sync_lease_release(config);
+    SWAP(struct sync_strset *, config->allowed_instances,
+         fresh->allowed_instances);
+    SWAP(struct sync_mapping *, config->mapping, fresh->mapping);
+
+    /*
+     * The fresh configuration maps the shared state file again, so use that
+     * mapping, which is for the new settings, and the matching credential
+     * cache.
+     */
+    SWAP(struct sync_shared *, config->shared, fresh->shared);
+    SWAP(char *, config->ad_ccache_name, fresh->ad_ccache_name);
+
+    /*
+     * Keep the syslog token buckets and the stats counts across the reload
+     * if we already had them.
+     */
+    if (config->log == NULL)
+        SWAP(struct sync_log *, config->log, fresh->log);
+    if (config->stats == NULL)
+        SWAP(struct sync_stats *, config->stats, fresh->stats);
+
+    /* Swap the settings themselves. */
+    SWAP(char *, config->ad_account_list, fresh->ad_account_list);
+    SWAP(bool, config->ad_adaptive_concurrency,
+         fresh->ad_adaptive_concurrency);
+    SWAP(long, config->ad_adaptive_slow, fresh->ad_adaptive_slow);
+    SWAP(char *, config->ad_admin_server, fresh->ad_admin_server);
+    SWAP(bool, config->ad_async, fresh->ad_async);
+    SWAP(char *, config->ad_base_instance, fresh->ad_base_instance);
+    SWAP(long, config->ad_breaker_cooldown, fresh->ad_breaker_cooldown);
+    SWAP(long, config->ad_breaker_slow, fresh->ad_breaker_slow);
+    SWAP(long, config->ad_breaker_threshold, fresh->ad_breaker_threshold);
+    SWAP(long, config->ad_dn_cache_missing, fresh->ad_dn_cache_missing);
+    SWAP(bool, config->ad_dn_cache_persist, fresh->ad_dn_cache_persist);
+    SWAP(long, config->ad_dn_cache_size, fresh->ad_dn_cache_size);
+    SWAP(long, config->ad_dn_cache_status, fresh->ad_dn_cache_status);
+    SWAP(struct vector *, config->ad_instances, fresh->ad_instances);
+    SWAP(char *, config->ad_keytab, fresh->ad_keytab);
+    SWAP(long, config->ad_kpasswd_concurrency,
+         fresh->ad_kpasswd_concurrency);
+    SWAP(char *, config->ad_ldap_base, fresh->ad_ldap_base);
+    SWAP(long, config->ad_ldap_connections, fresh->ad_ldap_connections);
+    SWAP(char *, config->ad_ldap_filter_attribute,
+         fresh->ad_ldap_filter_attribute);
+    SWAP(struct vector *, config->ad_ldap_instance_bases,
+         fresh->ad_ldap_instance_bases);
+    SWAP(struct vector *, config->ad_ldap_servers, fresh->ad_ldap_servers);
+    SWAP(long, config->ad_ldap_timeout, fresh->ad_ldap_timeout);
+    SWAP(bool, config->ad_ldaps, fresh->ad_ldaps);
+    SWAP(struct vector *, config->ad_mapping_rules, fresh->ad_mapping_rules);
+    SWAP(char *, config->ad_password_method, fresh->ad_password_method);
+    SWAP(char *, config->ad_principal, fresh->ad_principal);
+    SWAP(bool, config->ad_queue_only, fresh->ad_queue_only);
+    SWAP(char *, config->ad_realm, fresh->ad_realm);
+    SWAP(long, config->ad_status_depth, fresh->ad_status_depth);
+    SWAP(long, config->ad_status_window, fresh->ad_status_window);
+    SWAP(long, config->ad_timeout, fresh->ad_timeout);
+    SWAP(bool, config->ad_warmup, fresh->ad_warmup);
+    SWAP(char *, config->capture_file, fresh->capture_file);
+    SWAP(bool, config->config_reload, fresh->config_reload);
+    SWAP(long, config->queue_backoff, fresh->queue_backoff);
+    SWAP(bool, config->queue_coalesce, fresh->queue_coalesce);
+    SWAP(char *, config->queue_dir, fresh->queue_dir);
+    SWAP(char *, config->queue_format, fresh->queue_format);
+    SWAP(char *, config->queue_full_policy, fresh->queue_full_policy);
+    SWAP(bool, config->queue_group_commit, fresh->queue_group_commit);
+    SWAP(long, config->queue_hard_bytes, fresh->queue_hard_bytes);
+    SWAP(long, config->queue_hard_limit, fresh->queue_hard_limit);
+    SWAP(long, config->queue_lease_partitions,
+         fresh->queue_lease_partitions);
+    SWAP(long, config->queue_lease_time, fresh->queue_lease_time);
+    SWAP(struct vector *, config->queue_priority, fresh->queue_priority);
+    SWAP(long, config->queue_shards, fresh->queue_shards);
+    SWAP(long, config->queue_soft_bytes, fresh->queue_soft_bytes);
+    SWAP(long, config->queue_soft_limit, fresh->queue_soft_limit);
+    SWAP(long, config->queue_workers, fresh->queue_workers);
+    SWAP(bool, config->shared_state, fresh->shared_state);
+    SWAP(char *, config->stats_file, fresh->stats_file);
+    SWAP(bool, config->syslog, fresh->syslog);
+    SWAP(long, config->syslog_limit, fresh->syslog_limit);
+    SWAP(krb5_principal, config->ad_client, fresh->ad_client);
+    SWAP(krb5_keytab, config->ad_kt, fresh->ad_kt);
+    SWAP(size_t, config->ad_realm_length, fresh->ad_realm_length);
+    SWAP(struct vector *, config->ad_ldap_uris, fresh->ad_ldap_uris);
+}
+
+
+/*
+ * Match up the targets of ad_targets in config and fresh by name and apply
+ * the new settings of each target that is still listed to its existing
+ * configuration, so that it keeps the runtime state that doesn't depend on
+ * changed settings, and then switch to the new list.  Targets that are no
+ * longer listed are left in fresh to be freed by the caller.
+ */
+static void
+reload_targets(kadm5_hook_modinfo *config, krb5_context ctx,
+               kadm5_hook_modinfo *fresh)
+{
+    kadm5_hook_modinfo *old;
+    size_t i, j;
+
+    for (i = 0; i < fresh->target_count; i++)
+        for (j = 0; j < config->target_count; j++) {
+            old = config->targets[j];
+            if (strcmp(old->target, fresh->targets[i]->target) != 0)
+                continue;
+            reload_apply(old, ctx, fresh->targets[i]);
+            config->targets[j] = fresh->targets[i];
+            fresh->targets[i] = old;
+            break;
+        }
+    SWAP(kadm5_hook_modinfo **, config->targets, fresh->targets);
+    SWAP(size_t, config->target_count, fresh->target_count);
+    SWAP(struct vector *, config->ad_targets, fresh->ad_targets);
+    for (i = 0; i < config->target_count; i++)
+        config->targets[i]->parent = config;
+    for (i = 0; i < fresh->target_count; i++)
+        fresh->targets[i]->parent = fresh;
+}
+
+
+/*
+ * Start watching the krb5.conf files that the configuration was read from.
+ * These are the files listed in KRB5_CONFIG, separated by colons, or the
+ * default krb5.conf if that isn't set.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_reload_init(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_reload *reload;
+    struct vector *paths;
+    const char *files;
+    size_t i;
+
+    files = getenv("KRB5_CONFIG");
+    if (files == NULL || files[0] == '\0')
+        files = RELOAD_DEFAULT_CONFIG;
+    paths = sync_vector_split_multi(files, ":", NULL);
+    if (paths == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    reload = calloc(1, sizeof(*reload));
+    if (reload == NULL)
+        goto fail;
+    reload->files = calloc(paths->count, sizeof(struct reload_file));
+    if (reload->files == NULL && paths->count > 0)
+        goto fail;
+    for (i = 0; i < paths->count; i++) {
+        reload->files[i].path = strdup(paths->strings[i]);
+        if (reload->files[i].path == NULL)
+            goto fail;
+        reload->count++;
+        reload_file_changed(&reload->files[i]);
+    }
+    sync_vector_free(paths);
+    config->reload = reload;
+    return 0;
+
+fail:
+    sync_vector_free(paths);
+    config->reload = reload;
+    sync_reload_close(config);
+    return sync_error_system(ctx, "cannot allocate memory");
+}
+
+
+/*
+ * Resolve the AD principal and keytab of a freshly read configuration, and
+ * those of its targets, again with the context of the hook, since the
+ * context they were read with is freed at the end of the reload.  Returns a
+ * Kerberos status code.
+ */
+static krb5_error_code
+reload_resolve(kadm5_hook_modinfo *fresh, krb5_context read_ctx,
+               krb5_context ctx)
+{
+    krb5_error_code code;
+    size_t i;
+
+    for (i = 0; i < fresh->target_count; i++) {
+        code = reload_resolve(fresh->targets[i], read_ctx, ctx);
+        if (code != 0)
+            return code;
+    }
+    if (fresh->ad_client != NULL) {
+        krb5_free_principal(read_ctx, fresh->ad_client);
+        fresh->ad_client = NULL;
+        code = krb5_parse_name(ctx, fresh->ad_principal, &fresh->ad_client);
+        if (code != 0)
+            return code;
+    }
+    if (fresh->ad_kt != NULL) {
+        krb5_kt_close(read_ctx, fresh->ad_kt);
+        fresh->ad_kt = NULL;
+        code = krb5_kt_resolve(ctx, fresh->ad_keytab, &fresh->ad_kt);
+        if (code != 0)
+            return code;
+    }
+    return 0;
+}
+
+
+/*
+ * Log a warning for a failure to reload the configuration.
+ */
+static void
+reload_warn(kadm5_hook_modinfo *config, krb5_context ctx,
+            krb5_error_code code)
+{
+    const char *message;
+
+    message = krb5_get_error_message(ctx, code);
+    sync_syslog_warning(config, "krb5-sync: cannot reload configuration,"
+                        " keeping the old one: %s", message);
+    krb5_free_error_message(ctx, message);
+}
+
+
+/*
+ * Check whether any of the watched krb5.conf files have changed and, if so,
+ * read the configuration again and switch to it.  ctx is the context of the
+ * hook, which outlives the configuration.  Problems are logged rather than
+ * returned, since the change being handled can still go ahead with the old
+ * configuration.
+ */
+void
+sync_reload_check(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_reload *reload = config->reload;
+    kadm5_hook_modinfo *fresh;
+    krb5_context read_ctx;
+    krb5_error_code code;
+    bool changed = false, warm;
+    size_t i;
+
+    /* Check all of the files so that all of their identities are updated. */
+    if (reload == NULL)
+        return;
+    for (i = 0; i < reload->count; i++)
+        if (reload_file_changed(&reload->files[i]))
+            changed = true;
+    if (!changed)
+        return;
+
+    /*
+     * Read the new configuration using a context that sees the new files,
+     * and then resolve what outlives the reload with the hook context.
+     */
+    code = krb5_init_context(&read_ctx);
+    if (code != 0) {
+        sync_syslog_warning(config, "krb5-sync: cannot initialize Kerberos"
+                            " context to reload configuration");
+        return;
+    }
+    code = sync_config_read(read_ctx, &fresh);
+    if (code != 0) {
+        reload_warn(config, read_ctx, code);
+        krb5_free_context(read_ctx);
+        return;
+    }
+    code = reload_resolve(fresh, read_ctx, ctx);
+    if (code != 0) {
+        reload_warn(config, ctx, code);
+        sync_close(ctx, fresh);
+        krb5_free_context(read_ctx);
+        return;
+    }
+
+    /*
+     * Stop the worker and warm-up threads, switch to the new configuration
+     * and that of each target, and warm up again for the new settings if
+     * ad_warmup is still set.  Only a process that was already warming up
+     * starts again, since the others, such as krb5-sync workers and the
+     * children of Heimdal kadmind, must not.
+     */
+    warm = sync_warmup_running(config);
+    sync_worker_stop(config);
+    sync_warmup_stop(config);
+    reload_apply(config, ctx, fresh);
+    reload_targets(config, ctx, fresh);
+    sync_close(ctx, fresh);
+    krb5_free_context(read_ctx);
+    if (warm)
+        sync_warmup_start(config, ctx);
+    sync_syslog_notice(config, "krb5-sync: reloaded configuration");
+
+    /* If config_reload was turned off, stop watching. */
+    if (!config->config_reload)
+        sync_reload_close(config);
+}
+
+
+/*
+ * Stop watching the krb5.conf files.
+ */
+void
+sync_reload_close(kadm5_hook_modinfo *config)
+{
+    struct sync_reload *reload = config->reload;
+    size_t i;
+
+    if (reload == NULL)
+        return;
+    for (i = 0; i < reload->count; i++)
+        free(reload->files[i].path);
+    free(reload->files);
+    free(reload);
+    config->reload = NULL;
+}
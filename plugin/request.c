@@ -0,0 +1,435 @@
+/*
+ * The principal of the change being handled.
+ *
+ * A single password or status change needs the principal in several forms:
+ * unparsed for log messages, without the realm for the account list and the
+ * queue, with slashes changed to periods for queue file names, and converted
+ * to the corresponding Active Directory principal.  Rather than each layer
+ * computing the form it needs from the principal, sync_chpass and sync_status
+ * set up a request that is passed down to the queue and Active Directory
+ * code, and each form is computed the first time it's asked for and then
+ * kept until the request is freed.
+ *
+ * The request also holds the short-lived strings needed while handling the
+ * change, such as queue file names and LDAP filters.  Most changes need only
+ * a few hundred bytes of these, so they are carved out of a buffer in the
+ * request itself, which normally lives on the stack, and only strings that
+ * don't fit are allocated separately.  When the request is freed, all of
+ * them are cleared, so that nothing derived from a password or principal is
+ * left behind in freed memory, and released at once.
+ *
+ * A change may also be traced for sync lag, the time from the call of the
+ * hook to the change being made in Active Directory.  The hook gives the
+ * request an ID and the time it was called, which are written to the queue
+ * file along with the time of queuing if the change is queued and read back
+ * by whatever processes the queue, so that a lag record can be logged and
+ * the lag counted in the stats however the change was made.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+
+/* Counter that makes the request IDs of a process unique. */
+static unsigned long request_traces = 0;
+
+/* A temporary string that didn't fit in the buffer of a request. */
+struct sync_request_block {
+    struct sync_request_block *next;
+    size_t size;
+    char data[];
+};
+
+
+/*
+ * Set up a request for a change to the given principal.  The principal is
+ * not copied and must remain valid until the request is freed.
+ */
+void
+sync_request_init(struct sync_request *request, krb5_principal principal)
+{
+    request->principal = principal;
+    request->name = NULL;
+    request->user = NULL;
+    request->queue_user = NULL;
+    request->ad_principal = NULL;
+    request->ad_name = NULL;
+    request->domain = NULL;
+    request->used = 0;
+    request->blocks = NULL;
+    request->trace[0] = '\0';
+    timerclear(&request->entered);
+    timerclear(&request->queued);
+    timerclear(&request->picked);
+}
+
+
+/*
+ * Store in name the unparsed principal of the request, including the realm.
+ * Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_request_name(krb5_context ctx, struct sync_request *request,
+                  const char **name)
+{
+    krb5_error_code code;
+
+    if (request->name == NULL) {
+        code = krb5_unparse_name(ctx, request->principal, &request->name);
+        if (code != 0)
+            return code;
+    }
+    *name = request->name;
+    return 0;
+}
+
+
+/*
+ * Store in user the unparsed principal of the request without the realm.
+ * Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_request_user(krb5_context ctx, struct sync_request *request,
+                  const char **user)
+{
+    krb5_error_code code;
+
+    if (request->user == NULL) {
+        code = krb5_unparse_name_flags(ctx, request->principal,
+                                       KRB5_PRINCIPAL_UNPARSE_NO_REALM,
+                                       &request->user);
+        if (code != 0)
+            return code;
+    }
+    *user = request->user;
+    return 0;
+}
+
+
+/*
+ * Store in user the form of the principal used in queue file names, which is
+ * the principal without the realm and with any slashes converted to periods.
+ * Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_request_queue_user(krb5_context ctx, struct sync_request *request,
+                        const char **user)
+{
+    const char *name;
+    char *p;
+    krb5_error_code code;
+
+    if (request->queue_user == NULL) {
+        code = sync_request_user(ctx, request, &name);
+        if (code != 0)
+            return code;
+        request->queue_user = sync_request_printf(request, "%s", name);
+        if (request->queue_user == NULL)
+            return sync_error_system(ctx, "cannot allocate memory");
+        for (p = request->queue_user; *p != '\0'; p++)
+            if (*p == '/')
+                *p = '.';
+    }
+    *user = request->queue_user;
+    return 0;
+}
+
+
+/*
+ * Store in principal the principal in Active Directory corresponding to the
+ * principal of the request, and its unparsed form in name if name isn't
+ * NULL.  This may involve applying the rule of ad_mapping_rules for its
+ * instance or removing ad_base_instance and always involves changing the
+ * realm.  Returns a Kerberos status code.
+ */
+krb5_error_code
+sync_request_ad_principal(kadm5_hook_modinfo *config, krb5_context ctx,
+                          struct sync_request *request,
+                          krb5_principal *principal, const char **name)
+{
+    krb5_const_principal local = request->principal;
+    const char *base, *instance;
+    krb5_error_code code;
+
+    /*
+     * If a mapping rule gives the principal, use it.  If this is an
+     * ad_base_instance principal, build the principal for the base name.
+     * Otherwise, copy the principal and set the realm.
+     */
+    if (request->ad_principal == NULL) {
+        code = sync_mapping_principal(config, ctx, request,
+                                      &request->ad_principal);
+        if (code != 0)
+            return code;
+        if (request->ad_principal == NULL && config->ad_base_instance != NULL
+            && krb5_principal_get_num_comp(ctx, local) == 2) {
+            instance = krb5_principal_get_comp_string(ctx, local, 1);
+            if (strcmp(instance, config->ad_base_instance) == 0) {
+                base = krb5_principal_get_comp_string(ctx, local, 0);
+                code = krb5_build_principal(ctx, &request->ad_principal,
+                                            config->ad_realm_length,
+                                            config->ad_realm, base,
+                                            (char *) 0);
+                if (code != 0)
+                    return code;
+            }
+        }
+        if (request->ad_principal == NULL) {
+            code = krb5_copy_principal(ctx, local, &request->ad_principal);
+            if (code != 0)
+                return code;
+            code = krb5_principal_set_realm(ctx, request->ad_principal,
+                                            config->ad_realm);
+            if (code != 0)
+                return code;
+        }
+    }
+
+    /* The unparsed form is used for logging and LDAP searches. */
+    if (name != NULL && request->ad_name == NULL) {
+        code = krb5_unparse_name(ctx, request->ad_principal,
+                                 &request->ad_name);
+        if (code != 0)
+            return code;
+    }
+    *principal = request->ad_principal;
+    if (name != NULL)
+        *name = request->ad_name;
+    return 0;
+}
+
+
+/*
+ * Format a temporary string for a request, like asprintf, and return it.  The
+ * string is freed with the request and must not be freed separately.  Returns
+ * NULL on failure.
+ */
+char *
+sync_request_printf(struct sync_request *request, const char *format, ...)
+{
+    va_list args;
+    struct sync_request_block *block;
+    char *string;
+    size_t left;
+    int length;
+
+    /* Try the space left in the buffer first. */
+    string = request->buffer + request->used;
+    left = sizeof(request->buffer) - request->used;
+    va_start(args, format);
+    length = vsnprintf(string, left, format, args);
+    va_end(args);
+    if (length < 0)
+        return NULL;
+    if ((size_t) length < left) {
+        request->used += (size_t) length + 1;
+        return string;
+    }
+
+    /* Otherwise, allocate a block for it. */
+    block = malloc(sizeof(*block) + (size_t) length + 1);
+    if (block == NULL)
+        return NULL;
+    block->size = (size_t) length + 1;
+    va_start(args, format);
+    vsnprintf(block->data, block->size, format, args);
+    va_end(args);
+    block->next = request->blocks;
+    request->blocks = block;
+    return block->data;
+}
+
+
+/*
+ * Give a request a request ID and the current time as the time the hook was
+ * called, or copy both from another request.  The ID is made of the time,
+ * the process ID, and a counter, so that it is unique across the processes
+ * of a kadmind and the threads of the background worker.
+ */
+void
+sync_request_trace(struct sync_request *request,
+                   const struct sync_request *from)
+{
+    unsigned long count;
+
+    if (from != NULL) {
+        memcpy(request->trace, from->trace, sizeof(request->trace));
+        request->entered = from->entered;
+        return;
+    }
+    if (gettimeofday(&request->entered, NULL) < 0) {
+        request->trace[0] = '\0';
+        return;
+    }
+    count = __atomic_add_fetch(&request_traces, 1, __ATOMIC_RELAXED);
+    snprintf(request->trace, sizeof(request->trace), "%lx-%lx-%lx",
+             (unsigned long) request->entered.tv_sec,
+             (unsigned long) getpid(), count);
+}
+
+
+/*
+ * Return the trace line for the queue file of a traced change, with its
+ * request ID, the time its hook was called, and the current time as the time
+ * it was queued, all on one line:
+ *
+ *     trace <id> <seconds>.<microseconds> <seconds>.<microseconds>
+ *
+ * Returns NULL if the change isn't traced or on failure to allocate memory,
+ * in which case the change is queued untraced.
+ */
+const char *
+sync_request_trace_line(struct sync_request *request)
+{
+    if (request->trace[0] == '\0')
+        return NULL;
+    if (gettimeofday(&request->queued, NULL) < 0)
+        return NULL;
+    return sync_request_printf(request, "trace %s %ld.%06ld %ld.%06ld",
+                               request->trace,
+                               (long) request->entered.tv_sec,
+                               (long) request->entered.tv_usec,
+                               (long) request->queued.tv_sec,
+                               (long) request->queued.tv_usec);
+}
+
+
+/*
+ * Restore the trace of a queued change from its trace line, which may be
+ * NULL for a change queued without one, and stamp it as picked up now.  A
+ * line that can't be parsed leaves the change untraced.
+ */
+void
+sync_request_trace_read(struct sync_request *request, const char *line)
+{
+    char id[SYNC_REQUEST_TRACE];
+    long entered_sec, entered_usec, queued_sec, queued_usec;
+
+    if (line == NULL)
+        return;
+    if (sscanf(line, "trace %47s %ld.%6ld %ld.%6ld", id, &entered_sec,
+               &entered_usec, &queued_sec, &queued_usec) != 5)
+        return;
+    if (gettimeofday(&request->picked, NULL) < 0)
+        return;
+    memcpy(request->trace, id, sizeof(request->trace));
+    request->entered.tv_sec = (time_t) entered_sec;
+    request->entered.tv_usec = (suseconds_t) entered_usec;
+    request->queued.tv_sec = (time_t) queued_sec;
+    request->queued.tv_usec = (suseconds_t) queued_usec;
+}
+
+
+/*
+ * Return the number of seconds from one time to another.
+ */
+static double
+request_elapsed(const struct timeval *from, const struct timeval *to)
+{
+    return (double) (to->tv_sec - from->tv_sec)
+        + (double) (to->tv_usec - from->tv_usec) / 1000000;
+}
+
+
+/*
+ * Log the lag record of a traced change that has just been made in Active
+ * Directory and count its sync lag in the stats, as direct or queued.  For a
+ * queued change, the record also breaks the lag down into the time until it
+ * was queued, the time it spent in the queue, and the time taken to make it.
+ */
+void
+sync_request_lag(kadm5_hook_modinfo *config, krb5_context ctx,
+                 struct sync_request *request)
+{
+    struct timeval now;
+    const char *name;
+    const char *target;
+
+    if (request->trace[0] == '\0' || gettimeofday(&now, NULL) < 0)
+        return;
+    if (sync_request_name(ctx, request, &name) != 0)
+        name = "(unknown)";
+    target = (request->domain == NULL) ? "ad" : request->domain;
+    if (!timerisset(&request->queued)) {
+        sync_syslog_info(config, "krb5-sync: lag %s for %s in %s: %.6f"
+                         " seconds direct", request->trace, name, target,
+                         request_elapsed(&request->entered, &now));
+        sync_stats_record(config, SYNC_STATS_LAG_DIRECT, &request->entered,
+                          0);
+    } else {
+        sync_syslog_info(config, "krb5-sync: lag %s for %s in %s: %.6f"
+                         " seconds queued (%.6f to queue, %.6f in queue,"
+                         " %.6f to make)", request->trace, name, target,
+                         request_elapsed(&request->entered, &now),
+                         request_elapsed(&request->entered, &request->queued),
+                         request_elapsed(&request->queued, &request->picked),
+                         request_elapsed(&request->picked, &now));
+        sync_stats_record(config, SYNC_STATS_LAG_QUEUED, &request->entered,
+                          0);
+    }
+}
+
+
+/*
+ * Clear memory that may hold a password.  A plain memset before the memory
+ * is freed may be removed by the compiler, since nothing reads it again, so
+ * use explicit_bzero if available and otherwise write through a volatile
+ * pointer.
+ */
+void
+sync_wipe(void *data, size_t length)
+{
+#ifdef HAVE_EXPLICIT_BZERO
+    explicit_bzero(data, length);
+#else
+    volatile unsigned char *p = data;
+
+    while (length-- > 0)
+        *p++ = 0;
+#endif
+}
+
+
+/*
+ * Free the forms of the principal computed for a request and clear and free
+ * its temporary strings.  The principal itself belongs to the caller and is
+ * not freed.
+ */
+void
+sync_request_free(krb5_context ctx, struct sync_request *request)
+{
+    struct sync_request_block *block, *next;
+
+    if (request->name != NULL)
+        krb5_free_unparsed_name(ctx, request->name);
+    if (request->user != NULL)
+        krb5_free_unparsed_name(ctx, request->user);
+    if (request->ad_name != NULL)
+        krb5_free_unparsed_name(ctx, request->ad_name);
+    if (request->ad_principal != NULL)
+        krb5_free_principal(ctx, request->ad_principal);
+    for (block = request->blocks; block != NULL; block = next) {
+        next = block->next;
+        sync_wipe(block->data, block->size);
+        free(block);
+    }
+    sync_wipe(request->buffer, sizeof(request->buffer));
+    request->principal = NULL;
+    request->name = NULL;
+    request->user = NULL;
+    request->queue_user = NULL;
+    request->ad_principal = NULL;
+    request->ad_name = NULL;
+    request->used = 0;
+    request->blocks = NULL;
+    request->trace[0] = '\0';
+    timerclear(&request->entered);
+    timerclear(&request->queued);
+    timerclear(&request->picked);
+}
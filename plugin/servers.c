@@ -0,0 +1,290 @@
+/*
+ * Health tracking for Active Directory servers.
+ *
+ * When a domain controller is down or very slow, every change sent to it
+ * waits out the library timeouts, and with many changes that adds up
+ * quickly.  So keep track of how each server has been doing.  The LDAP
+ * servers are ad_ldap_servers, in order of preference, or ad_admin_server if
+ * that isn't set.  For each one we record the number of consecutive failures
+ * and a smoothed time to connect and bind.  A server that fails isn't tried
+ * again until a backoff period has passed, which doubles with each further
+ * failure, and new connections go to the fastest server that isn't backing
+ * off.  Servers that haven't been tried yet come after servers known to
+ * work, in the configured order, so connections stay with the first server
+ * that works until it fails.
+ *
+ * The Kerberos libraries find the kpasswd servers for ad_realm themselves and
+ * don't let us choose one for a particular password change, so password
+ * changes are tracked as a single service.  If a password change fails
+ * because no server could be reached, later ones fail immediately until the
+ * backoff period has passed, so that they are queued rather than each waiting
+ * for the same timeouts.
+ *
+ * Like the LDAP connection pool, this state is only used by whichever thread
+ * makes changes in Active Directory and so isn't locked.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/*
+ * The backoff period in seconds after the first failure of a server.  It
+ * doubles with each consecutive failure up to the maximum.
+ */
+#define SERVER_BACKOFF_MIN 30
+#define SERVER_BACKOFF_MAX (10 * 60)
+
+/*
+ * The health of one server or service.  failures is the number of
+ * consecutive failures, retry is the time before which it shouldn't be used
+ * again, and latency is the smoothed time in milliseconds to connect to it,
+ * which is only meaningful if measured is true.
+ */
+struct server_health {
+    unsigned long failures;
+    time_t retry;
+    unsigned long latency;
+    bool measured;
+};
+
+/* The health of the LDAP servers, in configured order, and of kpasswd. */
+struct sync_servers {
+    size_t count;
+    struct server_health *ldap;
+    struct server_health kpasswd;
+};
+
+
+/*
+ * Return the number of configured LDAP servers.
+ */
+static size_t
+server_count(kadm5_hook_modinfo *config)
+{
+    if (config->ad_ldap_servers != NULL && config->ad_ldap_servers->count > 0)
+        return config->ad_ldap_servers->count;
+    return (config->ad_admin_server != NULL) ? 1 : 0;
+}
+
+
+/*
+ * Get the health tracking state, creating it if needed or if the number of
+ * configured servers has changed.  Returns NULL on memory allocation failure.
+ */
+static struct sync_servers *
+server_state(kadm5_hook_modinfo *config)
+{
+    struct sync_servers *servers = config->servers;
+    size_t count;
+
+    count = server_count(config);
+    if (servers != NULL && servers->count == count)
+        return servers;
+    sync_server_close(config);
+    servers = calloc(1, sizeof(*servers));
+    if (servers == NULL)
+        return NULL;
+    if (count > 0) {
+        servers->ldap = calloc(count, sizeof(struct server_health));
+        if (servers->ldap == NULL) {
+            free(servers);
+            return NULL;
+        }
+    }
+    servers->count = count;
+    config->servers = servers;
+    return servers;
+}
+
+
+/*
+ * Record a success or failure of a server and return, for a failure, the
+ * number of seconds before it will be tried again.
+ */
+static long
+server_update(struct server_health *health, bool success)
+{
+    long backoff = SERVER_BACKOFF_MIN;
+    unsigned long i;
+
+    if (success) {
+        health->failures = 0;
+        health->retry = 0;
+        return 0;
+    }
+    health->failures++;
+    for (i = 1; i < health->failures && backoff < SERVER_BACKOFF_MAX; i++)
+        backoff *= 2;
+    if (backoff > SERVER_BACKOFF_MAX)
+        backoff = SERVER_BACKOFF_MAX;
+    health->retry = time(NULL) + backoff;
+    return backoff;
+}
+
+
+/*
+ * Returns true if a Kerberos error code from a password change means that
+ * the Active Directory servers couldn't be reached, as opposed to a problem
+ * with the change or our credentials.
+ */
+static bool
+server_unreachable(krb5_error_code code)
+{
+    return code == KRB5_KDC_UNREACH || code == KRB5_REALM_CANT_RESOLVE
+        || code == ETIMEDOUT || code == ECONNREFUSED;
+}
+
+
+/*
+ * Choose the LDAP server for a new connection and store its index.  This is
+ * the server with the lowest measured latency that isn't backing off after
+ * failures, or if there are none with a measured latency, the first one in
+ * order that isn't backing off.  If all of them are backing off, found is set
+ * to false.  Returns a configuration error if no servers are configured.
+ */
+krb5_error_code
+sync_server_pick(kadm5_hook_modinfo *config, krb5_context ctx, size_t *index,
+                 bool *found)
+{
+    struct sync_servers *servers;
+    struct server_health *health, *best = NULL;
+    time_t now;
+    size_t i;
+
+    *index = 0;
+    *found = false;
+    servers = server_state(config);
+    if (servers == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    if (servers->count == 0)
+        return sync_error_config(ctx, "configuration setting"
+                                 " ad_admin_server missing");
+    now = time(NULL);
+    for (i = 0; i < servers->count; i++) {
+        health = &servers->ldap[i];
+        if (health->retry > now)
+            continue;
+        if (best == NULL
+            || (health->measured && !best->measured)
+            || (health->measured && health->latency < best->latency)) {
+            best = health;
+            *index = i;
+        }
+    }
+    *found = (best != NULL);
+    return 0;
+}
+
+
+/*
+ * Return the name of the LDAP server with the given index.
+ */
+const char *
+sync_server_name(kadm5_hook_modinfo *config, size_t index)
+{
+    if (config->ad_ldap_servers != NULL && config->ad_ldap_servers->count > 0)
+        return config->ad_ldap_servers->strings[index];
+    return config->ad_admin_server;
+}
+
+
+/*
+ * Record the result of connecting to an LDAP server.  On success, msec is the
+ * time it took in milliseconds, which is added to the smoothed latency with
+ * a weight of one quarter.
+ */
+void
+sync_server_report(kadm5_hook_modinfo *config, size_t index, bool success,
+                   unsigned long msec)
+{
+    struct sync_servers *servers;
+    struct server_health *health;
+    long backoff;
+
+    servers = server_state(config);
+    if (servers == NULL || index >= servers->count)
+        return;
+    health = &servers->ldap[index];
+    backoff = server_update(health, success);
+    if (!success) {
+        sync_syslog_notice(config, "krb5-sync: LDAP connection to %s failed,"
+                           " not trying it again for %ld seconds",
+                           sync_server_name(config, index), backoff);
+        return;
+    }
+    if (health->measured)
+        health->latency = (health->latency * 3 + msec) / 4;
+    else
+        health->latency = msec;
+    health->measured = true;
+}
+
+
+/*
+ * Check whether a password change should be attempted.  Returns an error if
+ * the last attempt couldn't reach Active Directory and the backoff period
+ * since then hasn't passed.
+ */
+krb5_error_code
+sync_kpasswd_check(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_servers *servers;
+    time_t now;
+
+    servers = server_state(config);
+    if (servers == NULL)
+        return sync_error_system(ctx, "cannot allocate memory");
+    now = time(NULL);
+    if (servers->kpasswd.retry > now)
+        return sync_error_generic(ctx, "password changes in %s failed"
+                                  " recently, not trying again for %ld"
+                                  " seconds", config->ad_realm,
+                                  (long) (servers->kpasswd.retry - now));
+    return 0;
+}
+
+
+/*
+ * Record the result of a password change.  Errors that don't mean that
+ * Active Directory was unreachable say nothing about its health and are
+ * ignored.
+ */
+void
+sync_kpasswd_report(kadm5_hook_modinfo *config, krb5_error_code code)
+{
+    struct sync_servers *servers;
+    long backoff;
+
+    if (code != 0 && !server_unreachable(code))
+        return;
+    servers = server_state(config);
+    if (servers == NULL)
+        return;
+    backoff = server_update(&servers->kpasswd, code == 0);
+    if (code != 0)
+        sync_syslog_notice(config, "krb5-sync: cannot reach %s for password"
+                           " changes, not trying again for %ld seconds",
+                           config->ad_realm, backoff);
+}
+
+
+/*
+ * Free the health tracking state.
+ */
+void
+sync_server_close(kadm5_hook_modinfo *config)
+{
+    if (config->servers == NULL)
+        return;
+    free(config->servers->ldap);
+    free(config->servers);
+    config->servers = NULL;
+}
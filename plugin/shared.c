@@ -0,0 +1,420 @@
+/*
+ * State shared between processes through a mapped file in queue_dir.
+ *
+ * Heimdal kadmind forks a process for each connection, so the runtime state
+ * kept in the plugin configuration only lives as long as one connection:
+ * every process obtains its own AD credentials, starts with an empty DN
+ * cache, and counts Active Directory failures for the circuit breaker on its
+ * own.  If shared_state is set, that state is instead kept in the file
+ * .shared in queue_dir, which every process maps, so that each new process
+ * starts with the state left by the others.  The AD credentials themselves
+ * are kept in a file credential cache in queue_dir, and the mapped file
+ * holds their expiration time.
+ *
+ * The file is updated without mutexes or file locks.  Counters and times are
+ * read and written with atomic operations.  The DN cache is a direct-mapped
+ * table of fixed-size slots, each protected by a sequence number that is odd
+ * while the slot is being written: readers retry a few times and then treat
+ * the slot as a miss if the sequence number changed while they copied the slot
+ * or stays odd.  Writers lock the slot by storing the time in its lock and
+ * give up, leaving the DN uncached, if another writer has the slot.  A writer
+ * that dies in the middle of a write leaves the slot locked, so a lock older
+ * than SHARED_LOCK_STALE seconds is taken over by the next writer.  A slot
+ * with a principal but no DN records when a search found no account for that
+ * principal, for ad_dn_cache_missing.  Since it stores native types, the file
+ * may only be shared by processes using the same build of the plugin, which is
+ * checked using the size of its header.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+
+/*
+ * Name of the shared state file in queue_dir, followed by a hyphen and the
+ * target name for a target of ad_targets.
+ */
+#define SHARED_FILE ".shared"
+
+/* Identifies the file and the version of its layout. */
+#define SHARED_MAGIC   0x6b357373U
+#define SHARED_VERSION 3U
+
+/*
+ * How many times readers retry a DN cache slot that is being written, and
+ * after how many seconds a writer takes over the lock of a slot from a
+ * writer that presumably died, since a write only takes microseconds.
+ */
+#define SHARED_READ_TRIES 3
+#define SHARED_LOCK_STALE 60
+
+/*
+ * The largest principal and DN, including the nul, that fit in a DN cache
+ * slot.  Longer ones are not cached.
+ */
+#define SHARED_PRINCIPAL_MAX 256
+#define SHARED_DN_MAX        512
+
+/*
+ * One slot of the shared DN cache.  seq is odd while the slot is being
+ * written, lock is when the current writer locked the slot or 0 if it isn't
+ * locked, and an empty principal marks an unused slot.  If the DN is empty,
+ * missing is when the principal was found to be missing from AD.
+ */
+struct shared_slot {
+    unsigned int seq;
+    time_t lock;
+    char principal[SHARED_PRINCIPAL_MAX];
+    char dn[SHARED_DN_MAX];
+    time_t missing;
+};
+
+/*
+ * The start of the shared file, followed by slots DN cache slots.  The
+ * fields after the layout description correspond to the runtime state of
+ * the same names in the plugin configuration.
+ */
+struct shared_header {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int header_size;
+    unsigned int slots;
+    time_t ad_creds_expires;
+    unsigned long ad_failures;
+    time_t ad_breaker_until;
+    time_t stats_next_write;
+    struct sync_stats_counts stats[SYNC_STATS_STAGES];
+};
+
+/* The mapping of the shared file in this process. */
+struct sync_shared {
+    void *map;
+    size_t size;
+    struct shared_header *header;
+    struct shared_slot *slots;
+};
+
+
+/*
+ * Return the number of DN cache slots to create, which is ad_dn_cache_size
+ * rounded up to a power of two, or zero if the DN cache is disabled.
+ */
+static unsigned int
+shared_slot_count(kadm5_hook_modinfo *config)
+{
+    size_t slots;
+
+    if (config->ad_dn_cache_size <= 0)
+        return 0;
+    for (slots = 16; slots < (size_t) config->ad_dn_cache_size; )
+        slots *= 2;
+    return (unsigned int) slots;
+}
+
+
+/*
+ * Map the shared state file in queue_dir, creating it if needed, and store
+ * the mapping in the configuration.  The file is locked while it is set up
+ * so that two processes can't both initialize it.  Returns a Kerberos status
+ * code.
+ */
+krb5_error_code
+sync_shared_open(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_shared *shared = NULL;
+    struct shared_header header;
+    struct stat st;
+    char *path;
+    size_t size;
+    ssize_t status;
+    krb5_error_code code;
+    int fd;
+
+    if (config->queue_dir == NULL)
+        return sync_error_config(ctx, "shared_state requires queue_dir");
+    if (asprintf(&path, "%s/%s%s%s", config->queue_dir, SHARED_FILE,
+                 config->target == NULL ? "" : "-",
+                 config->target == NULL ? "" : config->target) < 0)
+        return sync_error_system(ctx, "cannot allocate memory");
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        code = sync_error_system(ctx, "cannot open %s", path);
+        free(path);
+        return code;
+    }
+    if (flock(fd, LOCK_EX) < 0) {
+        code = sync_error_system(ctx, "cannot flock %s", path);
+        goto done;
+    }
+    if (fstat(fd, &st) < 0) {
+        code = sync_error_system(ctx, "cannot stat %s", path);
+        goto done;
+    }
+
+    /* Set up a new file, or check the header of an existing one. */
+    memset(&header, 0, sizeof(header));
+    if (st.st_size == 0) {
+        header.magic = SHARED_MAGIC;
+        header.version = SHARED_VERSION;
+        header.header_size = sizeof(header);
+        header.slots = shared_slot_count(config);
+        size = sizeof(header) + header.slots * sizeof(struct shared_slot);
+        if (ftruncate(fd, (off_t) size) < 0) {
+            code = sync_error_system(ctx, "cannot extend %s", path);
+            goto done;
+        }
+        status = pwrite(fd, &header, sizeof(header), 0);
+        if (status < 0 || (size_t) status != sizeof(header)) {
+            code = sync_error_system(ctx, "cannot write %s", path);
+            goto done;
+        }
+    } else {
+        status = pread(fd, &header, sizeof(header), 0);
+        if (status < 0) {
+            code = sync_error_system(ctx, "cannot read %s", path);
+            goto done;
+        }
+        size = sizeof(header) + header.slots * sizeof(struct shared_slot);
+        if ((size_t) status != sizeof(header) || header.magic != SHARED_MAGIC
+            || header.version != SHARED_VERSION
+            || header.header_size != sizeof(header)
+            || (off_t) size > st.st_size) {
+            code = sync_error_config(ctx, "%s is not a shared state file for"
+                                     " this version of krb5-sync", path);
+            goto done;
+        }
+    }
+
+    /* Map it. */
+    shared = calloc(1, sizeof(*shared));
+    if (shared == NULL) {
+        code = sync_error_system(ctx, "cannot allocate memory");
+        goto done;
+    }
+    shared->size = size;
+    shared->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared->map == MAP_FAILED) {
+        code = sync_error_system(ctx, "cannot map %s", path);
+        free(shared);
+        goto done;
+    }
+    shared->header = shared->map;
+    shared->slots = (struct shared_slot *) (shared->header + 1);
+    config->shared = shared;
+    code = 0;
+
+done:
+    /* The mapping keeps the file open, so the lock must be released. */
+    flock(fd, LOCK_UN);
+    close(fd);
+    free(path);
+    return code;
+}
+
+
+/*
+ * Unmap the shared state file.
+ */
+void
+sync_shared_close(kadm5_hook_modinfo *config)
+{
+    if (config->shared == NULL)
+        return;
+    munmap(config->shared->map, config->shared->size);
+    free(config->shared);
+    config->shared = NULL;
+}
+
+
+/*
+ * Return the location of the expiration time of the AD credentials, the
+ * count of consecutive Active Directory failures, or the end of the circuit
+ * breaker cooldown, which is in the shared file if shared_state is set and
+ * in the configuration otherwise.  They should be accessed with atomic
+ * operations.
+ */
+time_t *
+sync_shared_creds_expires(kadm5_hook_modinfo *config)
+{
+    if (config->shared == NULL)
+        return &config->ad_creds_expires;
+    return &config->shared->header->ad_creds_expires;
+}
+
+unsigned long *
+sync_shared_failures(kadm5_hook_modinfo *config)
+{
+    if (config->shared == NULL)
+        return &config->ad_failures;
+    return &config->shared->header->ad_failures;
+}
+
+time_t *
+sync_shared_breaker_until(kadm5_hook_modinfo *config)
+{
+    if (config->shared == NULL)
+        return &config->ad_breaker_until;
+    return &config->shared->header->ad_breaker_until;
+}
+
+
+/*
+ * Return the shared stats counts and store the location of the time of the
+ * next write of stats_file, or return NULL if shared_state isn't set.
+ */
+struct sync_stats_counts *
+sync_shared_stats(kadm5_hook_modinfo *config, time_t **next_write)
+{
+    if (config->shared == NULL)
+        return NULL;
+    *next_write = &config->shared->header->stats_next_write;
+    return config->shared->header->stats;
+}
+
+
+/*
+ * Return the DN cache slot for a principal, or NULL if the shared DN cache
+ * has no slots or the principal is too long to be cached.
+ */
+static struct shared_slot *
+shared_slot(struct sync_shared *shared, const char *principal)
+{
+    unsigned int slots = shared->header->slots;
+
+    if (slots == 0 || strlen(principal) >= SHARED_PRINCIPAL_MAX)
+        return NULL;
+    return &shared->slots[sync_hash_string(principal) & (slots - 1)];
+}
+
+
+/*
+ * Copy the DN cache slot for an AD principal into dn, which must hold
+ * SHARED_DN_MAX bytes, and store its missing time.  Returns false if the slot
+ * is for another principal or is being written.  The copy is the caller's,
+ * so several threads may read slots at once.
+ */
+static bool
+shared_slot_read(struct sync_shared *shared, const char *principal,
+                 char *dn, time_t *missing)
+{
+    struct shared_slot *slot;
+    char found[SHARED_PRINCIPAL_MAX];
+    unsigned int seq;
+    int i;
+
+    slot = shared_slot(shared, principal);
+    if (slot == NULL)
+        return false;
+    for (i = 0; i < SHARED_READ_TRIES; i++) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq % 2 == 1)
+            continue;
+        memcpy(found, slot->principal, sizeof(found));
+        memcpy(dn, slot->dn, SHARED_DN_MAX);
+        *missing = slot->missing;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        found[sizeof(found) - 1] = '\0';
+        dn[SHARED_DN_MAX - 1] = '\0';
+        return (strcmp(found, principal) == 0);
+    }
+    return false;
+}
+
+
+/*
+ * Look up the cached DN for an AD principal in the shared DN cache.  Returns
+ * NULL if there is none or if the slot is being written, and otherwise a
+ * copy of the DN that is freed with the request.
+ */
+const char *
+sync_shared_dn_lookup(kadm5_hook_modinfo *config,
+                      struct sync_request *request, const char *principal)
+{
+    char dn[SHARED_DN_MAX];
+    time_t missing;
+
+    if (!shared_slot_read(config->shared, principal, dn, &missing))
+        return NULL;
+    if (dn[0] == '\0')
+        return NULL;
+    return sync_request_printf(request, "%s", dn);
+}
+
+
+/*
+ * Return when an AD principal was found to be missing from AD according to
+ * the shared DN cache, or 0 if it isn't known to be missing.
+ */
+time_t
+sync_shared_dn_missing(kadm5_hook_modinfo *config, const char *principal)
+{
+    char dn[SHARED_DN_MAX];
+    time_t missing;
+
+    if (!shared_slot_read(config->shared, principal, dn, &missing))
+        return 0;
+    if (dn[0] != '\0')
+        return 0;
+    return missing;
+}
+
+
+/*
+ * Store the DN for an AD principal in the shared DN cache, or if dn is NULL,
+ * remove the DN cached for that principal.  An empty DN records that the
+ * principal was just found to be missing from AD.  Nothing is done if the
+ * slot is being written by another process, unless that process locked it
+ * more than SHARED_LOCK_STALE seconds ago, in which case the slot is taken
+ * over.  Its sequence number is then still odd from the abandoned write.
+ */
+void
+sync_shared_dn_store(kadm5_hook_modinfo *config, const char *principal,
+                     const char *dn)
+{
+    struct shared_slot *slot;
+    unsigned int seq;
+    time_t now, lock;
+
+    slot = shared_slot(config->shared, principal);
+    if (slot == NULL)
+        return;
+    if (dn != NULL && strlen(dn) >= SHARED_DN_MAX)
+        dn = NULL;
+    now = time(NULL);
+    lock = __atomic_load_n(&slot->lock, __ATOMIC_RELAXED);
+    if (lock != 0 && lock + SHARED_LOCK_STALE > now)
+        return;
+    if (!__atomic_compare_exchange_n(&slot->lock, &lock, now, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if (seq % 2 == 0) {
+        __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        seq++;
+    }
+    if (dn == NULL) {
+        if (strcmp(slot->principal, principal) == 0) {
+            slot->principal[0] = '\0';
+            slot->dn[0] = '\0';
+            slot->missing = 0;
+        }
+    } else {
+        memcpy(slot->principal, principal, strlen(principal) + 1);
+        memcpy(slot->dn, dn, strlen(dn) + 1);
+        slot->missing = (dn[0] == '\0') ? now : 0;
+    }
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+}
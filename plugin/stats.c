@@ -0,0 +1,324 @@
+/*
+ * Latency histograms and outcome counters for the stages of a change.
+ *
+ * If stats_file is set, the plugin times each stage of handling a change
+ * that may be slow: obtaining AD credentials, the kpasswd exchange, binding,
+ * searching, and modifying over LDAP, looking up an instance in the local
+ * KDB, waiting for the queue lock, and writing to the queue, as well as
+ * whole password and status changes.  It also times the sync lag of each
+ * change from the call of the hook until the change is made in Active
+ * Directory, separately for changes made directly and from the queue, which
+ * are written as their own histogram.  For each stage it keeps a histogram of
+ * the times taken and counts of successes and failures, and it periodically
+ * writes them all to stats_file in the Prometheus text format, so that the
+ * node_exporter textfile collector or any other monitoring agent that reads
+ * files can pick them up.  If stats_file isn't set, the cost of each
+ * measurement is a single check of the configuration.
+ *
+ * The histogram buckets are powers of two milliseconds.  The counts are kept
+ * per process unless shared_state is set, in which case they are kept in the
+ * shared state file so that the counts written to stats_file cover every
+ * process of a kadmind that forks a process per connection.  Since the
+ * background worker thread for ad_async records stages as well and the
+ * shared counts are updated by several processes, all counts are updated
+ * with atomic operations, and whichever caller first sees that the write
+ * interval has passed writes the file.  Stages timed in a target of
+ * ad_targets are counted in the configuration it belongs to.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/* The minimum number of seconds between writes of stats_file. */
+#define STATS_INTERVAL 10
+
+/* The names of the stages, in the order of enum sync_stats_stage. */
+static const char *const stage_names[SYNC_STATS_STAGES] = {
+    "chpass", "status", "creds", "kpasswd", "ldap_bind", "ldap_search",
+    "ldap_modify", "instance", "queue_lock", "queue_write", "direct",
+    "queued"
+};
+
+/*
+ * The per-process counts for all stages, used unless shared_state is set.
+ * next_write is the time after which the next recorded stage writes
+ * stats_file again, and unwritten is true if this process counted stages
+ * that haven't been written yet.
+ */
+struct sync_stats {
+    time_t next_write;
+    bool unwritten;
+    struct sync_stats_counts stages[SYNC_STATS_STAGES];
+};
+
+
+/*
+ * Allocate the counts for a configuration with stats_file set.  Returns NULL
+ * on failure.
+ */
+struct sync_stats *
+sync_stats_new(void)
+{
+    return calloc(1, sizeof(struct sync_stats));
+}
+
+
+/*
+ * Start timing a stage by storing the current time.  If stats aren't being
+ * kept, the time is set to zero, which sync_stats_record ignores.
+ */
+void
+sync_stats_start(kadm5_hook_modinfo *config, struct timeval *start)
+{
+    if (config->parent != NULL)
+        config = config->parent;
+    if (config->stats == NULL || config->stats_file == NULL
+        || gettimeofday(start, NULL) < 0) {
+        start->tv_sec = 0;
+        start->tv_usec = 0;
+    }
+}
+
+
+/*
+ * Write one histogram series to the stats file, given the metric name, the
+ * label and its value, the counts, and the number of buckets to write.
+ */
+static void
+stats_histogram(FILE *file, const char *metric, const char *label,
+                const char *value, const struct sync_stats_counts *stage,
+                size_t buckets)
+{
+    unsigned long long total = 0;
+    size_t i;
+
+    for (i = 0; i < buckets; i++) {
+        total += stage->buckets[i];
+        fprintf(file, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", metric,
+                label, value, (double) (1UL << i) / 1000, total);
+    }
+    total = stage->success + stage->failure;
+    fprintf(file, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", metric, label,
+            value, total);
+    fprintf(file, "%s_sum{%s=\"%s\"} %.6f\n", metric, label, value,
+            (double) stage->usec / 1000000);
+    fprintf(file, "%s_count{%s=\"%s\"} %llu\n", metric, label, value, total);
+}
+
+
+/*
+ * Write the counts to stats_file, replacing it atomically so that readers
+ * never see a partial file.  The sync lag is written as its own histogram
+ * with the full range of buckets, and the other stages with only the
+ * buckets they use.  Errors are logged, since there is nobody to return them
+ * to.
+ */
+static void
+stats_write(kadm5_hook_modinfo *config,
+            const struct sync_stats_counts *stages)
+{
+    const struct sync_stats_counts *stage;
+    char *tmp;
+    FILE *file;
+    size_t i;
+
+    if (asprintf(&tmp, "%s.%lu", config->stats_file,
+                 (unsigned long) getpid()) < 0) {
+        sync_syslog_warning(config, "krb5-sync: cannot allocate memory");
+        return;
+    }
+    file = fopen(tmp, "w");
+    if (file == NULL)
+        goto fail;
+    fprintf(file, "# HELP krb5_sync_stage_seconds Time taken by each stage"
+            " of Active Directory synchronization.\n");
+    fprintf(file, "# TYPE krb5_sync_stage_seconds histogram\n");
+    for (i = 0; i < SYNC_STATS_LAG_DIRECT; i++)
+        stats_histogram(file, "krb5_sync_stage_seconds", "stage",
+                        stage_names[i], &stages[i], SYNC_STATS_STEP_BUCKETS);
+    fprintf(file, "# HELP krb5_sync_lag_seconds Time from the kadmind hook"
+            " to the change being made in Active Directory.\n");
+    fprintf(file, "# TYPE krb5_sync_lag_seconds histogram\n");
+    for (i = SYNC_STATS_LAG_DIRECT; i < SYNC_STATS_STAGES; i++)
+        stats_histogram(file, "krb5_sync_lag_seconds", "path", stage_names[i],
+                        &stages[i], SYNC_STATS_BUCKETS);
+    fprintf(file, "# HELP krb5_sync_stage_total Outcomes of each stage of"
+            " Active Directory synchronization.\n");
+    fprintf(file, "# TYPE krb5_sync_stage_total counter\n");
+    for (i = 0; i < SYNC_STATS_LAG_DIRECT; i++) {
+        stage = &stages[i];
+        fprintf(file, "krb5_sync_stage_total{stage=\"%s\",result=\"success\"}"
+                " %llu\n", stage_names[i], stage->success);
+        fprintf(file, "krb5_sync_stage_total{stage=\"%s\",result=\"failure\"}"
+                " %llu\n", stage_names[i], stage->failure);
+    }
+    if (ferror(file)) {
+        fclose(file);
+        goto fail;
+    }
+    if (fclose(file) != 0)
+        goto fail;
+    if (rename(tmp, config->stats_file) < 0)
+        goto fail;
+    free(tmp);
+    return;
+
+fail:
+    sync_syslog_warning(config, "krb5-sync: cannot write %s: %s",
+                        config->stats_file, strerror(errno));
+    unlink(tmp);
+    free(tmp);
+}
+
+
+/*
+ * Return the counts to update and the location of the time of the next write
+ * of stats_file, which are in the shared state file if shared_state is set.
+ */
+static struct sync_stats_counts *
+stats_stages(kadm5_hook_modinfo *config, time_t **next_write)
+{
+    struct sync_stats_counts *stages;
+
+    stages = sync_shared_stats(config, next_write);
+    if (stages != NULL)
+        return stages;
+    *next_write = &config->stats->next_write;
+    return config->stats->stages;
+}
+
+
+/*
+ * Copy the counts for writing.  All members of struct sync_stats_counts are
+ * unsigned long long, so they can be copied as an array with atomic loads.
+ */
+static void
+stats_copy(struct sync_stats_counts *copy, struct sync_stats_counts *stages)
+{
+    unsigned long long *from = (unsigned long long *) stages;
+    unsigned long long *to = (unsigned long long *) copy;
+    size_t i;
+
+    for (i = 0; i < sizeof(*copy) * SYNC_STATS_STAGES / sizeof(*to); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Record the result of a stage, given the time at which it started from
+ * sync_stats_start and its status code, and write stats_file if it hasn't
+ * been written for STATS_INTERVAL seconds.
+ */
+void
+sync_stats_record(kadm5_hook_modinfo *config, enum sync_stats_stage which,
+                  const struct timeval *start, krb5_error_code code)
+{
+    struct sync_stats *stats;
+    struct sync_stats_counts copy[SYNC_STATS_STAGES];
+    struct sync_stats_counts *stages, *stage;
+    struct timeval now;
+    time_t *next_write, last;
+    long long usec;
+    unsigned long msec;
+    size_t bucket;
+
+    if (config->parent != NULL)
+        config = config->parent;
+    stats = config->stats;
+    if (stats == NULL || config->stats_file == NULL || start->tv_sec == 0)
+        return;
+    if (gettimeofday(&now, NULL) < 0)
+        return;
+    usec = (long long) (now.tv_sec - start->tv_sec) * 1000000
+        + (now.tv_usec - start->tv_usec);
+    if (usec < 0)
+        usec = 0;
+    msec = (unsigned long) ((usec + 999) / 1000);
+    for (bucket = 0; bucket < SYNC_STATS_BUCKETS; bucket++)
+        if (msec <= (1UL << bucket))
+            break;
+
+    /* Update the counts. */
+    stages = stats_stages(config, &next_write);
+    stage = &stages[which];
+    if (bucket < SYNC_STATS_BUCKETS)
+        __atomic_fetch_add(&stage->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stage->usec, (unsigned long long) usec,
+                       __ATOMIC_RELAXED);
+    if (code == 0)
+        __atomic_fetch_add(&stage->success, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&stage->failure, 1, __ATOMIC_RELAXED);
+
+    /* Write the file if it's time and nobody else claimed the write. */
+    last = __atomic_load_n(next_write, __ATOMIC_RELAXED);
+    if (now.tv_sec < last
+        || !__atomic_compare_exchange_n(next_write, &last,
+                                        now.tv_sec + STATS_INTERVAL, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&stats->unwritten, true, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_store_n(&stats->unwritten, false, __ATOMIC_RELAXED);
+    stats_copy(copy, stages);
+    stats_write(config, copy);
+}
+
+
+/*
+ * Write stats_file with the current counts.  Unless always is true, skip the
+ * write if nothing was counted by this process since its last write.  That
+ * is the case for the final write on close, so that closing the
+ * configuration replaced by a reload doesn't overwrite the file with its
+ * empty counts.
+ */
+static void
+stats_flush(kadm5_hook_modinfo *config, bool always)
+{
+    struct sync_stats *stats = config->stats;
+    struct sync_stats_counts copy[SYNC_STATS_STAGES];
+    struct sync_stats_counts *stages;
+    time_t *next_write;
+
+    if (stats == NULL || config->stats_file == NULL)
+        return;
+    if (!__atomic_exchange_n(&stats->unwritten, false, __ATOMIC_RELAXED)
+        && !always)
+        return;
+    stages = stats_stages(config, &next_write);
+    stats_copy(copy, stages);
+    stats_write(config, copy);
+}
+
+
+/*
+ * Write stats_file immediately.
+ */
+void
+sync_stats_write(kadm5_hook_modinfo *config)
+{
+    stats_flush(config, true);
+}
+
+
+/*
+ * Write any counts not yet in stats_file and free the counts.
+ */
+void
+sync_stats_close(kadm5_hook_modinfo *config)
+{
+    if (config->stats == NULL)
+        return;
+    stats_flush(config, false);
+    free(config->stats);
+    config->stats = NULL;
+}
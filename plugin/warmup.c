@@ -0,0 +1,242 @@
+/*
+ * Warm-up and background refresh of Active Directory resources.
+ *
+ * Without ad_warmup, the first change after kadmind starts pays for
+ * obtaining AD credentials, picking a server, and binding an LDAP connection
+ * all at once, as does the first change after the credentials have expired
+ * or the pooled connections have been idle long enough to be dropped.  If
+ * ad_warmup is set, the kadmind hooks instead obtain the credentials and
+ * bind a pooled connection in advance when the plugin is loaded, and then
+ * start a background thread that periodically obtains new credentials well
+ * before the cached ones expire and keeps idle pooled connections open, so
+ * that changes normally find everything ready.
+ *
+ * The thread only uses sync_ad_creds_refresh and sync_ldap_keepalive, which
+ * are safe to call while changes are being made by other threads.  Failures
+ * are logged and otherwise ignored, since every change still sets up what it
+ * needs on first use.  The thread runs in the process that loaded the
+ * plugin.  Heimdal kadmind forks a child for each connection, and the
+ * children inherit the warmed-up credentials but not the thread or the
+ * pooled connections, which the parent keeps using, so each child binds its
+ * own connections on first use (see pool.c).  With shared_state, they also
+ * see the credentials renewed by the thread in the parent.  krb5-sync only
+ * warms up in -w mode, which makes every change itself, since its other
+ * modes may fork workers.
+ *
+ * If ad_targets is set, each target with ad_warmup set is warmed up and has
+ * its own refresher thread, since each has its own credentials and pool.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/* How often in seconds the refresher checks the credentials and pool. */
+#define WARMUP_INTERVAL 60
+
+/*
+ * Obtain new credentials once the cached ones expire within this many
+ * seconds.  This is well above the margin at which sync_ad_creds obtains new
+ * ones itself, so that changes don't have to.
+ */
+#define WARMUP_CREDS_MARGIN (15 * 60)
+
+/* State of the warm-up refresher thread. */
+struct sync_warmup {
+    kadm5_hook_modinfo *config;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    pid_t pid;
+    bool ldap;
+    bool stop;
+};
+
+
+/*
+ * Log a warning for a failure to warm up or refresh something.
+ */
+static void
+warmup_warn(kadm5_hook_modinfo *config, krb5_context ctx, const char *what,
+            krb5_error_code code)
+{
+    const char *message;
+
+    message = krb5_get_error_message(ctx, code);
+    sync_syslog_warning(config, "krb5-sync: cannot %s: %s", what, message);
+    krb5_free_error_message(ctx, message);
+}
+
+
+/*
+ * The main loop of the refresher thread.  Every WARMUP_INTERVAL seconds,
+ * obtain new AD credentials if the cached ones expire soon and keep idle
+ * pooled connections open, until asked to stop.
+ */
+static void *
+warmup_main(void *data)
+{
+    struct sync_warmup *warmup = data;
+    kadm5_hook_modinfo *config = warmup->config;
+    krb5_context ctx;
+    struct timespec deadline;
+    krb5_error_code code;
+
+    code = krb5_init_context(&ctx);
+    if (code != 0) {
+        sync_syslog_warning(config, "krb5-sync: cannot initialize Kerberos"
+                            " context for warm-up");
+        return NULL;
+    }
+    pthread_mutex_lock(&warmup->mutex);
+    while (!warmup->stop) {
+        deadline.tv_sec = time(NULL) + WARMUP_INTERVAL;
+        deadline.tv_nsec = 0;
+        pthread_cond_timedwait(&warmup->wakeup, &warmup->mutex, &deadline);
+        if (warmup->stop)
+            break;
+        pthread_mutex_unlock(&warmup->mutex);
+        code = sync_ad_creds_refresh(config, ctx, WARMUP_CREDS_MARGIN);
+        if (code != 0)
+            warmup_warn(config, ctx, "refresh Active Directory credentials",
+                        code);
+        if (warmup->ldap)
+            sync_ldap_keepalive(config);
+        pthread_mutex_lock(&warmup->mutex);
+    }
+    pthread_mutex_unlock(&warmup->mutex);
+    krb5_free_context(ctx);
+    return NULL;
+}
+
+
+/*
+ * Obtain AD credentials and bind a pooled LDAP connection, if LDAP is
+ * configured, and then start the refresher thread, with all signals blocked
+ * so that signals are still delivered to the kadmind main thread.  Nothing is
+ * done if ad_warmup isn't set or changes aren't being pushed to Active
+ * Directory.  With ad_targets, this is done for each target instead.
+ * Failures are logged and otherwise ignored.
+ */
+void
+sync_warmup_start(kadm5_hook_modinfo *config, krb5_context ctx)
+{
+    struct sync_warmup *warmup;
+    LDAP *ld;
+    sigset_t all, old;
+    krb5_error_code code;
+    size_t i;
+    int status;
+
+    if (config->targets != NULL) {
+        for (i = 0; i < config->target_count; i++)
+            sync_warmup_start(config->targets[i], ctx);
+        return;
+    }
+    if (!config->ad_warmup || config->ad_realm == NULL
+        || config->ad_queue_only)
+        return;
+    if (config->warmup != NULL && config->warmup->pid != getpid())
+        config->warmup = NULL;
+    if (config->warmup != NULL)
+        return;
+
+    /* Set up the credentials and a connection now. */
+    code = sync_ad_creds_refresh(config, ctx, WARMUP_CREDS_MARGIN);
+    if (code != 0)
+        warmup_warn(config, ctx, "obtain Active Directory credentials", code);
+    if (config->ad_ldap_base != NULL) {
+        code = sync_ldap_get(config, ctx, &ld);
+        if (code == 0)
+            sync_ldap_release(config, ld, false);
+        else
+            warmup_warn(config, ctx, "bind to Active Directory", code);
+    }
+
+    /* Start the thread that keeps them fresh. */
+    warmup = calloc(1, sizeof(*warmup));
+    if (warmup == NULL)
+        goto fail;
+    warmup->config = config;
+    warmup->pid = getpid();
+    warmup->ldap = (config->ldap_pool != NULL);
+    if (pthread_mutex_init(&warmup->mutex, NULL) != 0) {
+        free(warmup);
+        goto fail;
+    }
+    if (pthread_cond_init(&warmup->wakeup, NULL) != 0) {
+        pthread_mutex_destroy(&warmup->mutex);
+        free(warmup);
+        goto fail;
+    }
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    status = pthread_create(&warmup->thread, NULL, warmup_main, warmup);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (status != 0) {
+        pthread_cond_destroy(&warmup->wakeup);
+        pthread_mutex_destroy(&warmup->mutex);
+        free(warmup);
+        errno = status;
+        goto fail;
+    }
+    config->warmup = warmup;
+    return;
+
+fail:
+    sync_syslog_warning(config, "krb5-sync: cannot start warm-up thread: %s",
+                        strerror(errno));
+}
+
+
+/*
+ * Returns true if this process runs a refresher thread for the configuration
+ * or for any of its targets of ad_targets.
+ */
+bool
+sync_warmup_running(kadm5_hook_modinfo *config)
+{
+    size_t i;
+
+    for (i = 0; i < config->target_count; i++)
+        if (sync_warmup_running(config->targets[i]))
+            return true;
+    return config->warmup != NULL && config->warmup->pid == getpid();
+}
+
+
+/*
+ * Stop the refresher thread, if any, and those of the targets of ad_targets,
+ * and wait for them to exit.
+ */
+void
+sync_warmup_stop(kadm5_hook_modinfo *config)
+{
+    struct sync_warmup *warmup = config->warmup;
+    size_t i;
+
+    for (i = 0; i < config->target_count; i++)
+        sync_warmup_stop(config->targets[i]);
+    if (warmup == NULL)
+        return;
+    config->warmup = NULL;
+    if (warmup->pid != getpid())
+        return;
+    pthread_mutex_lock(&warmup->mutex);
+    warmup->stop = true;
+    pthread_cond_signal(&warmup->wakeup);
+    pthread_mutex_unlock(&warmup->mutex);
+    pthread_join(warmup->thread, NULL);
+    pthread_cond_destroy(&warmup->wakeup);
+    pthread_mutex_destroy(&warmup->mutex);
+    free(warmup);
+}
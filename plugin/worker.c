@@ -0,0 +1,219 @@
+/*
+ * Background worker thread for asynchronous Active Directory updates.
+ *
+ * If ad_async is set, the kadmind hooks only write each change to the queue
+ * and then wake up a background thread, which processes the queue with
+ * sync_queue_process.  The latency seen by kadmind is then only that of a
+ * local queue write.  The worker thread uses its own Kerberos context, and
+ * in this mode it is the only thread that uses the AD credentials, LDAP
+ * connection pool, and DN cache in the plugin configuration.
+ *
+ * The thread is started on first use rather than at plugin initialization,
+ * and is restarted if the process has forked since it was started, since
+ * Heimdal kadmind forks a child for each connection.  On shutdown, the
+ * worker finishes the change it is working on and exits, leaving any other
+ * changes in the queue for the next worker or for krb5-sync-backend.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+
+/*
+ * How long in seconds the worker waits before processing the queue again
+ * after some changes failed, if it isn't woken up by a new change first.
+ */
+#define WORKER_RETRY 60
+
+/* State of the background worker thread. */
+struct sync_worker {
+    kadm5_hook_modinfo *config;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    pid_t pid;
+    bool pending;
+    bool stop;
+};
+
+
+/*
+ * Returns true if the worker has been asked to stop.  Used as the stop
+ * function for sync_queue_process.
+ */
+static bool
+worker_stopping(kadm5_hook_modinfo *config)
+{
+    struct sync_worker *worker = config->worker;
+    bool stop;
+
+    pthread_mutex_lock(&worker->mutex);
+    stop = worker->stop;
+    pthread_mutex_unlock(&worker->mutex);
+    return stop;
+}
+
+
+/*
+ * The main loop of the worker thread.  Wait until there are new changes or
+ * it's time to retry failed ones, and then process the queue, until asked to
+ * stop.
+ */
+static void *
+worker_main(void *data)
+{
+    struct sync_worker *worker = data;
+    kadm5_hook_modinfo *config = worker->config;
+    krb5_context ctx;
+    struct timespec deadline;
+    unsigned long failed = 0;
+    const char *message;
+    krb5_error_code code;
+
+    code = krb5_init_context(&ctx);
+    if (code != 0) {
+        sync_syslog_warning(config, "krb5-sync: cannot initialize Kerberos"
+                            " context for worker");
+        return NULL;
+    }
+    pthread_mutex_lock(&worker->mutex);
+    while (!worker->stop) {
+        if (!worker->pending) {
+            if (failed == 0)
+                pthread_cond_wait(&worker->wakeup, &worker->mutex);
+            else {
+                deadline.tv_sec = time(NULL) + WORKER_RETRY;
+                deadline.tv_nsec = 0;
+                pthread_cond_timedwait(&worker->wakeup, &worker->mutex,
+                                       &deadline);
+                worker->pending = true;
+            }
+            continue;
+        }
+        worker->pending = false;
+        pthread_mutex_unlock(&worker->mutex);
+        code = sync_queue_process(config, ctx, worker_stopping, NULL,
+                                  &failed);
+        if (code != 0) {
+            message = krb5_get_error_message(ctx, code);
+            sync_syslog_warning(config, "krb5-sync: cannot process queue:"
+                                " %s", message);
+            krb5_free_error_message(ctx, message);
+            failed = 1;
+        }
+        pthread_mutex_lock(&worker->mutex);
+    }
+    pthread_mutex_unlock(&worker->mutex);
+    krb5_free_context(ctx);
+    return NULL;
+}
+
+
+/*
+ * Start the worker thread, with all signals blocked so that signals are
+ * still delivered to the kadmind main thread.  Returns false on failure.
+ */
+static bool
+worker_start(kadm5_hook_modinfo *config)
+{
+    struct sync_worker *worker;
+    sigset_t all, old;
+    int status;
+
+    worker = calloc(1, sizeof(*worker));
+    if (worker == NULL)
+        return false;
+    worker->config = config;
+    worker->pid = getpid();
+    worker->pending = true;
+    if (pthread_mutex_init(&worker->mutex, NULL) != 0) {
+        free(worker);
+        return false;
+    }
+    if (pthread_cond_init(&worker->wakeup, NULL) != 0) {
+        pthread_mutex_destroy(&worker->mutex);
+        free(worker);
+        return false;
+    }
+    config->worker = worker;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    status = pthread_create(&worker->thread, NULL, worker_main, worker);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (status != 0) {
+        config->worker = NULL;
+        pthread_cond_destroy(&worker->wakeup);
+        pthread_mutex_destroy(&worker->mutex);
+        free(worker);
+        errno = status;
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Tell the worker thread that there are new changes in the queue, starting
+ * it if it isn't running in this process.  If the worker can't be started,
+ * log a warning; the change stays in the queue for krb5-sync-backend.
+ */
+void
+sync_worker_notify(kadm5_hook_modinfo *config)
+{
+    struct sync_worker *worker = config->worker;
+
+    /*
+     * If we've forked since the worker was started, the thread doesn't exist
+     * in this process and the mutex may be in any state, so just abandon the
+     * parent's worker state.
+     */
+    if (worker != NULL && worker->pid != getpid()) {
+        config->worker = NULL;
+        worker = NULL;
+    }
+    if (worker == NULL) {
+        if (!worker_start(config))
+            sync_syslog_warning(config, "krb5-sync: cannot start worker"
+                                " thread: %s", strerror(errno));
+        return;
+    }
+    pthread_mutex_lock(&worker->mutex);
+    worker->pending = true;
+    pthread_cond_signal(&worker->wakeup);
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+
+/*
+ * Stop the worker thread, if any, and wait for it to exit.
+ */
+void
+sync_worker_stop(kadm5_hook_modinfo *config)
+{
+    struct sync_worker *worker = config->worker;
+
+    if (worker == NULL)
+        return;
+    if (worker->pid != getpid()) {
+        config->worker = NULL;
+        return;
+    }
+    pthread_mutex_lock(&worker->mutex);
+    worker->stop = true;
+    pthread_cond_signal(&worker->wakeup);
+    pthread_mutex_unlock(&worker->mutex);
+    pthread_join(worker->thread, NULL);
+    config->worker = NULL;
+    pthread_cond_destroy(&worker->wakeup);
+    pthread_mutex_destroy(&worker->mutex);
+    free(worker);
+}
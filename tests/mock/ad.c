@@ -0,0 +1,687 @@
+/*
+ * Mock Active Directory for krb5-sync testing.
+ *
+ * Replaces krb5_get_init_creds_keytab and krb5_set_password_using_ccache,
+ * which would otherwise talk to the Active Directory KDC and kpasswd
+ * server, and the OpenLDAP functions used for status changes and passwords
+ * set over LDAP, which would otherwise talk to its LDAP server.  Every
+ * search finds one account with the DN CN=<userPrincipalName>,<base>, which
+ * starts as a normal enabled account, except a search for mock_ad.missing,
+ * which finds nothing.  The only state the directory holds is
+ * the userAccountControl value written to each DN, which later searches
+ * return.  Modifies with an assertion control fail if the asserted value is
+ * no longer current.
+ *
+ * Each fake LDAP connection holds one end of a socketpair so that the
+ * plugin's poll of the connection descriptor before reusing it works as it
+ * would with a real idle connection.  Asynchronous searches and modifies
+ * are done immediately, and their results are queued on the connection
+ * until retrieved with ldap_result, oldest first.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <lber.h>
+#include <ldap.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <tests/mock/ad.h>
+
+/* The lifetime of the fake AD credentials. */
+#define MOCK_CREDS_LIFETIME (10 * 60 * 60)
+
+/* The initial userAccountControl value of the fake accounts. */
+#define MOCK_CONTROL 512U
+
+/* The number of hash buckets for the accounts that have been modified. */
+#define MOCK_BUCKETS 256
+
+/* An account whose userAccountControl value has been written. */
+struct mock_account {
+    char *dn;
+    unsigned int control;
+    struct mock_account *next;
+};
+
+/* A fake LDAP connection, with its queue of pending results. */
+struct ldap {
+    int fds[2];
+    int msgid;
+    struct ldapmsg *pending;
+};
+
+/*
+ * A fake result, holding a single entry for searches.  msgid, type, and code
+ * are only used for asynchronous operations.
+ */
+struct ldapmsg {
+    char *dn;
+    unsigned int control;
+    int msgid;
+    int type;
+    int code;
+    struct ldapmsg *next;
+};
+
+/* The mock state. */
+struct mock_ad mock_ad = {
+    0, 0, KRB5_KDC_UNREACH, 0, 0, LDAP_SERVER_DOWN, 0, "", 0, 0, 0, 0, 0, 0,
+    "", "", "", 0
+};
+
+/* The modified accounts, protected by a mutex for threaded callers. */
+static struct mock_account *mock_accounts[MOCK_BUCKETS];
+static pthread_mutex_t mock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Reset the mock to no delays, no failures, and zero counts.
+ */
+void
+mock_ad_reset(void)
+{
+    struct mock_account *account;
+    size_t i;
+
+    pthread_mutex_lock(&mock_mutex);
+    for (i = 0; i < MOCK_BUCKETS; i++)
+        while (mock_accounts[i] != NULL) {
+            account = mock_accounts[i];
+            mock_accounts[i] = account->next;
+            free(account->dn);
+            free(account);
+        }
+    pthread_mutex_unlock(&mock_mutex);
+    memset(&mock_ad, 0, sizeof(mock_ad));
+    mock_ad.kpasswd_error = KRB5_KDC_UNREACH;
+    mock_ad.ldap_error = LDAP_SERVER_DOWN;
+}
+
+
+/*
+ * Wait for the given delay and then decide whether a call should fail, given
+ * the percentage of calls that fail.
+ */
+static bool
+mock_call(unsigned long delay, unsigned int failures)
+{
+    struct timespec wait;
+
+    if (delay > 0) {
+        wait.tv_sec = (time_t) (delay / 1000000);
+        wait.tv_nsec = (long) (delay % 1000000) * 1000;
+        while (nanosleep(&wait, &wait) < 0 && errno == EINTR)
+            ;
+    }
+    if (failures == 0)
+        return false;
+    return (unsigned int) (random() % 100) < failures;
+}
+
+
+/*
+ * Return fake initial credentials for the client, as if from the Active
+ * Directory KDC.  They have no ticket, which is fine since they are only
+ * stored in a credential cache and passed back to the mock.
+ */
+krb5_error_code
+krb5_get_init_creds_keytab(krb5_context ctx, krb5_creds *creds,
+                           krb5_principal client, krb5_keytab keytab UNUSED,
+                           krb5_deltat start UNUSED,
+                           const char *service UNUSED,
+                           krb5_get_init_creds_opt *opts UNUSED)
+{
+    const char *realm;
+    krb5_error_code code;
+
+    __atomic_fetch_add(&mock_ad.creds, 1, __ATOMIC_RELAXED);
+    memset(creds, 0, sizeof(*creds));
+    code = krb5_copy_principal(ctx, client, &creds->client);
+    if (code != 0)
+        return code;
+    realm = krb5_principal_get_realm(ctx, client);
+    code = krb5_build_principal(ctx, &creds->server, (unsigned int)
+                                strlen(realm), realm, "krbtgt", realm,
+                                (const char *) NULL);
+    if (code != 0)
+        return code;
+    creds->times.authtime = time(NULL);
+    creds->times.starttime = creds->times.authtime;
+    creds->times.endtime = creds->times.authtime + MOCK_CREDS_LIFETIME;
+    return 0;
+}
+
+
+/*
+ * Pretend to set the password of a principal through kpasswd, remembering the
+ * password.  This may be called from several threads at once, so the count is
+ * updated atomically.
+ */
+krb5_error_code
+krb5_set_password_using_ccache(krb5_context ctx UNUSED,
+                               krb5_ccache ccache UNUSED, const char *password,
+                               krb5_principal principal UNUSED,
+                               int *result_code, krb5_data *result_code_string,
+                               krb5_data *result_string)
+{
+    __atomic_fetch_add(&mock_ad.kpasswd, 1, __ATOMIC_RELAXED);
+    *result_code = 0;
+    memset(result_code_string, 0, sizeof(*result_code_string));
+    memset(result_string, 0, sizeof(*result_string));
+    if (mock_call(mock_ad.kpasswd_delay, mock_ad.kpasswd_failures))
+        return mock_ad.kpasswd_error;
+    if (strlen(password) < sizeof(mock_ad.password))
+        strcpy(mock_ad.password, password);
+    return 0;
+}
+
+
+/*
+ * Create a fake LDAP connection.
+ */
+int
+ldap_initialize(LDAP **ld, const char *uri UNUSED)
+{
+    *ld = calloc(1, sizeof(**ld));
+    if (*ld == NULL)
+        return LDAP_NO_MEMORY;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, (*ld)->fds) < 0) {
+        free(*ld);
+        *ld = NULL;
+        return LDAP_LOCAL_ERROR;
+    }
+    return LDAP_SUCCESS;
+}
+
+
+/*
+ * Accept all options.  The only one that can be retrieved is the descriptor
+ * of the connection.
+ */
+int
+ldap_set_option(LDAP *ld UNUSED, int option UNUSED, const void *value UNUSED)
+{
+    return LDAP_OPT_SUCCESS;
+}
+
+int
+ldap_get_option(LDAP *ld, int option, void *value)
+{
+    if (ld == NULL || option != LDAP_OPT_DESC)
+        return LDAP_OPT_ERROR;
+    *(int *) value = ld->fds[0];
+    return LDAP_OPT_SUCCESS;
+}
+
+
+/*
+ * Pretend to do a GSSAPI bind.
+ */
+int
+ldap_sasl_interactive_bind_s(LDAP *ld UNUSED, const char *dn UNUSED,
+                             const char *mechanism UNUSED,
+                             LDAPControl **server UNUSED,
+                             LDAPControl **client UNUSED,
+                             unsigned flags UNUSED,
+                             LDAP_SASL_INTERACT_PROC *interact UNUSED,
+                             void *defaults UNUSED)
+{
+    __atomic_fetch_add(&mock_ad.bind, 1, __ATOMIC_RELAXED);
+    if (mock_call(mock_ad.ldap_delay, mock_ad.ldap_failures))
+        return mock_ad.ldap_error;
+    return LDAP_SUCCESS;
+}
+
+
+/*
+ * Return the hash bucket for a DN.
+ */
+static size_t
+mock_bucket(const char *dn)
+{
+    unsigned long hash = 0;
+    const char *p;
+
+    for (p = dn; *p != '\0'; p++)
+        hash = hash * 31 + (unsigned char) *p;
+    return hash % MOCK_BUCKETS;
+}
+
+
+/*
+ * Find the record of a modified account, returning NULL if it has never been
+ * modified.  Must be called with the mutex held.
+ */
+static struct mock_account *
+mock_account(const char *dn)
+{
+    struct mock_account *account;
+
+    account = mock_accounts[mock_bucket(dn)];
+    while (account != NULL && strcmp(account->dn, dn) != 0)
+        account = account->next;
+    return account;
+}
+
+
+/*
+ * Return the current userAccountControl value of an account.
+ */
+static unsigned int
+mock_control(const char *dn)
+{
+    struct mock_account *account;
+    unsigned int control = MOCK_CONTROL;
+
+    pthread_mutex_lock(&mock_mutex);
+    account = mock_account(dn);
+    if (account != NULL)
+        control = account->control;
+    pthread_mutex_unlock(&mock_mutex);
+    return control;
+}
+
+
+/*
+ * Find the fake account.  A base search finds the base, and a subtree search
+ * for (<attribute>=<value>) finds CN=<value>,<base> unless value is
+ * mock_ad.missing.  The base, filter, and size limit of the search are
+ * recorded.
+ */
+static int
+mock_search(const char *base, int scope, const char *filter, int sizelimit,
+            LDAPMessage **result)
+{
+    const char *start, *end;
+    int status;
+
+    *result = NULL;
+    __atomic_fetch_add(&mock_ad.search, 1, __ATOMIC_RELAXED);
+    snprintf(mock_ad.base, sizeof(mock_ad.base), "%s", base);
+    snprintf(mock_ad.filter, sizeof(mock_ad.filter), "%s", filter);
+    mock_ad.sizelimit = sizelimit;
+    if (mock_call(mock_ad.ldap_delay, mock_ad.ldap_failures))
+        return mock_ad.ldap_error;
+    *result = calloc(1, sizeof(**result));
+    if (*result == NULL)
+        return LDAP_NO_MEMORY;
+    if (scope == LDAP_SCOPE_BASE)
+        (*result)->dn = strdup(base);
+    else {
+        start = strchr(filter, '=');
+        end = strrchr(filter, ')');
+        if (start == NULL || end == NULL || end < start)
+            return LDAP_FILTER_ERROR;
+        start++;
+        if (mock_ad.missing[0] != '\0'
+            && strlen(mock_ad.missing) == (size_t) (end - start)
+            && strncmp(mock_ad.missing, start, end - start) == 0)
+            return LDAP_SUCCESS;
+        status = asprintf(&(*result)->dn, "CN=%.*s,%s", (int) (end - start),
+                          start, base);
+        if (status < 0)
+            (*result)->dn = NULL;
+    }
+    if ((*result)->dn == NULL)
+        return LDAP_NO_MEMORY;
+    (*result)->control = mock_control((*result)->dn);
+    return LDAP_SUCCESS;
+}
+
+int
+ldap_search_ext_s(LDAP *ld UNUSED, const char *base, int scope,
+                  const char *filter, char **attrs UNUSED,
+                  int attrsonly UNUSED, LDAPControl **server UNUSED,
+                  LDAPControl **client UNUSED, struct timeval *timeout UNUSED,
+                  int sizelimit, LDAPMessage **result)
+{
+    return mock_search(base, scope, filter, sizelimit, result);
+}
+
+
+/*
+ * Queue the result of an asynchronous operation on the connection with the
+ * given result code, returning its message ID in msgid.
+ */
+static void
+mock_queue(LDAP *ld, LDAPMessage *result, int type, int code, int *msgid)
+{
+    LDAPMessage **last;
+
+    result->msgid = ++ld->msgid;
+    result->type = type;
+    result->code = code;
+    for (last = &ld->pending; *last != NULL; last = &(*last)->next)
+        ;
+    *last = result;
+    *msgid = result->msgid;
+}
+
+
+/*
+ * Start a search, queuing its result.
+ */
+int
+ldap_search_ext(LDAP *ld, const char *base, int scope, const char *filter,
+                char **attrs UNUSED, int attrsonly UNUSED,
+                LDAPControl **server UNUSED, LDAPControl **client UNUSED,
+                struct timeval *timeout UNUSED, int sizelimit, int *msgid)
+{
+    LDAPMessage *result;
+    int status;
+
+    status = mock_search(base, scope, filter, sizelimit, &result);
+    if (status != LDAP_SUCCESS) {
+        ldap_msgfree(result);
+        return status;
+    }
+    mock_queue(ld, result, LDAP_RES_SEARCH_RESULT, LDAP_SUCCESS, msgid);
+    return LDAP_SUCCESS;
+}
+
+
+/*
+ * Return the oldest pending result, or 0 as if the wait timed out if there
+ * are none.  Only LDAP_RES_ANY is supported.
+ */
+int
+ldap_result(LDAP *ld, int msgid UNUSED, int all UNUSED,
+            struct timeval *timeout UNUSED, LDAPMessage **result)
+{
+    *result = ld->pending;
+    if (*result == NULL)
+        return 0;
+    ld->pending = (*result)->next;
+    (*result)->next = NULL;
+    return (*result)->type;
+}
+
+int
+ldap_msgid(LDAPMessage *result)
+{
+    return result->msgid;
+}
+
+int
+ldap_parse_result(LDAP *ld UNUSED, LDAPMessage *result, int *code,
+                  char **matched, char **message, char ***referrals,
+                  LDAPControl ***server, int freeit)
+{
+    *code = result->code;
+    if (matched != NULL)
+        *matched = NULL;
+    if (message != NULL)
+        *message = NULL;
+    if (referrals != NULL)
+        *referrals = NULL;
+    if (server != NULL)
+        *server = NULL;
+    if (freeit)
+        ldap_msgfree(result);
+    return LDAP_SUCCESS;
+}
+
+
+/*
+ * Functions to walk the single entry of a fake search result.
+ */
+int
+ldap_count_entries(LDAP *ld UNUSED, LDAPMessage *result)
+{
+    return (result == NULL || result->dn == NULL) ? 0 : 1;
+}
+
+LDAPMessage *
+ldap_first_entry(LDAP *ld UNUSED, LDAPMessage *result)
+{
+    return result;
+}
+
+int
+ldap_msgtype(LDAPMessage *message UNUSED)
+{
+    return LDAP_RES_SEARCH_ENTRY;
+}
+
+char *
+ldap_get_dn(LDAP *ld UNUSED, LDAPMessage *entry)
+{
+    return strdup(entry->dn);
+}
+
+struct berval **
+ldap_get_values_len(LDAP *ld UNUSED, LDAPMessage *entry, const char *attr)
+{
+    struct berval **values;
+
+    if (strcmp(attr, "userAccountControl") != 0)
+        return NULL;
+    values = calloc(2, sizeof(struct berval *));
+    if (values == NULL)
+        return NULL;
+    values[0] = calloc(1, sizeof(struct berval));
+    if (values[0] == NULL) {
+        free(values);
+        return NULL;
+    }
+    if (asprintf(&values[0]->bv_val, "%u", entry->control) < 0) {
+        free(values[0]);
+        free(values);
+        return NULL;
+    }
+    values[0]->bv_len = strlen(values[0]->bv_val);
+    return values;
+}
+
+int
+ldap_count_values_len(struct berval **values)
+{
+    int count = 0;
+
+    if (values == NULL)
+        return 0;
+    while (values[count] != NULL)
+        count++;
+    return count;
+}
+
+
+/*
+ * Create an assertion control, which holds the filter as its value rather
+ * than its BER encoding, since only mock_modify reads it.  The control is
+ * allocated with malloc so that the library ldap_control_free can free it.
+ */
+int
+ldap_create_assertion_control(LDAP *ld UNUSED, char *assertion,
+                              int iscritical, LDAPControl **control)
+{
+    *control = calloc(1, sizeof(**control));
+    if (*control == NULL)
+        return LDAP_NO_MEMORY;
+    (*control)->ldctl_oid = strdup(LDAP_CONTROL_ASSERT);
+    (*control)->ldctl_value.bv_val = strdup(assertion);
+    if ((*control)->ldctl_oid == NULL
+        || (*control)->ldctl_value.bv_val == NULL) {
+        ldap_control_free(*control);
+        *control = NULL;
+        return LDAP_NO_MEMORY;
+    }
+    (*control)->ldctl_value.bv_len = strlen(assertion);
+    (*control)->ldctl_iscritical = iscritical ? 1 : 0;
+    return LDAP_SUCCESS;
+}
+
+
+/*
+ * Remember a password set by replacing unicodePwd, which is the password in
+ * double quotes in UTF-16LE.  Only ASCII is decoded; anything else is stored
+ * as a question mark.
+ */
+static void
+mock_password(const struct berval *value)
+{
+    const unsigned char *p = (const unsigned char *) value->bv_val;
+    size_t i, length = 0;
+
+    for (i = 2; i + 3 < value->bv_len; i += 2) {
+        if (length + 1 >= sizeof(mock_ad.password))
+            break;
+        if (p[i + 1] == 0 && p[i] > 0 && p[i] < 0x80)
+            mock_ad.password[length++] = (char) p[i];
+        else
+            mock_ad.password[length++] = '?';
+    }
+    mock_ad.password[length] = '\0';
+}
+
+
+/*
+ * Pretend to modify an entry, remembering the userAccountControl value or
+ * the password set through unicodePwd.  If
+ * there is an assertion of the userAccountControl value, fail with
+ * LDAP_ASSERTION_FAILED if it isn't the current value or if assert_failures
+ * says to simulate a change by someone else.  The asynchronous version
+ * queues the result.
+ */
+static int
+mock_modify(const char *dn, LDAPMod **mods, LDAPControl **server)
+{
+    struct mock_account *account;
+    unsigned int control = 0, asserted;
+    bool found = false;
+    size_t i;
+    int status = LDAP_SUCCESS;
+
+    __atomic_fetch_add(&mock_ad.modify, 1, __ATOMIC_RELAXED);
+    if (mock_call(mock_ad.ldap_delay, mock_ad.ldap_failures))
+        return mock_ad.ldap_error;
+    for (i = 0; mods[i] != NULL; i++)
+        if (strcmp(mods[i]->mod_type, "userAccountControl") == 0) {
+            control = (unsigned int)
+                strtoul(mods[i]->mod_vals.modv_strvals[0], NULL, 10);
+            found = true;
+        } else if (strcmp(mods[i]->mod_type, "unicodePwd") == 0) {
+            mock_password(mods[i]->mod_vals.modv_bvals[0]);
+        }
+    if (!found)
+        return LDAP_SUCCESS;
+    pthread_mutex_lock(&mock_mutex);
+    for (i = 0; server != NULL && server[i] != NULL; i++) {
+        if (strcmp(server[i]->ldctl_oid, LDAP_CONTROL_ASSERT) != 0)
+            continue;
+        if (sscanf(server[i]->ldctl_value.bv_val, "(userAccountControl=%u)",
+                   &asserted) != 1)
+            continue;
+        account = mock_account(dn);
+        if (asserted != (account == NULL ? MOCK_CONTROL : account->control))
+            status = LDAP_ASSERTION_FAILED;
+        if (mock_ad.assert_failures > 0) {
+            mock_ad.assert_failures--;
+            status = LDAP_ASSERTION_FAILED;
+        }
+    }
+    if (status == LDAP_SUCCESS) {
+        account = mock_account(dn);
+        if (account == NULL) {
+            account = calloc(1, sizeof(*account));
+            if (account != NULL)
+                account->dn = strdup(dn);
+            if (account == NULL || account->dn == NULL) {
+                free(account);
+                status = LDAP_NO_MEMORY;
+            } else {
+                account->next = mock_accounts[mock_bucket(dn)];
+                mock_accounts[mock_bucket(dn)] = account;
+            }
+        }
+        if (status == LDAP_SUCCESS) {
+            account->control = control;
+            mock_ad.control = control;
+        }
+    }
+    pthread_mutex_unlock(&mock_mutex);
+    return status;
+}
+
+int
+ldap_modify_ext_s(LDAP *ld UNUSED, const char *dn, LDAPMod **mods,
+                  LDAPControl **server, LDAPControl **client UNUSED)
+{
+    return mock_modify(dn, mods, server);
+}
+
+int
+ldap_modify_ext(LDAP *ld, const char *dn, LDAPMod **mods,
+                LDAPControl **server, LDAPControl **client UNUSED,
+                int *msgid)
+{
+    LDAPMessage *result;
+    int status;
+
+    status = mock_modify(dn, mods, server);
+    if (status != LDAP_SUCCESS && status != LDAP_ASSERTION_FAILED)
+        return status;
+    result = calloc(1, sizeof(*result));
+    if (result == NULL)
+        return LDAP_NO_MEMORY;
+    mock_queue(ld, result, LDAP_RES_MODIFY, status, msgid);
+    return LDAP_SUCCESS;
+}
+
+
+/*
+ * Free fake LDAP data.
+ */
+void
+ldap_value_free_len(struct berval **values)
+{
+    size_t i;
+
+    if (values == NULL)
+        return;
+    for (i = 0; values[i] != NULL; i++) {
+        free(values[i]->bv_val);
+        free(values[i]);
+    }
+    free(values);
+}
+
+void
+ldap_memfree(void *data)
+{
+    free(data);
+}
+
+int
+ldap_msgfree(LDAPMessage *result)
+{
+    if (result != NULL) {
+        free(result->dn);
+        free(result);
+    }
+    return LDAP_RES_SEARCH_ENTRY;
+}
+
+int
+ldap_unbind_ext_s(LDAP *ld, LDAPControl **server UNUSED,
+                  LDAPControl **client UNUSED)
+{
+    LDAPMessage *result;
+
+    while (ld->pending != NULL) {
+        result = ld->pending;
+        ld->pending = result->next;
+        ldap_msgfree(result);
+    }
+    close(ld->fds[0]);
+    close(ld->fds[1]);
+    free(ld);
+    return LDAP_SUCCESS;
+}
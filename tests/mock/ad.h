@@ -0,0 +1,66 @@
+/*
+ * Mock Active Directory for krb5-sync testing.
+ *
+ * Replacements for the Kerberos and LDAP library functions that the plugin
+ * uses to talk to Active Directory, so that password and status changes can
+ * be tested and load-tested without an Active Directory server.  Linking
+ * tests/mock/ad.c into a program overrides the library versions.  Each call
+ * is counted, can be delayed, and can be made to fail with a given error
+ * some percentage of the time.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef MOCK_AD_H
+#define MOCK_AD_H 1
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <tests/tap/macros.h>
+
+/*
+ * The behavior and call counts of the mock Active Directory.  Delays are in
+ * microseconds, failures are percentages of calls, and the errors are what
+ * failing calls return.  The LDAP settings apply to binds, searches, and
+ * modifies, including asynchronous ones, which fail when started.
+ * assert_failures is the number of following modifies with an assertion
+ * control that fail as if the account had been changed by someone else.
+ * control is the last userAccountControl value written, password the last
+ * password set, and base, filter, and sizelimit those of the last search.
+ * A subtree search for the value missing finds no account if it is set.
+ * The calls may be made from several threads at once, so the counts are
+ * updated atomically.
+ */
+struct mock_ad {
+    unsigned long kpasswd_delay;
+    unsigned int kpasswd_failures;
+    krb5_error_code kpasswd_error;
+    unsigned long ldap_delay;
+    unsigned int ldap_failures;
+    int ldap_error;
+    unsigned int assert_failures;
+    char missing[64];
+
+    unsigned long creds;
+    unsigned long kpasswd;
+    unsigned long bind;
+    unsigned long search;
+    unsigned long modify;
+    unsigned int control;
+    char password[64];
+    char base[128];
+    char filter[128];
+    int sizelimit;
+};
+
+BEGIN_DECLS
+
+/* The mock state, initially with no delays or failures. */
+extern struct mock_ad mock_ad;
+
+/* Reset the mock to no delays, no failures, and zero counts. */
+void mock_ad_reset(void);
+
+END_DECLS
+
+#endif /* !MOCK_AD_H */
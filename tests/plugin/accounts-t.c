@@ -0,0 +1,126 @@
+/*
+ * Tests for the account list in the krb5-sync plugin.
+ *
+ * Checks lookups in the sorted list of accounts from ad_account_list, that
+ * the list is mapped again when the file is replaced, and that unsorted or
+ * missing lists are rejected.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Write the given contents to path by writing a temporary file and renaming
+ * it into place, the way the list is meant to be updated.  Calls bail on
+ * failure.
+ */
+static void
+write_list(const char *path, const char *contents)
+{
+    char *tmp;
+    FILE *file;
+
+    basprintf(&tmp, "%s.tmp", path);
+    file = fopen(tmp, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", tmp);
+    if (fputs(contents, file) == EOF || fclose(file) == EOF)
+        sysbail("cannot write %s", tmp);
+    if (rename(tmp, path) < 0)
+        sysbail("cannot rename %s to %s", tmp, path);
+    free(tmp);
+}
+
+
+/*
+ * Look up a name in the account list, returning whether it was found and
+ * calling bail if the lookup fails.
+ */
+static bool
+listed(kadm5_hook_modinfo *config, krb5_context ctx, const char *name)
+{
+    krb5_error_code code;
+    bool found;
+
+    code = sync_accounts_check(config, ctx, name, &found);
+    if (code != 0)
+        bail_krb5(ctx, code, "lookup of %s failed", name);
+    return found;
+}
+
+
+int
+main(void)
+{
+    kadm5_hook_modinfo *config;
+    krb5_context ctx;
+    krb5_error_code code;
+    char *tmpdir, *path;
+    bool found;
+
+    /* Define the plan. */
+    plan(17);
+
+    /* Obtain a Kerberos context. */
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* A missing list is an error. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/accounts", tmpdir);
+    config = bcalloc(1, sizeof(*config));
+    config->ad_account_list = path;
+    code = sync_accounts_check(config, ctx, "alice", &found);
+    ok(code != 0, "Lookup in missing list fails");
+    ok(!found, "...and finds nothing");
+
+    /* An empty list contains nothing. */
+    write_list(path, "");
+    ok(!listed(config, ctx, "alice"), "Empty list contains nothing");
+
+    /* Lookups of the first, middle, and last entries, and of missing ones. */
+    write_list(path, "alice\nbob\ncarol\ndave\neve\nfrank\ntest/root\n");
+    ok(listed(config, ctx, "alice"), "First account is found");
+    ok(listed(config, ctx, "dave"), "Middle account is found");
+    ok(listed(config, ctx, "test/root"), "Last account is found");
+    ok(!listed(config, ctx, "aaron"), "Account before the first not found");
+    ok(!listed(config, ctx, "zed"), "Account after the last not found");
+    ok(!listed(config, ctx, "bo"), "Prefix of an account not found");
+    ok(!listed(config, ctx, "bobby"), "Extension of an account not found");
+    ok(!listed(config, ctx, ""), "Empty name not found");
+
+    /* A list without a final newline still finds its last entry. */
+    write_list(path, "alice\nbob");
+    ok(listed(config, ctx, "bob"), "Last account without newline is found");
+
+    /* Replacing the file is noticed on the next lookup. */
+    write_list(path, "bob\ncarol\n");
+    ok(!listed(config, ctx, "alice"), "Replaced list drops old account");
+    ok(listed(config, ctx, "carol"), "...and finds new account");
+
+    /* An unsorted list is rejected. */
+    write_list(path, "carol\nbob\n");
+    code = sync_accounts_check(config, ctx, "bob", &found);
+    ok(code != 0, "Lookup in unsorted list fails");
+    ok(!found, "...and finds nothing");
+
+    /* Clean up. */
+    sync_accounts_close(config);
+    ok(config->accounts == NULL, "Closing unmaps the list");
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    free(config);
+    krb5_free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,320 @@
+/*
+ * Load test of Active Directory changes in the krb5-sync plugin.
+ *
+ * Not a test, since it reports timings rather than pass or fail.  Links with
+ * the mock Active Directory in tests/mock, delaying each kpasswd and LDAP
+ * call to stand in for the round trip to a real server and failing some
+ * percentage of them.  For each number of concurrent processes, it measures
+ * the throughput and latency percentiles of password and status changes made
+ * by that many processes, standing in for a forking kadmind, and the
+ * throughput of draining a queue of changes with that many workers.  Run it
+ * with make bench, which sets up the environment for the temporary
+ * directory, passing options in LOAD_FLAGS.
+ *
+ * Options:
+ *     -c <procs>      comma-separated process counts (default 1,4)
+ *     -e <percent>    percentage of kpasswd and LDAP calls that fail
+ *     -k <usec>       delay of each kpasswd call (default 2000)
+ *     -l <usec>       delay of each LDAP call (default 500)
+ *     -m <method>     ad_password_method to use (default kpasswd)
+ *     -n <changes>    changes to make for each measurement (default 1000)
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <plugin/internal.h>
+#include <tests/mock/ad.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/bench.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: ad-load [-c <procs>] [-e <percent>] [-k <usec>] [-l <usec>]\n\
+               [-m <method>] [-n <changes>]\n";
+
+/* The kinds of changes that can be timed. */
+enum load_change {
+    LOAD_PASSWORD,
+    LOAD_STATUS
+};
+
+
+/*
+ * Make one change for the given user, returning its latency in microseconds.
+ * Failures to reach the mock are queued by the plugin, so any error return
+ * is fatal.
+ */
+static double
+change_one(kadm5_hook_modinfo *config, krb5_context ctx, const char *user,
+           enum load_change change)
+{
+    krb5_principal princ;
+    struct timeval start;
+    krb5_error_code code;
+    double latency;
+
+    code = krb5_parse_name(ctx, user, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal %s", user);
+    if (gettimeofday(&start, NULL) < 0)
+        sysbail("cannot get current time");
+    if (change == LOAD_PASSWORD)
+        code = sync_chpass(config, ctx, princ, "password");
+    else
+        code = sync_status(config, ctx, princ, false);
+    latency = bench_elapsed(&start);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot change %s", user);
+    krb5_free_principal(ctx, princ);
+    return latency;
+}
+
+
+/*
+ * Start over with an empty queue.
+ */
+static void
+reset_queue(void)
+{
+    if (system("rm -rf queue") != 0)
+        bail("cannot remove queue");
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+}
+
+
+/*
+ * Time changes made by the given number of concurrent processes, which split
+ * the changes between them.  Each child initializes its own plugin, as a
+ * kadmind process would, and sends its latencies back through a pipe once it
+ * is done.
+ */
+static void
+load_changes(krb5_context ctx, unsigned long procs, unsigned long changes,
+             enum load_change change)
+{
+    kadm5_hook_modinfo *config;
+    struct timeval begin;
+    double *latency;
+    double total;
+    unsigned long each, i, j;
+    krb5_error_code code;
+    size_t want;
+    ssize_t status;
+    int (*fds)[2];
+    pid_t pid;
+    char *user;
+
+    reset_queue();
+    each = changes / procs;
+    if (each == 0)
+        each = 1;
+    latency = bcalloc(each * procs, sizeof(double));
+    fds = bcalloc(procs, sizeof(*fds));
+    if (gettimeofday(&begin, NULL) < 0)
+        sysbail("cannot get current time");
+    for (i = 0; i < procs; i++) {
+        if (pipe(fds[i]) < 0)
+            sysbail("cannot create pipe");
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0)
+            sysbail("cannot fork");
+        if (pid == 0) {
+            close(fds[i][0]);
+            srandom((unsigned int) getpid());
+            code = sync_init(ctx, &config);
+            if (code != 0)
+                bail_krb5(ctx, code, "cannot initialize plugin");
+            for (j = 0; j < each; j++) {
+                basprintf(&user, "load%lu.%lu@EXAMPLE.COM", i, j);
+                latency[j] = change_one(config, ctx, user, change);
+                free(user);
+            }
+            sync_close(ctx, config);
+            want = each * sizeof(double);
+            if (write(fds[i][1], latency, want) != (ssize_t) want)
+                _exit(1);
+            _exit(0);
+        }
+        close(fds[i][1]);
+    }
+
+    /* Collect the latencies and wait for the children. */
+    for (i = 0; i < procs; i++) {
+        want = each * sizeof(double);
+        for (j = 0; j < want; j += (size_t) status) {
+            status = read(fds[i][0], (char *) &latency[i * each] + j,
+                          want - j);
+            if (status <= 0)
+                bail("process %lu failed", i);
+        }
+        close(fds[i][0]);
+    }
+    while (wait(NULL) > 0)
+        ;
+    total = bench_elapsed(&begin);
+    bench_report(change == LOAD_PASSWORD ? "chpass" : "status", 0, procs,
+                 latency, each * procs, total);
+    free(fds);
+    free(latency);
+}
+
+
+/*
+ * Time draining a queue of password changes with the given number of worker
+ * processes.  Only the throughput is reported, since the latency of each
+ * change is not visible outside the workers.
+ */
+static void
+load_queue(krb5_context ctx, unsigned long procs, unsigned long changes)
+{
+    kadm5_hook_modinfo *config;
+    struct sync_request request;
+    krb5_principal princ;
+    struct timeval begin;
+    krb5_error_code code;
+    unsigned long failed, i;
+    char *user;
+
+    reset_queue();
+    code = sync_init(ctx, &config);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize plugin");
+    for (i = 0; i < changes; i++) {
+        basprintf(&user, "queue%lu@EXAMPLE.COM", i);
+        code = krb5_parse_name(ctx, user, &princ);
+        if (code != 0)
+            bail_krb5(ctx, code, "cannot parse principal %s", user);
+        sync_request_init(&request, princ);
+        code = sync_queue_write(config, ctx, &request, "password",
+                                "password");
+        if (code != 0)
+            bail_krb5(ctx, code, "cannot queue change for %s", user);
+        sync_request_free(ctx, &request);
+        krb5_free_principal(ctx, princ);
+        free(user);
+    }
+    fflush(stdout);
+    if (gettimeofday(&begin, NULL) < 0)
+        sysbail("cannot get current time");
+    code = sync_queue_process_parallel(config, ctx, procs, NULL, NULL,
+                                       &failed);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot process queue");
+    bench_report("queue", changes, procs, NULL, changes,
+                 bench_elapsed(&begin));
+    sync_close(ctx, config);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    unsigned long *procs;
+    size_t nprocs, i;
+    unsigned long changes = 1000;
+    unsigned long errors = 0;
+    const char *method = "kpasswd";
+    char *tmpdir, *krb5_config;
+    krb5_context ctx;
+    krb5_error_code code;
+    FILE *file;
+    int option;
+
+    /* Parse the options. */
+    mock_ad.kpasswd_delay = 2000;
+    mock_ad.ldap_delay = 500;
+    nprocs = bench_parse_list("1,4", &procs);
+    while ((option = getopt(argc, argv, "c:e:k:l:m:n:")) != EOF) {
+        switch (option) {
+        case 'c':
+            free(procs);
+            nprocs = bench_parse_list(optarg, &procs);
+            break;
+        case 'e':
+            errors = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            mock_ad.kpasswd_delay = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            mock_ad.ldap_delay = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            method = optarg;
+            break;
+        case 'n':
+            changes = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (changes == 0)
+        bail("number of changes must be positive");
+    if (errors > 100)
+        bail("error percentage must be at most 100");
+    for (i = 0; i < nprocs; i++)
+        if (procs[i] == 0)
+            bail("number of processes must be positive");
+    mock_ad.kpasswd_failures = (unsigned int) errors;
+    mock_ad.ldap_failures = (unsigned int) errors;
+
+    /* Work in a temporary directory with a krb5.conf for the mock. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    file = fopen("krb5.conf", "w");
+    if (file == NULL)
+        sysbail("cannot create krb5.conf");
+    fprintf(file, "[appdefaults]\n    krb5-sync = {\n");
+    fprintf(file, "        ad_keytab = ad-keytab\n");
+    fprintf(file, "        ad_principal = service/krb5-sync@EXAMPLE.COM\n");
+    fprintf(file, "        ad_realm = AD.EXAMPLE.COM\n");
+    fprintf(file, "        ad_admin_server = ad.example.com\n");
+    fprintf(file, "        ad_ldap_base = ou=Accounts,dc=ad,dc=example\n");
+    fprintf(file, "        ad_password_method = %s\n", method);
+    fprintf(file, "        queue_dir = queue\n");
+    fprintf(file, "        syslog = false\n    }\n\n");
+    fprintf(file, "[libdefaults]\n    default_realm = EXAMPLE.COM\n");
+    if (fclose(file) != 0)
+        sysbail("cannot write krb5.conf");
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot create Kerberos context");
+
+    /* Run the load tests. */
+    bench_header();
+    for (i = 0; i < nprocs; i++) {
+        load_changes(ctx, procs[i], changes, LOAD_PASSWORD);
+        load_changes(ctx, procs[i], changes, LOAD_STATUS);
+        load_queue(ctx, procs[i], changes);
+    }
+
+    /* Clean up. */
+    if (system("rm -rf queue krb5.conf") != 0)
+        bail("cannot remove queue");
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    free(krb5_config);
+    test_tmpdir_free(tmpdir);
+    free(procs);
+    return 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * Tests for Active Directory changes in the krb5-sync plugin.
+ *
+ * Uses the mock Active Directory in tests/mock to check that password and
+ * status changes are pushed to Active Directory, that failures are queued,
+ * and that queued changes are then made by processing the queue.  Also
+ * checks that warming up sets up the credentials and a connection in
+ * advance, that batches of status changes are pipelined on one connection,
+ * that batches of password changes keep changes for one account in order,
+ * that status changes within ad_status_window are batched, that status
+ * changes that would not change the account are not written, and that
+ * passwords can be set over LDAP.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/mock/ad.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* The userAccountControl bit for a disabled account. */
+#define UF_ACCOUNTDISABLE 0x02
+
+/* The results reported for a batch of changes. */
+struct batch_results {
+    size_t count;
+    krb5_error_code codes[3];
+};
+
+
+/*
+ * Record the result of a change in a batch.
+ */
+static void
+batch_report(void *data, size_t index, krb5_error_code code)
+{
+    struct batch_results *results = data;
+
+    if (index < 3)
+        results->codes[index] = code;
+    results->count++;
+}
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *krb5_config;
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *data;
+    unsigned long failed, search, modify, bind;
+    struct sync_request requests[3];
+    struct sync_ad_change changes[3];
+    struct sync_ad_password passwords[3];
+    unsigned long kpasswd;
+    struct batch_results results;
+    krb5_principal others[2], lookup;
+    const char *message;
+    size_t i;
+
+    /* Define the plan. */
+    plan(92);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Point KRB5_CONFIG at the correct krb5.conf file. */
+    path = test_file_path("data/krb5.conf");
+    if (path == NULL)
+        bail("cannot find data/krb5.conf in the test suite");
+    basprintf(&krb5_config, "KRB5_CONFIG=%s", path);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot create Kerberos context");
+    code = sync_init(ctx, &data);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize plugin");
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+
+    /* Warming up obtains credentials and binds a pooled connection. */
+    data->ad_warmup = true;
+    sync_warmup_start(data, ctx);
+    is_int(1, mock_ad.creds, "Warm-up obtained credentials");
+    is_int(1, mock_ad.bind, "...and bound to LDAP");
+
+    /* Password changes go to kpasswd, reusing the credentials. */
+    is_int(0, sync_chpass(data, ctx, princ, "foobar"), "sync_chpass");
+    is_int(1, mock_ad.creds, "...used the warmed-up credentials");
+    ok(mock_ad.kpasswd > 0, "...and called kpasswd");
+    is_string("foobar", mock_ad.password, "...with the new password");
+    is_int(0, sync_chpass(data, ctx, princ, "barbaz"), "Second sync_chpass");
+    is_int(1, mock_ad.creds, "...reused the credentials");
+    is_string("barbaz", mock_ad.password, "...and set the new password");
+
+    /* Status changes search for the account and then reuse its DN. */
+    is_int(0, sync_status(data, ctx, princ, false), "sync_status disable");
+    is_int(1, mock_ad.bind, "...used the warmed-up connection");
+    is_int(1, mock_ad.search, "...searched once");
+    is_int(1, mock_ad.modify, "...and modified once");
+    is_int(512 | UF_ACCOUNTDISABLE, mock_ad.control,
+           "...setting the disable flag");
+    is_int(0, sync_status(data, ctx, princ, true), "sync_status enable");
+    is_int(1, mock_ad.bind, "...reused the connection");
+    is_int(2, mock_ad.search, "...read the cached DN");
+    is_int(512, mock_ad.control, "...and cleared the disable flag");
+
+    /* Batches of status changes share a connection. */
+    code = krb5_parse_name(ctx, "one@EXAMPLE.COM", &others[0]);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal one@EXAMPLE.COM");
+    code = krb5_parse_name(ctx, "two@EXAMPLE.COM", &others[1]);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal two@EXAMPLE.COM");
+    sync_request_init(&requests[0], princ);
+    sync_request_init(&requests[1], others[0]);
+    sync_request_init(&requests[2], others[1]);
+    for (i = 0; i < 3; i++) {
+        changes[i].request = &requests[i];
+        changes[i].enabled = false;
+    }
+    memset(&results, 0, sizeof(results));
+    search = mock_ad.search;
+    code = sync_ad_status_batch(data, ctx, changes, 3, batch_report,
+                                &results);
+    is_int(0, code, "sync_ad_status_batch");
+    is_int(3, results.count, "...reported every change");
+    is_int(0, results.codes[0], "...first succeeded");
+    is_int(0, results.codes[1], "...second succeeded");
+    is_int(0, results.codes[2], "...third succeeded");
+    is_int(1, mock_ad.bind, "...reused the connection");
+    is_int(search + 3, mock_ad.search, "...searched for each account");
+    is_int(5, mock_ad.modify, "...and modified each account");
+    for (i = 0; i < 3; i++)
+        sync_request_free(ctx, &requests[i]);
+
+    /* Failures to start batched changes are reported. */
+    mock_ad.ldap_failures = 100;
+    mock_ad.ldap_error = LDAP_NO_SUCH_OBJECT;
+    for (i = 0; i < 3; i++)
+        sync_request_init(&requests[i], i == 0 ? princ : others[i - 1]);
+    memset(&results, 0, sizeof(results));
+    sync_ad_status_batch(data, ctx, changes, 3, batch_report, &results);
+    is_int(3, results.count, "Failing batch reported every change");
+    ok(results.codes[0] != 0 && results.codes[1] != 0 && results.codes[2] != 0,
+       "...with errors");
+    mock_ad.ldap_failures = 0;
+    mock_ad.ldap_error = LDAP_SERVER_DOWN;
+    for (i = 0; i < 3; i++)
+        sync_request_free(ctx, &requests[i]);
+
+    /* Batched password changes for the same account are made in order. */
+    data->ad_kpasswd_concurrency = 3;
+    sync_request_init(&requests[0], princ);
+    sync_request_init(&requests[1], others[0]);
+    sync_request_init(&requests[2], princ);
+    passwords[0].password = "first";
+    passwords[1].password = "second";
+    passwords[2].password = "second";
+    for (i = 0; i < 3; i++)
+        passwords[i].request = &requests[i];
+    memset(&results, 0, sizeof(results));
+    kpasswd = mock_ad.kpasswd;
+    code = sync_ad_chpass_batch(data, ctx, passwords, 3, batch_report,
+                                &results);
+    is_int(0, code, "sync_ad_chpass_batch");
+    is_int(3, results.count, "...reported every change");
+    ok(results.codes[0] == 0 && results.codes[1] == 0
+       && results.codes[2] == 0, "...all succeeded");
+    is_int(kpasswd + 3, mock_ad.kpasswd, "...called kpasswd for each");
+    is_string("second", mock_ad.password, "...with the last one last");
+    is_int(1, mock_ad.creds, "...reused the credentials");
+    data->ad_kpasswd_concurrency = 1;
+    for (i = 0; i < 3; i++)
+        sync_request_free(ctx, &requests[i]);
+
+    /* Status changes within ad_status_window are made together. */
+    data->ad_status_window = 10;
+    modify = mock_ad.modify;
+    is_int(0, sync_status(data, ctx, princ, false), "Batched sync_status");
+    is_int(0, sync_status(data, ctx, others[0], true), "...for another");
+    is_int(0, sync_status(data, ctx, princ, true), "...and the first again");
+    for (i = 0; i < 1000 && mock_ad.modify < modify + 2; i++)
+        usleep(10000);
+    is_int(modify + 2, mock_ad.modify, "...made once for each account");
+    is_int(1, mock_ad.bind, "...on the pooled connection");
+    data->ad_status_window = 0;
+    krb5_free_principal(ctx, others[0]);
+    krb5_free_principal(ctx, others[1]);
+
+    /* A status change the account already has is not written. */
+    modify = mock_ad.modify;
+    search = mock_ad.search;
+    is_int(0, sync_status(data, ctx, princ, true), "Repeated sync_status");
+    is_int(search + 1, mock_ad.search, "...read the account");
+    is_int(modify, mock_ad.modify, "...but did not modify it");
+
+    /* If the account changes before the modify, it is read again. */
+    mock_ad.assert_failures = 1;
+    is_int(0, sync_status(data, ctx, princ, false),
+           "sync_status with a concurrent change");
+    is_int(0, mock_ad.assert_failures, "...asserted the old value");
+    is_int(search + 3, mock_ad.search, "...read the account again");
+    is_int(modify + 2, mock_ad.modify, "...and modified it again");
+    is_int(512 | UF_ACCOUNTDISABLE, mock_ad.control,
+           "...setting the disable flag");
+
+    /* With ad_dn_cache_status, a known status is not even read. */
+    data->ad_dn_cache_status = 60;
+    is_int(0, sync_status(data, ctx, princ, true), "Remembered sync_status");
+    search = mock_ad.search;
+    modify = mock_ad.modify;
+    is_int(0, sync_status(data, ctx, princ, true), "...repeated");
+    is_int(search, mock_ad.search, "...did not read the account");
+    is_int(modify, mock_ad.modify, "...or modify it");
+    is_int(0, sync_status(data, ctx, princ, false), "...but a change");
+    is_int(modify + 1, mock_ad.modify, "...is still made");
+    data->ad_dn_cache_status = 0;
+
+    /* With ad_dn_cache_missing, a missing account is not searched again. */
+    data->ad_dn_cache_missing = 60;
+    snprintf(mock_ad.missing, sizeof(mock_ad.missing), "%s",
+             "gone@AD.EXAMPLE.COM");
+    code = krb5_parse_name(ctx, "gone@EXAMPLE.COM", &lookup);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse gone@EXAMPLE.COM");
+    sync_request_init(&requests[0], lookup);
+    search = mock_ad.search;
+    ok(sync_ad_status(data, ctx, &requests[0], false) != 0,
+       "Status change for a missing account fails");
+    is_int(search + 1, mock_ad.search, "...after searching");
+    code = sync_ad_status(data, ctx, &requests[0], false);
+    message = krb5_get_error_message(ctx, code);
+    is_string("user \"gone@AD.EXAMPLE.COM\" not found via LDAP (cached)",
+              message, "...and fails again");
+    krb5_free_error_message(ctx, message);
+    is_int(search + 1, mock_ad.search, "...without searching");
+    kpasswd = mock_ad.kpasswd;
+    ok(sync_ad_chpass(data, ctx, &requests[0], "gone") != 0,
+       "...as does a password change");
+    is_int(kpasswd, mock_ad.kpasswd, "...without kpasswd");
+    mock_ad.missing[0] = '\0';
+    sync_dncache_set_missing(data, "gone@AD.EXAMPLE.COM", false);
+    is_int(0, sync_ad_status(data, ctx, &requests[0], false),
+           "...but works once the account is seen");
+    is_int(search + 2, mock_ad.search, "...searching for it");
+    is_string("CN=gone@AD.EXAMPLE.COM,ou=Accounts,dc=ad,dc=example,dc=com",
+              sync_dncache_lookup(data, &requests[0], "gone@AD.EXAMPLE.COM"),
+              "...and caching its DN");
+    sync_request_free(ctx, &requests[0]);
+    krb5_free_principal(ctx, lookup);
+    data->ad_dn_cache_missing = 0;
+
+    /* Failures are queued. */
+    mock_ad.kpasswd_failures = 100;
+    is_int(0, sync_chpass(data, ctx, princ, "queued"),
+           "sync_chpass with kpasswd failing");
+    is_string("barbaz", mock_ad.password, "...did not change the password");
+    mock_ad.kpasswd_failures = 0;
+    mock_ad.ldap_failures = 100;
+    is_int(0, sync_status(data, ctx, princ, false),
+           "sync_status with LDAP failing");
+    mock_ad.ldap_failures = 0;
+    sync_queue_check_enable("queue", "test", false);
+
+    /* The queued password change is made by processing the queue. */
+    failed = 1;
+    code = sync_queue_process(data, ctx, NULL, NULL, &failed);
+    is_int(0, code, "Processing the queue");
+    is_int(0, failed, "...with no failures");
+    is_string("queued", mock_ad.password, "...made the queued change");
+
+    /* Passwords can be set over LDAP instead of with kpasswd. */
+    data->ad_password_method = bstrdup("ldap");
+    kpasswd = mock_ad.kpasswd;
+    search = mock_ad.search;
+    modify = mock_ad.modify;
+    is_int(0, sync_chpass(data, ctx, princ, "unicode"),
+           "sync_chpass over LDAP");
+    is_string("unicode", mock_ad.password, "...set the password");
+    is_int(kpasswd, mock_ad.kpasswd, "...without kpasswd");
+    is_int(search, mock_ad.search, "...using the cached DN");
+    is_int(modify + 1, mock_ad.modify, "...with one modify");
+    bind = mock_ad.bind;
+    is_int(0, sync_chpass(data, ctx, princ, "again"), "Second over LDAP");
+    is_string("again", mock_ad.password, "...set the password");
+    is_int(bind, mock_ad.bind, "...reusing the pooled connection");
+    sync_request_init(&requests[0], princ);
+    ok(sync_ad_chpass(data, ctx, &requests[0], "bad\xff") != 0,
+       "...and a password that isn't UTF-8 is rejected");
+    sync_request_free(ctx, &requests[0]);
+    free(data->ad_password_method);
+    data->ad_password_method = NULL;
+
+    /* Accounts can be found by sAMAccountName under a base per instance. */
+    data->ad_ldap_filter_attribute = bstrdup("sAMAccountName");
+    data->ad_ldap_instance_bases
+        = sync_vector_split_multi("root:ou=Admins,dc=ad,dc=example,dc=com",
+                                  " ", NULL);
+    code = krb5_parse_name(ctx, "lookup/root@EXAMPLE.COM", &lookup);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse lookup/root@EXAMPLE.COM");
+    sync_request_init(&requests[0], lookup);
+    is_int(0, sync_ad_status(data, ctx, &requests[0], false),
+           "Status change found by sAMAccountName");
+    is_string("(sAMAccountName=lookup)", mock_ad.filter,
+              "...searched on the first component");
+    is_string("ou=Admins,dc=ad,dc=example,dc=com", mock_ad.base,
+              "...under the base for its instance");
+    is_int(1, mock_ad.sizelimit, "...for at most one entry");
+    sync_request_free(ctx, &requests[0]);
+    krb5_free_principal(ctx, lookup);
+
+    /* Other principals use ad_ldap_base, and filter values are escaped. */
+    code = krb5_parse_name(ctx, "a(b)*@EXAMPLE.COM", &lookup);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse a(b)*@EXAMPLE.COM");
+    sync_request_init(&requests[0], lookup);
+    is_int(0, sync_ad_status(data, ctx, &requests[0], false),
+           "Status change for a principal with special characters");
+    is_string("(sAMAccountName=a\\28b\\29\\2a)", mock_ad.filter,
+              "...escaped them in the filter");
+    is_string("ou=Accounts,dc=ad,dc=example,dc=com", mock_ad.base,
+              "...and searched ad_ldap_base");
+    sync_request_free(ctx, &requests[0]);
+    krb5_free_principal(ctx, lookup);
+    free(data->ad_ldap_filter_attribute);
+    data->ad_ldap_filter_attribute = NULL;
+    sync_vector_free(data->ad_ldap_instance_bases);
+    data->ad_ldap_instance_bases = NULL;
+
+    /* Clean up the queue. */
+    ok(unlink("queue/.sequence") == 0, "Sequence file still exists");
+    ok(unlink("queue/.lock") == 0, "Lock file still exists");
+    ok(rmdir("queue") == 0, "...and the change is no longer queued");
+
+    /* Clean up. */
+    sync_close(ctx, data);
+    krb5_free_principal(ctx, princ);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    free(krb5_config);
+    test_file_path_free(path);
+    return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * Tests for asynchronous changes and queue processing in the krb5-sync plugin.
+ *
+ * Enable ad_async and test that changes are queued and left in the queue when
+ * the background worker can't make them.  Then test queue processing
+ * directly, including skipping later changes after a failure.  The test
+ * Active Directory configuration doesn't point to a working server, so all
+ * changes fail.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+
+/* The name of the first queued change reported by report_first. */
+static char *first = NULL;
+
+
+/*
+ * Remember the first queued change reported by sync_queue_process.
+ */
+static void
+report_first(kadm5_hook_modinfo *config UNUSED, krb5_context ctx UNUSED,
+             const char *name, krb5_error_code code UNUSED)
+{
+    if (first == NULL)
+        first = bstrdup(name);
+}
+
+
+/*
+ * Return the number of failed attempts recorded in the retry state of the
+ * given queued change, or -1 if there is none.
+ */
+static long
+retry_attempts(const char *name)
+{
+    FILE *file;
+    char *path;
+    long attempts, next;
+
+    basprintf(&path, "queue/.retry/%s", name);
+    file = fopen(path, "r");
+    free(path);
+    if (file == NULL)
+        return -1;
+    if (fscanf(file, "%ld %ld", &attempts, &next) != 2)
+        attempts = -1;
+    fclose(file);
+    return attempts;
+}
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *make_conf, *krb5_config;
+    const char *setup_argv[6];
+    krb5_context ctx;
+    krb5_principal princ;
+    struct sync_request request;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    unsigned long failed;
+    struct vector *files;
+    size_t i;
+
+    /* Define the plan. */
+    plan(52);
+
+    /* Set up a temporary directory and queue relative to it. */
+    path = test_file_path("data/krb5.conf");
+    if (path == NULL)
+        bail("cannot find data/krb5.conf in the test suite");
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with ad_async set. */
+    make_conf = test_file_path("data/make-krb5-conf");
+    if (make_conf == NULL)
+        bail("cannot find data/make-krb5-conf in the test suite");
+    setup_argv[0] = make_conf;
+    setup_argv[1] = path;
+    setup_argv[2] = tmpdir;
+    setup_argv[3] = "ad_async";
+    setup_argv[4] = "true";
+    setup_argv[5] = NULL;
+    run_setup(setup_argv);
+    test_file_path_free(make_conf);
+    test_file_path_free(path);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+
+    /* Obtain a new Kerberos context with that krb5.conf file. */
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* Test init. */
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ok(config != NULL, "...and config is non-NULL");
+
+    /*
+     * Queue a password change and a status change for the worker thread.  The
+     * changes will fail, so once the worker has been stopped, they should
+     * still be in the queue.
+     */
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    sync_request_init(&request, princ);
+    code = sync_chpass(config, ctx, princ, "foobar");
+    is_int(0, code, "sync_chpass succeeds");
+    code = sync_status(config, ctx, princ, false);
+    is_int(0, code, "sync_status disable succeeds");
+    sync_close(ctx, config);
+    sync_queue_check_password("queue", "test", "foobar");
+    sync_queue_check_enable("queue", "test", false);
+
+    /*
+     * Now test queue processing directly.  Queue two password changes for
+     * the same user and one for a different user.  The second change for the
+     * same user should be skipped after the first fails, whether or not the
+     * changes are divided among several worker processes.
+     */
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    sync_queue_block("queue", "test", "password");
+    is_int(0, sync_queue_write(config, ctx, &request, "password", "foobar"),
+           "Queuing a password change succeeds");
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, princ);
+    code = krb5_parse_name(ctx, "other@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal other@EXAMPLE.COM");
+    sync_request_init(&request, princ);
+    is_int(0, sync_queue_write(config, ctx, &request, "enable", NULL),
+           "Queuing a status change succeeds");
+    code = sync_queue_process(config, ctx, NULL, NULL, &failed);
+    is_int(0, code, "sync_queue_process succeeds");
+    is_int(2, failed, "...with two failed changes");
+    code = sync_queue_process_parallel(config, ctx, 3, NULL, NULL, &failed);
+    is_int(0, code, "sync_queue_process_parallel succeeds");
+    is_int(2, failed, "...with the same two failed changes");
+
+    /*
+     * With queue_coalesce set, only the newest change for each id is made.
+     * The blocking file for test is superseded by the real password change,
+     * so it's removed without being tried.  Queuing a disable for other then
+     * replaces the queued enable.
+     */
+    config->queue_coalesce = true;
+    code = sync_queue_process(config, ctx, NULL, NULL, &failed);
+    is_int(0, code, "sync_queue_process with coalescing succeeds");
+    is_int(2, failed, "...with two failed changes");
+    ok(access("queue/test-ad-password-19700101T000000Z", F_OK) < 0,
+       "...and the superseded change was removed");
+    is_int(0, sync_queue_write(config, ctx, &request, "disable", NULL),
+           "Queuing a superseding status change succeeds");
+    code = sync_queue_list(config, ctx, &files);
+    is_int(0, code, "Listing the queue succeeds");
+    is_int(2, files->count, "...and the older status change was removed");
+
+    /*
+     * With queue_backoff set, each failure is recorded with the time of the
+     * next attempt, and changes that aren't due yet are skipped without
+     * being attempted but are still counted as failed.
+     */
+    config->queue_backoff = 3600;
+    code = sync_queue_process(config, ctx, NULL, NULL, &failed);
+    is_int(0, code, "sync_queue_process with backoff succeeds");
+    is_int(2, failed, "...with two failed changes");
+    is_int(1, retry_attempts(files->strings[0]), "...recorded the failure");
+    code = sync_queue_process(config, ctx, NULL, NULL, &failed);
+    is_int(2, failed, "Changes not yet due are counted as failed");
+    is_int(1, retry_attempts(files->strings[0]), "...but not attempted");
+    for (i = 0; i < files->count; i++) {
+        basprintf(&path, "queue/.retry/%s", files->strings[i]);
+        ok(unlink(path) == 0, "Retry state %lu exists", (unsigned long) i);
+        free(path);
+    }
+    ok(rmdir("queue/.retry") == 0, "...and nothing else is retried");
+    config->queue_backoff = 0;
+
+    /*
+     * By default, the disable for other is made before the password change
+     * for test, but queue_priority can put password changes first.
+     */
+    code = sync_queue_process(config, ctx, NULL, report_first, &failed);
+    is_int(0, code, "sync_queue_process succeeds");
+    ok(first != NULL && strncmp(first, "other-ad-enable-", 16) == 0,
+       "...disable made first");
+    free(first);
+    first = NULL;
+    config->queue_priority = sync_vector_split_multi("password", " ", NULL);
+    code = sync_queue_process(config, ctx, NULL, report_first, &failed);
+    is_int(0, code, "sync_queue_process with queue_priority succeeds");
+    ok(first != NULL && strncmp(first, "test-ad-password-", 17) == 0,
+       "...and the password change is made first");
+    free(first);
+    first = NULL;
+    sync_vector_free(config->queue_priority);
+    config->queue_priority = NULL;
+
+    /*
+     * With queue_cursor set to the disable for other, a bounded run starts
+     * with the changes after it and wraps around, and the cursor is left at
+     * the last change reached.
+     */
+    config->queue_cursor = bstrdup(files->strings[0]);
+    code = sync_queue_process(config, ctx, NULL, report_first, &failed);
+    is_int(0, code, "sync_queue_process with queue_cursor succeeds");
+    ok(first != NULL && strncmp(first, "test-ad-password-", 17) == 0,
+       "...and starts after the cursor");
+    is_string(files->strings[0], config->queue_cursor,
+              "...and the cursor is the last change reached");
+    free(first);
+    free(config->queue_cursor);
+    config->queue_cursor = NULL;
+    for (i = 0; i < files->count; i++)
+        if (strncmp(files->strings[i], "other-", 6) == 0) {
+            basprintf(&path, "queue/%s", files->strings[i]);
+            unlink(path);
+            free(path);
+        }
+    sync_vector_free(files);
+    sync_close(ctx, config);
+    sync_queue_check_password("queue", "test", "foobar");
+
+    /* Unwind the queue and be sure all the right files exist. */
+    ok(unlink("queue/.sequence") == 0, "Sequence file still exists");
+    ok(unlink("queue/.lock") == 0, "Lock file still exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Manually clean up after the results of make-krb5-conf. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+
+    /* Clean up. */
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, princ);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Tests for the capture of hook events in the krb5-sync plugin.
+ *
+ * Checks that each captured change is one line with its time, operation,
+ * anonymized user, instance, and duration, that the same user always gets
+ * the same id in one process, and that the user and password don't appear
+ * in the capture file.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+
+/* A captured change, as read back from the capture file. */
+struct event {
+    long seconds;
+    long usec;
+    char operation[16];
+    char id[16];
+    char instance[64];
+    unsigned long duration;
+};
+
+
+/*
+ * Capture a change for the principal name with the given operation.
+ */
+static void
+capture(kadm5_hook_modinfo *config, krb5_context ctx, const char *name,
+        const char *operation)
+{
+    krb5_principal princ;
+    struct sync_request request;
+    krb5_error_code code;
+
+    code = krb5_parse_name(ctx, name, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse %s", name);
+    sync_request_init(&request, princ);
+    sync_request_trace(&request, NULL);
+    sync_capture_event(config, ctx, &request, operation);
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, princ);
+}
+
+
+/*
+ * Parse a line of the capture file into event, returning true on success.
+ */
+static bool
+parse(const char *line, struct event *event)
+{
+    return sscanf(line, "%ld.%ld %15s %15s %63s %lu", &event->seconds,
+                  &event->usec, event->operation, event->id,
+                  event->instance, &event->duration)
+        == 6;
+}
+
+
+int
+main(void)
+{
+    kadm5_hook_modinfo *config;
+    krb5_context ctx;
+    struct event events[4];
+    char *tmpdir, *line;
+    char buffer[BUFSIZ];
+    FILE *file;
+    size_t count = 0;
+    bool parsed = true, leaked = false;
+
+    /* Define the plan. */
+    plan(11);
+
+    /* Obtain a Kerberos context and a minimal configuration. */
+    if (krb5_init_context(&ctx) != 0)
+        bail("cannot initialize Kerberos context");
+    config = bcalloc(1, sizeof(*config));
+    tmpdir = test_tmpdir();
+    basprintf(&config->capture_file, "%s/capture", tmpdir);
+
+    /* Nothing is captured without capture_file. */
+    line = config->capture_file;
+    config->capture_file = NULL;
+    capture(config, ctx, "test@EXAMPLE.COM", "password");
+    config->capture_file = line;
+    ok(access(config->capture_file, F_OK) < 0,
+       "Nothing is captured without capture_file");
+
+    /* Capture some changes and read them back. */
+    capture(config, ctx, "test@EXAMPLE.COM", "password");
+    capture(config, ctx, "test/admin@EXAMPLE.COM", "enable");
+    capture(config, ctx, "other@EXAMPLE.COM", "disable");
+    capture(config, ctx, "test@EXAMPLE.COM", "password");
+    sync_capture_close(config);
+    file = fopen(config->capture_file, "r");
+    if (file == NULL)
+        sysbail("cannot open %s", config->capture_file);
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        if (strstr(buffer, "test") != NULL || strstr(buffer, "other") != NULL)
+            leaked = true;
+        if (count < 4 && !parse(buffer, &events[count]))
+            parsed = false;
+        count++;
+    }
+    fclose(file);
+    is_int(4, count, "One line is captured for each change");
+    ok(parsed, "...and each line has every field");
+    ok(!leaked, "...and doesn't name the user");
+
+    /* Check the fields. */
+    if (count < 4)
+        bail("not enough captured changes");
+    is_string("password", events[0].operation, "Operation is captured");
+    is_string("disable", events[2].operation, "...for each change");
+    is_string("-", events[0].instance, "Missing instance is a dash");
+    is_string("admin", events[1].instance, "...and an instance is kept");
+    is_string(events[0].id, events[3].id, "Same user gets the same id");
+    ok(strcmp(events[0].id, events[2].id) != 0,
+       "...and other users get other ids");
+    ok(events[3].seconds > events[0].seconds
+       || (events[3].seconds == events[0].seconds
+           && events[3].usec >= events[0].usec),
+       "Times are in order");
+
+    /* Clean up. */
+    unlink(config->capture_file);
+    free(config->capture_file);
+    free(config);
+    test_tmpdir_free(tmpdir);
+    krb5_free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Tests for the Active Directory DN cache in the krb5-sync plugin.
+ *
+ * Exercises the LRU eviction, removal, and persistence of the cache of DNs
+ * used for account status changes, without needing an Active Directory
+ * server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+int
+main(void)
+{
+    kadm5_hook_modinfo *config;
+    struct sync_request request;
+    char *tmpdir, *path;
+
+    /* Define the plan. */
+    plan(16);
+
+    /* A cache with room for two entries.  Lookups copy into the request. */
+    sync_request_init(&request, NULL);
+    config = bcalloc(1, sizeof(*config));
+    config->ad_dn_cache_size = 2;
+    is_string(NULL, sync_dncache_lookup(config, &request, "a@AD.EXAMPLE.COM"),
+              "Lookup in empty cache");
+    sync_dncache_store(config, "a@AD.EXAMPLE.COM", "cn=a,dc=example");
+    sync_dncache_store(config, "b@AD.EXAMPLE.COM", "cn=b,dc=example");
+    is_string("cn=a,dc=example",
+              sync_dncache_lookup(config, &request, "a@AD.EXAMPLE.COM"),
+              "Lookup of first entry");
+    is_string("cn=b,dc=example",
+              sync_dncache_lookup(config, &request, "b@AD.EXAMPLE.COM"),
+              "Lookup of second entry");
+
+    /* Use a again, so b is now the least recently used and is evicted. */
+    sync_dncache_lookup(config, &request, "a@AD.EXAMPLE.COM");
+    sync_dncache_store(config, "c@AD.EXAMPLE.COM", "cn=c,dc=example");
+    is_string(NULL, sync_dncache_lookup(config, &request, "b@AD.EXAMPLE.COM"),
+              "Least recently used entry was evicted");
+    is_string("cn=a,dc=example",
+              sync_dncache_lookup(config, &request, "a@AD.EXAMPLE.COM"),
+              "...but recently used entry was kept");
+    is_string("cn=c,dc=example",
+              sync_dncache_lookup(config, &request, "c@AD.EXAMPLE.COM"),
+              "...as was the new entry");
+
+    /* Replacing an entry changes the DN. */
+    sync_dncache_store(config, "a@AD.EXAMPLE.COM", "cn=a,ou=new");
+    is_string("cn=a,ou=new",
+              sync_dncache_lookup(config, &request, "a@AD.EXAMPLE.COM"),
+              "Replaced entry");
+
+    /* Removal. */
+    sync_dncache_remove(config, "a@AD.EXAMPLE.COM");
+    is_string(NULL, sync_dncache_lookup(config, &request, "a@AD.EXAMPLE.COM"),
+              "Removed entry");
+    is_string("cn=c,dc=example",
+              sync_dncache_lookup(config, &request, "c@AD.EXAMPLE.COM"),
+              "...and other entry is still there");
+    sync_dncache_remove(config, "x@AD.EXAMPLE.COM");
+    sync_dncache_free(config);
+    ok(config->dn_cache == NULL, "Cache freed");
+
+    /* A disabled cache stores nothing. */
+    config->ad_dn_cache_size = 0;
+    sync_dncache_store(config, "a@AD.EXAMPLE.COM", "cn=a,dc=example");
+    is_string(NULL, sync_dncache_lookup(config, &request, "a@AD.EXAMPLE.COM"),
+              "Disabled cache stores nothing");
+    ok(config->dn_cache == NULL, "...and is never created");
+
+    /* Persistence to the queue directory. */
+    tmpdir = test_tmpdir();
+    config->ad_dn_cache_size = 10;
+    config->ad_dn_cache_persist = true;
+    config->queue_dir = tmpdir;
+    sync_dncache_store(config, "a@AD.EXAMPLE.COM", "cn=a,dc=example");
+    sync_dncache_store(config, "b@AD.EXAMPLE.COM", "cn=b,dc=example");
+    sync_dncache_store(config, "bad\t@AD.EXAMPLE.COM", "cn=bad,dc=example");
+    sync_dncache_free(config);
+    basprintf(&path, "%s/.dn-cache", tmpdir);
+    ok(access(path, F_OK) == 0, "Cache saved to queue_dir");
+    is_string("cn=a,dc=example",
+              sync_dncache_lookup(config, &request, "a@AD.EXAMPLE.COM"),
+              "...and first entry loaded again");
+    is_string("cn=b,dc=example",
+              sync_dncache_lookup(config, &request, "b@AD.EXAMPLE.COM"),
+              "...as is the second entry");
+    is_string(NULL,
+              sync_dncache_lookup(config, &request, "bad\t@AD.EXAMPLE.COM"),
+              "...but not the entry with a tab");
+
+    /* Clean up. */
+    config->ad_dn_cache_persist = false;
+    sync_dncache_free(config);
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    sync_request_free(NULL, &request);
+    free(config);
+    return 0;
+}
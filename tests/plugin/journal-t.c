@@ -0,0 +1,241 @@
+/*
+ * Tests for the journal queue format in the krb5-sync plugin.
+ *
+ * Force queuing with queue_format set to journal and check that queued
+ * changes are appended to the journal instead of written to queue files,
+ * that conflict checks and queue listings use it, that another instance of
+ * the plugin sees the same changes, and that finished changes are dropped
+ * when the journal is compacted.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Count the files in the queue directory whose names don't start with a
+ * period, calling bail on failure.
+ */
+static size_t
+count_files(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    size_t count = 0;
+
+    dir = opendir("queue");
+    if (dir == NULL)
+        sysbail("cannot open queue");
+    while ((entry = readdir(dir)) != NULL)
+        if (entry->d_name[0] != '.')
+            count++;
+    closedir(dir);
+    return count;
+}
+
+
+/*
+ * Read the contents of the journal into a newly allocated string, calling
+ * bail on failure.
+ */
+static char *
+read_journal(void)
+{
+    char buffer[BUFSIZ];
+    size_t length;
+    FILE *file;
+
+    file = fopen("queue/.journal", "r");
+    if (file == NULL)
+        sysbail("cannot open queue/.journal");
+    length = fread(buffer, 1, sizeof(buffer) - 1, file);
+    if (ferror(file))
+        sysbail("cannot read queue/.journal");
+    fclose(file);
+    buffer[length] = '\0';
+    return bstrdup(buffer);
+}
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *make_conf, *krb5_config, *journal;
+    const char *setup_argv[8];
+    krb5_context ctx;
+    krb5_principal princ;
+    struct sync_request request;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config, *other;
+    struct vector *files;
+    unsigned long failed;
+    bool conflict;
+    size_t i;
+
+    /* Define the plan. */
+    plan(33);
+
+    /* Set up a temporary directory and queue relative to it. */
+    path = test_file_path("data/krb5.conf");
+    if (path == NULL)
+        bail("cannot find data/krb5.conf in the test suite");
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with ad_queue_only and queue_format set. */
+    make_conf = test_file_path("data/make-krb5-conf");
+    if (make_conf == NULL)
+        bail("cannot find data/make-krb5-conf in the test suite");
+    setup_argv[0] = make_conf;
+    setup_argv[1] = path;
+    setup_argv[2] = tmpdir;
+    setup_argv[3] = "ad_queue_only";
+    setup_argv[4] = "true";
+    setup_argv[5] = "queue_format";
+    setup_argv[6] = "journal";
+    setup_argv[7] = NULL;
+    run_setup(setup_argv);
+    test_file_path_free(make_conf);
+    test_file_path_free(path);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+
+    /* Obtain a new Kerberos context with that krb5.conf file. */
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* Test init. */
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ok(config != NULL, "...and config is non-NULL");
+    ok(config->journal != NULL, "...and uses a journal");
+
+    /* Queue a password change and check that it went into the journal. */
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    sync_request_init(&request, princ);
+    code = sync_chpass(config, ctx, princ, "foobar");
+    is_int(0, code, "sync_chpass succeeds");
+    journal = read_journal();
+    ok(strncmp(journal, "+\ttest-ad-password-", 19) == 0,
+       "...and the change is in the journal");
+    ok(strlen(journal) > 33
+       && strcmp(journal + strlen(journal) - 33,
+                 "-0000000000\ttest\tpassword\tfoobar\n") == 0,
+       "...with the right contents");
+    free(journal);
+    is_int(0, count_files(), "...and no queue file was written");
+
+    /* Conflict checks should see the queued change. */
+    code = sync_queue_conflict(config, ctx, &request, "password", &conflict);
+    is_int(0, code, "Conflict check succeeds");
+    ok(conflict, "...and finds the queued password change");
+    code = sync_queue_conflict(config, ctx, &request, "enable", &conflict);
+    is_int(0, code, "Conflict check for enable succeeds");
+    ok(!conflict, "...and finds no conflict");
+
+    /* Queue a disable and check the queue listing. */
+    code = sync_status(config, ctx, princ, false);
+    is_int(0, code, "sync_status disable succeeds");
+    code = sync_queue_list(config, ctx, &files);
+    is_int(0, code, "Listing the queue succeeds");
+    if (files->count != 2)
+        bail("wrong number of changes in queue: %lu",
+             (unsigned long) files->count);
+    ok(strncmp(files->strings[0], "test-ad-enable-", 15) == 0,
+       "...with the enable first");
+    ok(strncmp(files->strings[1], "test-ad-password-", 17) == 0,
+       "...and then the password change");
+
+    /* Another instance of the plugin should see the same changes. */
+    is_int(0, sync_init(ctx, &other), "Second sync_init succeeds");
+    code = sync_queue_conflict(other, ctx, &request, "disable", &conflict);
+    is_int(0, code, "Conflict check in the second instance succeeds");
+    ok(conflict, "...and finds the queued disable");
+
+    /* Processing the queue fails in the test suite, leaving the changes. */
+    code = sync_queue_process(other, ctx, NULL, NULL, &failed);
+    is_int(0, code, "Processing the queue succeeds");
+    is_int(2, failed, "...with both changes failing");
+    sync_close(ctx, other);
+
+    /*
+     * Finish the changes by hand, and then compaction should leave an empty
+     * journal.
+     */
+    for (i = 0; i < files->count; i++) {
+        code = sync_journal_remove(config, ctx, files->strings[i]);
+        is_int(0, code, "Removing queued change %lu succeeds",
+               (unsigned long) i);
+    }
+    sync_vector_free(files);
+    code = sync_queue_conflict(config, ctx, &request, "password", &conflict);
+    ok(code == 0 && !conflict, "No conflict after removing the changes");
+    is_int(0, sync_journal_compact(config, ctx), "Compaction succeeds");
+    journal = read_journal();
+    is_string("", journal, "...and leaves an empty journal");
+    free(journal);
+
+    /*
+     * With queue_coalesce, a new change replaces the pending one.  Also use
+     * group commit, which should work the same.
+     */
+    config->queue_coalesce = true;
+    config->queue_group_commit = true;
+    sync_chpass(config, ctx, princ, "first");
+    sync_chpass(config, ctx, princ, "second");
+    code = sync_queue_list(config, ctx, &files);
+    is_int(0, code, "Listing the coalesced queue succeeds");
+    is_int(1, files->count, "...and only one change is pending");
+    for (i = 0; i < files->count; i++)
+        sync_journal_remove(config, ctx, files->strings[i]);
+    sync_vector_free(files);
+
+    /* Passwords with newlines can't be stored in the journal. */
+    code = sync_queue_write(config, ctx, &request, "password", "foo\nbar");
+    ok(code != 0, "Queuing a password with a newline fails");
+
+    /* Clean up the queue. */
+    sync_close(ctx, config);
+    ok(unlink("queue/.journal") == 0, "Journal still exists");
+    ok(unlink("queue/.commit") == 0, "Commit file still exists");
+    ok(unlink("queue/.sequence") == 0, "Sequence file still exists");
+    ok(unlink("queue/.lock") == 0, "Lock file still exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Manually clean up after the results of make-krb5-conf. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+
+    /* Clean up. */
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, princ);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Tests for the leases on partitions of the queue in the krb5-sync plugin.
+ *
+ * Uses two configurations sharing a queue directory as two nodes, and checks
+ * that a node holding leases keeps the other from taking them, that each id
+ * is held by at most one node, that released leases can be taken at once,
+ * and that a node whose leases expire loses them to the other.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+#include <time.h>
+#include <utime.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+/* The number of partitions, and of ids to check. */
+#define PARTITIONS 4
+#define IDS        64
+
+
+/*
+ * Return a configuration for a node processing the queue in dir.
+ */
+static kadm5_hook_modinfo *
+node(const char *dir)
+{
+    kadm5_hook_modinfo *config;
+
+    config = bcalloc(1, sizeof(*config));
+    config->queue_dir = bstrdup(dir);
+    config->queue_lease_partitions = PARTITIONS;
+    config->queue_lease_time = 60;
+    return config;
+}
+
+
+/*
+ * Return the number of the test ids held by a node.
+ */
+static unsigned long
+held(kadm5_hook_modinfo *config)
+{
+    unsigned long i, count = 0;
+    char id[32];
+
+    for (i = 0; i < IDS; i++) {
+        snprintf(id, sizeof(id), "user%lu-ad-password", i);
+        if (sync_lease_held(config, id))
+            count++;
+    }
+    return count;
+}
+
+
+/*
+ * Set the modification time of the lease files of the given generation far
+ * enough in the past that they have expired.
+ */
+static void
+expire(const char *dir, unsigned long generation)
+{
+    struct utimbuf old;
+    unsigned long i;
+    char *path;
+
+    old.actime = time(NULL) - 600;
+    old.modtime = old.actime;
+    for (i = 0; i < PARTITIONS; i++) {
+        basprintf(&path, "%s/.leases/%lu-%lu", dir, i, generation);
+        if (utime(path, &old) < 0)
+            sysbail("cannot set the time of %s", path);
+        free(path);
+    }
+}
+
+
+int
+main(void)
+{
+    kadm5_hook_modinfo *one, *two;
+    krb5_context ctx;
+    krb5_error_code code;
+    char *tmpdir, *dir, *path, *command;
+    unsigned long i;
+    char id[32];
+    bool disjoint = true;
+
+    /* Define the plan. */
+    plan(14);
+
+    /* Obtain a Kerberos context and the queue directory. */
+    if (krb5_init_context(&ctx) != 0)
+        bail("cannot initialize Kerberos context");
+    tmpdir = test_tmpdir();
+    basprintf(&dir, "%s/queue", tmpdir);
+    if (mkdir(dir, 0700) < 0)
+        sysbail("cannot create %s", dir);
+
+    /* Without queue_lease_partitions, every change may be made. */
+    one = node(dir);
+    one->queue_lease_partitions = 0;
+    is_int(0, sync_lease_acquire(one, ctx), "Acquiring without leases");
+    is_int(IDS, held(one), "...and every id is held");
+    ok(one->lease == NULL, "...with no lease state");
+    one->queue_lease_partitions = PARTITIONS;
+
+    /* The first node takes every partition, leaving none for the second. */
+    two = node(dir);
+    code = sync_lease_acquire(one, ctx);
+    is_int(0, code, "First node acquires leases");
+    is_int(IDS, held(one), "...on every partition");
+    basprintf(&path, "%s/.leases/0-1", dir);
+    ok(access(path, F_OK) == 0, "...with a lease file for each");
+    free(path);
+    code = sync_lease_acquire(two, ctx);
+    is_int(0, code, "Second node acquires leases");
+    is_int(0, held(two), "...but gets none while they are held");
+
+    /* Once released, the second node can take them at once. */
+    sync_lease_release(one);
+    ok(one->lease == NULL, "Releasing frees the lease state");
+    sync_lease_acquire(two, ctx);
+    sync_lease_acquire(one, ctx);
+    for (i = 0; i < IDS; i++) {
+        snprintf(id, sizeof(id), "user%lu-ad-password", i);
+        if (sync_lease_held(one, id) && sync_lease_held(two, id))
+            disjoint = false;
+    }
+    is_int(IDS, held(two), "Released leases are taken by the other node");
+    ok(disjoint, "...and no id is held by both");
+    basprintf(&path, "%s/.leases/0-1", dir);
+    ok(access(path, F_OK) < 0, "...and the old lease files are removed");
+    free(path);
+
+    /* If the second node stops renewing, the first takes its partitions. */
+    expire(dir, 2);
+    sync_lease_acquire(one, ctx);
+    is_int(IDS, held(one), "Expired leases are taken by the other node");
+    sync_lease_acquire(two, ctx);
+    is_int(0, held(two), "...and lost by their holder");
+
+    /* Clean up. */
+    sync_lease_release(one);
+    sync_lease_release(two);
+    basprintf(&command, "rm -rf %s", dir);
+    if (system(command) != 0)
+        sysdiag("cannot remove %s", dir);
+    free(command);
+    free(one->queue_dir);
+    free(one);
+    free(two->queue_dir);
+    free(two);
+    free(dir);
+    test_tmpdir_free(tmpdir);
+    krb5_free_context(ctx);
+    return 0;
+}
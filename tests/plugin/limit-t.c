@@ -0,0 +1,113 @@
+/*
+ * Tests for the adaptive concurrency limits in the krb5-sync plugin.
+ *
+ * Checks that the window of operations in flight starts at one, grows by one
+ * per healthy operation until the first back-pressure and more slowly after
+ * it, is halved once per overload, stays between one and the maximum, is
+ * kept separately for each kind of operation, and treats slow operations as
+ * back-pressure if ad_adaptive_slow is set.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+
+/* The configured maximum number of operations in flight. */
+#define MAX 8
+
+
+/*
+ * Finish count kpasswd operations, each started and finished in turn, with
+ * the given back-pressure.
+ */
+static void
+operations(kadm5_hook_modinfo *config, size_t count, bool busy)
+{
+    struct sync_limit_op op;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        sync_limit_start(config, SYNC_LIMIT_KPASSWD, &op);
+        sync_limit_finish(config, SYNC_LIMIT_KPASSWD, &op, busy);
+    }
+}
+
+
+int
+main(void)
+{
+    kadm5_hook_modinfo *config;
+    struct sync_limit_op first, second;
+    size_t i;
+
+    /* Define the plan. */
+    plan(12);
+
+    /* Without ad_adaptive_concurrency, the maximum is always used. */
+    config = bcalloc(1, sizeof(*config));
+    operations(config, 1, true);
+    is_int(MAX, sync_limit_window(config, SYNC_LIMIT_KPASSWD, MAX),
+           "Window is the maximum without adaptation");
+    ok(config->limits == NULL, "...and no state is kept");
+
+    /* Slow start grows the window by one per healthy operation. */
+    config->ad_adaptive_concurrency = true;
+    is_int(1, sync_limit_window(config, SYNC_LIMIT_KPASSWD, MAX),
+           "Window starts at one");
+    operations(config, 3, false);
+    is_int(4, sync_limit_window(config, SYNC_LIMIT_KPASSWD, MAX),
+           "...and grows by one per healthy operation");
+
+    /* Back-pressure halves it, once for operations started before. */
+    sync_limit_start(config, SYNC_LIMIT_KPASSWD, &first);
+    sync_limit_start(config, SYNC_LIMIT_KPASSWD, &second);
+    sync_limit_finish(config, SYNC_LIMIT_KPASSWD, &first, true);
+    is_int(2, sync_limit_window(config, SYNC_LIMIT_KPASSWD, MAX),
+           "Back-pressure halves the window");
+    sync_limit_finish(config, SYNC_LIMIT_KPASSWD, &second, true);
+    is_int(2, sync_limit_window(config, SYNC_LIMIT_KPASSWD, MAX),
+           "...but only once per overload");
+
+    /* After that, it grows by one per window of healthy operations. */
+    operations(config, 1, false);
+    is_int(2, sync_limit_window(config, SYNC_LIMIT_KPASSWD, MAX),
+           "Window grows slowly after back-pressure");
+    operations(config, 2, false);
+    is_int(3, sync_limit_window(config, SYNC_LIMIT_KPASSWD, MAX),
+           "...by one per window of operations");
+
+    /* It stays between one and the maximum. */
+    operations(config, 100, false);
+    is_int(MAX, sync_limit_window(config, SYNC_LIMIT_KPASSWD, MAX),
+           "Window is capped at the maximum");
+    operations(config, 10, true);
+    is_int(1, sync_limit_window(config, SYNC_LIMIT_KPASSWD, MAX),
+           "...and never goes below one");
+
+    /* Each kind of operation has its own window. */
+    operations(config, 5, false);
+    is_int(1, sync_limit_window(config, SYNC_LIMIT_LDAP, MAX),
+           "LDAP window is separate from the kpasswd one");
+
+    /* With ad_adaptive_slow, a slow operation counts as back-pressure. */
+    config->ad_adaptive_slow = 1;
+    for (i = 0; i < 3; i++) {
+        sync_limit_start(config, SYNC_LIMIT_LDAP, &first);
+        sync_limit_finish(config, SYNC_LIMIT_LDAP, &first, false);
+    }
+    sync_limit_start(config, SYNC_LIMIT_LDAP, &first);
+    first.start.tv_sec -= 1;
+    sync_limit_finish(config, SYNC_LIMIT_LDAP, &first, false);
+    is_int(2, sync_limit_window(config, SYNC_LIMIT_LDAP, MAX),
+           "Slow operation halves the window with ad_adaptive_slow");
+
+    /* Clean up. */
+    sync_limit_close(config);
+    free(config);
+    return 0;
+}
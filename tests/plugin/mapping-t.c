@@ -0,0 +1,158 @@
+/*
+ * Tests for the rules mapping principals to Active Directory in the
+ * krb5-sync plugin.
+ *
+ * Checks the principal, search base, and DN given by a rule, the escaping of
+ * values put into a DN, that instances without a rule keep the default
+ * mapping, and that invalid rules are rejected.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Compile the rules in the space-separated string into the configuration,
+ * replacing any current rules, and return the Kerberos status code.
+ */
+static krb5_error_code
+compile(kadm5_hook_modinfo *config, krb5_context ctx, const char *rules)
+{
+    sync_mapping_free(config->mapping);
+    config->mapping = NULL;
+    config->ad_mapping_rules =
+        sync_vector_split_multi(rules, " ", config->ad_mapping_rules);
+    if (config->ad_mapping_rules == NULL)
+        sysbail("cannot split rules");
+    return sync_mapping_compile(config, ctx);
+}
+
+
+/*
+ * Check that a rule is rejected with the given error message.
+ */
+static void
+is_rejected(kadm5_hook_modinfo *config, krb5_context ctx, const char *rule,
+            const char *expected, const char *description)
+{
+    krb5_error_code code;
+    const char *message;
+
+    code = compile(config, ctx, rule);
+    message = krb5_get_error_message(ctx, code);
+    ok(code != 0, "%s is rejected", description);
+    is_string(expected, message, "...with the right error");
+    krb5_free_error_message(ctx, message);
+    ok(config->mapping == NULL, "...and leaves no rules");
+}
+
+
+int
+main(void)
+{
+    kadm5_hook_modinfo *config;
+    krb5_context ctx;
+    krb5_principal princ, ad_principal;
+    struct sync_request request;
+    krb5_error_code code;
+    const char *name, *dn;
+
+    /* Define the plan. */
+    plan(20);
+
+    /* Obtain a Kerberos context and a minimal configuration. */
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    config = bcalloc(1, sizeof(*config));
+    config->ad_realm = bstrdup("AD.EXAMPLE.COM");
+    config->ad_realm_length = strlen(config->ad_realm);
+    code = compile(config, ctx,
+                   "admin:%n-adm:ou=Admins,dc=ad:cn=%n\\,adm,ou=Admins,dc=ad"
+                   " svc:svc/%n::cn=%i-%n%%,ou=Services,dc=ad"
+                   " lab::ou=Lab,dc=ad");
+    is_int(0, code, "Compiling the rules succeeds");
+
+    /* A rule with a principal, base, and DN. */
+    code = krb5_parse_name(ctx, "test/admin@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse test/admin@EXAMPLE.COM");
+    sync_request_init(&request, princ);
+    sync_request_ad_principal(config, ctx, &request, &ad_principal, &name);
+    is_string("test-adm@AD.EXAMPLE.COM", name, "Rule maps the principal");
+    is_string("ou=Admins,dc=ad", sync_mapping_base(config, ctx, &request),
+              "...and gives the search base");
+    sync_mapping_dn(config, ctx, &request, &dn);
+    is_string("cn=test\\,adm,ou=Admins,dc=ad", dn, "...and the DN");
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, princ);
+
+    /* Values put into a DN are escaped, and %% is a percent sign. */
+    code = krb5_parse_name(ctx, "a+b/svc@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse a+b/svc@EXAMPLE.COM");
+    sync_request_init(&request, princ);
+    sync_request_ad_principal(config, ctx, &request, &ad_principal, &name);
+    is_string("svc/a+b@AD.EXAMPLE.COM", name,
+              "Rule can map to a principal with an instance");
+    ok(sync_mapping_base(config, ctx, &request) == NULL,
+       "...and an empty base keeps the default");
+    sync_mapping_dn(config, ctx, &request, &dn);
+    is_string("cn=svc-a\\+b%,ou=Services,dc=ad", dn,
+              "...and the DN escapes values");
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, princ);
+
+    /* A rule with only a base keeps the default principal and DN. */
+    code = krb5_parse_name(ctx, "test/lab@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse test/lab@EXAMPLE.COM");
+    sync_request_init(&request, princ);
+    sync_request_ad_principal(config, ctx, &request, &ad_principal, &name);
+    is_string("test/lab@AD.EXAMPLE.COM", name,
+              "Empty principal keeps the default");
+    sync_mapping_dn(config, ctx, &request, &dn);
+    ok(dn == NULL, "...as does a missing DN");
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, princ);
+
+    /* An instance without a rule only has its realm changed. */
+    code = krb5_parse_name(ctx, "test/root@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse test/root@EXAMPLE.COM");
+    sync_request_init(&request, princ);
+    sync_request_ad_principal(config, ctx, &request, &ad_principal, &name);
+    is_string("test/root@AD.EXAMPLE.COM", name,
+              "Instance without a rule keeps the default");
+    ok(sync_mapping_base(config, ctx, &request) == NULL,
+       "...and has no search base");
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, princ);
+
+    /* Invalid rules. */
+    is_rejected(config, ctx, "admin:%n admin:%n-adm",
+                "more than one ad_mapping_rules entry for instance admin",
+                "Duplicate instance");
+    is_rejected(config, ctx, "admin:%x",
+                "invalid template in ad_mapping_rules entry admin:%x",
+                "Unknown template escape");
+    is_rejected(config, ctx, "admin:a/b/c",
+                "principal in ad_mapping_rules entry admin:a/b/c has more"
+                " than two components", "Principal with three components");
+
+    /* Clean up. */
+    sync_vector_free(config->ad_mapping_rules);
+    sync_mapping_free(config->mapping);
+    free(config->ad_realm);
+    free(config);
+    krb5_free_context(ctx);
+    return 0;
+}
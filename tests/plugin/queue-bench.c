@@ -0,0 +1,317 @@
+/*
+ * Benchmark of queue writes and conflict checks in the krb5-sync plugin.
+ *
+ * Not a test, since it reports timings rather than pass or fail.  For each
+ * queue size, it fills a fresh queue with that many changes for other users
+ * and measures the throughput and latency percentiles of conflict checks,
+ * with the directory cache warm and with it discarded before every check,
+ * and of queue writes by each number of concurrent writer processes.  Run
+ * it with make bench, which sets up the environment for the temporary
+ * directory, passing options in BENCH_FLAGS.
+ *
+ * Options:
+ *     -f <format>     queue_format to use (directory or journal)
+ *     -n <sizes>      comma-separated queue sizes (default 0,1000,10000)
+ *     -o <ops>        operations to time for each measurement (default 1000)
+ *     -s <shards>     queue_shards to use (default 0)
+ *     -w <writers>    comma-separated writer counts (default 1,4)
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/bench.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* Usage message. */
+static const char usage_message[] = "\
+Usage: queue-bench [-f <format>] [-n <sizes>] [-o <ops>] [-s <shards>]\n\
+                   [-w <writers>]\n";
+
+
+/*
+ * Write a change to the queue for the given user, returning its latency in
+ * microseconds.  Calls bail on failure.
+ */
+static double
+queue_one(kadm5_hook_modinfo *config, krb5_context ctx, const char *user)
+{
+    struct sync_request request;
+    krb5_principal princ;
+    struct timeval start;
+    krb5_error_code code;
+    double latency;
+
+    code = krb5_parse_name(ctx, user, &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal %s", user);
+    sync_request_init(&request, princ);
+    if (gettimeofday(&start, NULL) < 0)
+        sysbail("cannot get current time");
+    code = sync_queue_write(config, ctx, &request, "password", "password");
+    latency = bench_elapsed(&start);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot queue change for %s", user);
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, princ);
+    return latency;
+}
+
+
+/*
+ * Start over with an empty queue holding size changes for other users and
+ * a new plugin configuration.  Changes are added with sync_queue_block where
+ * that produces the same queue files, which is much faster since it doesn't
+ * flush them to disk, and queued normally otherwise.
+ */
+static kadm5_hook_modinfo *
+setup(krb5_context ctx, unsigned long size)
+{
+    kadm5_hook_modinfo *config;
+    krb5_error_code code;
+    unsigned long i;
+    char *user;
+
+    if (system("rm -rf queue") != 0)
+        bail("cannot remove queue");
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+    code = sync_init(ctx, &config);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize plugin");
+    for (i = 0; i < size; i++) {
+        if (config->journal == NULL && config->queue_shards == 0) {
+            basprintf(&user, "fill%lu", i);
+            sync_queue_block("queue", user, "password");
+        } else {
+            basprintf(&user, "fill%lu@EXAMPLE.COM", i);
+            queue_one(config, ctx, user);
+        }
+        free(user);
+    }
+    return config;
+}
+
+
+/*
+ * Time conflict checks for users with nothing queued, which have to look at
+ * the whole queue.  If cold is true, discard the cached directory contents
+ * before each check.
+ */
+static void
+bench_conflict(kadm5_hook_modinfo *config, krb5_context ctx,
+               unsigned long size, unsigned long ops, bool cold)
+{
+    struct sync_request request;
+    krb5_principal princ;
+    struct timeval start, begin;
+    krb5_error_code code;
+    double *latency;
+    double total = 0;
+    bool conflict;
+    unsigned long i;
+
+    code = krb5_parse_name(ctx, "check@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal check@EXAMPLE.COM");
+    latency = bcalloc(ops, sizeof(double));
+    if (gettimeofday(&begin, NULL) < 0)
+        sysbail("cannot get current time");
+    for (i = 0; i < ops; i++) {
+        if (cold)
+            sync_queue_close(config);
+        sync_request_init(&request, princ);
+        if (gettimeofday(&start, NULL) < 0)
+            sysbail("cannot get current time");
+        code = sync_queue_conflict(config, ctx, &request, "password",
+                                   &conflict);
+        latency[i] = bench_elapsed(&start);
+        if (code != 0)
+            bail_krb5(ctx, code, "cannot check for conflicts");
+        sync_request_free(ctx, &request);
+    }
+    total = bench_elapsed(&begin);
+    bench_report(cold ? "conflict-cold" : "conflict", size, 1, latency, ops,
+                 total);
+    free(latency);
+    krb5_free_principal(ctx, princ);
+}
+
+
+/*
+ * Time queue writes by the given number of concurrent writer processes,
+ * which split ops between them.  Each child sends its latencies back through
+ * a pipe once it is done.
+ */
+static void
+bench_write(kadm5_hook_modinfo *config, krb5_context ctx, unsigned long size,
+            unsigned long writers, unsigned long ops)
+{
+    struct timeval begin;
+    double *latency;
+    double total;
+    unsigned long each, i, j;
+    size_t want;
+    ssize_t status;
+    int (*fds)[2];
+    pid_t pid;
+    char *user;
+
+    each = ops / writers;
+    if (each == 0)
+        each = 1;
+    latency = bcalloc(each * writers, sizeof(double));
+    fds = bcalloc(writers, sizeof(*fds));
+    if (gettimeofday(&begin, NULL) < 0)
+        sysbail("cannot get current time");
+    for (i = 0; i < writers; i++) {
+        if (pipe(fds[i]) < 0)
+            sysbail("cannot create pipe");
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0)
+            sysbail("cannot fork");
+        if (pid == 0) {
+            close(fds[i][0]);
+            for (j = 0; j < each; j++) {
+                basprintf(&user, "bench%lu.%lu@EXAMPLE.COM", i, j);
+                latency[j] = queue_one(config, ctx, user);
+                free(user);
+            }
+            want = each * sizeof(double);
+            if (write(fds[i][1], latency, want) != (ssize_t) want)
+                _exit(1);
+            _exit(0);
+        }
+        close(fds[i][1]);
+    }
+
+    /* Collect the latencies and wait for the children. */
+    for (i = 0; i < writers; i++) {
+        want = each * sizeof(double);
+        for (j = 0; j < want; j += (size_t) status) {
+            status = read(fds[i][0], (char *) &latency[i * each] + j,
+                          want - j);
+            if (status <= 0)
+                bail("writer %lu failed", i);
+        }
+        close(fds[i][0]);
+    }
+    while (wait(NULL) > 0)
+        ;
+    total = bench_elapsed(&begin);
+    bench_report("write", size, writers, latency, each * writers, total);
+    free(fds);
+    free(latency);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    const char *format = "directory";
+    unsigned long *sizes, *writers;
+    size_t nsizes, nwriters, i, j;
+    unsigned long ops = 1000;
+    unsigned long shards = 0;
+    char *tmpdir, *krb5_config;
+    kadm5_hook_modinfo *config;
+    krb5_context ctx;
+    krb5_error_code code;
+    FILE *file;
+    int option;
+
+    /* Parse the options. */
+    nsizes = bench_parse_list("0,1000,10000", &sizes);
+    nwriters = bench_parse_list("1,4", &writers);
+    while ((option = getopt(argc, argv, "f:n:o:s:w:")) != EOF) {
+        switch (option) {
+        case 'f':
+            format = optarg;
+            break;
+        case 'n':
+            free(sizes);
+            nsizes = bench_parse_list(optarg, &sizes);
+            break;
+        case 'o':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            shards = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            free(writers);
+            nwriters = bench_parse_list(optarg, &writers);
+            break;
+        default:
+            fprintf(stderr, "%s", usage_message);
+            exit(1);
+        }
+    }
+    if (ops == 0)
+        bail("number of operations must be positive");
+    for (i = 0; i < nwriters; i++)
+        if (writers[i] == 0)
+            bail("number of writers must be positive");
+
+    /* Work in a temporary directory with a krb5.conf for the options. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    file = fopen("krb5.conf", "w");
+    if (file == NULL)
+        sysbail("cannot create krb5.conf");
+    fprintf(file, "[appdefaults]\n    krb5-sync = {\n");
+    fprintf(file, "        ad_realm = AD.EXAMPLE.COM\n");
+    fprintf(file, "        queue_dir = queue\n");
+    fprintf(file, "        queue_format = %s\n", format);
+    fprintf(file, "        queue_shards = %lu\n", shards);
+    fprintf(file, "        syslog = false\n    }\n\n");
+    fprintf(file, "[libdefaults]\n    default_realm = EXAMPLE.COM\n");
+    if (fclose(file) != 0)
+        sysbail("cannot write krb5.conf");
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot create Kerberos context");
+
+    /* Run the benchmarks. */
+    bench_header();
+    for (i = 0; i < nsizes; i++) {
+        config = setup(ctx, sizes[i]);
+        bench_conflict(config, ctx, sizes[i], ops, false);
+        bench_conflict(config, ctx, sizes[i], ops, true);
+        sync_close(ctx, config);
+        for (j = 0; j < nwriters; j++) {
+            config = setup(ctx, sizes[i]);
+            bench_write(config, ctx, sizes[i], writers[j], ops);
+            sync_close(ctx, config);
+        }
+    }
+
+    /* Clean up. */
+    if (system("rm -rf queue krb5.conf") != 0)
+        bail("cannot remove queue");
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    free(krb5_config);
+    test_tmpdir_free(tmpdir);
+    free(sizes);
+    free(writers);
+    return 0;
+}
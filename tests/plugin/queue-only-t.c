@@ -17,6 +17,7 @@
 
 #include <errno.h>
 #include <sys/stat.h>
+#include <utime.h>
 
 #include <plugin/internal.h>
 #include <tests/tap/basic.h>
@@ -31,13 +32,21 @@ main(void)
 {
     char *path, *tmpdir, *make_conf, *krb5_config;
     const char *setup_argv[6];
+    char buffer[BUFSIZ];
     krb5_context ctx;
-    krb5_principal princ;
+    krb5_principal princ, renamed;
+    struct sync_request request;
     krb5_error_code code;
     kadm5_hook_modinfo *config;
+    struct vector *files;
+    struct utimbuf times;
+    FILE *file;
+    bool conflict, queued;
+    size_t i;
+    int line;
 
     /* Define the plan. */
-    plan(23);
+    plan(61);
 
     /* Set up a temporary directory and queue relative to it. */
     path = test_file_path("data/krb5.conf");
@@ -81,6 +90,7 @@ main(void)
     code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
     if (code != 0)
         bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    sync_request_init(&request, princ);
     code = sync_chpass(config, ctx, princ, "foobar");
     is_int(0, code, "sync_chpass succeeds");
     sync_queue_check_password("queue", "test", "foobar");
@@ -95,7 +105,138 @@ main(void)
     is_int(0, code, "sync_status disable succeeds");
     sync_queue_check_enable("queue", "test", false);
 
+    /*
+     * With queue_group_commit, the change should be queued the same way, and
+     * the flush should be counted in the commit file.
+     */
+    config->queue_group_commit = true;
+    code = sync_chpass(config, ctx, princ, "foobar");
+    is_int(0, code, "sync_chpass with group commit succeeds");
+    sync_queue_check_password("queue", "test", "foobar");
+    file = fopen("queue/.commit", "r");
+    if (file == NULL || fgets(buffer, sizeof(buffer), file) == NULL)
+        buffer[0] = '\0';
+    if (file != NULL)
+        fclose(file);
+    is_string("1\n", buffer, "...and the flush was counted");
+
+    /*
+     * Changes queued in quick succession get increasing sequence numbers, so
+     * they are listed in the order in which they were queued.
+     */
+    sync_chpass(config, ctx, princ, "first");
+    sync_chpass(config, ctx, princ, "second");
+    code = sync_queue_list(config, ctx, &files);
+    is_int(0, code, "Listing the queue succeeds");
+    if (files->count != 2)
+        bail("wrong number of files in queue: %lu",
+             (unsigned long) files->count);
+    for (i = 0; i < files->count; i++) {
+        basprintf(&path, "queue/%s", files->strings[i]);
+        file = fopen(path, "r");
+        if (file == NULL)
+            sysbail("cannot open %s", path);
+        for (line = 0; line < 4; line++)
+            if (fgets(buffer, sizeof(buffer), file) == NULL)
+                buffer[0] = '\0';
+        fclose(file);
+        is_string(i == 0 ? "first\n" : "second\n", buffer,
+                  "...and change %lu is in order", (unsigned long) i);
+        unlink(path);
+        free(path);
+    }
+    sync_vector_free(files);
+
+    /*
+     * Conflict checks cache the contents of the queue directory until its
+     * modification time changes.  Backdate the directory so that the cache
+     * is trusted, and then add a queue file behind its back without
+     * changing the modification time to check that the cache is used.
+     */
+    times.actime = time(NULL) - 3600;
+    times.modtime = times.actime;
+    if (utime("queue", &times) < 0)
+        sysbail("cannot set times of queue");
+    code = sync_queue_conflict(config, ctx, &request, "password", &conflict);
+    is_int(0, code, "Conflict check succeeds");
+    ok(!conflict, "...and finds no conflict");
+    file = fopen("queue/test-ad-password-19700101T000000Z-0000000000", "w");
+    if (file == NULL)
+        sysbail("cannot create queue file");
+    fprintf(file, "test\nad\npassword\nfoobar\n");
+    fclose(file);
+    if (utime("queue", &times) < 0)
+        sysbail("cannot set times of queue");
+    code = sync_queue_conflict(config, ctx, &request, "password", &conflict);
+    ok(code == 0 && !conflict, "...and uses the cache if nothing changed");
+    times.modtime++;
+    if (utime("queue", &times) < 0)
+        sysbail("cannot set times of queue");
+    code = sync_queue_conflict(config, ctx, &request, "password", &conflict);
+    ok(code == 0 && conflict, "...and sees the change once it has");
+    code = sync_queue_conflict(config, ctx, &request, "enable", &conflict);
+    ok(code == 0 && !conflict, "...but not for other operations");
+
+    /* Checking and queuing at once only queues a conflicting change. */
+    code = sync_queue_conflict_write(config, ctx, &request, "enable", NULL,
+                                     &queued);
+    ok(code == 0 && !queued, "Change without a conflict isn't queued");
+    code = sync_queue_conflict_write(config, ctx, &request, "password",
+                                     "foobar", &queued);
+    ok(code == 0 && queued, "...but one with a conflict is");
+    code = sync_queue_list(config, ctx, &files);
+    if (code != 0)
+        bail("cannot list queue");
+    is_int(2, files->count, "...in the same queue");
+    for (i = 0; i < files->count; i++) {
+        basprintf(&path, "queue/%s", files->strings[i]);
+        unlink(path);
+        free(path);
+    }
+    sync_vector_free(files);
+    code = sync_queue_conflict(config, ctx, &request, "password", &conflict);
+    ok(code == 0 && !conflict, "...and no conflict once it's removed");
+
+    /*
+     * When a principal is renamed, its queued changes move to the new name,
+     * unless that's an instance that isn't synchronized, in which case they
+     * are removed, as they are when the principal is deleted.
+     */
+    code = krb5_parse_name(ctx, "other@EXAMPLE.COM", &renamed);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal other@EXAMPLE.COM");
+    sync_chpass(config, ctx, princ, "foobar");
+    sync_status(config, ctx, princ, false);
+    code = sync_rename(config, ctx, princ, renamed);
+    is_int(0, code, "sync_rename succeeds");
+    sync_queue_check_password("queue", "other", "foobar");
+    sync_queue_check_enable("queue", "other", false);
+    krb5_free_principal(ctx, renamed);
+    code = krb5_parse_name(ctx, "test/admin@EXAMPLE.COM", &renamed);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test/admin@EXAMPLE.COM");
+    sync_chpass(config, ctx, princ, "foobar");
+    code = sync_rename(config, ctx, princ, renamed);
+    is_int(0, code, "sync_rename to an unsynchronized instance succeeds");
+    code = sync_queue_list(config, ctx, &files);
+    if (code != 0)
+        bail("cannot list queue");
+    is_int(0, files->count, "...and drops the queued change");
+    sync_vector_free(files);
+    krb5_free_principal(ctx, renamed);
+    sync_chpass(config, ctx, princ, "foobar");
+    sync_status(config, ctx, princ, true);
+    code = sync_remove(config, ctx, princ);
+    is_int(0, code, "sync_remove succeeds");
+    code = sync_queue_list(config, ctx, &files);
+    if (code != 0)
+        bail("cannot list queue");
+    is_int(0, files->count, "...and removes the queued changes");
+    sync_vector_free(files);
+
     /* Unwind the queue and be sure all the right files exist. */
+    ok(unlink("queue/.commit") == 0, "Commit file still exists");
+    ok(unlink("queue/.sequence") == 0, "Sequence file still exists");
     ok(unlink("queue/.lock") == 0, "Lock file still exists");
     ok(rmdir("queue") == 0, "No other files in queue directory");
 
@@ -111,6 +252,7 @@ main(void)
     test_tmpdir_free(tmpdir);
 
     /* Clean up. */
+    sync_request_free(ctx, &request);
     krb5_free_principal(ctx, princ);
     krb5_free_context(ctx);
     putenv((char *) "KRB5_CONFIG=");
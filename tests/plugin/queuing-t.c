@@ -20,6 +20,7 @@
 
 #include <errno.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include <plugin/internal.h>
 #include <tests/tap/basic.h>
@@ -36,11 +37,12 @@ main(void)
     krb5_principal princ;
     krb5_error_code code;
     kadm5_hook_modinfo *data;
+    struct vector *files;
     const char *message;
     char *wanted;
 
     /* Define the plan. */
-    plan(47);
+    plan(95);
 
     /* Set up a temporary directory and queue relative to it. */
     tmpdir = test_tmpdir();
@@ -65,6 +67,12 @@ main(void)
     /* Test init. */
     is_int(0, sync_init(ctx, &data), "sync_init succeeds");
     ok(data != NULL, "...and data is non-NULL");
+    ok(data->ad_client != NULL, "...and ad_principal is parsed");
+    is_int(14, data->ad_realm_length, "...and the ad_realm length is set");
+    ok(data->ad_ldap_uris != NULL && data->ad_ldap_uris->count == 1,
+       "...and there is one LDAP URI");
+    is_string("ldap://ad.example.com", data->ad_ldap_uris->strings[0],
+              "...for ad_admin_server");
 
     /* Block processing for our test user and then test password change. */
     code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
@@ -125,7 +133,66 @@ main(void)
     code = sync_status(data, ctx, princ, true);
     is_int(0, code, "sync_status enable of admin instance succeeds");
 
+    /*
+     * While the circuit breaker is open after repeated failures, changes
+     * should be queued without trying Active Directory.
+     */
+    krb5_free_principal(ctx, princ);
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    data->ad_failures = (unsigned long) data->ad_breaker_threshold;
+    data->ad_breaker_until = time(NULL) + 60;
+    code = sync_chpass(data, ctx, princ, "foobar");
+    is_int(0, code, "sync_chpass with the breaker open succeeds");
+    sync_queue_check_password("queue", "test", "foobar");
+    code = sync_status(data, ctx, princ, false);
+    is_int(0, code, "sync_status with the breaker open succeeds");
+    sync_queue_check_enable("queue", "test", false);
+    is_int(data->ad_breaker_threshold, data->ad_failures,
+           "...and Active Directory was not tried");
+
+    /*
+     * With queue limits, the queue depth is kept in .depth.  Above the soft
+     * limit, superseded changes are removed even without queue_coalesce.
+     * Above the hard limit, changes are refused unless queue_full_policy is
+     * drop-superseded and they supersede a queued change.  The depth isn't
+     * lowered by changes removed outside the plugin until the queue is
+     * counted again.
+     */
+    data->queue_soft_limit = 1;
+    data->queue_hard_limit = 2;
+    code = sync_chpass(data, ctx, princ, "first");
+    is_int(0, code, "sync_chpass below the soft limit succeeds");
+    code = sync_chpass(data, ctx, princ, "second");
+    is_int(0, code, "sync_chpass above the soft limit succeeds");
+    sync_queue_check_password("queue", "test", "second");
+    if (sync_queue_list(data, ctx, &files) != 0)
+        bail("cannot list queue");
+    is_int(0, files->count, "...and the first change was superseded");
+    sync_vector_free(files);
+    data->queue_hard_limit = 1;
+    code = sync_status(data, ctx, princ, false);
+    ok(code != 0, "sync_status above the hard limit fails");
+    data->queue_full_policy = bstrdup("drop-superseded");
+    code = sync_status(data, ctx, princ, false);
+    ok(code != 0, "...and with drop-superseded if nothing is superseded");
+    sync_queue_block("queue", "test", "password");
+    code = sync_chpass(data, ctx, princ, "third");
+    is_int(0, code, "...but a superseding change is queued");
+    sync_queue_check_password("queue", "test", "third");
+    ok(access("queue/test-ad-password-19700101T000000Z", F_OK) < 0,
+       "...and the superseded change was removed");
+    is_int(0, sync_queue_recount(data, ctx), "Counting the queue again");
+    code = sync_status(data, ctx, princ, false);
+    is_int(0, code, "...lets changes be queued again");
+    sync_queue_check_enable("queue", "test", false);
+    ok(unlink("queue/.depth") == 0, "Depth file exists");
+    data->queue_soft_limit = 0;
+    data->queue_hard_limit = 0;
+
     /* Unwind the queue and be sure all the right files exist. */
+    ok(unlink("queue/.sequence") == 0, "Sequence file still exists");
     ok(unlink("queue/.lock") == 0, "Lock file still exists");
     ok(rmdir("queue") == 0, "No other files in queue directory");
 
@@ -134,8 +201,7 @@ main(void)
     code = krb5_parse_name(ctx, "test/root@EXAMPLE.COM", &princ);
     if (code != 0)
         bail_krb5(ctx, code, "cannot parse principal test/root@EXAMPLE.COM");
-    basprintf(&wanted, "cannot open lock file queue/.lock: %s",
-              strerror(ENOENT));
+    basprintf(&wanted, "cannot stat queue: %s", strerror(ENOENT));
     code = sync_chpass(data, ctx, princ, "foobar");
     is_int(ENOENT, code, "sync_chpass fails with no queue");
     message = krb5_get_error_message(ctx, code);
@@ -147,6 +213,18 @@ main(void)
     is_string(wanted, message, "...with correct error message");
     krb5_free_error_message(ctx, message);
 
+    /*
+     * A status that was the same before the modification, as recorded by
+     * sync_status_precommit, isn't pushed or queued, so that succeeds.
+     */
+    code = krb5_copy_principal(ctx, princ, &data->status_principal);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot copy principal");
+    data->status_disabled = true;
+    code = sync_status(data, ctx, princ, false);
+    is_int(0, code, "sync_status of unchanged status does nothing");
+    ok(data->status_principal == NULL, "...and forgets the old status");
+
     /* Shut down the plugin. */
     sync_close(ctx, data);
     free(wanted);
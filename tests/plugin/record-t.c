@@ -0,0 +1,107 @@
+/*
+ * Tests for reading queue files in the krb5-sync plugin.
+ *
+ * Checks that sync_queue_read_record splits a queue file into its fields,
+ * including any trace line, accepts lines of any length, and rejects
+ * incomplete or invalid files.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Write the given contents to a queue file at path.  Calls bail on failure.
+ */
+static void
+write_file(const char *path, const char *contents)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fputs(contents, file) == EOF || fclose(file) == EOF)
+        sysbail("cannot write %s", path);
+}
+
+
+int
+main(void)
+{
+    struct sync_queue_record record;
+    krb5_context ctx;
+    char *tmpdir, *path, *contents, *password;
+
+    /* Define the plan. */
+    plan(17);
+
+    /* Set up a Kerberos context and a file in the temporary directory. */
+    if (krb5_init_context(&ctx) != 0)
+        bail("cannot create Kerberos context");
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/test-ad-password-20100101T000000Z-0000000001",
+              tmpdir);
+
+    /* A password change. */
+    write_file(path, "test\nad\npassword\nfoobar\n");
+    is_int(0, sync_queue_read_record(ctx, path, &record), "Read password");
+    is_string("test", record.user, "...user");
+    is_string("ad", record.domain, "...domain");
+    is_string("password", record.operation, "...operation");
+    is_string("foobar", record.password, "...and password");
+    sync_queue_record_free(&record);
+    ok(record.data == NULL, "Freeing clears the record");
+
+    /* A status change has no password. */
+    write_file(path, "test\nad\ndisable\n");
+    is_int(0, sync_queue_read_record(ctx, path, &record), "Read disable");
+    is_string("disable", record.operation, "...operation");
+    is_string(NULL, record.password, "...and no password");
+    is_string(NULL, record.trace, "...or trace line");
+    sync_queue_record_free(&record);
+
+    /* A trace line follows the other fields. */
+    write_file(path, "test\nad\npassword\nfoobar\ntrace 1-2-3 1.000000"
+               " 2.000000\n");
+    is_int(0, sync_queue_read_record(ctx, path, &record), "Read traced");
+    is_string("trace 1-2-3 1.000000 2.000000", record.trace,
+              "...with its trace line");
+    sync_queue_record_free(&record);
+
+    /* Lines may be longer than any stdio buffer. */
+    password = bcalloc(1, BUFSIZ * 4 + 1);
+    memset(password, 'a', BUFSIZ * 4);
+    basprintf(&contents, "test\nad\npassword\n%s\n", password);
+    write_file(path, contents);
+    is_int(0, sync_queue_read_record(ctx, path, &record), "Read long line");
+    is_string(password, record.password, "...with the whole password");
+    sync_queue_record_free(&record);
+    free(contents);
+    free(password);
+
+    /* Incomplete and invalid files are rejected. */
+    write_file(path, "test\nad\npassword\nfoobar");
+    ok(sync_queue_read_record(ctx, path, &record) != 0,
+       "Password without newline is rejected");
+    write_file(path, "test\nad\n");
+    ok(sync_queue_read_record(ctx, path, &record) != 0,
+       "Missing operation is rejected");
+    write_file(path, "test\n\nenable\n");
+    ok(sync_queue_read_record(ctx, path, &record) != 0,
+       "Missing domain is rejected");
+
+    /* Clean up. */
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    krb5_free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Tests for reloading the configuration of the krb5-sync plugin.
+ *
+ * Sets config_reload, rewrites krb5.conf between changes, and checks that
+ * the new settings are picked up, that caches survive unless a setting they
+ * depend on changed, and that a broken configuration leaves the old one in
+ * place.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Write a new krb5.conf in tmpdir from the test template with config_reload
+ * set and the given extra key and value, if key isn't NULL.
+ */
+static void
+write_config(const char *tmpdir, const char *key, const char *value)
+{
+    char *make_conf, *path;
+    const char *setup_argv[9];
+
+    path = test_file_path("data/krb5.conf");
+    if (path == NULL)
+        bail("cannot find data/krb5.conf in the test suite");
+    make_conf = test_file_path("data/make-krb5-conf");
+    if (make_conf == NULL)
+        bail("cannot find data/make-krb5-conf in the test suite");
+    setup_argv[0] = make_conf;
+    setup_argv[1] = path;
+    setup_argv[2] = tmpdir;
+    setup_argv[3] = "config_reload";
+    setup_argv[4] = "true";
+    setup_argv[5] = key;
+    setup_argv[6] = value;
+    setup_argv[7] = NULL;
+    run_setup(setup_argv);
+    test_file_path_free(make_conf);
+    test_file_path_free(path);
+}
+
+
+int
+main(void)
+{
+    char *tmpdir, *krb5_config, *path;
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct sync_request request;
+
+    /* Define the plan. */
+    plan(12);
+    sync_request_init(&request, NULL);
+
+    /* Set up a krb5.conf with config_reload and point KRB5_CONFIG at it. */
+    tmpdir = test_tmpdir();
+    write_config(tmpdir, NULL, NULL);
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /*
+     * Use a principal with an instance that isn't allowed, so that the
+     * changes are ignored after the configuration is checked.
+     */
+    code = krb5_parse_name(ctx, "test/admin@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test/admin@EXAMPLE.COM");
+
+    /* Initialize the plugin and put something in the DN cache. */
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ok(config->reload != NULL, "...and watches krb5.conf");
+    ok(!config->queue_coalesce, "...and queue_coalesce is not set");
+    sync_dncache_store(config, "test@AD.EXAMPLE.COM", "cn=test,dc=example");
+
+    /* Nothing changes if krb5.conf hasn't changed. */
+    is_int(0, sync_chpass(config, ctx, princ, "foobar"),
+           "sync_chpass succeeds");
+    ok(!config->queue_coalesce, "...and the configuration is unchanged");
+
+    /* A new setting is picked up on the next change and the cache is kept. */
+    write_config(tmpdir, "queue_coalesce", "true");
+    is_int(0, sync_chpass(config, ctx, princ, "foobar"),
+           "sync_chpass after changing krb5.conf succeeds");
+    ok(config->queue_coalesce, "...and queue_coalesce is now set");
+    is_string("cn=test,dc=example",
+              sync_dncache_lookup(config, &request, "test@AD.EXAMPLE.COM"),
+              "...and the DN cache was kept");
+
+    /* Changing a setting the DN cache depends on discards it. */
+    write_config(tmpdir, "ad_dn_cache_size", "10");
+    is_int(0, sync_status(config, ctx, princ, false),
+           "sync_status after changing krb5.conf succeeds");
+    is_string(NULL,
+              sync_dncache_lookup(config, &request, "test@AD.EXAMPLE.COM"),
+              "...and the DN cache was discarded");
+
+    /* A broken configuration is ignored. */
+    write_config(tmpdir, "queue_shards", "1000");
+    sync_chpass(config, ctx, princ, "foobar");
+    is_int(0, config->queue_shards, "Broken configuration is not used");
+    is_int(10, config->ad_dn_cache_size, "...and the old one is kept");
+
+    /* Clean up. */
+    sync_close(ctx, config);
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    krb5_free_principal(ctx, princ);
+    sync_request_free(ctx, &request);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Tests for the forms of the principal kept for a change in the krb5-sync
+ * plugin.
+ *
+ * Checks each form of the principal of a request, including the conversion
+ * to the Active Directory principal, that each is computed only once, the
+ * trace of a request and its trace line, and the temporary strings kept in
+ * a request.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+
+
+int
+main(void)
+{
+    kadm5_hook_modinfo *config;
+    krb5_context ctx;
+    krb5_principal princ, ad_principal, again;
+    struct sync_request request, copy;
+    krb5_error_code code;
+    const char *name, *second, *line;
+    char *string, *big, *long_string;
+
+    /* Define the plan. */
+    plan(23);
+
+    /* Obtain a Kerberos context and a minimal configuration. */
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+    config = bcalloc(1, sizeof(*config));
+    config->ad_realm = bstrdup("AD.EXAMPLE.COM");
+    config->ad_realm_length = strlen(config->ad_realm);
+    config->ad_base_instance = bstrdup("windows");
+
+    /* The local forms of a principal with an instance. */
+    code = krb5_parse_name(ctx, "test/admin@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test/admin@EXAMPLE.COM");
+    sync_request_init(&request, princ);
+    is_int(0, sync_request_name(ctx, &request, &name), "Name succeeds");
+    is_string("test/admin@EXAMPLE.COM", name, "...and is the full name");
+    sync_request_name(ctx, &request, &second);
+    ok(name == second, "...and is only computed once");
+    sync_request_user(ctx, &request, &name);
+    is_string("test/admin", name, "User is the name without the realm");
+    sync_request_queue_user(ctx, &request, &name);
+    is_string("test.admin", name, "Queue user has no slashes");
+    sync_request_user(ctx, &request, &name);
+    is_string("test/admin", name, "...and leaves the user alone");
+
+    /* The AD principal only changes the realm. */
+    code = sync_request_ad_principal(config, ctx, &request, &ad_principal,
+                                     &name);
+    is_int(0, code, "AD principal succeeds");
+    is_string("test/admin@AD.EXAMPLE.COM", name, "...and changes the realm");
+    sync_request_ad_principal(config, ctx, &request, &again, NULL);
+    ok(ad_principal == again, "...and is only computed once");
+    sync_request_free(ctx, &request);
+    ok(request.principal == NULL, "Freeing clears the request");
+    krb5_free_principal(ctx, princ);
+
+    /* An ad_base_instance principal maps to the base name. */
+    code = krb5_parse_name(ctx, "test/windows@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse test/windows@EXAMPLE.COM");
+    sync_request_init(&request, princ);
+    code = sync_request_ad_principal(config, ctx, &request, &ad_principal,
+                                     &name);
+    is_int(0, code, "AD principal for ad_base_instance succeeds");
+    is_string("test@AD.EXAMPLE.COM", name, "...and drops the instance");
+    sync_request_free(ctx, &request);
+
+    /* A traced request carries its ID and times through its trace line. */
+    sync_request_init(&request, princ);
+    ok(sync_request_trace_line(&request) == NULL,
+       "Untraced request has no trace line");
+    sync_request_trace(&request, NULL);
+    ok(request.trace[0] != '\0' && timerisset(&request.entered),
+       "Tracing sets an ID and the time of the hook");
+    line = sync_request_trace_line(&request);
+    ok(line != NULL && strncmp(line, "trace ", 6) == 0,
+       "...and gives a trace line");
+    sync_request_init(&copy, princ);
+    sync_request_trace_read(&copy, line);
+    is_string(request.trace, copy.trace, "Reading it restores the ID");
+    ok(timercmp(&request.entered, &copy.entered, ==)
+       && timercmp(&request.queued, &copy.queued, ==)
+       && timerisset(&copy.picked),
+       "...and the times, stamping it as picked up");
+    sync_request_free(ctx, &copy);
+    sync_request_init(&copy, princ);
+    sync_request_trace_read(&copy, "trace bogus");
+    ok(copy.trace[0] == '\0', "...and ignores a bad trace line");
+    sync_request_free(ctx, &copy);
+    sync_request_free(ctx, &request);
+
+    /* Short temporary strings go in the buffer of the request. */
+    sync_request_init(&request, princ);
+    string = sync_request_printf(&request, "%s-%d", "secret", 42);
+    is_string("secret-42", string, "Temporary string is formatted");
+    ok(string >= request.buffer
+       && string < request.buffer + sizeof(request.buffer),
+       "...and is in the request buffer");
+
+    /* Strings that don't fit are allocated separately. */
+    long_string = bcalloc(1, SYNC_REQUEST_BUFFER + 1);
+    memset(long_string, 'x', SYNC_REQUEST_BUFFER);
+    big = sync_request_printf(&request, "%s", long_string);
+    ok(big != NULL && strcmp(big, long_string) == 0,
+       "Long temporary string is formatted");
+    ok(request.blocks != NULL, "...and is allocated separately");
+    free(long_string);
+
+    /* Freeing the request clears the buffer. */
+    sync_request_free(ctx, &request);
+    ok(strstr(request.buffer, "secret") == NULL,
+       "Freeing clears the temporary strings");
+    krb5_free_principal(ctx, princ);
+
+    /* Clean up. */
+    free(config->ad_base_instance);
+    free(config->ad_realm);
+    free(config);
+    krb5_free_context(ctx);
+    return 0;
+}
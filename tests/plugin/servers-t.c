@@ -0,0 +1,148 @@
+/*
+ * Tests for the Active Directory server health tracking in the krb5-sync
+ * plugin.
+ *
+ * Checks the choice of LDAP server as servers fail and report their latency,
+ * that password changes back off after Active Directory is unreachable, and
+ * the deadline for a change from ad_timeout, without needing an Active
+ * Directory server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+
+
+int
+main(void)
+{
+    kadm5_hook_modinfo *config;
+    krb5_context ctx;
+    krb5_error_code code;
+    const char *message;
+    size_t server;
+    bool found;
+    struct timeval left;
+
+    /* Define the plan. */
+    plan(25);
+
+    /* Obtain a Kerberos context. */
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* With no servers configured, picking one is a configuration error. */
+    config = bcalloc(1, sizeof(*config));
+    config->ad_realm = bstrdup("AD.EXAMPLE.COM");
+    code = sync_server_pick(config, ctx, &server, &found);
+    ok(code != 0, "Picking a server with none configured fails");
+
+    /* With only ad_admin_server, that is the server. */
+    config->ad_admin_server = bstrdup("dc.ad.example.com");
+    code = sync_server_pick(config, ctx, &server, &found);
+    ok(code == 0 && found, "Picking ad_admin_server succeeds");
+    is_string("dc.ad.example.com", sync_server_name(config, server),
+              "...and returns its name");
+
+    /* ad_ldap_servers overrides it, and the first server is used first. */
+    config->ad_ldap_servers = sync_vector_new();
+    sync_vector_add(config->ad_ldap_servers, "dc1.ad.example.com");
+    sync_vector_add(config->ad_ldap_servers, "dc2.ad.example.com");
+    sync_vector_add(config->ad_ldap_servers, "dc3.ad.example.com");
+    code = sync_server_pick(config, ctx, &server, &found);
+    ok(code == 0 && found, "Picking from ad_ldap_servers succeeds");
+    is_string("dc1.ad.example.com", sync_server_name(config, server),
+              "...and returns the first one");
+
+    /* A server that works stays in use. */
+    sync_server_report(config, 0, true, 200);
+    sync_server_pick(config, ctx, &server, &found);
+    is_int(0, server, "Working server is still used");
+
+    /* A failed server is skipped in favor of the next one. */
+    sync_server_report(config, 0, false, 0);
+    sync_server_pick(config, ctx, &server, &found);
+    is_int(1, server, "Failed server is skipped");
+
+    /* Among working servers, the fastest is used. */
+    sync_server_report(config, 1, true, 100);
+    sync_server_report(config, 2, true, 40);
+    sync_server_pick(config, ctx, &server, &found);
+    is_int(2, server, "Fastest server is used");
+
+    /* Latency is smoothed, so one slow connection doesn't change that. */
+    sync_server_report(config, 2, true, 160);
+    sync_server_pick(config, ctx, &server, &found);
+    is_int(2, server, "...even after one slower connection");
+    sync_server_report(config, 2, true, 400);
+    sync_server_pick(config, ctx, &server, &found);
+    is_int(1, server, "...but not after it stays slow");
+
+    /* If all servers have failed recently, none is found. */
+    sync_server_report(config, 1, false, 0);
+    sync_server_report(config, 2, false, 0);
+    code = sync_server_pick(config, ctx, &server, &found);
+    ok(code == 0 && !found, "No server if all have failed");
+
+    /* Password changes back off only if AD couldn't be reached. */
+    is_int(0, sync_kpasswd_check(config, ctx), "Password changes allowed");
+    sync_kpasswd_report(config, EINVAL);
+    is_int(0, sync_kpasswd_check(config, ctx),
+           "...after a failure from Active Directory");
+    sync_kpasswd_report(config, KRB5_KDC_UNREACH);
+    code = sync_kpasswd_check(config, ctx);
+    ok(code != 0, "...but not after it was unreachable");
+    message = krb5_get_error_message(ctx, code);
+    ok(strncmp(message, "password changes in AD.EXAMPLE.COM failed recently",
+               50) == 0, "...with the right error");
+    krb5_free_error_message(ctx, message);
+    sync_kpasswd_report(config, 0);
+    is_int(0, sync_kpasswd_check(config, ctx),
+           "...and allowed again after a success");
+
+    /* Changing the server list resets the tracking. */
+    sync_vector_add(config->ad_ldap_servers, "dc4.ad.example.com");
+    code = sync_server_pick(config, ctx, &server, &found);
+    ok(code == 0 && found && server == 0, "New server list starts over");
+
+    /* With no deadline, only the limit for the call applies. */
+    is_int(0, sync_ad_deadline(config, ctx, 0, &left), "No deadline");
+    is_int(-1, left.tv_sec, "...and no limit");
+    sync_ad_deadline(config, ctx, 10, &left);
+    is_int(10, left.tv_sec, "...or the limit for the call");
+
+    /* A deadline caps the limit, and the call fails once it has passed. */
+    config->ad_timeout = 30;
+    config->ad_deadline.tv_sec = time(NULL) + 5;
+    config->ad_deadline.tv_usec = 0;
+    is_int(0, sync_ad_deadline(config, ctx, 10, &left), "Deadline not passed");
+    ok(left.tv_sec <= 5, "...and caps the limit for the call");
+    config->ad_deadline.tv_sec = time(NULL) - 1;
+    code = sync_ad_deadline(config, ctx, 10, &left);
+    ok(code != 0, "Deadline passed");
+    message = krb5_get_error_message(ctx, code);
+    is_string("Active Directory did not finish within ad_timeout (30 seconds)",
+              message, "...with the right error");
+    krb5_free_error_message(ctx, message);
+
+    /* Clean up. */
+    sync_server_close(config);
+    ok(config->servers == NULL, "Closing frees the state");
+    sync_vector_free(config->ad_ldap_servers);
+    free(config->ad_admin_server);
+    free(config->ad_realm);
+    free(config);
+    krb5_free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Tests for the sharded queue layout in the krb5-sync plugin.
+ *
+ * Force queuing with queue_shards set and check that queued changes go into
+ * the shard directory for the user, that the shard count is recorded for
+ * krb5-sync-backend, that conflict checks only see the user's shard, and that
+ * listing the queue finds files in both layouts.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/process.h>
+#include <tests/tap/string.h>
+#include <tests/tap/sync.h>
+
+/* A queue file in the unsharded layout, older than anything we queue. */
+#define OLD_FILE "test-ad-enable-20000101T000000Z-00"
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *make_conf, *krb5_config;
+    const char *setup_argv[8];
+    char buffer[BUFSIZ];
+    krb5_context ctx;
+    krb5_principal princ, admin;
+    struct sync_request request, admin_request;
+    krb5_error_code code;
+    kadm5_hook_modinfo *config;
+    struct vector *files;
+    bool conflict;
+    FILE *file;
+    size_t i;
+
+    /* Define the plan. */
+    plan(24);
+
+    /* Set up a temporary directory and queue relative to it. */
+    path = test_file_path("data/krb5.conf");
+    if (path == NULL)
+        bail("cannot find data/krb5.conf in the test suite");
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Set up our krb5.conf with ad_queue_only and queue_shards set. */
+    make_conf = test_file_path("data/make-krb5-conf");
+    if (make_conf == NULL)
+        bail("cannot find data/make-krb5-conf in the test suite");
+    setup_argv[0] = make_conf;
+    setup_argv[1] = path;
+    setup_argv[2] = tmpdir;
+    setup_argv[3] = "ad_queue_only";
+    setup_argv[4] = "true";
+    setup_argv[5] = "queue_shards";
+    setup_argv[6] = "16";
+    setup_argv[7] = NULL;
+    run_setup(setup_argv);
+    test_file_path_free(make_conf);
+    test_file_path_free(path);
+
+    /* Point KRB5_CONFIG at the newly-generated krb5.conf file. */
+    basprintf(&krb5_config, "KRB5_CONFIG=%s/krb5.conf", tmpdir);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+
+    /* Obtain a new Kerberos context with that krb5.conf file. */
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize Kerberos context");
+
+    /* Test init. */
+    is_int(0, sync_init(ctx, &config), "sync_init succeeds");
+    ok(config != NULL, "...and config is non-NULL");
+
+    /*
+     * Queue a password change.  The FNV-1a hash of "test" modulo 16 is 5, so
+     * it should go into the 05 shard.
+     */
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+    sync_request_init(&request, princ);
+    code = sync_chpass(config, ctx, princ, "foobar");
+    is_int(0, code, "sync_chpass succeeds");
+    sync_queue_check_password("queue/05", "test", "foobar");
+
+    /* The shard count should be recorded for krb5-sync-backend. */
+    file = fopen("queue/.shards", "r");
+    ok(file != NULL, "Shard count was recorded");
+    if (file == NULL || fgets(buffer, sizeof(buffer), file) == NULL)
+        buffer[0] = '\0';
+    if (file != NULL)
+        fclose(file);
+    is_string("16\n", buffer, "...with the right contents");
+
+    /*
+     * Queue an enable and leave it in the queue.  Conflict checks only look
+     * in the user's shard.  test/admin hashes to shard 00, which doesn't
+     * exist.
+     */
+    code = sync_status(config, ctx, princ, true);
+    is_int(0, code, "sync_status enable succeeds");
+    code = sync_queue_conflict(config, ctx, &request, "enable", &conflict);
+    is_int(0, code, "Conflict check succeeds");
+    ok(conflict, "...and finds the queued enable");
+    code = krb5_parse_name(ctx, "test/admin@EXAMPLE.COM", &admin);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test/admin@EXAMPLE.COM");
+    sync_request_init(&admin_request, admin);
+    code = sync_queue_conflict(config, ctx, &admin_request, "enable",
+                               &conflict);
+    is_int(0, code, "Conflict check for a missing shard succeeds");
+    ok(!conflict, "...and finds no conflict");
+
+    /*
+     * Add a change in the old flat layout and make sure the queue listing
+     * finds both and sorts by file name, ignoring the shard.
+     */
+    file = fopen("queue/" OLD_FILE, "w");
+    if (file == NULL)
+        sysbail("cannot create queue/" OLD_FILE);
+    fputs("test\nad\nenable\n", file);
+    fclose(file);
+    code = sync_queue_list(config, ctx, &files);
+    is_int(0, code, "Listing the queue succeeds");
+    if (files->count != 2)
+        bail("wrong number of files in queue: %lu",
+             (unsigned long) files->count);
+    is_string(OLD_FILE, files->strings[0], "...with the flat one first");
+    ok(strncmp(files->strings[1], "05/test-ad-enable-", 18) == 0,
+       "...and then the sharded one");
+    for (i = 0; i < files->count; i++) {
+        basprintf(&path, "queue/%s", files->strings[i]);
+        unlink(path);
+        free(path);
+    }
+    sync_vector_free(files);
+
+    /* Unwind the queue and be sure all the right files exist. */
+    ok(rmdir("queue/05") == 0, "No other files in the shard directory");
+    ok(unlink("queue/.shards") == 0, "Shard count file still exists");
+    ok(unlink("queue/.sequence") == 0, "Sequence file still exists");
+    ok(unlink("queue/.lock") == 0, "Lock file still exists");
+    ok(rmdir("queue") == 0, "No other files in queue directory");
+
+    /* Shut down the plugin. */
+    sync_close(ctx, config);
+
+    /* Manually clean up after the results of make-krb5-conf. */
+    basprintf(&path, "%s/krb5.conf", tmpdir);
+    unlink(path);
+    free(path);
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+
+    /* Clean up. */
+    sync_request_free(ctx, &admin_request);
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, admin);
+    krb5_free_principal(ctx, princ);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    free(krb5_config);
+    return 0;
+}
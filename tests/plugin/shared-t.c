@@ -0,0 +1,130 @@
+/*
+ * Tests for the state shared between processes in the krb5-sync plugin.
+ *
+ * Maps the shared state file from two configurations, standing in for two
+ * processes of a forking kadmind, and checks that the DN cache, circuit
+ * breaker state, credential expiration, and stats counts stored through one
+ * are seen by the other, without needing an Active Directory server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Allocate a configuration using the shared state file in the given
+ * directory and map it, returning the status of sync_shared_open.
+ */
+static krb5_error_code
+shared_config(krb5_context ctx, char *dir, kadm5_hook_modinfo **config)
+{
+    *config = bcalloc(1, sizeof(**config));
+    (*config)->queue_dir = dir;
+    (*config)->ad_dn_cache_size = 10;
+    (*config)->shared_state = true;
+    return sync_shared_open(*config, ctx);
+}
+
+
+int
+main(void)
+{
+    krb5_context ctx;
+    kadm5_hook_modinfo *one, *two, *local;
+    struct sync_request request;
+    struct sync_stats_counts *counts;
+    struct timeval start;
+    time_t *next_write;
+    char *tmpdir, *path;
+    FILE *file;
+
+    /* Define the plan. */
+    plan(16);
+
+    /* Map the same file from two configurations. */
+    if (krb5_init_context(&ctx) != 0)
+        bail("cannot create Kerberos context");
+    tmpdir = test_tmpdir();
+    sync_request_init(&request, NULL);
+    is_int(0, shared_config(ctx, tmpdir, &one), "First mapping");
+    is_int(0, shared_config(ctx, tmpdir, &two), "Second mapping");
+    ok(one->shared != NULL && two->shared != NULL, "...both stored");
+
+    /* The DN cache is shared. */
+    sync_dncache_store(one, "a@AD.EXAMPLE.COM", "cn=a,dc=example");
+    is_string("cn=a,dc=example",
+              sync_dncache_lookup(two, &request, "a@AD.EXAMPLE.COM"),
+              "DN stored by one seen by the other");
+    is_string(NULL, sync_dncache_lookup(two, &request, "b@AD.EXAMPLE.COM"),
+              "...but not other principals");
+    sync_dncache_remove(two, "a@AD.EXAMPLE.COM");
+    is_string(NULL, sync_dncache_lookup(one, &request, "a@AD.EXAMPLE.COM"),
+              "DN removed by the other is gone");
+    ok(one->dn_cache == NULL, "...and no private cache was created");
+
+    /* So are the circuit breaker and credential state. */
+    (*sync_shared_failures(one))++;
+    is_int(1, *sync_shared_failures(two), "Failure count is shared");
+    *sync_shared_creds_expires(two) = 1000;
+    is_int(1000, *sync_shared_creds_expires(one),
+           "Credential expiration is shared");
+
+    /* So are the stats counts. */
+    basprintf(&path, "%s/krb5-sync.prom", tmpdir);
+    one->stats_file = path;
+    one->stats = sync_stats_new();
+    sync_stats_start(one, &start);
+    sync_stats_record(one, SYNC_STATS_KPASSWD, &start, 0);
+    counts = sync_shared_stats(two, &next_write);
+    ok(counts != NULL, "Shared stats counts");
+    is_int(1, counts[SYNC_STATS_KPASSWD].success, "...include the success");
+    sync_stats_close(one);
+    unlink(path);
+    free(path);
+
+    /* Without shared_state, the state is in the configuration. */
+    local = bcalloc(1, sizeof(*local));
+    ok(sync_shared_failures(local) == &local->ad_failures,
+       "Unshared failure count is in the configuration");
+    ok(sync_shared_stats(local, &next_write) == NULL,
+       "...and there are no shared stats");
+    free(local);
+
+    /* Closing unmaps. */
+    sync_shared_close(one);
+    sync_shared_close(two);
+    ok(one->shared == NULL, "Closing unmaps");
+    free(one);
+    free(two);
+
+    /* A file that isn't a shared state file is rejected. */
+    basprintf(&path, "%s/.shared", tmpdir);
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    fprintf(file, "not a shared state file\n");
+    fclose(file);
+    ok(shared_config(ctx, tmpdir, &one) != 0, "Other file is rejected");
+    free(one);
+
+    /* shared_state requires queue_dir. */
+    ok(shared_config(ctx, NULL, &one) != 0, "queue_dir is required");
+    free(one);
+
+    /* Clean up. */
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    sync_request_free(ctx, &request);
+    krb5_free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Tests for the latency histograms and outcome counts in the krb5-sync
+ * plugin.
+ *
+ * Records the results of some stages with known times and checks the counts
+ * written to stats_file, without needing an Active Directory server.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+
+#include <plugin/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Read the whole stats file into a newly allocated string, returning NULL if
+ * it doesn't exist.  Calls bail on other failures.
+ */
+static char *
+read_stats(const char *path)
+{
+    FILE *file;
+    char *contents;
+    size_t length;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        return NULL;
+    contents = bcalloc(1, 64 * 1024);
+    length = fread(contents, 1, 64 * 1024 - 1, file);
+    if (ferror(file))
+        sysbail("cannot read %s", path);
+    fclose(file);
+    contents[length] = '\0';
+    return contents;
+}
+
+
+/*
+ * Record a stage that took the given number of milliseconds, by backdating
+ * its start time.
+ */
+static void
+record(kadm5_hook_modinfo *config, enum sync_stats_stage stage,
+       unsigned long msec, krb5_error_code code)
+{
+    struct timeval start;
+
+    sync_stats_start(config, &start);
+    start.tv_sec -= msec / 1000;
+    start.tv_usec -= (msec % 1000) * 1000;
+    if (start.tv_usec < 0) {
+        start.tv_sec--;
+        start.tv_usec += 1000000;
+    }
+    sync_stats_record(config, stage, &start, code);
+}
+
+
+int
+main(void)
+{
+    kadm5_hook_modinfo *config;
+    struct timeval start;
+    char *tmpdir, *path, *stats;
+
+    /* Define the plan. */
+    plan(16);
+
+    /* Without stats_file, nothing is timed. */
+    config = bcalloc(1, sizeof(*config));
+    start.tv_sec = 1;
+    sync_stats_start(config, &start);
+    is_int(0, start.tv_sec, "Nothing timed without stats_file");
+    sync_stats_record(config, SYNC_STATS_KPASSWD, &start, 0);
+    sync_stats_close(config);
+
+    /* The first recorded stage writes the file. */
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/krb5-sync.prom", tmpdir);
+    config->stats_file = path;
+    config->stats = sync_stats_new();
+    ok(config->stats != NULL, "Stats allocated");
+    record(config, SYNC_STATS_KPASSWD, 3, 0);
+    stats = read_stats(path);
+    ok(stats != NULL, "First stage writes stats_file");
+    ok(strstr(stats, "krb5_sync_stage_seconds_bucket{stage=\"kpasswd\","
+              "le=\"0.002\"} 0\n") != NULL, "...without a count in 2ms");
+    ok(strstr(stats, "krb5_sync_stage_seconds_bucket{stage=\"kpasswd\","
+              "le=\"0.004\"} 1\n") != NULL, "...with a count in 4ms");
+    ok(strstr(stats, "krb5_sync_stage_seconds_count{stage=\"kpasswd\"} 1\n")
+       != NULL, "...and a total count");
+    ok(strstr(stats, "krb5_sync_stage_total{stage=\"kpasswd\","
+              "result=\"success\"} 1\n") != NULL, "...and one success");
+    free(stats);
+
+    /* Later stages are only written after an interval or on request. */
+    record(config, SYNC_STATS_KPASSWD, 100, KRB5_KDC_UNREACH);
+    record(config, SYNC_STATS_QUEUE_WRITE, 60 * 1000, 0);
+    stats = read_stats(path);
+    ok(strstr(stats, "krb5_sync_stage_seconds_count{stage=\"kpasswd\"} 1\n")
+       != NULL, "Later stages not written at once");
+    free(stats);
+    sync_stats_write(config);
+    stats = read_stats(path);
+    ok(strstr(stats, "krb5_sync_stage_seconds_bucket{stage=\"kpasswd\","
+              "le=\"0.128\"} 2\n") != NULL, "...but are when requested");
+    ok(strstr(stats, "krb5_sync_stage_total{stage=\"kpasswd\","
+              "result=\"failure\"} 1\n") != NULL, "...including the failure");
+    ok(strstr(stats, "krb5_sync_stage_seconds_bucket{stage=\"queue_write\","
+              "le=\"32.768\"} 0\n") != NULL
+       && strstr(stats, "krb5_sync_stage_seconds_bucket{stage=\"queue_write\","
+                 "le=\"+Inf\"} 1\n") != NULL,
+       "Times past the last bucket only count in +Inf");
+    ok(strstr(stats, "krb5_sync_stage_seconds_count{stage=\"status\"} 0\n")
+       != NULL, "Stages never recorded are still listed");
+    free(stats);
+
+    /* Sync lag is its own histogram with buckets for queued changes. */
+    record(config, SYNC_STATS_LAG_QUEUED, 20 * 60 * 1000, 0);
+    sync_stats_write(config);
+    stats = read_stats(path);
+    ok(strstr(stats, "krb5_sync_lag_seconds_bucket{path=\"queued\","
+              "le=\"1048.58\"} 0\n") != NULL
+       && strstr(stats, "krb5_sync_lag_seconds_bucket{path=\"queued\","
+                 "le=\"2097.15\"} 1\n") != NULL,
+       "Queued sync lag counted in its bucket");
+    ok(strstr(stats, "krb5_sync_lag_seconds_count{path=\"direct\"} 0\n")
+       != NULL, "...and direct sync lag listed separately");
+    ok(strstr(stats, "stage=\"queued\"") == NULL,
+       "...and not as a stage");
+    free(stats);
+
+    /* Closing frees the counts. */
+    sync_stats_close(config);
+    ok(config->stats == NULL, "Closing frees the stats");
+
+    /* Clean up. */
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    free(config);
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Tests for changes in several Active Directory targets.
+ *
+ * Uses the mock Active Directory in tests/mock with a krb5.conf that lists
+ * two targets in ad_targets, one configured only by the krb5-sync defaults
+ * and one with its own section, and checks that each target gets its own
+ * settings, that password and status changes are made in both, that a
+ * failed change is queued for each target under its own name, and that
+ * processing the queue makes each queued change in its own target.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/krb5.h>
+#include <portable/system.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <plugin/internal.h>
+#include <tests/mock/ad.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+
+
+/*
+ * Return the number of files in the queue whose names start with prefix.
+ */
+static size_t
+queued(const char *prefix)
+{
+    DIR *dir;
+    struct dirent *entry;
+    size_t count = 0;
+
+    dir = opendir("queue");
+    if (dir == NULL)
+        sysbail("cannot open queue");
+    while ((entry = readdir(dir)) != NULL)
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0)
+            count++;
+    closedir(dir);
+    return count;
+}
+
+
+int
+main(void)
+{
+    char *path, *tmpdir, *krb5_config;
+    krb5_context ctx;
+    krb5_principal princ;
+    krb5_error_code code;
+    kadm5_hook_modinfo *data, *one, *two;
+    unsigned long failed, kpasswd;
+    FILE *file;
+
+    /* Define the plan. */
+    plan(23);
+
+    /* Set up a temporary directory and queue relative to it. */
+    tmpdir = test_tmpdir();
+    if (chdir(tmpdir) < 0)
+        sysbail("cannot cd to %s", tmpdir);
+    if (mkdir("queue", 0777) < 0)
+        sysbail("cannot mkdir queue");
+
+    /* Point KRB5_CONFIG at the krb5.conf file with targets. */
+    path = test_file_path("data/krb5-targets.conf");
+    if (path == NULL)
+        bail("cannot find data/krb5-targets.conf in the test suite");
+    basprintf(&krb5_config, "KRB5_CONFIG=%s", path);
+    if (putenv(krb5_config) < 0)
+        sysbail("cannot set KRB5_CONFIG in the environment");
+    code = krb5_init_context(&ctx);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot create Kerberos context");
+    code = sync_init(ctx, &data);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot initialize plugin");
+    code = krb5_parse_name(ctx, "test@EXAMPLE.COM", &princ);
+    if (code != 0)
+        bail_krb5(ctx, code, "cannot parse principal test@EXAMPLE.COM");
+
+    /* Each target has its own settings, falling back on krb5-sync. */
+    is_int(2, data->target_count, "Two targets");
+    one = sync_target_find(data, "one");
+    two = sync_target_find(data, "two");
+    ok(one != NULL && two != NULL, "...found by name");
+    ok(sync_target_find(data, "ad") == NULL, "...and ad is not a target");
+    if (one == NULL || two == NULL)
+        bail("targets not configured");
+    is_string("AD.EXAMPLE.COM", one->ad_realm, "...first uses the default");
+    is_string("TWO.EXAMPLE.COM", two->ad_realm, "...second has its own");
+    is_string("two.example.com", two->ad_admin_server,
+              "...with its own server");
+    is_string("ad-keytab", two->ad_keytab, "...and the default keytab");
+    ok(strcmp(one->ad_ccache_name, two->ad_ccache_name) != 0,
+       "...and separate credential caches");
+
+    /* Changes are made in both targets, each with its own credentials. */
+    is_int(0, sync_chpass(data, ctx, princ, "foobar"), "sync_chpass");
+    is_int(2, mock_ad.kpasswd, "...called kpasswd for each target");
+    is_int(2, mock_ad.creds, "...with credentials for each");
+    is_int(0, sync_status(data, ctx, princ, false), "sync_status disable");
+    is_int(2, mock_ad.bind, "...bound to each target");
+    is_int(2, mock_ad.modify, "...and modified the account in each");
+    is_int(0, queued("test-"), "...and nothing was queued");
+
+    /*
+     * A failed change is queued for each target.  Use an error that doesn't
+     * mean Active Directory is unreachable, so that the queued changes are
+     * tried again at once.
+     */
+    mock_ad.kpasswd_failures = 100;
+    mock_ad.kpasswd_error = KRB5KDC_ERR_POLICY;
+    is_int(0, sync_chpass(data, ctx, princ, "queued"),
+           "sync_chpass with kpasswd failing");
+    is_int(1, queued("test-one-password-"), "...queued for the first target");
+    is_int(1, queued("test-two-password-"), "...and for the second");
+    mock_ad.kpasswd_failures = 0;
+
+    /* Processing the queue makes each change in its own target. */
+    kpasswd = mock_ad.kpasswd;
+    failed = 1;
+    code = sync_queue_process(data, ctx, NULL, NULL, &failed);
+    is_int(0, code, "Processing the queue");
+    is_int(0, failed, "...with no failures");
+    is_int(kpasswd + 2, mock_ad.kpasswd, "...made both queued changes");
+
+    /* A queued change for an unknown target fails. */
+    file = fopen("queue/test-ad-enable-20100101T000000Z-0000000001", "w");
+    if (file == NULL)
+        sysbail("cannot create queue file");
+    fputs("test\nad\nenable\n", file);
+    if (fclose(file) == EOF)
+        sysbail("cannot write queue file");
+    failed = 0;
+    code = sync_queue_process(data, ctx, NULL, NULL, &failed);
+    is_int(0, code, "Processing a change for an unknown target");
+    is_int(1, failed, "...fails the change");
+    unlink("queue/test-ad-enable-20100101T000000Z-0000000001");
+
+    /* Clean up. */
+    unlink("queue/.sequence");
+    unlink("queue/.lock");
+    if (rmdir("queue") < 0)
+        sysdiag("cannot remove queue");
+    sync_close(ctx, data);
+    krb5_free_principal(ctx, princ);
+    krb5_free_context(ctx);
+    putenv((char *) "KRB5_CONFIG=");
+    if (chdir("..") < 0)
+        sysbail("cannot chdir to parent directory");
+    test_tmpdir_free(tmpdir);
+    free(krb5_config);
+    test_file_path_free(path);
+    return 0;
+}
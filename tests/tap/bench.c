@@ -0,0 +1,109 @@
+/*
+ * Utility functions for krb5-sync benchmarks.
+ *
+ * Parsing of options and reporting of results shared by the benchmarks in
+ * the krb5-sync test suite.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <errno.h>
+#include <sys/time.h>
+
+#include <tests/tap/basic.h>
+#include <tests/tap/bench.h>
+
+
+/*
+ * Parse a comma-separated list of numbers, storing a newly allocated array
+ * in numbers and returning the count.  Calls bail on invalid numbers.
+ */
+size_t
+bench_parse_list(const char *list, unsigned long **numbers)
+{
+    const char *p;
+    char *end;
+    size_t count = 1, i;
+
+    for (p = list; *p != '\0'; p++)
+        if (*p == ',')
+            count++;
+    *numbers = bcalloc(count, sizeof(unsigned long));
+    for (i = 0, p = list; i < count; i++, p = end + 1) {
+        errno = 0;
+        (*numbers)[i] = strtoul(p, &end, 10);
+        if (errno != 0 || end == p || (*end != ',' && *end != '\0'))
+            bail("invalid number list %s", list);
+    }
+    return count;
+}
+
+
+/*
+ * Return the microseconds elapsed since start.
+ */
+double
+bench_elapsed(const struct timeval *start)
+{
+    struct timeval now;
+
+    if (gettimeofday(&now, NULL) < 0)
+        sysbail("cannot get current time");
+    return (double) (now.tv_sec - start->tv_sec) * 1000000
+        + (double) (now.tv_usec - start->tv_usec);
+}
+
+
+/*
+ * Compare two latencies for qsort.
+ */
+static int
+compare_double(const void *a, const void *b)
+{
+    const double *first = a;
+    const double *second = b;
+
+    if (*first < *second)
+        return -1;
+    return (*first > *second) ? 1 : 0;
+}
+
+
+/*
+ * Print the header of the table of results.
+ */
+void
+bench_header(void)
+{
+    printf("%-14s %7s %7s %10s %9s %9s %9s %9s\n", "operation", "size",
+           "procs", "ops/sec", "p50 usec", "p90 usec", "p99 usec",
+           "max usec");
+    fflush(stdout);
+}
+
+
+/*
+ * Report one measurement, given the name of the operation, the queue size,
+ * the number of processes, the latencies of each operation in microseconds,
+ * their count, and the wall-clock time of the whole measurement in
+ * microseconds.
+ */
+void
+bench_report(const char *name, unsigned long size, unsigned long count,
+             double *latency, size_t ops, double total)
+{
+    printf("%-14s %7lu %7lu %10.0f", name, size, count,
+           (double) ops * 1000000 / total);
+    if (latency == NULL || ops == 0)
+        printf(" %9s %9s %9s %9s\n", "-", "-", "-", "-");
+    else {
+        qsort(latency, ops, sizeof(double), compare_double);
+        printf(" %9.0f %9.0f %9.0f %9.0f\n", latency[ops / 2],
+               latency[ops * 9 / 10], latency[ops * 99 / 100],
+               latency[ops - 1]);
+    }
+    fflush(stdout);
+}
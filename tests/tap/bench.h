@@ -0,0 +1,40 @@
+/*
+ * Utility functions for krb5-sync benchmarks.
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef TAP_BENCH_H
+#define TAP_BENCH_H 1
+
+#include <config.h>
+#include <tests/tap/macros.h>
+
+#include <stddef.h>
+#include <sys/time.h>
+
+BEGIN_DECLS
+
+/*
+ * Parse a comma-separated list of numbers, storing a newly allocated array
+ * in numbers and returning the count.  Calls bail on invalid numbers.
+ */
+size_t bench_parse_list(const char *list, unsigned long **numbers);
+
+/* Return the microseconds elapsed since start.  Calls sysbail on failure. */
+double bench_elapsed(const struct timeval *start);
+
+/*
+ * Print the header of the table of results, and one line of it, given the
+ * name of the operation, the queue size, the concurrency, the latencies of
+ * each operation in microseconds (which are sorted), their count, and the
+ * wall-clock time of the whole measurement in microseconds.  If latency is
+ * NULL, only the throughput is reported.
+ */
+void bench_header(void);
+void bench_report(const char *name, unsigned long size, unsigned long count,
+                  double *latency, size_t ops, double total);
+
+END_DECLS
+
+#endif /* TAP_BENCH_H */
@@ -14,6 +14,7 @@
 #include <config.h>
 #include <portable/system.h>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <time.h>
@@ -89,29 +90,41 @@ static void
 queue_check(const char *queue, const char *user, const char *op,
             const char *password)
 {
-    char *path, *wanted, *munged_user;
+    char *path, *prefix, *wanted, *munged_user;
     const char *path_op;
+    DIR *dir;
+    struct dirent *entry;
     time_t now, timestamp;
     struct tm *date;
     struct stat st;
     FILE *file;
     char buffer[BUFSIZ];
 
-    /* Find the queue file.  It should have a nearby timestamp. */
+    /*
+     * Find the queue file.  It should have a nearby timestamp, followed by a
+     * hyphen and the sequence number.
+     */
     path = NULL;
     now = time(NULL);
     path_op = (strcmp("disable", op) == 0) ? "enable" : op;
     munged_user = munge_user(user);
-    for (timestamp = now - 1; timestamp <= now; timestamp++) {
+    dir = opendir(queue);
+    if (dir == NULL)
+        sysbail("cannot open %s", queue);
+    for (timestamp = now - 1; timestamp <= now && path == NULL; timestamp++) {
         date = gmtime(&timestamp);
-        basprintf(&path, "%s/%s-ad-%s-%04d%02d%02dT%02d%02d%02dZ-00", queue,
+        basprintf(&prefix, "%s-ad-%s-%04d%02d%02dT%02d%02d%02dZ-",
                   munged_user, path_op, date->tm_year + 1900, date->tm_mon + 1,
                   date->tm_mday, date->tm_hour, date->tm_min, date->tm_sec);
-        if (access(path, F_OK) == 0)
-            break;
-        free(path);
-        path = NULL;
+        rewinddir(dir);
+        while ((entry = readdir(dir)) != NULL)
+            if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
+                basprintf(&path, "%s/%s", queue, entry->d_name);
+                break;
+            }
+        free(prefix);
     }
+    closedir(dir);
     free(munged_user);
 
     /* Check that we found a queued change. */
@@ -17,15 +17,130 @@
  */
 
 #include <config.h>
+#include <portable/kadmin.h>
 #include <portable/krb5.h>
 #include <portable/system.h>
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <syslog.h>
+#include <time.h>
 
 #include <plugin/internal.h>
+#include <util/macros.h>
 #include <util/messages-krb5.h>
 #include <util/messages.h>
+#include <util/xmalloc.h>
+
+/* Report progress of a bulk synchronization after this many changes. */
+#define BULK_PROGRESS 1000
+
+/*
+ * How long in seconds a watching krb5-sync waits before processing the queue
+ * again if it sees no new changes, after some changes failed, and when
+ * polling because inotify isn't available.
+ */
+#define WATCH_INTERVAL 300
+#define WATCH_RETRY    60
+#define WATCH_POLL     5
+
+/* Set by the signal handler when a watching krb5-sync should exit. */
+static volatile sig_atomic_t watch_stop = 0;
+
+/* Set by -s to report the result of each change as a structured line. */
+static bool stream = false;
+
+/*
+ * Set by -l and -m to bound a run that processes the queue: the maximum
+ * number of changes to attempt and the time at which to stop, each 0 for no
+ * bound, and the number of changes attempted so far.
+ */
+static unsigned long process_limit = 0;
+static time_t process_deadline = 0;
+static unsigned long process_count = 0;
+
+/*
+ * The classes of errors reported by -s, other than config for configuration
+ * errors and other for everything else, and text in the error message that
+ * identifies each.  These are the errors that can indicate that the account
+ * doesn't exist in Active Directory yet, which krb5-sync-backend -s hides.
+ */
+static const struct {
+    const char *class;
+    const char *text;
+} stream_classes[] = {
+    { "missing",    " not found via "         },
+    { "timeout",    "Connection timed out"    },
+    { "auth",       "Authentication error"    },
+    { "locator",    "for service_locator"     },
+    { "permission", "Operation not permitted" },
+};
+
+/*
+ * A status change for bulk synchronization.  status is 1 to enable the
+ * account, 0 to disable it, and -1 to push its status in the local KDB.
+ */
+struct bulk_change {
+    char *principal;
+    int status;
+};
+
+/*
+ * A batch of bulk status changes being made, for reporting the results: the
+ * change and status for each index of the batch, and the count of failures.
+ */
+struct bulk_batch {
+    const struct bulk_change **changes;
+    bool *enabled;
+    krb5_context ctx;
+    bool verbose;
+    unsigned long failed;
+};
+
+/* An Active Directory account read by reconciliation and its status. */
+struct reconcile_account {
+    char *target;
+    bool enabled;
+};
+
+/*
+ * The Active Directory accounts read by reconciliation, sorted by principal
+ * once they have all been read, the changes to make for the accounts whose
+ * status differs, and the counts for the summary.
+ */
+struct reconcile {
+    struct reconcile_account *accounts;
+    size_t count;
+    size_t size;
+    struct bulk_change *changes;
+    size_t nchanges;
+    size_t changes_size;
+    unsigned long checked;
+    unsigned long differ;
+    unsigned long missing;
+    unsigned long failed;
+};
+
+/*
+ * The latencies in microseconds of the changes made by a replay and of the
+ * same changes when they were captured, and the count of failures.
+ */
+struct replay {
+    unsigned long *latency;
+    unsigned long *captured;
+    size_t count;
+    size_t size;
+    unsigned long failed;
+};
 
 
 /*
@@ -34,11 +149,15 @@
  */
 static void
 ad_password(kadm5_hook_modinfo *config, krb5_context ctx,
-            krb5_principal principal, char *password, const char *user)
+            krb5_principal principal, const char *password,
+            const char *user)
 {
+    struct sync_request request;
     krb5_error_code code;
 
-    code = sync_ad_chpass(config, ctx, principal, password);
+    sync_request_init(&request, principal);
+    code = sync_ad_chpass(config, ctx, &request, password);
+    sync_request_free(ctx, &request);
     if (code != 0)
         die_krb5(ctx, code, "AD password change for %s failed", user);
     notice("AD password change for %s succeeded", user);
@@ -53,9 +172,12 @@ static void
 ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
           krb5_principal principal, bool enable, const char *user)
 {
+    struct sync_request request;
     krb5_error_code code;
 
-    code = sync_ad_status(config, ctx, principal, enable);
+    sync_request_init(&request, principal);
+    code = sync_ad_status(config, ctx, &request, enable);
+    sync_request_free(ctx, &request);
     if (code != 0)
         die_krb5(ctx, code, "AD status change for %s failed", user);
     notice("AD status change for %s succeeded", user);
@@ -63,89 +185,1229 @@ ad_status(kadm5_hook_modinfo *config, krb5_context ctx,
 
 
 /*
- * Read a line from a queue file, making sure we got a complete line and
- * cutting off the trailing newline.  Doesn't return on error.
+ * Read a queue file and take appropriate action based on its contents, which
+ * are read and checked with sync_queue_read_record.  The actions are the same
+ * as from the command-line switches, in the target named by the domain of
+ * the change.  If the change was successful, delete the queue file.
  */
 static void
-read_line(FILE *file, const char *filename, char *buffer, size_t bufsiz)
+process_queue_file(kadm5_hook_modinfo *config, krb5_context ctx,
+                   const char *filename)
 {
-    if (fgets(buffer, bufsiz, file) == NULL)
-        sysdie("cannot read from queue file %s", filename);
-    if (buffer[strlen(buffer) - 1] != '\n')
-        die("line too long in queue file %s", filename);
-    buffer[strlen(buffer) - 1] = '\0';
+    struct sync_queue_record record;
+    krb5_principal principal;
+    krb5_error_code ret;
+
+    /* Read the queue file and convert the user into a principal. */
+    ret = sync_queue_read_record(ctx, filename, &record);
+    if (ret != 0)
+        die_krb5(ctx, ret, "cannot read queue file %s", filename);
+    config = sync_target_find(config, record.domain);
+    if (config == NULL)
+        die("unknown target system %s in queue file %s", record.domain,
+            filename);
+    ret = krb5_parse_name(ctx, record.user, &principal);
+    if (ret != 0)
+        die_krb5(ctx, ret, "cannot parse user %s into principal",
+                 record.user);
+
+    /* Perform the appropriate action. */
+    if (record.password != NULL)
+        ad_password(config, ctx, principal, record.password, record.user);
+    else if (strcmp(record.operation, "enable") == 0)
+        ad_status(config, ctx, principal, true, record.user);
+    else if (strcmp(record.operation, "disable") == 0)
+        ad_status(config, ctx, principal, false, record.user);
+    else
+        die("unknown action %s in queue file %s", record.operation, filename);
+
+    /* If we got here, we were successful, so delete the queue file. */
+    sync_queue_record_free(&record);
+    krb5_free_principal(ctx, principal);
+    if (unlink(filename) != 0)
+        sysdie("unable to unlink queue file %s", filename);
 }
 
 
 /*
- * Read a queue file and take appropriate action based on its contents.  The
- * format is:
- *
- *     <principal>
- *     ad
- *     enable | disable | password
- *     [<password>]
- *
- * The actions are the same as from the command-line switches, except that
- * passwords are changed separately in AFS and AD.  enable and disable are not
- * supported for AFS.
+ * Write the result of a change as a line on standard output for -s: ok or
+ * error, the class of the error (- for success), and a message made from
+ * what, which describes the change, and the Kerberos error message, all
+ * separated by tabs.  Tabs and newlines in the message are replaced with
+ * spaces so that each result is one line.
  */
 static void
-process_queue_file(kadm5_hook_modinfo *config, krb5_context ctx,
-                   const char *filename)
+stream_result(krb5_context ctx, krb5_error_code code, const char *what)
+{
+    const char *error = NULL, *class = "-";
+    char *message;
+    size_t i;
+
+    if (code == 0)
+        xasprintf(&message, "%s succeeded", what);
+    else {
+        error = krb5_get_error_message(ctx, code);
+        xasprintf(&message, "%s failed: %s", what, error);
+        class = "other";
+        if (code == KADM5_MISSING_KRB5_CONF_PARAMS)
+            class = "config";
+        for (i = 0; i < ARRAY_SIZE(stream_classes); i++)
+            if (strstr(error, stream_classes[i].text) != NULL) {
+                class = stream_classes[i].class;
+                break;
+            }
+        krb5_free_error_message(ctx, error);
+    }
+    for (i = 0; message[i] != '\0'; i++)
+        if (message[i] == '\t' || message[i] == '\n')
+            message[i] = ' ';
+    printf("%s\t%s\t%s\n", code == 0 ? "ok" : "error", class, message);
+    fflush(stdout);
+    free(message);
+}
+
+
+/*
+ * Report the result of one change made while processing the queue.  Called
+ * by sync_queue_process after each queue file.
+ */
+static void
+report_queue_file(kadm5_hook_modinfo *config UNUSED, krb5_context ctx,
+                  const char *name, krb5_error_code code)
+{
+    char *what;
+
+    process_count++;
+    if (stream) {
+        xasprintf(&what, "queued change %s", name);
+        stream_result(ctx, code, what);
+        free(what);
+    } else if (code == 0)
+        notice("queued change %s succeeded", name);
+    else
+        warn_krb5(ctx, code, "queued change %s failed", name);
+}
+
+
+/*
+ * The stop function for sync_queue_process in a bounded run, which stops
+ * once the limit of changes has been attempted or the deadline has passed.
+ */
+static bool
+process_stopping(kadm5_hook_modinfo *config UNUSED)
+{
+    if (process_limit > 0 && process_count >= process_limit)
+        return true;
+    return (process_deadline > 0 && time(NULL) >= process_deadline);
+}
+
+
+/*
+ * Take the lock that keeps runs processing the same queue from overlapping,
+ * an exclusive lock on .process in the queue directory.  Returns the file
+ * descriptor holding it, which is closed to release it, or -1 if another run
+ * already holds it.
+ */
+static int
+process_lock(const char *dir)
+{
+    char *path;
+    int fd;
+
+    xasprintf(&path, "%s/.process", dir);
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        sysdie("cannot open lock file %s", path);
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno != EWOULDBLOCK)
+            sysdie("cannot flock lock file %s", path);
+        close(fd);
+        fd = -1;
+    }
+    free(path);
+    return fd;
+}
+
+
+/*
+ * Read the name of the last change reached by the previous bounded run from
+ * .cursor in the queue directory.  Returns a newly allocated string, which is
+ * empty if there is no cursor yet.
+ */
+static char *
+process_cursor_read(const char *dir)
 {
-    FILE *queue;
     char buffer[BUFSIZ];
-    char *user;
+    char *path;
+    FILE *file;
+
+    xasprintf(&path, "%s/.cursor", dir);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno != ENOENT)
+            sysdie("cannot open %s", path);
+        free(path);
+        return xstrdup("");
+    }
+    if (fgets(buffer, sizeof(buffer), file) == NULL)
+        buffer[0] = '\0';
+    buffer[strcspn(buffer, "\n")] = '\0';
+    fclose(file);
+    free(path);
+    return xstrdup(buffer);
+}
+
+
+/*
+ * Save the cursor for the next bounded run, replacing .cursor in the queue
+ * directory atomically.
+ */
+static void
+process_cursor_write(const char *dir, const char *cursor)
+{
+    char *path, *tmp;
+    FILE *file;
+
+    xasprintf(&path, "%s/.cursor", dir);
+    xasprintf(&tmp, "%s/.cursor.tmp", dir);
+    file = fopen(tmp, "w");
+    if (file == NULL)
+        sysdie("cannot create %s", tmp);
+    fprintf(file, "%s\n", cursor);
+    if (fclose(file) == EOF)
+        sysdie("cannot write %s", tmp);
+    if (rename(tmp, path) < 0)
+        sysdie("cannot rename %s to %s", tmp, path);
+    free(path);
+    free(tmp);
+}
+
+
+/*
+ * Process every change in the given queue directory, using the same
+ * algorithm as the krb5-sync-backend process command: changes are made in
+ * sorted order and, after a failure, later changes for the same user and
+ * operation are skipped.  If queue_workers is set, unrelated changes are
+ * made concurrently by that many worker processes.  Only one run processes
+ * a queue at a time, and this returns at once if another run already is.
+ *
+ * If a limit or maximum time was given, the run is bounded and starts after
+ * the last change reached by the previous bounded run, so that successive
+ * runs work through a large queue.  The limit is split among the workers.
+ * Exits with status 1 if any change failed.
+ */
+static void
+process_queue(kadm5_hook_modinfo *config, krb5_context ctx, const char *dir,
+              unsigned long limit, unsigned long seconds)
+{
+    unsigned long failed, workers;
+    bool bounded;
+    int lock;
+    krb5_error_code code;
+
+    free(config->queue_dir);
+    config->queue_dir = strdup(dir);
+    if (config->queue_dir == NULL)
+        sysdie("cannot allocate memory");
+    lock = process_lock(dir);
+    if (lock < 0) {
+        if (!stream)
+            notice("queue %s is already being processed", dir);
+        return;
+    }
+
+    /* Set up the bounds of the run, if any. */
+    workers = (config->queue_workers > 1)
+        ? (unsigned long) config->queue_workers : 1;
+    bounded = (limit > 0 || seconds > 0);
+    if (limit > 0)
+        process_limit = (limit + workers - 1) / workers;
+    if (seconds > 0)
+        process_deadline = time(NULL) + (time_t) seconds;
+    if (bounded)
+        config->queue_cursor = process_cursor_read(dir);
+
+    /*
+     * Line-buffer output so that each message is written at once and the
+     * output of concurrent workers isn't interleaved within a line.
+     */
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+    setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
+    code = sync_queue_process_parallel(config, ctx, workers,
+                                       bounded ? process_stopping : NULL,
+                                       report_queue_file, &failed);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot process queue %s", dir);
+    if (bounded)
+        process_cursor_write(dir, config->queue_cursor);
+    close(lock);
+    if (failed > 0)
+        exit(1);
+}
+
+
+/*
+ * Make the change in a queue file for -s, deleting the file if it succeeds.
+ * The same as process_queue_file, except that failures are returned as a
+ * Kerberos error code rather than being fatal.
+ */
+static krb5_error_code
+stream_file(kadm5_hook_modinfo *config, krb5_context ctx,
+            const char *filename)
+{
+    struct sync_queue_record record;
+    struct sync_request request;
     krb5_principal principal;
-    krb5_error_code ret;
-    bool ad = false;
-    bool enable = false;
-    bool disable = false;
-    bool password = false;
+    krb5_error_code code;
+
+    code = sync_queue_read_record(ctx, filename, &record);
+    if (code != 0)
+        return code;
+    config = sync_target_find(config, record.domain);
+    if (config == NULL) {
+        code = sync_error_generic(ctx, "unknown target system %s",
+                                  record.domain);
+        goto done;
+    }
+    code = krb5_parse_name(ctx, record.user, &principal);
+    if (code != 0)
+        goto done;
+    sync_request_init(&request, principal);
+    if (record.password != NULL)
+        code = sync_ad_chpass(config, ctx, &request, record.password);
+    else if (strcmp(record.operation, "enable") == 0)
+        code = sync_ad_status(config, ctx, &request, true);
+    else if (strcmp(record.operation, "disable") == 0)
+        code = sync_ad_status(config, ctx, &request, false);
+    else
+        code = sync_error_generic(ctx, "unknown action %s",
+                                  record.operation);
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, principal);
+    if (code == 0 && unlink(filename) != 0)
+        code = sync_error_system(ctx, "unable to unlink queue file");
+
+done:
+    sync_queue_record_free(&record);
+    return code;
+}
+
+
+/*
+ * Enable or disable an account in Active Directory for -s, returning a
+ * Kerberos error code.  config is the target given with -t, or the main
+ * configuration if none was given.
+ */
+static krb5_error_code
+stream_status(kadm5_hook_modinfo *config, krb5_context ctx, const char *user,
+              bool enable)
+{
+    struct sync_request request;
+    krb5_principal principal;
+    krb5_error_code code;
+
+    if (config->targets != NULL)
+        return sync_error_config(ctx, "ad_targets is set, so a target must"
+                                 " be given with -t");
+    code = krb5_parse_name(ctx, user, &principal);
+    if (code != 0)
+        return code;
+    sync_request_init(&request, principal);
+    code = sync_ad_status(config, ctx, &request, enable);
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, principal);
+    return code;
+}
+
+
+/*
+ * If line is the command word followed by whitespace and an argument, return
+ * the argument.  Otherwise, return NULL.
+ */
+static const char *
+stream_command(const char *line, const char *command)
+{
+    size_t length = strlen(command);
+
+    if (strncmp(line, command, length) != 0)
+        return NULL;
+    if (line[length] != ' ' && line[length] != '\t')
+        return NULL;
+    line += length;
+    line += strspn(line, " \t");
+    return (*line == '\0') ? NULL : line;
+}
+
+
+/*
+ * Run as a co-process for -s: read requests from standard input, one per
+ * line, and write one result line for each, as described by stream_result,
+ * until end of file or a line saying quit.  A request is enable <user> or
+ * disable <user>, made in ad, or otherwise the path to a queue file, whose
+ * change is made in its own target.  Blank lines are ignored.  Credentials
+ * and LDAP connections are kept between requests.
+ */
+static void
+stream_run(kadm5_hook_modinfo *config, kadm5_hook_modinfo *ad,
+           krb5_context ctx)
+{
+    char *line = NULL, *what;
+    const char *user;
+    size_t size = 0;
+    krb5_error_code code;
+
+    while (getline(&line, &size, stdin) >= 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        if (strcmp(line, "quit") == 0)
+            break;
+        if ((user = stream_command(line, "enable")) != NULL) {
+            code = stream_status(ad, ctx, user, true);
+            xasprintf(&what, "AD status change for %s", user);
+        } else if ((user = stream_command(line, "disable")) != NULL) {
+            code = stream_status(ad, ctx, user, false);
+            xasprintf(&what, "AD status change for %s", user);
+        } else {
+            code = stream_file(config, ctx, line);
+            xasprintf(&what, "queued change %s", line);
+        }
+        stream_result(ctx, code, what);
+        free(what);
+    }
+    if (ferror(stdin))
+        sysdie("cannot read standard input");
+    free(line);
+}
+
+
+/*
+ * Signal handler for a watching krb5-sync, asking it to exit after the
+ * current change.  Also used as the stop function for sync_queue_process.
+ */
+static void
+watch_signal(int sig UNUSED)
+{
+    watch_stop = 1;
+}
+
+static bool
+watch_stopping(kadm5_hook_modinfo *config UNUSED)
+{
+    return watch_stop;
+}
+
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/*
+ * Watch a queue directory for new queue files, and for appends to the
+ * journal if queue_format is journal.  If recurse is true, also watch its
+ * existing subdirectories, which are the shards if queue_shards is set.
+ * Returns the watch descriptor.
+ */
+static int
+watch_add(int fd, const char *dir, bool recurse)
+{
+    DIR *queue;
+    struct dirent *entry;
+    uint32_t mask;
+    char *path;
+    int wd;
 
-    /* Open the queue file. */
-    queue = fopen(filename, "r");
+    mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_CREATE | IN_ONLYDIR;
+    wd = inotify_add_watch(fd, dir, mask);
+    if (wd < 0)
+        sysdie("cannot watch %s", dir);
+    if (!recurse)
+        return wd;
+    queue = opendir(dir);
     if (queue == NULL)
-        sysdie("cannot open queue file %s", filename);
+        sysdie("cannot open %s", dir);
+    while ((entry = readdir(queue)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        xasprintf(&path, "%s/%s", dir, entry->d_name);
+        if (inotify_add_watch(fd, path, mask) < 0 && errno != ENOTDIR)
+            syswarn("cannot watch %s", path);
+        free(path);
+    }
+    closedir(queue);
+    return wd;
+}
 
-    /* Get user and convert into a principal. */
-    read_line(queue, filename, buffer, sizeof(buffer));
-    user = strdup(buffer);
-    ret = krb5_parse_name(ctx, buffer, &principal);
-    if (ret != 0)
-        die_krb5(ctx, ret, "cannot parse user %s into principal", buffer);
 
-    /* Get function. */
-    read_line(queue, filename, buffer, sizeof(buffer));
-    if (strcmp(buffer, "ad") == 0)
-        ad = true;
-    else
-        die("unknown target system %s in queue file %s", buffer, filename);
-    read_line(queue, filename, buffer, sizeof(buffer));
-    if (strcmp(buffer, "enable") == 0)
-        enable = true;
-    else if (strcmp(buffer, "disable") == 0)
-        disable = true;
-    else if (strcmp(buffer, "password") == 0)
-        password = true;
+/*
+ * Wait up to timeout seconds for a change to be queued, given the inotify
+ * descriptor, the watch descriptor of the queue directory, and its path.
+ * Events for files whose names start with a period, such as the lock
+ * files, are ignored, except for the journal, so that processing the queue
+ * doesn't wake the watcher up again.  Also returns early if asked to exit.
+ */
+static void
+watch_wait(int fd, int root, const char *dir, int timeout)
+{
+    union {
+        struct inotify_event event;
+        char data[4096];
+    } buffer;
+    const struct inotify_event *event;
+    struct pollfd pfd;
+    time_t deadline, now;
+    ssize_t length;
+    size_t i;
+    char *path;
+    bool found = false;
+
+    deadline = time(NULL) + timeout;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!found && !watch_stop && (now = time(NULL)) < deadline) {
+        if (poll(&pfd, 1, (int) (deadline - now) * 1000) <= 0)
+            continue;
+        length = read(fd, buffer.data, sizeof(buffer.data));
+        if (length < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            sysdie("cannot read inotify events");
+        }
+        for (i = 0; i < (size_t) length; i += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *) (buffer.data + i);
+            if (event->mask & IN_Q_OVERFLOW)
+                found = true;
+            else if (event->len == 0)
+                continue;
+            else if ((event->mask & IN_ISDIR) && event->wd == root) {
+                xasprintf(&path, "%s/%s", dir, event->name);
+                watch_add(fd, path, false);
+                free(path);
+                found = true;
+            } else if (event->mask & IN_CREATE)
+                continue;
+            else if (event->name[0] != '.'
+                     || strcmp(event->name, ".journal") == 0)
+                found = true;
+        }
+    }
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
+
+/*
+ * Watch the given queue directory, processing it whenever a change is
+ * queued, until killed.  This uses the same algorithm as process_queue, but
+ * changes are made in this process regardless of queue_workers so that its
+ * Active Directory credentials and LDAP connections stay warm between
+ * changes.  It is the only mode that starts the ad_warmup refresher, since
+ * the others may fork workers that must not share the connections.  The
+ * queue is watched with inotify where available and otherwise polled every
+ * WATCH_POLL seconds.  It is also processed again after WATCH_RETRY seconds
+ * if changes failed, and every WATCH_INTERVAL seconds in case a change was
+ * missed.  SIGHUP, SIGINT, and SIGTERM cause it to exit after the current
+ * change.
+ */
+static void
+watch_queue(kadm5_hook_modinfo *config, krb5_context ctx, const char *dir)
+{
+    struct sigaction sa;
+    unsigned long failed;
+    krb5_error_code code;
+#ifdef HAVE_SYS_INOTIFY_H
+    int fd, root;
+#endif
+
+    free(config->queue_dir);
+    config->queue_dir = xstrdup(dir);
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+    setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
+    sync_warmup_start(config, ctx);
+
+    /* Exit cleanly on signals, interrupting any wait. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_signal;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGHUP, &sa, NULL) < 0 || sigaction(SIGINT, &sa, NULL) < 0
+        || sigaction(SIGTERM, &sa, NULL) < 0)
+        sysdie("cannot set signal handlers");
+
+    /* Start watching before the first pass so that no change is missed. */
+#ifdef HAVE_SYS_INOTIFY_H
+    fd = inotify_init();
+    if (fd < 0)
+        sysdie("cannot initialize inotify");
+    root = watch_add(fd, dir, true);
+#endif
+    notice("watching queue %s", dir);
+    while (!watch_stop) {
+        code = sync_queue_process(config, ctx, watch_stopping,
+                                  report_queue_file, &failed);
+        if (code != 0) {
+            warn_krb5(ctx, code, "cannot process queue %s", dir);
+            failed = 1;
+        }
+#ifdef HAVE_SYS_INOTIFY_H
+        watch_wait(fd, root, dir, failed > 0 ? WATCH_RETRY : WATCH_INTERVAL);
+#else
+        if (!watch_stop)
+            sleep(WATCH_POLL);
+#endif
+    }
+#ifdef HAVE_SYS_INOTIFY_H
+    close(fd);
+#endif
+    notice("stopped watching queue %s", dir);
+}
+
+
+/*
+ * Read the changes for bulk synchronization from standard input, one
+ * principal per line, optionally followed by whitespace and enable or
+ * disable.  Principals without an action get the given default status.
+ * Returns the changes and stores their count in count.  Blank lines are
+ * ignored; malformed lines are fatal, so that nothing is done for a bad
+ * list.
+ */
+static struct bulk_change *
+bulk_read(int status, size_t *count)
+{
+    struct bulk_change *changes = NULL;
+    size_t size = 0, length = 0, line = 0;
+    char *buffer = NULL, *action;
+    ssize_t status_read;
+
+    *count = 0;
+    while ((status_read = getline(&buffer, &length, stdin)) >= 0) {
+        line++;
+        buffer[strcspn(buffer, "\r\n")] = '\0';
+        if (buffer[0] == '\0')
+            continue;
+        if (*count == size) {
+            size = (size == 0) ? 1024 : size * 2;
+            changes = xreallocarray(changes, size, sizeof(*changes));
+        }
+        action = buffer + strcspn(buffer, " \t");
+        changes[*count].status = status;
+        if (*action != '\0') {
+            *action++ = '\0';
+            action += strspn(action, " \t");
+            if (strcmp(action, "enable") == 0)
+                changes[*count].status = 1;
+            else if (strcmp(action, "disable") == 0)
+                changes[*count].status = 0;
+            else
+                die("unknown action %s on line %lu of input", action,
+                    (unsigned long) line);
+        }
+        changes[*count].principal = xstrdup(buffer);
+        (*count)++;
+    }
+    if (ferror(stdin))
+        sysdie("cannot read standard input");
+    free(buffer);
+    return changes;
+}
+
+
+/*
+ * List the principals in the local KDB matching a glob pattern, which is
+ * matched in the default realm unless it includes a realm, and return them
+ * as changes with the given status.  Stores the count in count.
+ */
+static struct bulk_change *
+bulk_list(kadm5_hook_modinfo *config, krb5_context ctx, const char *pattern,
+          int status, size_t *count)
+{
+    struct bulk_change *changes;
+    struct vector *names;
+    const char *realm;
+    char *default_realm = NULL;
+    krb5_error_code code;
+    size_t i;
+
+    realm = strchr(pattern, '@');
+    if (realm != NULL)
+        realm++;
+    else {
+        code = krb5_get_default_realm(ctx, &default_realm);
+        if (code != 0)
+            die_krb5(ctx, code, "cannot get default realm");
+        realm = default_realm;
+    }
+    code = sync_instance_list(config, ctx, realm, pattern, &names);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot list principals matching %s", pattern);
+    changes = xcalloc(names->count > 0 ? names->count : 1, sizeof(*changes));
+    for (i = 0; i < names->count; i++) {
+        changes[i].principal = xstrdup(names->strings[i]);
+        changes[i].status = status;
+    }
+    *count = names->count;
+    sync_vector_free(names);
+    krb5_free_default_realm(ctx, default_realm);
+    return changes;
+}
+
+
+/*
+ * Report the result of one change in a batch of bulk status changes.  Called
+ * by sync_ad_status_batch as each change finishes.
+ */
+static void
+bulk_report(void *data, size_t i, krb5_error_code code)
+{
+    struct bulk_batch *batch = data;
+    const struct bulk_change *change = batch->changes[i];
+
+    if (code != 0) {
+        warn_krb5(batch->ctx, code, "AD status change for %s failed",
+                  change->principal);
+        batch->failed++;
+    } else if (batch->verbose)
+        notice("%s account %s", batch->enabled[i] ? "enabled" : "disabled",
+               change->principal);
+}
+
+
+/*
+ * Make a batch of bulk status changes, looking up the status of each in the
+ * local KDB if it wasn't given, with pipelined LDAP operations.  Failures are
+ * reported, as are successes if verbose is true.  Returns the number of
+ * failed changes.
+ */
+static unsigned long
+bulk_batch(kadm5_hook_modinfo *config, krb5_context ctx,
+           const struct bulk_change **changes, size_t count, bool verbose)
+{
+    struct bulk_batch batch;
+    struct sync_request *requests;
+    struct sync_ad_change *ad;
+    krb5_principal principal;
+    krb5_error_code code;
+    bool disabled;
+    size_t i, n = 0;
+
+    batch.ctx = ctx;
+    batch.verbose = verbose;
+    batch.failed = 0;
+    batch.changes = xcalloc(count > 0 ? count : 1, sizeof(*batch.changes));
+    batch.enabled = xcalloc(count > 0 ? count : 1, sizeof(bool));
+    requests = xcalloc(count > 0 ? count : 1, sizeof(*requests));
+    ad = xcalloc(count > 0 ? count : 1, sizeof(*ad));
+    for (i = 0; i < count; i++) {
+        code = krb5_parse_name(ctx, changes[i]->principal, &principal);
+        if (code == 0 && changes[i]->status < 0) {
+            code = sync_instance_disabled(config, ctx, principal, &disabled);
+            if (code != 0)
+                krb5_free_principal(ctx, principal);
+        } else
+            disabled = (changes[i]->status == 0);
+        if (code != 0) {
+            warn_krb5(ctx, code, "AD status change for %s failed",
+                      changes[i]->principal);
+            batch.failed++;
+            continue;
+        }
+        sync_request_init(&requests[n], principal);
+        ad[n].request = &requests[n];
+        ad[n].enabled = !disabled;
+        batch.changes[n] = changes[i];
+        batch.enabled[n] = !disabled;
+        n++;
+    }
+    code = sync_ad_status_batch(config, ctx, ad, n, bulk_report, &batch);
+    if (code != 0) {
+        warn_krb5(ctx, code, "AD status changes failed");
+        batch.failed += n;
+    }
+    for (i = 0; i < n; i++) {
+        principal = requests[i].principal;
+        sync_request_free(ctx, &requests[i]);
+        krb5_free_principal(ctx, principal);
+    }
+    free(requests);
+    free(ad);
+    free(batch.changes);
+    free(batch.enabled);
+    return batch.failed;
+}
+
+
+/*
+ * Make the bulk changes that belong to this part of parts, chosen by a hash
+ * of the principal so that repeated changes for the same principal are made
+ * in order by the same worker.  Changes are made in batches of BULK_PROGRESS
+ * with pipelined LDAP operations.  Failures are reported and counted but
+ * don't stop the run, and progress is reported after each batch.  Returns
+ * the number of failed changes.
+ */
+static unsigned long
+bulk_run(kadm5_hook_modinfo *config, krb5_context ctx,
+         const struct bulk_change *changes, size_t count, unsigned long part,
+         unsigned long parts)
+{
+    const struct bulk_change **batch;
+    unsigned long done = 0, failed = 0, total = 0;
+    size_t i, n;
+
+    for (i = 0; i < count; i++)
+        if (sync_hash_string(changes[i].principal) % parts == part)
+            total++;
+    batch = xcalloc(BULK_PROGRESS, sizeof(*batch));
+    for (i = 0; i < count; ) {
+        for (n = 0; i < count && n < BULK_PROGRESS; i++)
+            if (sync_hash_string(changes[i].principal) % parts == part)
+                batch[n++] = &changes[i];
+        if (n == 0)
+            continue;
+        failed += bulk_batch(config, ctx, batch, n, false);
+        done += n;
+        if (done < total)
+            notice("%lu of %lu status changes made, %lu failed", done,
+                   total, failed);
+    }
+    notice("%lu of %lu status changes made, %lu failed", done, total,
+           failed);
+    free(batch);
+    return failed;
+}
+
+
+/*
+ * Synchronize the status of many accounts, read from standard input or
+ * listed from the local KDB by a glob pattern, reusing Active Directory
+ * credentials and LDAP connections across changes.  If queue_workers is set,
+ * the changes are divided among that many worker processes, each with its
+ * own connections.  status is 1 or 0 to enable or disable every account, or
+ * -1 to look up their status in the local KDB unless given in the input.
+ * Exits with status 1 if any change failed.
+ */
+static void
+bulk_sync(kadm5_hook_modinfo *config, krb5_context ctx, const char *pattern,
+          int status)
+{
+    struct bulk_change *changes;
+    unsigned long workers, failed = 0, count, i;
+    size_t nchanges;
+    pid_t *pids;
+    int *fds;
+    int fd[2], wstatus;
+
+    /* Get the changes to make. */
+    if (pattern != NULL)
+        changes = bulk_list(config, ctx, pattern, status, &nchanges);
     else
-        die("unknown action %s in queue file %s", buffer, filename);
+        changes = bulk_read(status, &nchanges);
 
-    /* Perform the appropriate action. */
-    if (password) {
-        read_line(queue, filename, buffer, sizeof(buffer));
-        if (ad)
-            ad_password(config, ctx, principal, buffer, user);
-    } else if (enable || disable) {
-        ad_status(config, ctx, principal, enable, user);
+    /* With only one worker, make the changes in this process. */
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+    setvbuf(stderr, NULL, _IOLBF, BUFSIZ);
+    workers = (config->queue_workers > 1)
+        ? (unsigned long) config->queue_workers : 1;
+    if (workers == 1)
+        failed = bulk_run(config, ctx, changes, nchanges, 0, 1);
+    else {
+        pids = xcalloc(workers, sizeof(pid_t));
+        fds = xcalloc(workers, sizeof(int));
+        sync_instance_close(config);
+        fflush(NULL);
+        for (i = 0; i < workers; i++) {
+            if (pipe(fd) < 0)
+                sysdie("cannot create pipe");
+            pids[i] = fork();
+            if (pids[i] < 0)
+                sysdie("cannot fork bulk worker");
+            if (pids[i] == 0) {
+                close(fd[0]);
+                count = bulk_run(config, ctx, changes, nchanges, i, workers);
+                if (write(fd[1], &count, sizeof(count)) != sizeof(count))
+                    _exit(1);
+                fflush(NULL);
+                _exit(0);
+            }
+            close(fd[1]);
+            fds[i] = fd[0];
+        }
+        for (i = 0; i < workers; i++) {
+            if (read(fds[i], &count, sizeof(count)) == sizeof(count))
+                failed += count;
+            else
+                failed++;
+            close(fds[i]);
+            if (waitpid(pids[i], &wstatus, 0) < 0 || wstatus != 0)
+                warn("bulk worker %lu failed", i);
+        }
+        free(pids);
+        free(fds);
     }
+    for (i = 0; i < nchanges; i++)
+        free(changes[i].principal);
+    free(changes);
+    if (failed > 0)
+        exit(1);
+}
 
-    /* If we got here, we were successful.  Close the file and delete it. */
-    fclose(queue);
-    if (unlink(filename) != 0)
-        sysdie("unable to unlink queue file %s", filename);
-    free(user);
+
+/*
+ * Compare two reconciliation accounts by their Active Directory principal,
+ * ignoring case as Active Directory does.
+ */
+static int
+reconcile_compare(const void *a, const void *b)
+{
+    const struct reconcile_account *first = a;
+    const struct reconcile_account *second = b;
+
+    return strcasecmp(first->target, second->target);
+}
+
+
+/*
+ * Record an account found in Active Directory and its status.  Called by
+ * sync_ad_accounts for each account.
+ */
+static void
+reconcile_found(void *data, const char *upn, bool enabled)
+{
+    struct reconcile *reconcile = data;
+
+    if (reconcile->count == reconcile->size) {
+        reconcile->size = (reconcile->size == 0) ? 1024 : reconcile->size * 2;
+        reconcile->accounts = xreallocarray(reconcile->accounts,
+                                            reconcile->size,
+                                            sizeof(*reconcile->accounts));
+    }
+    reconcile->accounts[reconcile->count].target = xstrdup(upn);
+    reconcile->accounts[reconcile->count].enabled = enabled;
+    reconcile->count++;
+}
+
+
+/*
+ * Compare the status of a principal in the local KDB with that of its
+ * Active Directory account, if the plugin would synchronize its status, and
+ * add a change for the account if they differ.  If incremental is true, only
+ * accounts changed in Active Directory were read, so a principal with no
+ * account read is skipped rather than counted as missing.  Returns a Kerberos status
+ * code for failures to read the principal.
+ */
+static krb5_error_code
+reconcile_check(kadm5_hook_modinfo *config, krb5_context ctx,
+                struct reconcile *reconcile, const char *name,
+                bool incremental)
+{
+    struct reconcile_account key, *account;
+    struct bulk_change *change;
+    struct sync_request request;
+    krb5_principal principal, ad_principal;
+    const char *target;
+    bool allowed, disabled;
+    krb5_error_code code;
+
+    code = krb5_parse_name(ctx, name, &principal);
+    if (code != 0)
+        return code;
+    sync_request_init(&request, principal);
+    code = sync_principal_allowed(config, ctx, &request, false, &allowed);
+    if (code != 0 || !allowed)
+        goto done;
+    code = sync_request_ad_principal(config, ctx, &request, &ad_principal,
+                                     &target);
+    if (code != 0)
+        goto done;
+
+    /* Find its Active Directory account. */
+    key.target = (char *) target;
+    account = bsearch(&key, reconcile->accounts, reconcile->count,
+                      sizeof(key), reconcile_compare);
+    if (account == NULL) {
+        if (!incremental) {
+            reconcile->checked++;
+            reconcile->missing++;
+        }
+        goto done;
+    }
+    reconcile->checked++;
+
+    /* Change the account if its status differs. */
+    code = sync_instance_disabled(config, ctx, principal, &disabled);
+    if (code != 0 || account->enabled != disabled)
+        goto done;
+    reconcile->differ++;
+    if (reconcile->nchanges == reconcile->changes_size) {
+        reconcile->changes_size = (reconcile->changes_size == 0)
+            ? 1024 : reconcile->changes_size * 2;
+        reconcile->changes = xreallocarray(reconcile->changes,
+                                           reconcile->changes_size,
+                                           sizeof(*reconcile->changes));
+    }
+    change = &reconcile->changes[reconcile->nchanges++];
+    change->principal = xstrdup(name);
+    change->status = disabled ? 0 : 1;
+
+done:
+    sync_request_free(ctx, &request);
+    krb5_free_principal(ctx, principal);
+    return code;
+}
+
+
+/*
+ * Find and fix differences between the status of accounts in the local KDB
+ * and in Active Directory.  The status of every account is read from Active
+ * Directory with a single paged search rather than a search per account,
+ * and then the status of each principal matching pattern (all principals if
+ * it is NULL) whose changes the plugin synchronizes is read from the KDB.
+ * Only accounts whose status differs are changed.  Accounts missing from
+ * Active Directory are counted but otherwise ignored.
+ *
+ * If incremental is true, only the Active Directory accounts changed since
+ * the last reconciliation against the same domain controller are read, and
+ * only their principals are compared, falling back to all accounts if there
+ * is no record of a previous one.  Exits with status 1 if any change failed.
+ */
+static void
+reconcile_run(kadm5_hook_modinfo *config, krb5_context ctx,
+              const char *pattern, bool incremental)
+{
+    struct reconcile reconcile;
+    struct bulk_change *names;
+    const struct bulk_change **changes;
+    size_t count, i;
+    krb5_error_code code;
+
+    /* Read the status of the accounts from Active Directory. */
+    memset(&reconcile, 0, sizeof(reconcile));
+    code = sync_ad_accounts(config, ctx, &incremental, reconcile_found,
+                            &reconcile);
+    if (code != 0)
+        die_krb5(ctx, code, "cannot list Active Directory accounts");
+    qsort(reconcile.accounts, reconcile.count, sizeof(*reconcile.accounts),
+          reconcile_compare);
+
+    /* Compare with the status of each principal in the KDB. */
+    if (reconcile.count > 0 || !incremental) {
+        names = bulk_list(config, ctx, pattern == NULL ? "*" : pattern, -1,
+                          &count);
+        for (i = 0; i < count; i++) {
+            code = reconcile_check(config, ctx, &reconcile,
+                                   names[i].principal, incremental);
+            if (code != 0) {
+                warn_krb5(ctx, code, "cannot get status of %s",
+                          names[i].principal);
+                reconcile.failed++;
+            }
+            free(names[i].principal);
+        }
+        free(names);
+    }
+    for (i = 0; i < reconcile.count; i++)
+        free(reconcile.accounts[i].target);
+    free(reconcile.accounts);
+
+    /* Change the accounts whose status differs. */
+    if (reconcile.nchanges > 0) {
+        changes = xcalloc(reconcile.nchanges, sizeof(*changes));
+        for (i = 0; i < reconcile.nchanges; i++)
+            changes[i] = &reconcile.changes[i];
+        reconcile.failed += bulk_batch(config, ctx, changes,
+                                       reconcile.nchanges, true);
+        for (i = 0; i < reconcile.nchanges; i++)
+            free(reconcile.changes[i].principal);
+        free(changes);
+    }
+    free(reconcile.changes);
+    notice("%lu accounts checked, %lu differed, %lu not in AD, %lu failed",
+           reconcile.checked, reconcile.differ, reconcile.missing,
+           reconcile.failed);
+    if (reconcile.failed > 0)
+        exit(1);
+}
+
+
+/*
+ * Comparison function for qsort to sort latencies.
+ */
+static int
+replay_compare(const void *a, const void *b)
+{
+    unsigned long first = *(const unsigned long *) a;
+    unsigned long second = *(const unsigned long *) b;
+
+    return (first > second) - (first < second);
+}
+
+
+/*
+ * Sort count latencies and report their median, 90th and 99th percentiles,
+ * and maximum in milliseconds, labeled with what.
+ */
+static void
+replay_report(const char *what, unsigned long *latency, size_t count)
+{
+    double quantile[4];
+    const double ranks[4] = { 0.5, 0.9, 0.99, 1.0 };
+    size_t i;
+
+    if (count == 0)
+        return;
+    qsort(latency, count, sizeof(*latency), replay_compare);
+    for (i = 0; i < 4; i++)
+        quantile[i] = latency[(size_t) (ranks[i] * (double) (count - 1))]
+            / 1000.0;
+    notice("%s latency: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms",
+           what, quantile[0], quantile[1], quantile[2], quantile[3]);
+}
+
+
+/*
+ * Return the number of microseconds from start to end.
+ */
+static double
+replay_elapsed(const struct timeval *start, const struct timeval *end)
+{
+    return (double) (end->tv_sec - start->tv_sec) * 1000000
+        + (double) (end->tv_usec - start->tv_usec);
+}
+
+
+/*
+ * Replay a file of hook events written by the plugin with capture_file set,
+ * feeding each through the password or status change hook at the time it
+ * was captured, relative to the first, sped up by speed.  Each captured user
+ * id becomes the principal replay-<id> in the default realm, with the
+ * captured instance if any, and password changes set a synthetic password.
+ * If a change takes longer than the gap until the next, the next is made at
+ * once, so the replay falls behind rather than dropping changes.  Reports
+ * the throughput and the latency of the hooks, along with the latency when
+ * the changes were captured.  Exits with status 1 if any change failed.
+ */
+static void
+replay_run(kadm5_hook_modinfo *config, krb5_context ctx, const char *path,
+           unsigned long speed)
+{
+    struct replay replay;
+    struct timeval first, start, now, before;
+    struct timespec wait;
+    char buffer[BUFSIZ], operation[16], id[16], instance[256];
+    char *name, *password;
+    long seconds, usec;
+    unsigned long duration, line = 0;
+    double offset, delay;
+    krb5_principal principal;
+    krb5_error_code code;
+    FILE *file;
+
+    /* Don't capture the replay, which might append to the file being read. */
+    free(config->capture_file);
+    config->capture_file = NULL;
+
+    file = fopen(path, "r");
+    if (file == NULL)
+        sysdie("cannot open %s", path);
+    memset(&replay, 0, sizeof(replay));
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        line++;
+        if (sscanf(buffer, "%ld.%ld %15s %15s %255s %lu", &seconds, &usec,
+                   operation, id, instance, &duration) != 6)
+            die("invalid event on line %lu of %s", line, path);
+
+        /* Wait until it's time for this change. */
+        if (line == 1) {
+            first.tv_sec = seconds;
+            first.tv_usec = usec;
+            gettimeofday(&start, NULL);
+        }
+        now.tv_sec = seconds;
+        now.tv_usec = usec;
+        offset = replay_elapsed(&first, &now) / (double) speed;
+        gettimeofday(&now, NULL);
+        delay = offset - replay_elapsed(&start, &now);
+        if (delay > 0) {
+            wait.tv_sec = (time_t) (delay / 1000000);
+            wait.tv_nsec = (long) (delay - (double) wait.tv_sec * 1000000)
+                * 1000;
+            nanosleep(&wait, NULL);
+        }
+
+        /* Make the change. */
+        if (strcmp(instance, "-") == 0)
+            xasprintf(&name, "replay-%s", id);
+        else
+            xasprintf(&name, "replay-%s/%s", id, instance);
+        code = krb5_parse_name(ctx, name, &principal);
+        if (code != 0)
+            die_krb5(ctx, code, "cannot parse user %s into principal", name);
+        gettimeofday(&before, NULL);
+        if (strcmp(operation, "password") == 0) {
+            xasprintf(&password, "Replay-%lu-%lu!", (unsigned long) getpid(),
+                      line);
+            code = sync_chpass(config, ctx, principal, password);
+            free(password);
+        } else if (strcmp(operation, "enable") == 0)
+            code = sync_status(config, ctx, principal, true);
+        else if (strcmp(operation, "disable") == 0)
+            code = sync_status(config, ctx, principal, false);
+        else
+            die("unknown operation %s on line %lu of %s", operation, line,
+                path);
+        gettimeofday(&now, NULL);
+        if (code != 0) {
+            warn_krb5(ctx, code, "%s change for %s failed", operation, name);
+            replay.failed++;
+        }
+        krb5_free_principal(ctx, principal);
+        free(name);
+
+        /* Record its latency. */
+        if (replay.count == replay.size) {
+            replay.size = (replay.size == 0) ? 1024 : replay.size * 2;
+            replay.latency = xreallocarray(replay.latency, replay.size,
+                                           sizeof(*replay.latency));
+            replay.captured = xreallocarray(replay.captured, replay.size,
+                                            sizeof(*replay.captured));
+        }
+        replay.latency[replay.count] =
+            (unsigned long) replay_elapsed(&before, &now);
+        replay.captured[replay.count] = duration;
+        replay.count++;
+    }
+    if (ferror(file))
+        sysdie("cannot read %s", path);
+    fclose(file);
+
+    /* Report the results. */
+    gettimeofday(&now, NULL);
+    offset = (replay.count > 0) ? replay_elapsed(&start, &now) / 1000000 : 0;
+    notice("%lu changes replayed in %.1f seconds (%.1f per second),"
+           " %lu failed", (unsigned long) replay.count, offset,
+           (offset > 0) ? (double) replay.count / offset : 0.0,
+           replay.failed);
+    replay_report("replay", replay.latency, replay.count);
+    replay_report("captured", replay.captured, replay.count);
+    free(replay.latency);
+    free(replay.captured);
+    if (replay.failed > 0)
+        exit(1);
+}
+
+
+/*
+ * Parse the argument of an option that takes a positive number, exiting with
+ * an error if it isn't one.
+ */
+static unsigned long
+parse_number(const char *arg, int option)
+{
+    unsigned long value;
+    char *end;
+
+    errno = 0;
+    value = strtoul(arg, &end, 10);
+    if (errno != 0 || *arg == '\0' || *arg == '-' || *end != '\0'
+        || value == 0)
+        die("invalid argument to -%c: %s", option, arg);
+    return value;
 }
 
 
@@ -155,10 +1417,21 @@ main(int argc, char *argv[])
     int option;
     int enable = false;
     int disable = false;
+    int bulk = false;
+    int reconciling = false;
+    int incremental = false;
+    int watch = false;
+    char *pattern = NULL;
     char *password = NULL;
     char *filename = NULL;
+    char *queue = NULL;
+    char *replay = NULL;
+    char *target = NULL;
     char *user;
-    kadm5_hook_modinfo *config;
+    unsigned long limit = 0;
+    unsigned long seconds = 0;
+    unsigned long speed = 0;
+    kadm5_hook_modinfo *config, *ad;
     krb5_context ctx;
     krb5_error_code code;
     krb5_principal principal;
@@ -171,12 +1444,24 @@ main(int argc, char *argv[])
     message_program_name = "krb5-sync";
 
     /* Parse command-line options. */
-    while ((option = getopt(argc, argv, "def:p:")) != EOF) {
+    while ((option = getopt(argc, argv, "bdef:g:il:m:p:q:R:rst:wx:")) != EOF) {
         switch (option) {
+        case 'b': bulk = true;          break;
         case 'd': disable = true;       break;
         case 'e': enable = true;        break;
         case 'f': filename = optarg;    break;
+        case 'g': pattern = optarg;     break;
+        case 'i': incremental = true;   break;
+        case 'l': limit = parse_number(optarg, option);   break;
+        case 'm': seconds = parse_number(optarg, option); break;
         case 'p': password = optarg;    break;
+        case 'q': queue = optarg;       break;
+        case 'R': replay = optarg;      break;
+        case 'r': reconciling = true;   break;
+        case 's': stream = true;        break;
+        case 't': target = optarg;      break;
+        case 'w': watch = true;         break;
+        case 'x': speed = parse_number(optarg, option);   break;
 
         default:
             fprintf(stderr, "Usage: krb5-sync [-d | -e] [-p <pass>] <user>\n");
@@ -185,7 +1470,42 @@ main(int argc, char *argv[])
     }
     argc -= optind;
     argv += optind;
-    if (argc != 1 && filename == NULL) {
+    if (replay != NULL) {
+        if (argc != 0 || bulk || pattern != NULL || enable || disable
+            || password != NULL || filename != NULL || queue != NULL
+            || reconciling || stream || target != NULL || watch) {
+            fprintf(stderr, "Usage: krb5-sync -R <file> [-x <speed>]\n");
+            exit(1);
+        }
+    } else if (speed > 0) {
+        fprintf(stderr, "Usage: krb5-sync -R <file> [-x <speed>]\n");
+        exit(1);
+    } else if (stream && queue == NULL) {
+        if (argc != 0 || bulk || pattern != NULL || enable || disable
+            || password != NULL || filename != NULL || reconciling
+            || watch) {
+            fprintf(stderr, "Usage: krb5-sync -s [-t <target>]\n");
+            exit(1);
+        }
+    } else if (reconciling) {
+        if (argc != 0 || bulk || enable || disable || password != NULL
+            || filename != NULL || queue != NULL) {
+            fprintf(stderr, "Usage: krb5-sync -r [-i] [-g <pattern>]\n");
+            exit(1);
+        }
+    } else if (incremental) {
+        fprintf(stderr, "Usage: krb5-sync -r -i [-g <pattern>]\n");
+        exit(1);
+    } else if (bulk || pattern != NULL) {
+        if (argc != 0 || password != NULL || filename != NULL
+            || queue != NULL) {
+            fprintf(stderr, "Usage: krb5-sync (-b | -g <pattern>)"
+                    " [-d | -e]\n");
+            exit(1);
+        }
+        if (bulk && pattern != NULL)
+            die("cannot specify both -b and -g");
+    } else if (argc != 1 && filename == NULL && queue == NULL && !stream) {
         fprintf(stderr, "Usage: krb5-sync [-d | -e] [-p <pass>] <user>\n");
         exit(1);
     }
@@ -193,13 +1513,33 @@ main(int argc, char *argv[])
         fprintf(stderr, "Usage: krb5-sync -f <file>\n");
         exit(1);
     }
+    if (watch && queue == NULL) {
+        fprintf(stderr, "Usage: krb5-sync -q <queue> -w\n");
+        exit(1);
+    }
+    if ((limit > 0 || seconds > 0) && (queue == NULL || watch)) {
+        fprintf(stderr, "Usage: krb5-sync -q <queue> [-l <limit>]"
+                " [-m <seconds>]\n");
+        exit(1);
+    }
+    if (argc != 0 && queue != NULL) {
+        fprintf(stderr, "Usage: krb5-sync -q <queue>\n");
+        exit(1);
+    }
     user = argv[0];
     if (enable && disable)
         die("cannot specify both -d and -e");
-    if (!enable && !disable && password == NULL && filename == NULL)
+    if (!enable && !disable && password == NULL && filename == NULL
+        && queue == NULL && !bulk && pattern == NULL && !reconciling
+        && !stream && replay == NULL)
         die("no action specified");
-    if (filename != NULL && (enable || disable || password != NULL))
+    if (filename != NULL && queue != NULL)
+        die("cannot specify both -f and -q");
+    if ((filename != NULL || queue != NULL)
+        && (enable || disable || password != NULL))
         die("must specify queue file or action, not both");
+    if ((filename != NULL || queue != NULL) && target != NULL)
+        die("queued changes are made in their own target, not in -t");
 
     /* Create a Kerberos context for plugin initialization. */
     code = krb5_init_context(&ctx);
@@ -211,17 +1551,39 @@ main(int argc, char *argv[])
     if (code != 0)
         die_krb5(ctx, code, "plugin initialization failed");
 
+    /* Find the target for changes made directly in Active Directory. */
+    ad = config;
+    if (target != NULL) {
+        ad = sync_target_find(config, target);
+        if (ad == NULL)
+            die("unknown target %s", target);
+    } else if (config->targets != NULL && filename == NULL && queue == NULL
+               && !stream && replay == NULL)
+        die("ad_targets is set, so a target must be given with -t");
+
     /* Now, do whatever we were supposed to do. */
-    if (filename != NULL)
+    if (replay != NULL)
+        replay_run(config, ctx, replay, speed == 0 ? 1 : speed);
+    else if (reconciling)
+        reconcile_run(ad, ctx, pattern, incremental);
+    else if (bulk || pattern != NULL)
+        bulk_sync(ad, ctx, pattern, enable ? 1 : (disable ? 0 : -1));
+    else if (filename != NULL)
         process_queue_file(config, ctx, filename);
+    else if (stream && queue == NULL)
+        stream_run(config, ad, ctx);
+    else if (queue != NULL && watch)
+        watch_queue(config, ctx, queue);
+    else if (queue != NULL)
+        process_queue(config, ctx, queue, limit, seconds);
     else {
         code = krb5_parse_name(ctx, user, &principal);
         if (code != 0)
             die_krb5(ctx, code, "cannot parse user %s into principal", user);
         if (password != NULL)
-            ad_password(config, ctx, principal, password, user);
+            ad_password(ad, ctx, principal, password, user);
         if (enable || disable)
-            ad_status(config, ctx, principal, enable, user);
+            ad_status(ad, ctx, principal, enable, user);
     }
     exit(0);
 }